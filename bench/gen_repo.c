@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Synthetic repository generator for the benchmark suite. The layout and
+ * contents depend only on the options and the seed, so repeated runs build
+ * byte-identical trees. */
+typedef struct {
+    unsigned long files;
+    unsigned int depth;
+    unsigned int fanout;
+    unsigned long min_size;
+    unsigned long max_size;
+    unsigned int commits;
+    unsigned int mutate_percent;
+    uint64_t seed;
+    const char *target;
+} GenOptions;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void usage(void) {
+    fputs("usage: gen_repo [-n files] [-d depth] [-w fanout] [-s min:max] [-c commits]\n"
+          "                [-m mutate%] [-S seed] <directory>\n"
+          "  -s  file sizes in bytes, log-uniform between min and max\n"
+          "  -c  number of commits to create with git (0 = plain worktree)\n"
+          "  -m  percentage of files rewritten between commits\n",
+          stderr);
+}
+
+static int ensure_dirs(char *path) {
+    char *cursor;
+    for (cursor = path + 1; *cursor != '\0'; cursor++) {
+        if (*cursor == '/') {
+            *cursor = '\0';
+            if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *cursor = '/';
+        }
+    }
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+static int file_path(const GenOptions *opts, unsigned long index, char *out, size_t out_size) {
+    uint64_t mix = (uint64_t)index * 0x9E3779B97F4A7C15ULL;
+    size_t used;
+    unsigned int level;
+
+    mix ^= mix >> 31;
+    used = (size_t)snprintf(out, out_size, "%s", opts->target);
+    for (level = 0; level < opts->depth && used < out_size; level++) {
+        used += (size_t)snprintf(out + used, out_size - used, "/d%u", (unsigned int)(mix % opts->fanout));
+        mix /= opts->fanout;
+        mix ^= mix << 7;
+    }
+    if (used >= out_size) {
+        return -1;
+    }
+    return snprintf(out + used, out_size - used, "/f%lu.txt", index) < (int)(out_size - used) ? 0 : -1;
+}
+
+static unsigned long pick_size(const GenOptions *opts) {
+    double lo = log((double)(opts->min_size + 1));
+    double hi = log((double)(opts->max_size + 1));
+    double unit = (double)(rng_next() >> 11) / (double)(1ULL << 53);
+    return (unsigned long)exp(lo + (hi - lo) * unit) - 1;
+}
+
+static int write_file(const GenOptions *opts, unsigned long index, unsigned int generation) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789 ";
+    char path[PATH_MAX];
+    char line[81];
+    unsigned long size = pick_size(opts);
+    unsigned long written = 0;
+    char *slash;
+    FILE *file;
+
+    if (file_path(opts, index, path, sizeof(path)) != 0) {
+        return -1;
+    }
+    slash = strrchr(path, '/');
+    *slash = '\0';
+    if (ensure_dirs(path) != 0) {
+        return -1;
+    }
+    *slash = '/';
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "file %lu generation %u\n", index, generation);
+    while (written < size) {
+        size_t len = size - written < 80 ? (size_t)(size - written) : 80;
+        size_t i;
+        for (i = 0; i + 1 < len; i++) {
+            line[i] = alphabet[rng_next() % (sizeof(alphabet) - 1)];
+        }
+        line[len - 1] = '\n';
+        fwrite(line, 1, len, file);
+        written += len;
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static int run_git(const char *target, const char *args) {
+    char command[PATH_MAX * 2];
+    if (snprintf(command, sizeof(command), "git -C '%s' %s >/dev/null 2>&1", target, args) >= (int)sizeof(command)) {
+        return -1;
+    }
+    return system(command) == 0 ? 0 : -1;
+}
+
+static int parse_options(int argc, char **argv, GenOptions *opts) {
+    int opt;
+
+    opts->files = 1000;
+    opts->depth = 3;
+    opts->fanout = 8;
+    opts->min_size = 64;
+    opts->max_size = 16384;
+    opts->commits = 0;
+    opts->mutate_percent = 5;
+    opts->seed = 42;
+
+    while ((opt = getopt(argc, argv, "n:d:w:s:c:m:S:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts->files = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts->depth = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts->fanout = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            if (sscanf(optarg, "%lu:%lu", &opts->min_size, &opts->max_size) != 2 || opts->min_size > opts->max_size) {
+                return -1;
+            }
+            break;
+        case 'c':
+            opts->commits = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            opts->mutate_percent = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            opts->seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (optind + 1 != argc || opts->fanout == 0 || opts->files == 0) {
+        return -1;
+    }
+    opts->target = argv[optind];
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    GenOptions opts;
+    unsigned long i;
+    unsigned int commit;
+    char target[PATH_MAX];
+
+    if (parse_options(argc, argv, &opts) != 0) {
+        usage();
+        return 2;
+    }
+    rng_state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    if (snprintf(target, sizeof(target), "%s", opts.target) >= (int)sizeof(target) || ensure_dirs(target) != 0) {
+        fprintf(stderr, "gen_repo: cannot create %s\n", opts.target);
+        return 1;
+    }
+
+    for (i = 0; i < opts.files; i++) {
+        if (write_file(&opts, i, 0) != 0) {
+            fprintf(stderr, "gen_repo: cannot write file %lu\n", i);
+            return 1;
+        }
+    }
+
+    if (opts.commits == 0) {
+        return 0;
+    }
+
+    setenv("GIT_AUTHOR_NAME", "bench", 1);
+    setenv("GIT_AUTHOR_EMAIL", "bench@local", 1);
+    setenv("GIT_COMMITTER_NAME", "bench", 1);
+    setenv("GIT_COMMITTER_EMAIL", "bench@local", 1);
+
+    if (run_git(opts.target, "init -q -b main") != 0) {
+        fprintf(stderr, "gen_repo: git init failed\n");
+        return 1;
+    }
+
+    for (commit = 0; commit < opts.commits; commit++) {
+        char args[64];
+        if (commit > 0) {
+            unsigned long changed = opts.files * opts.mutate_percent / 100;
+            if (changed == 0) {
+                changed = 1;
+            }
+            for (i = 0; i < changed; i++) {
+                if (write_file(&opts, rng_next() % opts.files, commit) != 0) {
+                    fprintf(stderr, "gen_repo: cannot rewrite files\n");
+                    return 1;
+                }
+            }
+        }
+        snprintf(args, sizeof(args), "commit -q -m 'commit %u'", commit);
+        if (run_git(opts.target, "add -A") != 0 || run_git(opts.target, args) != 0) {
+            fprintf(stderr, "gen_repo: git commit failed\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Runs a command and appends "wall_us,max_child_rss_kb,exit_code" to the
+ * output file. max_child_rss_kb is the largest RSS of any single process in
+ * the tree (RUSAGE_CHILDREN), not the sum of the tree.
+ *
+ * With -f the command runs under ptrace instead and "forks,exit_code" is
+ * appended, counting the fork/vfork events of the whole process tree (-1
+ * when ptrace is not permitted). Tracing stops every fork, so it is never
+ * combined with timing: run.sh does one extra untimed run for the count. */
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int run_untraced(char **argv, int *exit_code) {
+    int status;
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    *exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+static int run_traced(char **argv, int *exit_code, long *forks) {
+    pid_t root;
+    int status;
+
+    root = fork();
+    if (root < 0) {
+        return -1;
+    }
+    if (root == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+            /* Signal the parent to fall back by exiting before exec. */
+            _exit(126);
+        }
+        raise(SIGSTOP);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    if (waitpid(root, &status, 0) < 0) {
+        return -1;
+    }
+    if (WIFEXITED(status)) {
+        return -1;
+    }
+    if (ptrace(PTRACE_SETOPTIONS, root, NULL, (void *)(long)(PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK)) != 0) {
+        kill(root, SIGKILL);
+        waitpid(root, NULL, 0);
+        return -1;
+    }
+    ptrace(PTRACE_CONT, root, NULL, NULL);
+
+    *forks = 0;
+    while (1) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == root) {
+                *exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            int sig = WSTOPSIG(status);
+            int event = status >> 16;
+            if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK) {
+                (*forks)++;
+                sig = 0;
+            } else if (sig == SIGSTOP || sig == SIGTRAP) {
+                sig = 0;
+            }
+            ptrace(PTRACE_CONT, pid, NULL, (void *)(long)sig);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    struct rusage usage;
+    long long start;
+    long long elapsed = 0;
+    long forks = -1;
+    int count_forks = 0;
+    int exit_code = 0;
+    int first = 1;
+    FILE *file;
+
+    while (first < argc) {
+        if (strcmp(argv[first], "-o") == 0 && first + 1 < argc) {
+            output = argv[first + 1];
+            first += 2;
+        } else if (strcmp(argv[first], "-f") == 0) {
+            count_forks = 1;
+            first++;
+        } else {
+            break;
+        }
+    }
+    if (first < argc && strcmp(argv[first], "--") == 0) {
+        first++;
+    }
+    if (first >= argc) {
+        fputs("usage: measure [-o file] [-f] [--] command [args...]\n", stderr);
+        return 2;
+    }
+
+    if (count_forks) {
+        if (getenv("BENCH_NO_PTRACE") != NULL || run_traced(argv + first, &exit_code, &forks) != 0) {
+            forks = -1;
+            if (run_untraced(argv + first, &exit_code) != 0) {
+                perror("measure");
+                return 1;
+            }
+        }
+    } else {
+        start = now_us();
+        if (run_untraced(argv + first, &exit_code) != 0) {
+            perror("measure");
+            return 1;
+        }
+        elapsed = now_us() - start;
+    }
+    getrusage(RUSAGE_CHILDREN, &usage);
+
+    file = output != NULL ? fopen(output, "a") : stderr;
+    if (file == NULL) {
+        perror("measure");
+        return 1;
+    }
+    if (count_forks) {
+        fprintf(file, "%ld,%d\n", forks, exit_code);
+    } else {
+        fprintf(file, "%lld,%ld,%d\n", elapsed, usage.ru_maxrss, exit_code);
+    }
+    if (file != stderr) {
+        fclose(file);
+    }
+    return exit_code;
+}
@@ -0,0 +1,191 @@
+#!/bin/sh
+# Benchmark driver for `make bench`. Times cg and stock git on the same
+# synthetic repositories and prints one CSV row per tool and scenario:
+#   tool,scenario,runs,median_ms,p95_ms,forks,max_child_rss_kb
+#
+# Each scenario takes BENCH_RUNS timed samples plus one untimed run under
+# ptrace that counts forks, so tracing overhead never reaches the times.
+# Samples whose command fails are dropped; runs counts the ones kept.
+#
+# Tunables (environment): BENCH_FILES, BENCH_DEPTH, BENCH_FANOUT, BENCH_SIZES,
+# BENCH_COMMITS, BENCH_RUNS, BENCH_TOOLS, BENCH_DIR, CG.
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+CG=${CG:-$here/../cg}
+case $CG in
+    /*) ;;
+    *) CG=$(pwd)/$CG ;;
+esac
+FILES=${BENCH_FILES:-2000}
+DEPTH=${BENCH_DEPTH:-3}
+FANOUT=${BENCH_FANOUT:-8}
+SIZES=${BENCH_SIZES:-64:16384}
+COMMITS=${BENCH_COMMITS:-20}
+RUNS=${BENCH_RUNS:-5}
+TOOLS=${BENCH_TOOLS:-cg git}
+WORK=${BENCH_DIR:-${TMPDIR:-/tmp}/cg-bench.$$}
+
+GEN=$here/gen_repo
+MEASURE=$here/measure
+
+export GIT_AUTHOR_NAME=bench GIT_AUTHOR_EMAIL=bench@local
+export GIT_COMMITTER_NAME=bench GIT_COMMITTER_EMAIL=bench@local
+export GIT_CONFIG_NOSYSTEM=1 HOME="$WORK/home"
+
+cleanup() {
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$WORK/home"
+git config --global init.defaultBranch main
+git config --global advice.detachedHead false
+
+gen_args="-n $FILES -d $DEPTH -w $FANOUT -s $SIZES"
+"$GEN" $gen_args "$WORK/pristine-tree"
+"$GEN" $gen_args -c "$COMMITS" "$WORK/pristine-history"
+
+tool_cmd() {
+    if [ "$1" = cg ]; then
+        printf '%s' "$CG"
+    else
+        printf 'git'
+    fi
+}
+
+# Prepares a fresh copy of the history repo that the given tool can use.
+fresh_history() {
+    rm -rf "$2"
+    cp -a "$WORK/pristine-history" "$2"
+    if [ "$1" = cg ]; then
+        (cd "$2" && "$CG" checkout main >/dev/null 2>&1)
+    fi
+}
+
+# summarize <tool> <scenario> <samples file>; the fork count is read from
+# <samples file>.forks.
+summarize() {
+    forks=$(awk -F, '$2 == 0 { forks = $1 } END { print forks == "" ? -1 : forks }' "$3.forks")
+    awk -F, '$3 == 0' "$3" | sort -t, -k1,1n | awk -F, -v tool="$1" -v scenario="$2" -v forks="$forks" '
+        { wall[NR] = $1; if ($2 > rss) rss = $2 }
+        END {
+            if (NR == 0) {
+                printf "%s,%s,0,,,%s,\n", tool, scenario, forks
+                exit
+            }
+            median = (NR % 2) ? wall[(NR + 1) / 2] : (wall[NR / 2] + wall[NR / 2 + 1]) / 2
+            p95 = int(NR * 0.95 + 0.999999)
+            if (p95 < 1) p95 = 1
+            printf "%s,%s,%d,%.2f,%.2f,%s,%d\n", tool, scenario, NR, median / 1000, wall[p95] / 1000, forks, rss
+        }'
+}
+
+# measure_in <dir> <samples file> <command...>: sample $i of the scenario;
+# samples 0 to RUNS-1 are timed, sample RUNS only counts forks.
+measure_in() {
+    dir=$1
+    samples=$2
+    shift 2
+    if [ "$i" -lt "$RUNS" ]; then
+        set -- -o "$samples" -- "$@"
+    else
+        set -- -o "$samples.forks" -f -- "$@"
+    fi
+    status=0
+    (cd "$dir" && "$MEASURE" "$@" >/dev/null 2>&1) || status=$?
+    if [ "$status" -ne 0 ]; then
+        echo "bench: sample $i in $dir failed with status $status, dropped" >&2
+    fi
+}
+
+echo "tool,scenario,runs,median_ms,p95_ms,forks,max_child_rss_kb"
+
+for tool in $TOOLS; do
+    bin=$(tool_cmd "$tool")
+    samples=$WORK/samples.csv
+
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        rm -rf "$WORK/init"
+        mkdir -p "$WORK/init"
+        measure_in "$WORK/init" "$samples" "$bin" init
+        i=$((i + 1))
+    done
+    summarize "$tool" init "$samples"
+
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        rm -rf "$WORK/add"
+        cp -a "$WORK/pristine-tree" "$WORK/add"
+        (cd "$WORK/add" && "$bin" init >/dev/null)
+        measure_in "$WORK/add" "$samples" "$bin" add .
+        i=$((i + 1))
+    done
+    summarize "$tool" add "$samples"
+
+    repo=$WORK/repo-$tool
+    fresh_history "$tool" "$repo"
+
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        measure_in "$repo" "$samples" "$bin" status
+        i=$((i + 1))
+    done
+    summarize "$tool" status-clean "$samples"
+
+    find "$repo" -name 'f*0.txt' -path '*/d*' | head -n $((FILES / 100 + 1)) | while read -r path; do
+        echo "dirty" >> "$path"
+    done
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        measure_in "$repo" "$samples" "$bin" status
+        i=$((i + 1))
+    done
+    summarize "$tool" status-dirty "$samples"
+
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        target=$(find "$repo" -name 'f*.txt' -path '*/d*' | head -n 1)
+        echo "commit $i" >> "$target"
+        (cd "$repo" && "$bin" add "$target" >/dev/null 2>&1)
+        measure_in "$repo" "$samples" "$bin" commit -m "bench commit $i"
+        i=$((i + 1))
+    done
+    summarize "$tool" commit "$samples"
+
+    fresh_history "$tool" "$repo"
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        measure_in "$repo" "$samples" "$bin" log
+        i=$((i + 1))
+    done
+    summarize "$tool" log "$samples"
+
+    git -C "$repo" branch -f bench-old HEAD~$((COMMITS > 1 ? COMMITS - 1 : 0)) >/dev/null 2>&1
+    : > "$samples"
+    : > "$samples.forks"
+    i=0
+    while [ "$i" -le "$RUNS" ]; do
+        if [ $((i % 2)) -eq 0 ]; then
+            branch=bench-old
+        else
+            branch=main
+        fi
+        measure_in "$repo" "$samples" "$bin" checkout "$branch"
+        i=$((i + 1))
+    done
+    summarize "$tool" checkout "$samples"
+done
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1.h"
+
+/* Hashes an in-memory buffer with every SHA-1 kernel available on this
+ * machine and prints "kernel,size_bytes,gb_per_s". Digests are checked
+ * against the portable kernel so a broken accelerated path fails loudly. */
+
+#define DEFAULT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_ROUNDS 5
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Hashes in odd-sized pieces so the partial-block paths are exercised too. */
+static void hash_buffer(const unsigned char *data, size_t size, unsigned char out[20]) {
+    Sha1Ctx ctx;
+    size_t offset = 0;
+    size_t step = 1;
+
+    sha1_init(&ctx);
+    while (offset < size) {
+        size_t take = size - offset < step ? size - offset : step;
+        sha1_update(&ctx, data + offset, take);
+        offset += take;
+        step = step < 4096 ? step * 3 + 1 : 1024 * 1024;
+    }
+    sha1_final(&ctx, out);
+}
+
+int main(int argc, char **argv) {
+    size_t size = DEFAULT_SIZE;
+    int rounds = DEFAULT_ROUNDS;
+    unsigned char *data;
+    unsigned char reference[20];
+    uint32_t seed = 0x9e3779b9u;
+    size_t i;
+    const char *name;
+    bool available;
+    int failed = 0;
+
+    if (argc > 1) {
+        size = (size_t)strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        rounds = atoi(argv[2]);
+    }
+    if (size == 0 || rounds <= 0) {
+        fprintf(stderr, "usage: sha1_bench [size_bytes [rounds]]\n");
+        return 2;
+    }
+
+    data = malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "sha1_bench: out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < size; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = (unsigned char)seed;
+    }
+
+    if (sha1_select_kernel("portable") != 0) {
+        free(data);
+        return 1;
+    }
+    hash_buffer(data, size, reference);
+
+    printf("kernel,size_bytes,gb_per_s\n");
+    for (i = 0; (name = sha1_kernel_at(i, &available)) != NULL; i++) {
+        unsigned char digest[20];
+        double best = 0.0;
+        int round;
+
+        if (!available || sha1_select_kernel(name) != 0) {
+            printf("%s,%zu,unavailable\n", name, size);
+            continue;
+        }
+        hash_buffer(data, size, digest);
+        if (memcmp(digest, reference, sizeof(digest)) != 0) {
+            fprintf(stderr, "sha1_bench: %s digest differs from portable\n", name);
+            failed = 1;
+            continue;
+        }
+        for (round = 0; round < rounds; round++) {
+            Sha1Ctx ctx;
+            double start = now_seconds();
+            double rate;
+            sha1_init(&ctx);
+            sha1_update(&ctx, data, size);
+            sha1_final(&ctx, digest);
+            rate = (double)size / (now_seconds() - start) / 1e9;
+            if (rate > best) {
+                best = rate;
+            }
+        }
+        printf("%s,%zu,%.3f\n", name, size, best);
+    }
+
+    free(data);
+    return failed;
+}
@@ -0,0 +1,72 @@
+#ifndef CG_H
+#define CG_H
+
+#include <stddef.h>
+
+/* Embedding API for cg, built as libcg.a (and libcg.so). The cg binary is a
+ * thin client of the same library: cg_main runs one command line.
+ *
+ * A cg_repo handle keeps the parsed cg-index and HEAD tree warm between
+ * calls, the way `cg batch` does, so repeated status/add/commit calls skip
+ * reparsing. The files on disk stay authoritative: every call revalidates
+ * the warm state against them, and drops the cached object listings once
+ * HEAD or the index changed, so commits made by other processes are still
+ * seen. The library keeps process-wide state: use it from one thread
+ * at a time.
+ *
+ * Functions return 0 on success and -1 on failure after printing a message
+ * to stderr, like the commands they mirror.
+ *
+ * Only the cg_* functions below are exported; everything else in libcg is
+ * internal to the library. */
+
+#if defined(__GNUC__)
+#define CG_EXTERN __attribute__((visibility("default")))
+#else
+#define CG_EXTERN
+#endif
+
+typedef struct cg_repo cg_repo;
+
+typedef enum {
+    CG_STATUS_STAGED_NEW,
+    CG_STATUS_STAGED_MODIFIED,
+    CG_STATUS_STAGED_RENAMED, /* path is "old -> new" */
+    CG_STATUS_STAGED_DELETED,
+    CG_STATUS_MODIFIED,
+    CG_STATUS_DELETED,
+    CG_STATUS_UNTRACKED
+} cg_status_kind;
+
+/* Called once per reported path, in `cg status` order. A nonzero return
+ * stops the iteration and becomes the result of cg_status. */
+typedef int (*cg_status_fn)(void *ctx, const char *path, cg_status_kind kind);
+
+/* Opens the repository containing path (a work tree directory or any
+ * directory below it). */
+CG_EXTERN int cg_repo_open(const char *path, cg_repo **out);
+CG_EXTERN void cg_repo_close(cg_repo *repo);
+CG_EXTERN const char *cg_repo_root(const cg_repo *repo);
+
+/* The handle's index is a read-only snapshot of the cg-index, which is
+ * only changed through cg_add and cg_commit. cg_index_load takes the
+ * snapshot, and cg_status, cg_add and cg_commit retake it before they run;
+ * call cg_index_load again to see what cg_add or cg_commit wrote. */
+CG_EXTERN int cg_index_load(cg_repo *repo);
+/* Entries of the snapshot in index order; hex receives the blob id. */
+CG_EXTERN size_t cg_index_count(const cg_repo *repo);
+CG_EXTERN int cg_index_entry(const cg_repo *repo, size_t pos, const char **path, char hex[41]);
+
+CG_EXTERN int cg_status(cg_repo *repo, cg_status_fn fn, void *ctx);
+/* Stages files and directories given relative to the repository root or
+ * as absolute paths, like `cg add`. */
+CG_EXTERN int cg_add(cg_repo *repo, const char *const *paths, size_t count);
+/* Commits the staged index on top of HEAD, like `cg commit -m`. commit_hex
+ * may be NULL. */
+CG_EXTERN int cg_commit(cg_repo *repo, const char *message, char commit_hex[41]);
+
+/* Runs a cg command line (argv[0] is the program name) and returns its
+ * exit status. */
+CG_EXTERN int cg_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,5 @@
+#include "cg.h"
+
+int main(int argc, char **argv) {
+    return cg_main(argc, argv);
+}
@@ -0,0 +1,542 @@
+#include "diff.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BINARY_CHECK_BYTES 8000
+#define HUNK_HEADER_FUNC_MAX 80
+/* Like xdiff, give up on a minimal script once the edit cost passes
+ * max(DIFF_MIN_COST, sqrt(lines)) and split at the furthest-reaching
+ * diagonal instead; pathological inputs then stay near-linear. */
+#define DIFF_MIN_COST 256
+/* Span hashing as in git's diffcore-delta: a span ends at a newline or after
+ * 64 bytes, and its rolling hash is folded into a prime-sized space. */
+#define SKETCH_SPAN_BYTES 64
+#define SKETCH_HASH_BASE 107927u
+
+typedef struct {
+    const unsigned char *start;
+    size_t len;
+} DiffLine;
+
+typedef struct {
+    DiffLine *lines;
+    long count;
+    uint32_t *ids;
+    char *changed;
+} DiffFile;
+
+typedef struct {
+    uint64_t hash;
+    const DiffLine *line;
+    uint32_t id;
+} InternSlot;
+
+typedef struct {
+    const uint32_t *a;
+    const uint32_t *b;
+    char *a_changed;
+    char *b_changed;
+    long *kvf;
+    long *kvb;
+    long max_cost;
+} DiffContext;
+
+bool diff_is_binary(const unsigned char *data, size_t size) {
+    return memchr(data, '\0', size < BINARY_CHECK_BYTES ? size : BINARY_CHECK_BYTES) != NULL;
+}
+
+static int split_lines(const unsigned char *data, size_t size, DiffFile *file) {
+    size_t pos = 0;
+    long count = 0;
+    const unsigned char *cursor = data;
+    const unsigned char *end = data + size;
+
+    while (cursor < end) {
+        const unsigned char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        count++;
+        cursor = newline != NULL ? newline + 1 : end;
+    }
+
+    file->count = count;
+    file->lines = malloc((size_t)(count + 1) * sizeof(DiffLine));
+    file->ids = malloc((size_t)(count + 1) * sizeof(uint32_t));
+    file->changed = calloc((size_t)count + 1, 1);
+    if (file->lines == NULL || file->ids == NULL || file->changed == NULL) {
+        return -1;
+    }
+
+    count = 0;
+    while (pos < size) {
+        const unsigned char *newline = memchr(data + pos, '\n', size - pos);
+        size_t len = newline != NULL ? (size_t)(newline - (data + pos)) + 1 : size - pos;
+        file->lines[count].start = data + pos;
+        file->lines[count].len = len;
+        count++;
+        pos += len;
+    }
+    return 0;
+}
+
+static void diff_file_free(DiffFile *file) {
+    free(file->lines);
+    free(file->ids);
+    free(file->changed);
+}
+
+static uint64_t line_hash(const DiffLine *line) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i;
+
+    for (i = 0; i < line->len; i++) {
+        hash ^= line->start[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* Maps every distinct line of both files to a small integer so the diff
+ * loop compares ids instead of bytes. */
+static int intern_lines(DiffFile *a, DiffFile *b) {
+    size_t total = (size_t)(a->count + b->count);
+    size_t capacity = 16;
+    InternSlot *slots;
+    uint32_t next_id = 0;
+    DiffFile *files[2];
+    int f;
+
+    files[0] = a;
+    files[1] = b;
+    while (capacity < total * 2) {
+        capacity *= 2;
+    }
+    slots = calloc(capacity, sizeof(InternSlot));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    for (f = 0; f < 2; f++) {
+        long i;
+        for (i = 0; i < files[f]->count; i++) {
+            const DiffLine *line = &files[f]->lines[i];
+            uint64_t hash = line_hash(line);
+            size_t slot = (size_t)hash & (capacity - 1);
+
+            while (slots[slot].line != NULL) {
+                const DiffLine *other = slots[slot].line;
+                if (slots[slot].hash == hash && other->len == line->len &&
+                    memcmp(other->start, line->start, line->len) == 0) {
+                    break;
+                }
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (slots[slot].line == NULL) {
+                slots[slot].hash = hash;
+                slots[slot].line = line;
+                slots[slot].id = next_id++;
+            }
+            files[f]->ids[i] = slots[slot].id;
+        }
+    }
+
+    free(slots);
+    return 0;
+}
+
+/* Finds a split point on a middle snake of the box [a_lo, a_hi) x
+ * [b_lo, b_hi), searching forward from the top-left and backward from the
+ * bottom-right until the paths overlap. kvf/kvb are indexed by diagonal
+ * k = x - y. */
+static void diff_split(const DiffContext *ctx, long a_lo, long a_hi, long b_lo, long b_hi, long *split_a,
+                       long *split_b) {
+    const uint32_t *a = ctx->a;
+    const uint32_t *b = ctx->b;
+    long *kvf = ctx->kvf;
+    long *kvb = ctx->kvb;
+    long dmin = a_lo - b_hi;
+    long dmax = a_hi - b_lo;
+    long fmid = a_lo - b_lo;
+    long bmid = a_hi - b_hi;
+    bool odd = ((fmid - bmid) & 1) != 0;
+    long fmin = fmid;
+    long fmax = fmid;
+    long bmin = bmid;
+    long bmax = bmid;
+    long cost;
+
+    kvf[fmid] = a_lo;
+    kvb[bmid] = a_hi;
+
+    for (cost = 1;; cost++) {
+        long d;
+
+        if (fmin > dmin) {
+            kvf[--fmin - 1] = -1;
+        } else {
+            ++fmin;
+        }
+        if (fmax < dmax) {
+            kvf[++fmax + 1] = -1;
+        } else {
+            --fmax;
+        }
+        for (d = fmax; d >= fmin; d -= 2) {
+            long x = kvf[d - 1] >= kvf[d + 1] ? kvf[d - 1] + 1 : kvf[d + 1];
+            long y = x - d;
+            while (x < a_hi && y < b_hi && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            kvf[d] = x;
+            if (odd && bmin <= d && d <= bmax && kvb[d] <= x) {
+                *split_a = x;
+                *split_b = y;
+                return;
+            }
+        }
+
+        if (bmin > dmin) {
+            kvb[--bmin - 1] = LONG_MAX;
+        } else {
+            ++bmin;
+        }
+        if (bmax < dmax) {
+            kvb[++bmax + 1] = LONG_MAX;
+        } else {
+            --bmax;
+        }
+        for (d = bmax; d >= bmin; d -= 2) {
+            long x = kvb[d - 1] < kvb[d + 1] ? kvb[d - 1] : kvb[d + 1] - 1;
+            long y = x - d;
+            while (x > a_lo && y > b_lo && a[x - 1] == b[y - 1]) {
+                x--;
+                y--;
+            }
+            kvb[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= kvf[d]) {
+                *split_a = x;
+                *split_b = y;
+                return;
+            }
+        }
+
+        if (cost >= ctx->max_cost) {
+            long best = -1;
+            for (d = fmax; d >= fmin; d -= 2) {
+                long x = kvf[d] < a_hi ? kvf[d] : a_hi;
+                long y = x - d;
+                if (y > b_hi) {
+                    x -= y - b_hi;
+                    y = b_hi;
+                }
+                if (x + y > best) {
+                    best = x + y;
+                    *split_a = x;
+                    *split_b = y;
+                }
+            }
+            return;
+        }
+    }
+}
+
+static void diff_mark(char *changed, long lo, long hi) {
+    for (; lo < hi; lo++) {
+        changed[lo] = 1;
+    }
+}
+
+static void diff_compare(const DiffContext *ctx, long a_lo, long a_hi, long b_lo, long b_hi) {
+    long split_a = a_lo;
+    long split_b = b_lo;
+
+    while (a_lo < a_hi && b_lo < b_hi && ctx->a[a_lo] == ctx->b[b_lo]) {
+        a_lo++;
+        b_lo++;
+    }
+    while (a_lo < a_hi && b_lo < b_hi && ctx->a[a_hi - 1] == ctx->b[b_hi - 1]) {
+        a_hi--;
+        b_hi--;
+    }
+
+    if (a_lo == a_hi) {
+        diff_mark(ctx->b_changed, b_lo, b_hi);
+        return;
+    }
+    if (b_lo == b_hi) {
+        diff_mark(ctx->a_changed, a_lo, a_hi);
+        return;
+    }
+
+    diff_split(ctx, a_lo, a_hi, b_lo, b_hi, &split_a, &split_b);
+    if ((split_a == a_lo && split_b == b_lo) || (split_a == a_hi && split_b == b_hi)) {
+        /* Only reachable through the cost cutoff; settle for a replace. */
+        diff_mark(ctx->a_changed, a_lo, a_hi);
+        diff_mark(ctx->b_changed, b_lo, b_hi);
+        return;
+    }
+    diff_compare(ctx, a_lo, split_a, b_lo, split_b);
+    diff_compare(ctx, split_a, a_hi, split_b, b_hi);
+}
+
+static void print_range(FILE *out, long start, long count) {
+    if (count == 1) {
+        fprintf(out, "%ld", start + 1);
+    } else if (count == 0) {
+        fprintf(out, "%ld,0", start);
+    } else {
+        fprintf(out, "%ld,%ld", start + 1, count);
+    }
+}
+
+static void print_line(FILE *out, char marker, const DiffLine *line) {
+    fputc(marker, out);
+    fwrite(line->start, 1, line->len, out);
+    if (line->len == 0 || line->start[line->len - 1] != '\n') {
+        fputs("\n\\ No newline at end of file\n", out);
+    }
+}
+
+/* Git's default hunk header: the nearest line above the hunk that starts
+ * with a letter, '_' or '$', cut to 80 bytes without trailing blanks. */
+static void print_function_context(FILE *out, const DiffFile *a, long hunk_a) {
+    long k;
+
+    for (k = hunk_a - 1; k >= 0; k--) {
+        const DiffLine *line = &a->lines[k];
+        size_t len = line->len < HUNK_HEADER_FUNC_MAX ? line->len : HUNK_HEADER_FUNC_MAX;
+        unsigned char first = len > 0 ? line->start[0] : 0;
+
+        if (!isalpha(first) && first != '_' && first != '$') {
+            continue;
+        }
+        while (len > 0 && isspace(line->start[len - 1])) {
+            len--;
+        }
+        fputc(' ', out);
+        fwrite(line->start, 1, len, out);
+        return;
+    }
+}
+
+/* Walks both change maps in step; unchanged lines pair up one to one, so a
+ * change block ends where both maps go quiet again. Blocks closer than
+ * 2 * context lines share a hunk. */
+static void print_hunks(FILE *out, const DiffFile *a, const DiffFile *b, int context) {
+    long i = 0;
+    long j = 0;
+
+    while (i < a->count || j < b->count) {
+        long hunk_a;
+        long hunk_b;
+        long end_a;
+        long end_b;
+        long scan_a;
+        long scan_b;
+        long x;
+        long y;
+
+        if (!(i < a->count && a->changed[i]) && !(j < b->count && b->changed[j])) {
+            i++;
+            j++;
+            continue;
+        }
+
+        hunk_a = i > context ? i - context : 0;
+        hunk_b = j - (i - hunk_a);
+
+        /* Extend over following blocks while the gap stays small. */
+        scan_a = i;
+        scan_b = j;
+        for (;;) {
+            long gap = 0;
+            while (scan_a < a->count && a->changed[scan_a]) {
+                scan_a++;
+            }
+            while (scan_b < b->count && b->changed[scan_b]) {
+                scan_b++;
+            }
+            end_a = scan_a;
+            end_b = scan_b;
+            while (scan_a < a->count && scan_b < b->count && !a->changed[scan_a] && !b->changed[scan_b] &&
+                   gap <= 2 * context) {
+                scan_a++;
+                scan_b++;
+                gap++;
+            }
+            if (gap > 2 * context || ((scan_a >= a->count || !a->changed[scan_a]) &&
+                                      (scan_b >= b->count || !b->changed[scan_b]))) {
+                break;
+            }
+        }
+        end_a = end_a + context < a->count ? end_a + context : a->count;
+        end_b = end_b + context < b->count ? end_b + context : b->count;
+
+        fputs("@@ -", out);
+        print_range(out, hunk_a, end_a - hunk_a);
+        fputs(" +", out);
+        print_range(out, hunk_b, end_b - hunk_b);
+        fputs(" @@", out);
+        print_function_context(out, a, hunk_a);
+        fputc('\n', out);
+
+        x = hunk_a;
+        y = hunk_b;
+        while (x < end_a || y < end_b) {
+            if (x < end_a && a->changed[x]) {
+                print_line(out, '-', &a->lines[x++]);
+            } else if (y < end_b && b->changed[y]) {
+                print_line(out, '+', &b->lines[y++]);
+            } else {
+                print_line(out, ' ', &a->lines[x]);
+                x++;
+                y++;
+            }
+        }
+        i = end_a;
+        j = end_b;
+    }
+}
+
+int diff_unified(FILE *out, const unsigned char *old_data, size_t old_size, const unsigned char *new_data,
+                 size_t new_size, int context) {
+    DiffFile a;
+    DiffFile b;
+    DiffContext ctx;
+    long *diagonals = NULL;
+    long total;
+    int result = -1;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    if (split_lines(old_data, old_size, &a) != 0 || split_lines(new_data, new_size, &b) != 0 ||
+        intern_lines(&a, &b) != 0) {
+        goto done;
+    }
+
+    total = a.count + b.count + 3;
+    diagonals = malloc((size_t)total * 2 * sizeof(long));
+    if (diagonals == NULL) {
+        goto done;
+    }
+    ctx.a = a.ids;
+    ctx.b = b.ids;
+    ctx.a_changed = a.changed;
+    ctx.b_changed = b.changed;
+    ctx.kvf = diagonals + b.count + 1;
+    ctx.kvb = diagonals + total + b.count + 1;
+    ctx.max_cost = DIFF_MIN_COST;
+    while (ctx.max_cost * ctx.max_cost < total) {
+        ctx.max_cost *= 2;
+    }
+
+    diff_compare(&ctx, 0, a.count, 0, b.count);
+    print_hunks(out, &a, &b, context);
+    result = 0;
+
+done:
+    free(diagonals);
+    diff_file_free(&a);
+    diff_file_free(&b);
+    return result;
+}
+
+static int span_cmp(const void *left, const void *right) {
+    const DiffSpan *a = (const DiffSpan *)left;
+    const DiffSpan *b = (const DiffSpan *)right;
+    return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+int diff_sketch_build(const unsigned char *data, size_t size, DiffSketch *sketch) {
+    bool text = !diff_is_binary(data, size);
+    uint32_t accum1 = 0;
+    uint32_t accum2 = 0;
+    size_t chunk = 0;
+    size_t count = 0;
+    size_t used = 0;
+    size_t i;
+
+    sketch->spans = NULL;
+    sketch->count = 0;
+    sketch->size = size;
+    /* At worst one span per 64 bytes plus one per newline. */
+    for (i = 0; i < size; i++) {
+        count += data[i] == '\n';
+    }
+    count += size / SKETCH_SPAN_BYTES + 1;
+    sketch->spans = malloc(count * sizeof(DiffSpan));
+    if (sketch->spans == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        uint32_t c = data[i];
+        uint32_t old1 = accum1;
+
+        if (text && c == '\r' && i + 1 < size && data[i + 1] == '\n') {
+            continue;
+        }
+        accum1 = (accum1 << 7) ^ (accum2 >> 25);
+        accum2 = (accum2 << 7) ^ (old1 >> 25);
+        accum1 += c;
+        if (++chunk < SKETCH_SPAN_BYTES && c != '\n') {
+            continue;
+        }
+        sketch->spans[used].hash = (accum1 + accum2 * 0x61) % SKETCH_HASH_BASE;
+        sketch->spans[used++].bytes = (uint32_t)chunk;
+        chunk = 0;
+        accum1 = 0;
+        accum2 = 0;
+    }
+    if (chunk > 0) {
+        sketch->spans[used].hash = (accum1 + accum2 * 0x61) % SKETCH_HASH_BASE;
+        sketch->spans[used++].bytes = (uint32_t)chunk;
+    }
+
+    /* Fold equal hashes together so comparison is a single merge. */
+    qsort(sketch->spans, used, sizeof(DiffSpan), span_cmp);
+    count = 0;
+    for (i = 0; i < used; i++) {
+        if (count > 0 && sketch->spans[count - 1].hash == sketch->spans[i].hash) {
+            sketch->spans[count - 1].bytes += sketch->spans[i].bytes;
+        } else {
+            sketch->spans[count++] = sketch->spans[i];
+        }
+    }
+    sketch->count = count;
+    return 0;
+}
+
+void diff_sketch_free(DiffSketch *sketch) {
+    free(sketch->spans);
+    sketch->spans = NULL;
+    sketch->count = 0;
+}
+
+int diff_similarity(const DiffSketch *src, const DiffSketch *dst, int min_score) {
+    size_t max_size = src->size > dst->size ? src->size : dst->size;
+    size_t base_size = src->size < dst->size ? src->size : dst->size;
+    uint64_t copied = 0;
+    size_t i = 0;
+    size_t j = 0;
+
+    if (max_size == 0 || (uint64_t)max_size * (DIFF_MAX_SCORE - min_score) <
+                             (uint64_t)(max_size - base_size) * DIFF_MAX_SCORE) {
+        return 0;
+    }
+    while (i < src->count && j < dst->count) {
+        if (src->spans[i].hash < dst->spans[j].hash) {
+            i++;
+        } else if (dst->spans[j].hash < src->spans[i].hash) {
+            j++;
+        } else {
+            uint32_t src_bytes = src->spans[i++].bytes;
+            uint32_t dst_bytes = dst->spans[j++].bytes;
+            copied += src_bytes < dst_bytes ? src_bytes : dst_bytes;
+        }
+    }
+    return (int)(copied * DIFF_MAX_SCORE / max_size);
+}
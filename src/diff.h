@@ -0,0 +1,46 @@
+#ifndef CG_DIFF_H
+#define CG_DIFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DIFF_CONTEXT_LINES 3
+/* Similarity scores run from 0 to DIFF_MAX_SCORE, as in git. */
+#define DIFF_MAX_SCORE 60000
+#define DIFF_RENAME_SCORE 30000
+
+/* Git's heuristic: a NUL byte in the first 8000 bytes means binary. */
+bool diff_is_binary(const unsigned char *data, size_t size);
+
+/* Writes the unified hunks ("@@ ... @@" and the lines below them) turning
+ * old into new. Lines are interned to integers and compared with a
+ * linear-space Myers diff. Writes nothing when the inputs are equal.
+ * Returns -1 only on allocation failure. Safe to call from several threads
+ * at once. */
+int diff_unified(FILE *out, const unsigned char *old_data, size_t old_size, const unsigned char *new_data,
+                 size_t new_size, int context);
+
+typedef struct {
+    uint32_t hash;
+    uint32_t bytes;
+} DiffSpan;
+
+/* Content fingerprint for rename detection: the bytes covered by each span
+ * hash, sorted by hash. Comparing two sketches costs one merge over them
+ * instead of a full diff. */
+typedef struct {
+    DiffSpan *spans;
+    size_t count;
+    size_t size;
+} DiffSketch;
+
+int diff_sketch_build(const unsigned char *data, size_t size, DiffSketch *sketch);
+void diff_sketch_free(DiffSketch *sketch);
+/* Bytes of dst that can be copied from src, scaled against the larger of
+ * the two sizes. Returns 0 straight away when the size difference alone
+ * keeps the score below min_score. */
+int diff_similarity(const DiffSketch *src, const DiffSketch *dst, int min_score);
+
+#endif
@@ -0,0 +1,225 @@
+#include "ewah.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A run-length word: bit 0 is the running bit, bits 1-32 count the run of
+ * repeated words, bits 33-63 count the literal words that follow it. */
+#define RLW_RUNNING_MAX 0xFFFFFFFFull
+#define RLW_LITERAL_MAX 0x7FFFFFFFull
+#define WORD_ALL_ONES (~(uint64_t)0)
+
+void bitmap_init(Bitmap *bitmap) {
+    bitmap->words = NULL;
+    bitmap->word_count = 0;
+    bitmap->bit_size = 0;
+}
+
+void bitmap_free(Bitmap *bitmap) {
+    free(bitmap->words);
+    bitmap_init(bitmap);
+}
+
+static int bitmap_grow(Bitmap *bitmap, size_t word_count) {
+    uint64_t *words;
+
+    if (word_count <= bitmap->word_count) {
+        return 0;
+    }
+    words = realloc(bitmap->words, word_count * sizeof(uint64_t));
+    if (words == NULL) {
+        return -1;
+    }
+    memset(words + bitmap->word_count, 0, (word_count - bitmap->word_count) * sizeof(uint64_t));
+    bitmap->words = words;
+    bitmap->word_count = word_count;
+    return 0;
+}
+
+int bitmap_reserve(Bitmap *bitmap, size_t bit_count) {
+    return bitmap_grow(bitmap, (bit_count + 63) / 64);
+}
+
+int bitmap_set(Bitmap *bitmap, size_t pos) {
+    if (bitmap_grow(bitmap, pos / 64 + 1) != 0) {
+        return -1;
+    }
+    bitmap->words[pos / 64] |= (uint64_t)1 << (pos % 64);
+    if (pos >= bitmap->bit_size) {
+        bitmap->bit_size = pos + 1;
+    }
+    return 0;
+}
+
+bool bitmap_get(const Bitmap *bitmap, size_t pos) {
+    if (pos / 64 >= bitmap->word_count) {
+        return false;
+    }
+    return (bitmap->words[pos / 64] >> (pos % 64)) & 1;
+}
+
+int bitmap_or(Bitmap *dst, const Bitmap *src) {
+    size_t i;
+
+    if (bitmap_grow(dst, src->word_count) != 0) {
+        return -1;
+    }
+    for (i = 0; i < src->word_count; i++) {
+        dst->words[i] |= src->words[i];
+    }
+    if (src->bit_size > dst->bit_size) {
+        dst->bit_size = src->bit_size;
+    }
+    return 0;
+}
+
+int bitmap_xor(Bitmap *dst, const Bitmap *src) {
+    size_t i;
+
+    if (bitmap_grow(dst, src->word_count) != 0) {
+        return -1;
+    }
+    for (i = 0; i < src->word_count; i++) {
+        dst->words[i] ^= src->words[i];
+    }
+    if (src->bit_size > dst->bit_size) {
+        dst->bit_size = src->bit_size;
+    }
+    return 0;
+}
+
+size_t bitmap_count(const Bitmap *bitmap, const Bitmap *mask) {
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < bitmap->word_count; i++) {
+        uint64_t word = bitmap->words[i];
+
+        if (mask != NULL) {
+            word &= i < mask->word_count ? mask->words[i] : 0;
+        }
+        count += (size_t)__builtin_popcountll(word);
+    }
+    return count;
+}
+
+static void put_be32(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+static void put_be64(unsigned char *out, uint64_t value) {
+    put_be32(out, (uint32_t)(value >> 32));
+    put_be32(out + 4, (uint32_t)value);
+}
+
+static uint32_t get_be32(const unsigned char *in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+static uint64_t get_be64(const unsigned char *in) {
+    return ((uint64_t)get_be32(in) << 32) | get_be32(in + 4);
+}
+
+int ewah_serialize(const Bitmap *bitmap, unsigned char **out, size_t *out_len) {
+    size_t used = (bitmap->bit_size + 63) / 64;
+    uint64_t *buffer;
+    size_t count = 0;
+    size_t last_rlw = 0;
+    size_t i = 0;
+    unsigned char *bytes;
+
+    if (used > bitmap->word_count) {
+        used = bitmap->word_count;
+    }
+    /* Worst case is one marker per literal word plus one. */
+    buffer = malloc((used * 2 + 1) * sizeof(uint64_t));
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    do {
+        uint64_t running_bit = 0;
+        uint64_t running = 0;
+        uint64_t literals = 0;
+        size_t marker = count++;
+
+        if (i < used && (bitmap->words[i] == 0 || bitmap->words[i] == WORD_ALL_ONES)) {
+            uint64_t fill = bitmap->words[i];
+            running_bit = fill != 0;
+            while (i < used && bitmap->words[i] == fill && running < RLW_RUNNING_MAX) {
+                running++;
+                i++;
+            }
+        }
+        while (i < used && bitmap->words[i] != 0 && bitmap->words[i] != WORD_ALL_ONES &&
+               literals < RLW_LITERAL_MAX) {
+            buffer[count++] = bitmap->words[i++];
+            literals++;
+        }
+        buffer[marker] = running_bit | (running << 1) | (literals << 33);
+        last_rlw = marker;
+    } while (i < used);
+
+    *out_len = 4 + 4 + count * 8 + 4;
+    bytes = malloc(*out_len);
+    if (bytes == NULL) {
+        free(buffer);
+        return -1;
+    }
+    put_be32(bytes, (uint32_t)bitmap->bit_size);
+    put_be32(bytes + 4, (uint32_t)count);
+    for (i = 0; i < count; i++) {
+        put_be64(bytes + 8 + i * 8, buffer[i]);
+    }
+    put_be32(bytes + 8 + count * 8, (uint32_t)last_rlw);
+    free(buffer);
+    *out = bytes;
+    return 0;
+}
+
+long ewah_deserialize(const unsigned char *data, size_t len, Bitmap *out) {
+    uint32_t bit_size;
+    uint32_t count;
+    size_t pos = 0;
+    size_t word = 0;
+
+    bitmap_init(out);
+    if (len < 12) {
+        return -1;
+    }
+    bit_size = get_be32(data);
+    count = get_be32(data + 4);
+    if ((len - 12) / 8 < count) {
+        return -1;
+    }
+    if (bitmap_grow(out, ((size_t)bit_size + 63) / 64) != 0) {
+        return -1;
+    }
+
+    while (pos < count) {
+        uint64_t rlw = get_be64(data + 8 + pos * 8);
+        uint64_t running = (rlw >> 1) & RLW_RUNNING_MAX;
+        uint64_t literals = rlw >> 33;
+        uint64_t fill = (rlw & 1) ? WORD_ALL_ONES : 0;
+
+        pos++;
+        if (running > out->word_count - word || literals > out->word_count - word - running ||
+            literals > count - pos) {
+            bitmap_free(out);
+            return -1;
+        }
+        for (; running > 0; running--) {
+            out->words[word++] = fill;
+        }
+        for (; literals > 0; literals--) {
+            out->words[word++] = get_be64(data + 8 + pos * 8);
+            pos++;
+        }
+    }
+
+    out->bit_size = bit_size;
+    return (long)(12 + (size_t)count * 8);
+}
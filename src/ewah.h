@@ -0,0 +1,37 @@
+#ifndef CG_EWAH_H
+#define CG_EWAH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Uncompressed bitmap used in memory; bit i lives in words[i / 64]. */
+typedef struct {
+    uint64_t *words;
+    size_t word_count;
+    size_t bit_size;
+} Bitmap;
+
+void bitmap_init(Bitmap *bitmap);
+void bitmap_free(Bitmap *bitmap);
+/* Allocates room for bit_count bits up front, for callers that know the
+ * size and would otherwise grow the words one set at a time. */
+int bitmap_reserve(Bitmap *bitmap, size_t bit_count);
+int bitmap_set(Bitmap *bitmap, size_t pos);
+bool bitmap_get(const Bitmap *bitmap, size_t pos);
+/* dst |= src and dst ^= src, growing dst to the longer of the two. */
+int bitmap_or(Bitmap *dst, const Bitmap *src);
+int bitmap_xor(Bitmap *dst, const Bitmap *src);
+/* Number of set bits; with a mask, only those also set in the mask. */
+size_t bitmap_count(const Bitmap *bitmap, const Bitmap *mask);
+
+/* EWAH-compressed serialization in git's on-disk layout (big-endian):
+ * bit size u32, word count u32, 64-bit words, position of the last
+ * run-length word u32. Runs of all-zero or all-one words collapse into a
+ * single marker, so a sparse bitmap costs space in proportion to its set
+ * bits. ewah_serialize returns a malloc'd buffer. */
+int ewah_serialize(const Bitmap *bitmap, unsigned char **out, size_t *out_len);
+/* Returns the number of bytes consumed, or -1 on malformed input. */
+long ewah_deserialize(const unsigned char *data, size_t len, Bitmap *out);
+
+#endif
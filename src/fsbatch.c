@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+
+#include "fsbatch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CG_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+#endif
+
+/* Requests kept in flight by the io_uring backend, and threads blocked in
+ * system calls by the fallback. Both are far above the CPU count on purpose:
+ * on network filesystems the time goes to round trips, not to work. */
+#define FS_BATCH_DEPTH 256
+#define FS_BATCH_THREADS 32
+/* Largest single read; io_uring lengths are 32 bits. */
+#define FS_BATCH_READ_CHUNK (1u << 30)
+
+typedef enum {
+    FS_BACKEND_AUTO,
+    FS_BACKEND_THREADS,
+    FS_BACKEND_URING,
+} FsBackend;
+
+static FsBackend fs_backend = FS_BACKEND_AUTO;
+
+static bool fs_batch_wanted(const FsBatchItem *item, size_t max_size) {
+    return item->error == 0 && S_ISREG(item->st.st_mode) && (uint64_t)item->st.st_size <= max_size;
+}
+
+static int fs_batch_alloc(FsBatchItem *items, size_t count, size_t max_size) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        items[i].data = NULL;
+        items[i].size = 0;
+        items[i].loaded = false;
+        if (!fs_batch_wanted(&items[i], max_size)) {
+            continue;
+        }
+        items[i].data = malloc(items[i].st.st_size > 0 ? (size_t)items[i].st.st_size : 1);
+        if (items[i].data == NULL) {
+            while (i > 0) {
+                i--;
+                free(items[i].data);
+                items[i].data = NULL;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void fs_stat_job(void *ctx, size_t index) {
+    FsBatchItem *item = (FsBatchItem *)ctx + index;
+
+    item->error = lstat(item->path, &item->st) == 0 ? 0 : errno;
+}
+
+static void fs_read_job(void *ctx, size_t index) {
+    FsBatchItem *item = (FsBatchItem *)ctx + index;
+    size_t want = (size_t)item->st.st_size;
+    int fd;
+
+    if (item->data == NULL) {
+        return;
+    }
+    fd = open(item->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        item->error = errno;
+        return;
+    }
+    while (item->size < want) {
+        ssize_t got = pread(fd, item->data + item->size, want - item->size, (off_t)item->size);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            item->error = errno;
+            close(fd);
+            return;
+        }
+        if (got == 0) {
+            break;
+        }
+        item->size += (size_t)got;
+    }
+    close(fd);
+    item->loaded = true;
+}
+
+#ifdef CG_IO_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    unsigned entries;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+} Uring;
+
+typedef enum {
+    FS_STAGE_STATX,
+    FS_STAGE_OPEN,
+    FS_STAGE_READ,
+    FS_STAGE_DONE,
+} FsStage;
+
+typedef struct {
+    struct statx stx;
+    int fd;
+    FsStage stage;
+} FsSlot;
+
+static Uring fs_ring = {.fd = -1};
+static bool fs_ring_tried;
+
+static void uring_close(Uring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* Containers and hardened kernels often refuse io_uring outright, and
+ * kernels before 5.6 lack the opcodes; both cases fall back to threads. */
+static bool uring_supports_ops(int fd) {
+    static const unsigned char needed[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ};
+    struct io_uring_probe *probe;
+    bool supported = true;
+    size_t i;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+        return false;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) != 0) {
+        free(probe);
+        return false;
+    }
+    for (i = 0; i < sizeof(needed); i++) {
+        supported = supported && needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+static int uring_open(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    unsigned char *sq;
+    unsigned char *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+    if (!uring_supports_ops(ring->fd)) {
+        goto fail;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return 0;
+
+fail:
+    uring_close(ring);
+    return -1;
+}
+
+static bool fs_ring_ready(void) {
+    if (!fs_ring_tried) {
+        fs_ring_tried = true;
+        uring_open(&fs_ring, FS_BATCH_DEPTH);
+    }
+    return fs_ring.fd >= 0;
+}
+
+static void stat_from_statx(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = (off_t)stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = (blkcnt_t)stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, FsBatchItem *item, FsSlot *slot, size_t index) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+    switch (slot->stage) {
+    case FS_STAGE_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)item->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&slot->stx;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        break;
+    case FS_STAGE_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)item->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        break;
+    default: {
+        size_t left = (size_t)item->st.st_size - item->size;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = slot->fd;
+        sqe->addr = (uintptr_t)(item->data + item->size);
+        sqe->len = left > FS_BATCH_READ_CHUNK ? FS_BATCH_READ_CHUNK : (unsigned)left;
+        sqe->off = item->size;
+        break;
+    }
+    }
+}
+
+static void uring_finish_read(FsBatchItem *item, FsSlot *slot, int error) {
+    close(slot->fd);
+    slot->fd = -1;
+    item->error = error;
+    item->loaded = error == 0;
+    slot->stage = FS_STAGE_DONE;
+}
+
+/* Moves an item to its next step given the result of the last one; returns
+ * true when it needs another request. */
+static bool uring_advance(FsBatchItem *item, FsSlot *slot, int res) {
+    switch (slot->stage) {
+    case FS_STAGE_STATX:
+        slot->stage = FS_STAGE_DONE;
+        if (res < 0) {
+            item->error = -res;
+            return false;
+        }
+        stat_from_statx(&slot->stx, &item->st);
+        item->error = 0;
+        return false;
+    case FS_STAGE_OPEN:
+        if (res < 0) {
+            item->error = -res;
+            slot->stage = FS_STAGE_DONE;
+            return false;
+        }
+        slot->fd = res;
+        if (item->st.st_size == 0) {
+            uring_finish_read(item, slot, 0);
+            return false;
+        }
+        slot->stage = FS_STAGE_READ;
+        return true;
+    case FS_STAGE_READ:
+        if (res == -EINTR || res == -EAGAIN) {
+            return true;
+        }
+        if (res < 0) {
+            uring_finish_read(item, slot, -res);
+            return false;
+        }
+        item->size += (size_t)res;
+        if (res > 0 && item->size < (size_t)item->st.st_size) {
+            return true;
+        }
+        uring_finish_read(item, slot, 0);
+        return false;
+    default:
+        return false;
+    }
+}
+
+/* Drives every item through its requests with up to ring->entries of them
+ * in flight. Items whose step completed and that need another one wait in
+ * requeue, which can never hold more than the number in flight. A read
+ * batch starts items without a buffer as done. */
+static int uring_run(Uring *ring, FsBatchItem *items, size_t count, FsStage first) {
+    FsSlot *slots = calloc(count, sizeof(FsSlot));
+    size_t *requeue = malloc(ring->entries * sizeof(size_t));
+    size_t requeue_len = 0;
+    size_t next = 0;
+    size_t in_flight = 0;
+    unsigned to_submit = 0;
+    size_t i;
+
+    if (slots == NULL || requeue == NULL) {
+        free(slots);
+        free(requeue);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        slots[i].fd = -1;
+        slots[i].stage = first == FS_STAGE_OPEN && items[i].data == NULL ? FS_STAGE_DONE : first;
+    }
+
+    for (;;) {
+        unsigned tail = *ring->sq_tail;
+        unsigned head;
+        int entered;
+
+        for (;;) {
+            size_t index;
+            unsigned slot;
+            while (next < count && slots[next].stage == FS_STAGE_DONE) {
+                next++;
+            }
+            if (in_flight == ring->entries || (requeue_len == 0 && next == count)) {
+                break;
+            }
+            index = requeue_len > 0 ? requeue[--requeue_len] : next++;
+            slot = tail & *ring->sq_mask;
+            uring_prep(&ring->sqes[slot], &items[index], &slots[index], index);
+            ring->sq_array[slot] = slot;
+            tail++;
+            to_submit++;
+            in_flight++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        if (in_flight == 0) {
+            break;
+        }
+
+        entered = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            /* Requests already queued may still write into slots, so
+             * they are deliberately leaked rather than freed. */
+            free(requeue);
+            return -1;
+        }
+        if (entered > 0) {
+            to_submit -= (unsigned)entered;
+        }
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t index = (size_t)cqe->user_data;
+            if (uring_advance(&items[index], &slots[index], cqe->res)) {
+                requeue[requeue_len++] = index;
+            }
+            in_flight--;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free(slots);
+    free(requeue);
+    return 0;
+}
+#endif
+
+static bool fs_use_uring(void) {
+#ifdef CG_IO_URING
+    return fs_backend != FS_BACKEND_THREADS && fs_ring_ready();
+#else
+    return false;
+#endif
+}
+
+int fs_batch_select(const char *name) {
+    if (name == NULL || name[0] == '\0') {
+        fs_backend = FS_BACKEND_AUTO;
+        return 0;
+    }
+    if (strcmp(name, "threads") == 0) {
+        fs_backend = FS_BACKEND_THREADS;
+        return 0;
+    }
+#ifdef CG_IO_URING
+    if (strcmp(name, "uring") == 0 && fs_ring_ready()) {
+        fs_backend = FS_BACKEND_URING;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char *fs_batch_backend(void) {
+    return fs_use_uring() ? "uring" : "threads";
+}
+
+int fs_batch_stat(FsBatchItem *items, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+#ifdef CG_IO_URING
+    if (fs_use_uring()) {
+        return uring_run(&fs_ring, items, count, FS_STAGE_STATX);
+    }
+#endif
+    parallel_for_threads(count, FS_BATCH_THREADS, fs_stat_job, items);
+    return 0;
+}
+
+int fs_batch_read(FsBatchItem *items, size_t count, size_t max_size) {
+    if (count == 0) {
+        return 0;
+    }
+    if (fs_batch_alloc(items, count, max_size) != 0) {
+        return -1;
+    }
+#ifdef CG_IO_URING
+    if (fs_use_uring()) {
+        return uring_run(&fs_ring, items, count, FS_STAGE_OPEN);
+    }
+#endif
+    parallel_for_threads(count, FS_BATCH_THREADS, fs_read_job, items);
+    return 0;
+}
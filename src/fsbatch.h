@@ -0,0 +1,34 @@
+#ifndef CG_FSBATCH_H
+#define CG_FSBATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* One file in a batch. path must stay valid until the batch returns. */
+typedef struct {
+    const char *path;
+    int error;           /* errno of the step that failed, 0 on success */
+    struct stat st;      /* lstat() result, filled by fs_batch_stat */
+    unsigned char *data; /* contents, filled by fs_batch_read; free() it */
+    size_t size;
+    bool loaded;
+} FsBatchItem;
+
+/* Selects the backend by name ("uring", "threads"). NULL or an empty name
+ * defers the choice to the first batch, which uses io_uring when the kernel
+ * offers statx, openat and read through it and a thread pool otherwise.
+ * Returns -1 if the named backend is unknown or unavailable here. */
+int fs_batch_select(const char *name);
+const char *fs_batch_backend(void);
+
+/* lstat()s every item, keeping many requests in flight at once. */
+int fs_batch_stat(FsBatchItem *items, size_t count);
+/* Reads whole every item that fs_batch_stat found to be a regular file of at
+ * most max_size bytes and sets loaded; the others are left alone. A file
+ * that shrank meanwhile yields its shorter contents. Returns -1 only when
+ * buffers cannot be allocated; per-file failures land in error. Neither
+ * call is safe to run from several threads at once. */
+int fs_batch_read(FsBatchItem *items, size_t count, size_t max_size);
+
+#endif
@@ -1,31 +1,94 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
-#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "cg.h"
+#include "diff.h"
+#include "ewah.h"
+#include "fsbatch.h"
+#include "objcache.h"
+#include "pack.h"
+#include "parallel.h"
+#include "sha1.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+/* Files smaller than this are hashed with a plain read loop; larger ones are
+ * mapped in fixed windows so peak RSS stays bounded regardless of file size. */
+#define HASH_CHUNK_SIZE (64 * 1024)
+#define HASH_MMAP_THRESHOLD (256 * 1024)
+#define HASH_MMAP_WINDOW (4 * 1024 * 1024)
+#define DIRECT_IO_ALIGN 4096
+
+typedef struct {
+    unsigned char hash[20];
+} ObjectId;
+
+/* Stat data of the worktree file an entry was last hashed from, truncated to
+ * 32 bits as in git's index. A file whose lstat still matches is taken to be
+ * unchanged without reading it. mode 0 means the entry has none. */
+typedef struct {
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t dev;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t size;
+} IndexStat;
+
+#define INDEX_MODE_FILE 0100644u
+#define INDEX_MODE_EXEC 0100755u
+#define INDEX_MODE_SYMLINK 0120000u
+
 typedef struct {
     char *path;
-    char hash[41];
+    ObjectId oid;
+    uint32_t mode;
+    IndexStat stat;
 } IndexEntry;
 
+/* Cached tree ids per directory, mirroring git's cache-tree. entry_count is
+ * the number of index entries below the directory, or -1 once a path inside
+ * it has changed and oid can no longer be trusted. */
+typedef struct CacheTree {
+    char *name;
+    int entry_count;
+    ObjectId oid;
+    struct CacheTree **children;
+    size_t child_count;
+    size_t child_cap;
+} CacheTree;
+
 typedef struct {
     IndexEntry *items;
     size_t len;
     size_t cap;
+    CacheTree *cache_tree;
 } IndexList;
 
 typedef struct {
@@ -34,6 +97,196 @@ typedef struct {
     size_t cap;
 } PathList;
 
+/* State kept warm across commands under `cg batch`. Single-shot invocations
+ * leave it inactive and always read from disk. */
+typedef struct {
+    bool active;
+    char cwd[PATH_MAX];
+    char repo_root[PATH_MAX];
+    bool index_valid;
+    struct stat index_stat;
+    struct stat journal_stat;
+    IndexList index;
+    bool head_valid;
+    ObjectId head_commit;
+    IndexList head_entries;
+    /* The repository as the last command left it; see repo_cache_check_disk. */
+    bool disk_valid;
+    bool disk_has_head;
+    ObjectId disk_head;
+    struct stat disk_index_stat;
+    struct stat disk_journal_stat;
+    struct stat disk_packed_refs_stat;
+} RepoCache;
+
+static RepoCache repo_cache;
+
+/* Structured performance tracing, enabled with CG_TRACE=<file> (or 1 for
+ * stderr). Every event is one JSON object per line with a CLOCK_MONOTONIC
+ * timestamp. When the variable is unset trace_file stays NULL and every hook
+ * below reduces to a single predictable branch. */
+typedef struct {
+    unsigned long long files_stated;
+    unsigned long long bytes_hashed;
+    unsigned long long objects_read;
+    unsigned long long subprocesses;
+    unsigned long long allocations;
+    unsigned long long object_cache_hits;
+    unsigned long long object_cache_misses;
+    unsigned long long delta_cache_hits;
+    unsigned long long delta_cache_misses;
+} TraceCounters;
+
+typedef struct {
+    const char *name;
+    long long start_ns;
+    TraceCounters at_start;
+} TraceRegion;
+
+static FILE *trace_file;
+static TraceCounters trace_counters;
+
+/* Inflated objects read through the object database, kept for the whole
+ * process; see odb_read. */
+static ObjectCache object_cache = OBJECT_CACHE_INIT;
+
+/* Atomic because parallel_for workers count too. */
+#define TRACE_COUNT(field, amount)                                                                     \
+    do {                                                                                               \
+        if (trace_file != NULL) {                                                                      \
+            __atomic_fetch_add(&trace_counters.field, (unsigned long long)(amount), __ATOMIC_RELAXED); \
+        }                                                                                              \
+    } while (0)
+
+static long long trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void trace_write_string(const char *text) {
+    fputc('"', trace_file);
+    for (; *text != '\0'; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            fprintf(trace_file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(trace_file, "\\u%04x", c);
+        } else {
+            fputc(c, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
+
+/* The caches count hits and misses themselves, under their locks, since
+ * pack reads also run on worker threads. */
+static void trace_snapshot(TraceCounters *out) {
+    *out = trace_counters;
+    object_cache_stats(&object_cache, &out->object_cache_hits, &out->object_cache_misses);
+    pack_delta_cache_stats(&out->delta_cache_hits, &out->delta_cache_misses);
+}
+
+static void trace_write_counters(const TraceCounters *now, const TraceCounters *since) {
+    fprintf(trace_file,
+            ",\"files_stated\":%llu,\"bytes_hashed\":%llu,\"objects_read\":%llu,"
+            "\"subprocesses\":%llu,\"allocations\":%llu,\"object_cache_hits\":%llu,"
+            "\"object_cache_misses\":%llu,\"delta_cache_hits\":%llu,\"delta_cache_misses\":%llu",
+            now->files_stated - since->files_stated,
+            now->bytes_hashed - since->bytes_hashed,
+            now->objects_read - since->objects_read,
+            now->subprocesses - since->subprocesses,
+            now->allocations - since->allocations,
+            now->object_cache_hits - since->object_cache_hits,
+            now->object_cache_misses - since->object_cache_misses,
+            now->delta_cache_hits - since->delta_cache_hits,
+            now->delta_cache_misses - since->delta_cache_misses);
+}
+
+static void trace_begin_event(const char *event) {
+    fprintf(trace_file, "{\"event\":\"%s\",\"t_ns\":%lld,\"pid\":%ld", event, trace_now_ns(), (long)getpid());
+}
+
+static void trace_init(int argc, char **argv) {
+    const char *target = getenv("CG_TRACE");
+    int i;
+
+    if (target == NULL || target[0] == '\0' || strcmp(target, "0") == 0) {
+        return;
+    }
+    if (strcmp(target, "1") == 0 || strcmp(target, "2") == 0) {
+        trace_file = stderr;
+    } else {
+        trace_file = fopen(target, "a");
+        if (trace_file == NULL) {
+            fprintf(stderr, "cg: warning: cannot open trace file '%s'\n", target);
+            return;
+        }
+    }
+
+    trace_begin_event("start");
+    fputs(",\"argv\":[", trace_file);
+    for (i = 0; i < argc; i++) {
+        if (i > 0) {
+            fputc(',', trace_file);
+        }
+        trace_write_string(argv[i]);
+    }
+    fputs("],\"sha1\":", trace_file);
+    trace_write_string(sha1_kernel_name());
+    fputs(",\"io\":", trace_file);
+    trace_write_string(fs_batch_backend());
+    fputs("}\n", trace_file);
+}
+
+static void trace_finish(int exit_code) {
+    static const TraceCounters zero;
+    TraceCounters now;
+
+    if (trace_file == NULL) {
+        return;
+    }
+    trace_snapshot(&now);
+    trace_begin_event("exit");
+    fprintf(trace_file, ",\"code\":%d", exit_code);
+    trace_write_counters(&now, &zero);
+    fputs("}\n", trace_file);
+    if (trace_file != stderr) {
+        fclose(trace_file);
+    } else {
+        fflush(trace_file);
+    }
+    trace_file = NULL;
+}
+
+static void trace_region_enter(TraceRegion *region, const char *name) {
+    if (trace_file == NULL) {
+        return;
+    }
+    region->name = name;
+    region->start_ns = trace_now_ns();
+    trace_snapshot(&region->at_start);
+    trace_begin_event("region_enter");
+    fputs(",\"region\":", trace_file);
+    trace_write_string(name);
+    fputs("}\n", trace_file);
+}
+
+static void trace_region_leave(TraceRegion *region) {
+    TraceCounters now;
+
+    if (trace_file == NULL) {
+        return;
+    }
+    trace_snapshot(&now);
+    trace_begin_event("region_leave");
+    fputs(",\"region\":", trace_file);
+    trace_write_string(region->name);
+    fprintf(trace_file, ",\"elapsed_ns\":%lld", trace_now_ns() - region->start_ns);
+    trace_write_counters(&now, &region->at_start);
+    fputs("}\n", trace_file);
+}
+
 static int path_join(const char *left, const char *right, char *out, size_t out_size) {
     int written = snprintf(out, out_size, "%s/%s", left, right);
     if (written < 0 || (size_t)written >= out_size) {
@@ -57,6 +310,31 @@ static int ensure_dir(const char *path) {
     return -1;
 }
 
+/* Creates the directories leading to path, below its first root_len bytes,
+ * which must already exist. */
+static int ensure_parent_dirs(const char *path, size_t root_len) {
+    char dir[PATH_MAX];
+    char *slash;
+    char *cursor;
+
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) {
+        return -1;
+    }
+    slash = strrchr(dir, '/');
+    if (slash == NULL || (size_t)(slash - dir) <= root_len) {
+        return 0;
+    }
+    *slash = '\0';
+    for (cursor = dir + root_len; (cursor = strchr(cursor + 1, '/')) != NULL;) {
+        *cursor = '\0';
+        if (ensure_dir(dir) != 0) {
+            return -1;
+        }
+        *cursor = '/';
+    }
+    return ensure_dir(dir);
+}
+
 static int write_text_file(const char *path, const char *content) {
     FILE *file = fopen(path, "w");
     if (file == NULL) {
@@ -77,9 +355,26 @@ static int write_text_file(const char *path, const char *content) {
     return 0;
 }
 
+static int write_all(int fd, const void *data, size_t len) {
+    const unsigned char *cursor = (const unsigned char *)data;
+    while (len > 0) {
+        ssize_t written = write(fd, cursor, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        cursor += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
 static char *dup_string(const char *text) {
     size_t len = strlen(text);
     char *copy = malloc(len + 1);
+    TRACE_COUNT(allocations, 1);
     if (copy == NULL) {
         return NULL;
     }
@@ -95,17 +390,208 @@ static void strip_newlines(char *text) {
     }
 }
 
-static bool is_hash40(const char *text) {
-    size_t i;
-    if (strlen(text) != 40) {
+/* Ids live in memory as raw bytes and are compared with a fixed 20-byte
+ * memcmp; hex only appears at I/O boundaries (index file, refs, git
+ * plumbing). Both directions use SSE2 for the first 32 hex digits when the
+ * target has it and finish with the scalar loop. */
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+#if defined(__SSE2__)
+static __m128i hex_encode_nibbles(__m128i nibbles) {
+    __m128i letters = _mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9));
+    __m128i ascii = _mm_add_epi8(nibbles, _mm_set1_epi8('0'));
+    return _mm_add_epi8(ascii, _mm_and_si128(letters, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+static int hex_decode_16(const char *in, unsigned char out[8]) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)in);
+    __m128i folded = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                     _mm_cmplt_epi8(folded, _mm_set1_epi8('f' + 1)));
+    __m128i values;
+    __m128i pairs;
+
+    if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+        return -1;
+    }
+    values = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+                          _mm_and_si128(is_alpha, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10))));
+    pairs = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(values, 4), _mm_set1_epi16(0x00ff)), _mm_srli_epi16(values, 8));
+    _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(pairs, pairs));
+    return 0;
+}
+#endif
+
+static void oid_to_hex(const ObjectId *oid, char out[41]) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)oid->hash);
+        __m128i mask = _mm_set1_epi8(0x0f);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        __m128i low = _mm_and_si128(bytes, mask);
+        _mm_storeu_si128((__m128i *)out, hex_encode_nibbles(_mm_unpacklo_epi8(high, low)));
+        _mm_storeu_si128((__m128i *)(out + 16), hex_encode_nibbles(_mm_unpackhi_epi8(high, low)));
+        i = 16;
+    }
+#endif
+    for (; i < 20; i++) {
+        out[i * 2] = hex_digits[oid->hash[i] >> 4];
+        out[i * 2 + 1] = hex_digits[oid->hash[i] & 0x0f];
+    }
+    out[40] = '\0';
+}
+
+static int oid_from_hex(const char *hex, ObjectId *oid) {
+    size_t i = 0;
+
+    if (strnlen(hex, 41) != 40) {
+        return -1;
+    }
+#if defined(__SSE2__)
+    if (hex_decode_16(hex, oid->hash) != 0 || hex_decode_16(hex + 16, oid->hash + 8) != 0) {
+        return -1;
+    }
+    i = 16;
+#endif
+    for (; i < 20; i++) {
+        int high = hex_value((unsigned char)hex[i * 2]);
+        int low = hex_value((unsigned char)hex[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+            return -1;
+        }
+        oid->hash[i] = (unsigned char)((high << 4) | low);
+    }
+    return 0;
+}
+
+static bool oid_equal(const ObjectId *left, const ObjectId *right) {
+    return memcmp(left->hash, right->hash, sizeof(left->hash)) == 0;
+}
+
+/* Object ids are already uniformly distributed, so any four bytes hash well. */
+static size_t oid_bucket(const ObjectId *oid) {
+    return ((size_t)oid->hash[0] << 24) | ((size_t)oid->hash[1] << 16) | ((size_t)oid->hash[2] << 8) | oid->hash[3];
+}
+
+typedef struct {
+    ObjectId *slots;
+    bool *used;
+    size_t cap;
+    size_t len;
+} OidSet;
+
+static void oid_set_init(OidSet *set) {
+    set->slots = NULL;
+    set->used = NULL;
+    set->cap = 0;
+    set->len = 0;
+}
+
+static void oid_set_free(OidSet *set) {
+    free(set->slots);
+    free(set->used);
+    oid_set_init(set);
+}
+
+/* Returns 1 when oid was added, 0 when it was already present. */
+static int oid_set_insert(OidSet *set, const ObjectId *oid) {
+    size_t pos;
+
+    if ((set->len + 1) * 2 > set->cap) {
+        OidSet grown;
+        size_t i;
+
+        grown.cap = set->cap == 0 ? 64 : set->cap * 2;
+        grown.len = 0;
+        grown.slots = malloc(grown.cap * sizeof(ObjectId));
+        grown.used = calloc(grown.cap, sizeof(bool));
+        if (grown.slots == NULL || grown.used == NULL) {
+            free(grown.slots);
+            free(grown.used);
+            return -1;
+        }
+        for (i = 0; i < set->cap; i++) {
+            if (set->used[i]) {
+                oid_set_insert(&grown, &set->slots[i]);
+            }
+        }
+        oid_set_free(set);
+        *set = grown;
+    }
+    for (pos = oid_bucket(oid) & (set->cap - 1); set->used[pos]; pos = (pos + 1) & (set->cap - 1)) {
+        if (oid_equal(&set->slots[pos], oid)) {
+            return 0;
+        }
+    }
+    set->used[pos] = true;
+    set->slots[pos] = *oid;
+    set->len++;
+    return 1;
+}
+
+static bool oid_set_contains(const OidSet *set, const ObjectId *oid) {
+    size_t pos;
+
+    if (set->cap == 0) {
         return false;
     }
-    for (i = 0; i < 40; i++) {
-        if (!isxdigit((unsigned char)text[i])) {
-            return false;
+    for (pos = oid_bucket(oid) & (set->cap - 1); set->used[pos]; pos = (pos + 1) & (set->cap - 1)) {
+        if (oid_equal(&set->slots[pos], oid)) {
+            return true;
         }
     }
-    return true;
+    return false;
+}
+
+/* Backward-shift deletion: later members of the probe chain move into the
+ * hole unless their home bucket lies after it, so no tombstones are needed. */
+static void oid_set_remove(OidSet *set, const ObjectId *oid) {
+    size_t mask = set->cap - 1;
+    size_t pos;
+
+    if (set->cap == 0) {
+        return;
+    }
+    for (pos = oid_bucket(oid) & mask; !set->used[pos] || !oid_equal(&set->slots[pos], oid); pos = (pos + 1) & mask) {
+        if (!set->used[pos]) {
+            return;
+        }
+    }
+    set->len--;
+    for (;;) {
+        size_t next = pos;
+        size_t home;
+
+        set->used[pos] = false;
+        for (;;) {
+            next = (next + 1) & mask;
+            if (!set->used[next]) {
+                return;
+            }
+            home = oid_bucket(&set->slots[next]) & mask;
+            if (pos <= next ? (home <= pos || home > next) : (home <= pos && home > next)) {
+                break;
+            }
+        }
+        set->slots[pos] = set->slots[next];
+        set->used[pos] = true;
+        pos = next;
+    }
 }
 
 static char *shell_quote_alloc(const char *input) {
@@ -138,6 +624,10 @@ static char *shell_quote_alloc(const char *input) {
     return output;
 }
 
+static void odb_invalidate(void);
+
+/* Both runners drop the cached object database afterwards: the command may
+ * have written objects or repacked. */
 static int run_command_capture(const char *command, char *output, size_t output_size) {
     FILE *pipe;
     char chunk[512];
@@ -148,6 +638,7 @@ static int run_command_capture(const char *command, char *output, size_t output_
         output[0] = '\0';
     }
 
+    TRACE_COUNT(subprocesses, 1);
     pipe = popen(command, "r");
     if (pipe == NULL) {
         return -1;
@@ -165,6 +656,7 @@ static int run_command_capture(const char *command, char *output, size_t output_
     }
 
     status = pclose(pipe);
+    odb_invalidate();
     if (status == -1) {
         return -1;
     }
@@ -175,7 +667,11 @@ static int run_command_capture(const char *command, char *output, size_t output_
 }
 
 static int run_command_passthrough(const char *command) {
-    int status = system(command);
+    int status;
+
+    TRACE_COUNT(subprocesses, 1);
+    status = system(command);
+    odb_invalidate();
     if (status == -1) {
         return -1;
     }
@@ -185,6 +681,109 @@ static int run_command_passthrough(const char *command) {
     return -1;
 }
 
+/* A git child driven over pipes, for requests that would otherwise cost one
+ * fork per object: cat-file --batch stays up for the whole process. */
+typedef struct {
+    pid_t pid;
+    FILE *to_child;
+    FILE *from_child;
+} Coprocess;
+
+static int coprocess_start(Coprocess *proc, const char *repo_root, const char *const *args) {
+    const char *argv[16];
+    int to_child[2];
+    int from_child[2];
+    size_t argc = 0;
+    pid_t pid;
+
+    argv[argc++] = "git";
+    argv[argc++] = "-C";
+    argv[argc++] = repo_root;
+    while (*args != NULL && argc < sizeof(argv) / sizeof(argv[0]) - 1) {
+        argv[argc++] = *args++;
+    }
+    argv[argc] = NULL;
+
+    if (pipe2(to_child, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) != 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        return -1;
+    }
+
+    TRACE_COUNT(subprocesses, 1);
+    pid = fork();
+    if (pid < 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        if (devnull >= 0) {
+            dup2(devnull, STDERR_FILENO);
+        }
+        execvp("git", (char *const *)argv);
+        _exit(127);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+    proc->pid = pid;
+    proc->to_child = fdopen(to_child[1], "w");
+    proc->from_child = fdopen(from_child[0], "r");
+    if (proc->to_child == NULL || proc->from_child == NULL) {
+        if (proc->to_child != NULL) {
+            fclose(proc->to_child);
+        } else {
+            close(to_child[1]);
+        }
+        if (proc->from_child != NULL) {
+            fclose(proc->from_child);
+        } else {
+            close(from_child[0]);
+        }
+        waitpid(pid, NULL, 0);
+        proc->pid = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int coprocess_finish(Coprocess *proc) {
+    char sink[512];
+    int status;
+
+    if (proc->pid <= 0) {
+        return -1;
+    }
+    fclose(proc->to_child);
+    while (fread(sink, 1, sizeof(sink), proc->from_child) > 0) {
+    }
+    fclose(proc->from_child);
+    proc->to_child = NULL;
+    proc->from_child = NULL;
+
+    while (waitpid(proc->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            proc->pid = -1;
+            return -1;
+        }
+    }
+    proc->pid = -1;
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return -1;
+}
+
 static int build_git_path(const char *repo_root, const char *entry, char *out, size_t out_size) {
     char git_dir[PATH_MAX];
     if (path_join(repo_root, ".git", git_dir, sizeof(git_dir)) != 0) {
@@ -210,10 +809,10 @@ static int absolute_to_repo_rel(const char *repo_root, const char *absolute_path
     return snprintf(out, out_size, "%s", absolute_path + root_len + 1) < (int)out_size ? 0 : -1;
 }
 
-static int find_repo_root(char *out, size_t out_size) {
+static int discover_repo_root_from(const char *start, char *out, size_t out_size) {
     char cursor[PATH_MAX];
 
-    if (getcwd(cursor, sizeof(cursor)) == NULL) {
+    if (snprintf(cursor, sizeof(cursor), "%s", start) >= (int)sizeof(cursor)) {
         return -1;
     }
 
@@ -221,6 +820,7 @@ static int find_repo_root(char *out, size_t out_size) {
         char git_dir[PATH_MAX];
         struct stat st;
 
+        TRACE_COUNT(files_stated, 1);
         if (build_git_path(cursor, "", git_dir, sizeof(git_dir)) == 0 &&
             stat(git_dir, &st) == 0 &&
             S_ISDIR(st.st_mode)) {
@@ -250,1205 +850,9629 @@ static int find_repo_root(char *out, size_t out_size) {
     return -1;
 }
 
-static void index_list_init(IndexList *list) {
-    list->items = NULL;
-    list->len = 0;
-    list->cap = 0;
-}
-
-static void index_list_free(IndexList *list) {
-    size_t i;
-    for (i = 0; i < list->len; i++) {
-        free(list->items[i].path);
-    }
-    free(list->items);
-    list->items = NULL;
-    list->len = 0;
-    list->cap = 0;
-}
+static int discover_repo_root(char *out, size_t out_size) {
+    char cwd[PATH_MAX];
 
-static int index_list_reserve(IndexList *list, size_t needed) {
-    IndexEntry *new_items;
-    size_t new_cap = list->cap == 0 ? 16 : list->cap;
-    while (new_cap < needed) {
-        new_cap *= 2;
-    }
-    new_items = realloc(list->items, new_cap * sizeof(IndexEntry));
-    if (new_items == NULL) {
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
         return -1;
     }
-    list->items = new_items;
-    list->cap = new_cap;
-    return 0;
+    return discover_repo_root_from(cwd, out, out_size);
 }
 
-static ssize_t index_list_find(const IndexList *list, const char *path) {
-    size_t i;
-    for (i = 0; i < list->len; i++) {
-        if (strcmp(list->items[i].path, path) == 0) {
-            return (ssize_t)i;
-        }
-    }
-    return -1;
-}
+static void repo_cache_drop_state(void);
 
-static int index_list_upsert(IndexList *list, const char *path, const char *hash) {
-    ssize_t pos = index_list_find(list, path);
-    if (pos >= 0) {
-        memcpy(list->items[pos].hash, hash, 41);
-        return 0;
+static int locate_repo_root(char *out, size_t out_size) {
+    char cwd[PATH_MAX];
+
+    if (!repo_cache.active) {
+        return discover_repo_root(out, out_size);
     }
 
-    if (list->len == list->cap && index_list_reserve(list, list->len + 1) != 0) {
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
         return -1;
     }
 
-    list->items[list->len].path = dup_string(path);
-    if (list->items[list->len].path == NULL) {
-        return -1;
+    if (repo_cache.repo_root[0] == '\0' || strcmp(repo_cache.cwd, cwd) != 0) {
+        char root[PATH_MAX];
+        if (discover_repo_root(root, sizeof(root)) != 0) {
+            return -1;
+        }
+        if (strcmp(root, repo_cache.repo_root) != 0) {
+            repo_cache_drop_state();
+            memcpy(repo_cache.repo_root, root, sizeof(root));
+        }
+        memcpy(repo_cache.cwd, cwd, sizeof(cwd));
     }
-    memcpy(list->items[list->len].hash, hash, 41);
-    list->len++;
-    return 0;
+
+    return snprintf(out, out_size, "%s", repo_cache.repo_root) < (int)out_size ? 0 : -1;
 }
 
-static int index_cmp_path(const void *left, const void *right) {
-    const IndexEntry *l = (const IndexEntry *)left;
-    const IndexEntry *r = (const IndexEntry *)right;
-    return strcmp(l->path, r->path);
+static int find_repo_root(char *out, size_t out_size) {
+    TraceRegion region;
+    int result;
+
+    trace_region_enter(&region, "find_repo_root");
+    result = locate_repo_root(out, out_size);
+    trace_region_leave(&region);
+    return result;
 }
 
-static int save_cg_index(const char *repo_root, IndexList *list) {
-    char index_path[PATH_MAX];
+static int read_git_file_line(const char *repo_root, const char *entry, char *out, size_t out_size) {
+    char path[PATH_MAX];
     FILE *file;
-    size_t i;
 
-    if (build_git_path(repo_root, "cg-index", index_path, sizeof(index_path)) != 0) {
+    if (build_git_path(repo_root, entry, path, sizeof(path)) != 0) {
+        errno = ENAMETOOLONG;
         return -1;
     }
 
-    qsort(list->items, list->len, sizeof(IndexEntry), index_cmp_path);
-
-    file = fopen(index_path, "w");
+    file = fopen(path, "r");
     if (file == NULL) {
         return -1;
     }
-
-    for (i = 0; i < list->len; i++) {
-        if (fprintf(file, "%s %s\n", list->items[i].hash, list->items[i].path) < 0) {
-            fclose(file);
-            return -1;
-        }
+    if (fgets(out, (int)out_size, file) == NULL) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
     }
-
-    return fclose(file) == 0 ? 0 : -1;
+    fclose(file);
+    strip_newlines(out);
+    return 0;
 }
 
-static int load_cg_index(const char *repo_root, IndexList *list) {
-    char index_path[PATH_MAX];
-    FILE *file;
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t read_len;
+/* Read-only view of packed-refs. Records are "<hex> <refname>\n", each
+ * optionally followed by a "^<hex>" peel line; git writes them sorted by
+ * refname and says so in the "# pack-refs with:" header. */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t records; /* offset of the first record, past the header */
+    bool sorted;
+} PackedRefs;
 
-    if (build_git_path(repo_root, "cg-index", index_path, sizeof(index_path)) != 0) {
+typedef struct {
+    char *name;
+    ObjectId oid;
+    bool loose;
+    bool symbolic; /* a loose "ref: <target>" file */
+} RefEntry;
+
+typedef struct {
+    RefEntry *items;
+    size_t len;
+    size_t cap;
+} RefList;
+
+/* Returns 1 (with an empty view) when there is no packed-refs file. */
+static int packed_refs_open(const char *repo_root, PackedRefs *packed) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    memset(packed, 0, sizeof(*packed));
+    if (build_git_path(repo_root, "packed-refs", path, sizeof(path)) != 0) {
         return -1;
     }
-
-    file = fopen(index_path, "r");
-    if (file == NULL) {
-        if (errno == ENOENT) {
-            return 0;
-        }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 1 : -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
         return -1;
     }
-
-    while ((read_len = getline(&line, &cap, file)) != -1) {
-        char *space;
-        char *hash;
-        char *path;
-        (void)read_len;
-        strip_newlines(line);
-        if (line[0] == '\0') {
-            continue;
-        }
-        space = strchr(line, ' ');
-        if (space == NULL) {
-            continue;
-        }
-        *space = '\0';
-        hash = line;
-        path = space + 1;
-        if (!is_hash40(hash) || path[0] == '\0') {
-            continue;
-        }
-        if (index_list_upsert(list, path, hash) != 0) {
-            free(line);
-            fclose(file);
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
             return -1;
         }
+        packed->data = map;
+        packed->size = (size_t)st.st_size;
+    }
+    close(fd);
+
+    while (packed->records < packed->size && packed->data[packed->records] == '#') {
+        const char *line = packed->data + packed->records;
+        const char *end = memchr(line, '\n', packed->size - packed->records);
+        size_t len = end != NULL ? (size_t)(end - line) : packed->size - packed->records;
+
+        if (len >= 17 && memcmp(line, "# pack-refs with:", 17) == 0 && memmem(line, len, " sorted", 7) != NULL) {
+            packed->sorted = true;
+        }
+        packed->records += len + (end != NULL);
     }
+    return 0;
+}
 
-    free(line);
-    return fclose(file) == 0 ? 0 : -1;
+static void packed_refs_close(PackedRefs *packed) {
+    if (packed->data != NULL) {
+        munmap(packed->data, packed->size);
+    }
+    memset(packed, 0, sizeof(*packed));
 }
 
-static void path_list_init(PathList *list) {
-    list->items = NULL;
-    list->len = 0;
-    list->cap = 0;
+static size_t packed_refs_line_end(const PackedRefs *packed, size_t pos) {
+    const char *end = memchr(packed->data + pos, '\n', packed->size - pos);
+    return end != NULL ? (size_t)(end - packed->data) + 1 : packed->size;
 }
 
-static void path_list_free(PathList *list) {
-    size_t i;
-    for (i = 0; i < list->len; i++) {
-        free(list->items[i]);
+/* A prefix match compares equal when prefix is set. */
+static int packed_refs_compare(const PackedRefs *packed, size_t pos, const char *key, size_t key_len,
+                               bool prefix) {
+    const char *name = packed->data + pos + 41;
+    size_t name_len = packed_refs_line_end(packed, pos) - pos - 41;
+    size_t len;
+    int cmp;
+
+    if (name_len > 0 && name[name_len - 1] == '\n') {
+        name_len--;
     }
-    free(list->items);
-    list->items = NULL;
-    list->len = 0;
-    list->cap = 0;
+    len = name_len < key_len ? name_len : key_len;
+    cmp = memcmp(name, key, len);
+    if (cmp != 0 || prefix) {
+        return cmp != 0 ? cmp : name_len < key_len ? -1 : 0;
+    }
+    return name_len < key_len ? -1 : name_len > key_len;
 }
 
-static bool path_list_contains(const PathList *list, const char *path) {
-    size_t i;
-    for (i = 0; i < list->len; i++) {
-        if (strcmp(list->items[i], path) == 0) {
-            return true;
+static bool packed_refs_record(const PackedRefs *packed, size_t pos) {
+    return packed->size - pos > 41 && packed->data[pos] != '^' && packed->data[pos + 40] == ' ';
+}
+
+/* Offset of the first record whose refname is not below key (compared as
+ * a prefix when prefix is set). Binary search over byte offsets: land
+ * anywhere, back up to the start of that line, and step over peel lines,
+ * which always belong to the record before them. */
+static size_t packed_refs_seek(const PackedRefs *packed, const char *key, bool prefix) {
+    size_t lo = packed->records;
+    size_t hi = packed->size;
+    size_t key_len = strlen(key);
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t next;
+
+        while (mid > lo && packed->data[mid - 1] != '\n') {
+            mid--;
+        }
+        if (packed->data[mid] == '^' && mid > lo) {
+            mid--;
+            while (mid > lo && packed->data[mid - 1] != '\n') {
+                mid--;
+            }
+        }
+        next = packed_refs_line_end(packed, mid);
+        while (next < hi && packed->data[next] == '^') {
+            next = packed_refs_line_end(packed, next);
+        }
+        if (!packed_refs_record(packed, mid) || packed_refs_compare(packed, mid, key, key_len, prefix) < 0) {
+            lo = next;
+        } else {
+            hi = mid;
         }
     }
-    return false;
+    return lo;
 }
 
-static int path_list_add(PathList *list, const char *path) {
-    char **new_items;
-    if (path_list_contains(list, path)) {
-        return 0;
-    }
+static int ref_list_add(RefList *list, const char *name, size_t name_len, const ObjectId *oid) {
+    RefEntry *entry;
+
     if (list->len == list->cap) {
-        size_t new_cap = list->cap == 0 ? 16 : list->cap * 2;
-        new_items = realloc(list->items, new_cap * sizeof(char *));
-        if (new_items == NULL) {
+        size_t new_cap = list->cap == 0 ? 64 : list->cap * 2;
+        RefEntry *items;
+        TRACE_COUNT(allocations, 1);
+        items = realloc(list->items, new_cap * sizeof(RefEntry));
+        if (items == NULL) {
             return -1;
         }
-        list->items = new_items;
+        list->items = items;
         list->cap = new_cap;
     }
-    list->items[list->len] = dup_string(path);
-    if (list->items[list->len] == NULL) {
+    entry = &list->items[list->len];
+    entry->name = malloc(name_len + 1);
+    if (entry->name == NULL) {
         return -1;
     }
+    memcpy(entry->name, name, name_len);
+    entry->name[name_len] = '\0';
+    entry->oid = *oid;
+    entry->loose = false;
+    entry->symbolic = false;
     list->len++;
     return 0;
 }
 
-static int git_hash_object(const char *repo_root, const char *relpath, bool write_object, char out_hash[41]) {
-    char *qroot = shell_quote_alloc(repo_root);
-    char *qpath = shell_quote_alloc(relpath);
-    char *command;
-    char output[256];
-    int status;
-    size_t needed;
-    const char *write_flag = write_object ? "-w" : "";
-
-    if (qroot == NULL || qpath == NULL) {
-        free(qroot);
-        free(qpath);
-        return -1;
+static void ref_list_free(RefList *list) {
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        free(list->items[i].name);
     }
+    free(list->items);
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
 
-    needed = strlen("git -C  hash-object  --  2>/dev/null") + strlen(qroot) + strlen(write_flag) + strlen(qpath) + 1;
-    command = malloc(needed);
-    if (command == NULL) {
-        free(qroot);
-        free(qpath);
-        return -1;
-    }
+static int ref_entry_cmp(const void *left, const void *right) {
+    return strcmp(((const RefEntry *)left)->name, ((const RefEntry *)right)->name);
+}
 
-    snprintf(command, needed, "git -C %s hash-object %s -- %s 2>/dev/null", qroot, write_flag, qpath);
-    status = run_command_capture(command, output, sizeof(output));
+static int packed_refs_collect(const PackedRefs *packed, const char *prefix, RefList *out) {
+    size_t prefix_len = strlen(prefix);
+    size_t pos = packed->sorted ? packed_refs_seek(packed, prefix, true) : packed->records;
+    size_t first = out->len;
 
-    free(command);
-    free(qroot);
-    free(qpath);
+    while (pos < packed->size) {
+        size_t next = packed_refs_line_end(packed, pos);
+        if (packed_refs_record(packed, pos)) {
+            char hex[41];
+            ObjectId oid;
+            size_t name_len = next - pos - 41 - (packed->data[next - 1] == '\n');
+            int cmp = packed_refs_compare(packed, pos, prefix, prefix_len, true);
 
-    if (status != 0) {
-        return -1;
+            if (cmp > 0 && packed->sorted) {
+                break;
+            }
+            memcpy(hex, packed->data + pos, 40);
+            hex[40] = '\0';
+            if (cmp == 0 && oid_from_hex(hex, &oid) == 0 &&
+                ref_list_add(out, packed->data + pos + 41, name_len, &oid) != 0) {
+                return -1;
+            }
+        }
+        pos = next;
     }
-
-    strip_newlines(output);
-    if (!is_hash40(output)) {
-        return -1;
+    if (!packed->sorted) {
+        qsort(out->items + first, out->len - first, sizeof(RefEntry), ref_entry_cmp);
     }
-    memcpy(out_hash, output, 41);
     return 0;
 }
 
-static int load_head_tree(const char *repo_root, IndexList *head_entries, bool *has_head) {
-    char *qroot = shell_quote_alloc(repo_root);
-    char *command;
-    char output[256];
-    size_t needed;
-    int status;
-
-    if (qroot == NULL) {
-        return -1;
-    }
-
-    needed = strlen("git -C  rev-parse --verify HEAD 2>/dev/null") + strlen(qroot) + 1;
-    command = malloc(needed);
-    if (command == NULL) {
-        free(qroot);
-        return -1;
+/* Returns 1 when refname is not in packed-refs. */
+static int lookup_packed_ref(const char *repo_root, const char *refname, ObjectId *out) {
+    PackedRefs packed;
+    size_t name_len = strlen(refname);
+    size_t pos;
+    int result = packed_refs_open(repo_root, &packed);
+
+    if (result != 0) {
+        return result;
+    }
+    result = 1;
+    pos = packed.sorted ? packed_refs_seek(&packed, refname, false) : packed.records;
+    while (pos < packed.size) {
+        size_t next = packed_refs_line_end(&packed, pos);
+        if (packed_refs_record(&packed, pos)) {
+            int cmp = packed_refs_compare(&packed, pos, refname, name_len, false);
+            if (cmp == 0) {
+                char hex[41];
+                memcpy(hex, packed.data + pos, 40);
+                hex[40] = '\0';
+                result = oid_from_hex(hex, out) == 0 ? 0 : -1;
+                break;
+            }
+            if (cmp > 0 && packed.sorted) {
+                break;
+            }
+        }
+        pos = next;
     }
-    snprintf(command, needed, "git -C %s rev-parse --verify HEAD 2>/dev/null", qroot);
-    status = run_command_capture(command, output, sizeof(output));
-    free(command);
+    packed_refs_close(&packed);
+    return result;
+}
 
-    if (status != 0) {
-        *has_head = false;
-        free(qroot);
-        return 0;
-    }
+/* Returns 1 when the ref does not exist, e.g. on an unborn branch. */
+static int resolve_ref(const char *repo_root, const char *refname, ObjectId *out) {
+    char name[PATH_MAX];
+    int depth;
 
-    *has_head = true;
-    needed = strlen("git -C  ls-tree -r HEAD 2>/dev/null") + strlen(qroot) + 1;
-    command = malloc(needed);
-    if (command == NULL) {
-        free(qroot);
+    if (snprintf(name, sizeof(name), "%s", refname) >= (int)sizeof(name)) {
         return -1;
     }
-    snprintf(command, needed, "git -C %s ls-tree -r HEAD 2>/dev/null", qroot);
-
-    {
-        FILE *pipe = popen(command, "r");
-        char *line = NULL;
-        size_t cap = 0;
-        ssize_t read_len;
-
-        if (pipe == NULL) {
-            free(command);
-            free(qroot);
-            return -1;
-        }
-
-        while ((read_len = getline(&line, &cap, pipe)) != -1) {
-            char mode[16];
-            char type[16];
-            char hash[41];
-            char *tab;
-            char *path;
-            (void)read_len;
 
-            tab = strchr(line, '\t');
-            if (tab == NULL) {
-                continue;
-            }
-            *tab = '\0';
-            path = tab + 1;
-            strip_newlines(path);
-            if (sscanf(line, "%15s %15s %40s", mode, type, hash) == 3) {
-                if (strcmp(type, "blob") == 0 && is_hash40(hash) && path[0] != '\0') {
-                    if (index_list_upsert(head_entries, path, hash) != 0) {
-                        free(line);
-                        pclose(pipe);
-                        free(command);
-                        free(qroot);
-                        return -1;
-                    }
-                }
+    for (depth = 0; depth < 5; depth++) {
+        char line[PATH_MAX];
+        if (read_git_file_line(repo_root, name, line, sizeof(line)) != 0) {
+            if (errno != ENOENT && errno != ENOTDIR) {
+                return -1;
             }
+            return lookup_packed_ref(repo_root, name, out);
         }
-
-        free(line);
-        status = pclose(pipe);
-        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-            free(command);
-            free(qroot);
-            return -1;
+        if (strncmp(line, "ref: ", 5) == 0) {
+            memmove(name, line + 5, strlen(line + 5) + 1);
+            continue;
         }
+        return oid_from_hex(line, out) == 0 ? 0 : -1;
     }
 
-    free(command);
-    free(qroot);
-    return 0;
+    return -1;
 }
 
-static int sync_cg_index_from_head(const char *repo_root) {
-    IndexList head_entries;
-    bool has_head = false;
-    int result;
+static CacheTree *cache_tree_new(const char *name, size_t name_len) {
+    CacheTree *node = calloc(1, sizeof(*node));
 
-    index_list_init(&head_entries);
-    if (load_head_tree(repo_root, &head_entries, &has_head) != 0) {
-        index_list_free(&head_entries);
-        return -1;
+    TRACE_COUNT(allocations, 1);
+    if (node == NULL) {
+        return NULL;
     }
-
-    result = save_cg_index(repo_root, &head_entries);
-    index_list_free(&head_entries);
-    return result;
+    node->name = malloc(name_len + 1);
+    if (node->name == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->name, name, name_len);
+    node->name[name_len] = '\0';
+    node->entry_count = -1;
+    return node;
 }
 
-static int get_current_branch(const char *repo_root, char *branch, size_t branch_size) {
-    char *qroot = shell_quote_alloc(repo_root);
-    char *command;
-    char output[256];
-    int status;
-    size_t needed;
+static void cache_tree_free(CacheTree *node) {
+    size_t i;
 
-    if (qroot == NULL) {
-        return -1;
+    if (node == NULL) {
+        return;
     }
-
-    needed = strlen("git -C  symbolic-ref --short HEAD 2>/dev/null") + strlen(qroot) + 1;
-    command = malloc(needed);
-    if (command == NULL) {
-        free(qroot);
-        return -1;
+    for (i = 0; i < node->child_count; i++) {
+        cache_tree_free(node->children[i]);
     }
+    free(node->children);
+    free(node->name);
+    free(node);
+}
 
-    snprintf(command, needed, "git -C %s symbolic-ref --short HEAD 2>/dev/null", qroot);
-    status = run_command_capture(command, output, sizeof(output));
-    free(command);
-    free(qroot);
+static bool cache_tree_named(const CacheTree *node, const char *name, size_t name_len) {
+    return strncmp(node->name, name, name_len) == 0 && node->name[name_len] == '\0';
+}
 
-    if (status != 0) {
-        return snprintf(branch, branch_size, "detached") < (int)branch_size ? 0 : -1;
+static int cache_tree_attach(CacheTree *node, CacheTree *child) {
+    if (node->child_count == node->child_cap) {
+        size_t new_cap = node->child_cap == 0 ? 4 : node->child_cap * 2;
+        CacheTree **children = realloc(node->children, new_cap * sizeof(*children));
+        if (children == NULL) {
+            return -1;
+        }
+        node->children = children;
+        node->child_cap = new_cap;
     }
-
-    strip_newlines(output);
-    return snprintf(branch, branch_size, "%s", output) < (int)branch_size ? 0 : -1;
+    node->children[node->child_count++] = child;
+    return 0;
 }
 
-static int collect_files_recursive(const char *repo_root, const char *absolute_path, PathList *files) {
-    struct stat st;
+static CacheTree *cache_tree_child(CacheTree *node, const char *name, size_t name_len, bool create) {
+    CacheTree *child;
+    size_t i;
 
-    if (lstat(absolute_path, &st) != 0) {
-        return -1;
+    for (i = 0; i < node->child_count; i++) {
+        if (cache_tree_named(node->children[i], name, name_len)) {
+            return node->children[i];
+        }
     }
+    if (!create) {
+        return NULL;
+    }
+    child = cache_tree_new(name, name_len);
+    if (child != NULL && cache_tree_attach(node, child) != 0) {
+        cache_tree_free(child);
+        return NULL;
+    }
+    return child;
+}
 
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir;
-        struct dirent *entry;
-        char git_dir[PATH_MAX];
-
-        if (build_git_path(repo_root, "", git_dir, sizeof(git_dir)) != 0) {
-            return -1;
-        }
-        if (strcmp(absolute_path, git_dir) == 0) {
-            return 0;
+static void cache_tree_invalidate(CacheTree *node, const char *path) {
+    while (node != NULL) {
+        const char *slash = strchr(path, '/');
+        node->entry_count = -1;
+        if (slash == NULL) {
+            return;
         }
+        node = cache_tree_child(node, path, (size_t)(slash - path), false);
+        path = slash + 1;
+    }
+}
 
-        dir = opendir(absolute_path);
-        if (dir == NULL) {
-            return -1;
-        }
+static CacheTree *cache_tree_copy(const CacheTree *node) {
+    CacheTree *copy;
+    size_t i;
 
-        while ((entry = readdir(dir)) != NULL) {
-            char next_path[PATH_MAX];
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-            if (path_join(absolute_path, entry->d_name, next_path, sizeof(next_path)) != 0) {
-                closedir(dir);
-                return -1;
-            }
-            if (collect_files_recursive(repo_root, next_path, files) != 0) {
-                closedir(dir);
-                return -1;
-            }
+    copy = cache_tree_new(node->name, strlen(node->name));
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->entry_count = node->entry_count;
+    copy->oid = node->oid;
+    if (node->child_count > 0) {
+        copy->children = malloc(node->child_count * sizeof(*copy->children));
+        if (copy->children == NULL) {
+            cache_tree_free(copy);
+            return NULL;
         }
-
-        return closedir(dir) == 0 ? 0 : -1;
+        copy->child_cap = node->child_count;
     }
-
-    if (S_ISREG(st.st_mode)) {
-        char relpath[PATH_MAX];
-        if (absolute_to_repo_rel(repo_root, absolute_path, relpath, sizeof(relpath)) != 0) {
-            return -1;
+    for (i = 0; i < node->child_count; i++) {
+        copy->children[i] = cache_tree_copy(node->children[i]);
+        if (copy->children[i] == NULL) {
+            cache_tree_free(copy);
+            return NULL;
         }
-        return path_list_add(files, relpath);
+        copy->child_count++;
     }
+    return copy;
+}
 
-    return 0;
+static void index_list_init(IndexList *list) {
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+    list->cache_tree = NULL;
 }
 
-static int collect_add_inputs(const char *repo_root, int argc, char **argv, PathList *files) {
-    int i;
-    char cwd[PATH_MAX];
+static void index_list_free(IndexList *list) {
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+    cache_tree_free(list->cache_tree);
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+    list->cache_tree = NULL;
+}
 
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+static int index_list_reserve(IndexList *list, size_t needed) {
+    IndexEntry *new_items;
+    size_t new_cap = list->cap == 0 ? 16 : list->cap;
+    while (new_cap < needed) {
+        new_cap *= 2;
+    }
+    TRACE_COUNT(allocations, 1);
+    new_items = realloc(list->items, new_cap * sizeof(IndexEntry));
+    if (new_items == NULL) {
         return -1;
     }
+    list->items = new_items;
+    list->cap = new_cap;
+    return 0;
+}
 
-    for (i = 0; i < argc; i++) {
-        char joined[PATH_MAX];
-        char resolved[PATH_MAX];
-        char relpath[PATH_MAX];
+static int index_list_append(IndexList *list, const char *path, const ObjectId *oid, uint32_t mode) {
+    if (list->len == list->cap && index_list_reserve(list, list->len + 1) != 0) {
+        return -1;
+    }
 
-        if (argv[i][0] == '/') {
-            if (snprintf(joined, sizeof(joined), "%s", argv[i]) >= (int)sizeof(joined)) {
-                return -1;
-            }
-        } else {
-            if (path_join(cwd, argv[i], joined, sizeof(joined)) != 0) {
-                return -1;
-            }
-        }
+    list->items[list->len].path = dup_string(path);
+    if (list->items[list->len].path == NULL) {
+        return -1;
+    }
+    list->items[list->len].oid = *oid;
+    list->items[list->len].mode = mode;
+    memset(&list->items[list->len].stat, 0, sizeof(IndexStat));
+    list->len++;
+    return 0;
+}
 
-        if (realpath(joined, resolved) == NULL) {
-            fprintf(stderr, "cg add: path not found: %s\n", argv[i]);
-            return -1;
-        }
+static int index_list_copy(IndexList *dst, const IndexList *src) {
+    size_t i;
 
-        if (absolute_to_repo_rel(repo_root, resolved, relpath, sizeof(relpath)) != 0) {
-            fprintf(stderr, "cg add: path outside repository: %s\n", argv[i]);
+    if (src->len > 0 && index_list_reserve(dst, dst->len + src->len) != 0) {
+        return -1;
+    }
+    for (i = 0; i < src->len; i++) {
+        IndexEntry *entry = &dst->items[dst->len];
+        entry->path = dup_string(src->items[i].path);
+        if (entry->path == NULL) {
             return -1;
         }
-
-        if (strcmp(relpath, ".") == 0) {
-            if (collect_files_recursive(repo_root, resolved, files) != 0) {
-                return -1;
-            }
-        } else {
-            if (collect_files_recursive(repo_root, resolved, files) != 0) {
-                return -1;
-            }
+        entry->oid = src->items[i].oid;
+        entry->mode = src->items[i].mode;
+        entry->stat = src->items[i].stat;
+        dst->len++;
+    }
+    if (src->cache_tree != NULL && dst->cache_tree == NULL) {
+        dst->cache_tree = cache_tree_copy(src->cache_tree);
+        if (dst->cache_tree == NULL) {
+            return -1;
         }
     }
-
     return 0;
 }
 
-static void print_usage(void) {
-    puts("CG - C Git");
-    puts("Usage:");
-    puts("  cg init [directory]");
-    puts("  cg status");
-    puts("  cg add <path> [path...]");
-    puts("  cg commit -m <message>");
-    puts("  cg log");
-    puts("  cg branch [name]");
-    puts("  cg branch -d <name>");
-    puts("  cg checkout <branch|commit>");
-    puts("  cg --help");
-    puts("  cg --version");
+static void repo_cache_drop_state(void) {
+    repo_cache.disk_valid = false;
+    if (repo_cache.index_valid) {
+        index_list_free(&repo_cache.index);
+        repo_cache.index_valid = false;
+    }
+    if (repo_cache.head_valid) {
+        index_list_free(&repo_cache.head_entries);
+        repo_cache.head_valid = false;
+    }
 }
 
-static int cmd_init(int argc, char **argv) {
-    const char *target = ".";
-    char git_dir[PATH_MAX];
-    char path_buf[PATH_MAX];
-    char resolved[PATH_MAX];
-    const char *repo_dirs[] = {"objects", "refs", "refs/heads", "refs/tags"};
-    size_t i;
+static bool same_file_state(const struct stat *left, const struct stat *right) {
+    return left->st_dev == right->st_dev && left->st_ino == right->st_ino &&
+           left->st_size == right->st_size &&
+           left->st_mtim.tv_sec == right->st_mtim.tv_sec &&
+           left->st_mtim.tv_nsec == right->st_mtim.tv_nsec;
+}
 
-    if (argc > 1) {
-        fprintf(stderr, "cg init: too many arguments\n");
-        return 1;
-    }
+static bool repo_cache_owns(const char *repo_root) {
+    return repo_cache.active && strcmp(repo_cache.repo_root, repo_root) == 0;
+}
 
-    if (argc == 1) {
-        target = argv[0];
+static void repo_cache_store_index(const char *repo_root, const struct stat *st, const struct stat *journal_st,
+                                   const IndexList *list) {
+    if (!repo_cache_owns(repo_root)) {
+        return;
     }
-
-    if (ensure_dir(target) != 0) {
-        fprintf(stderr, "cg init: cannot create/open directory '%s': %s\n", target, strerror(errno));
-        return 1;
+    if (repo_cache.index_valid) {
+        index_list_free(&repo_cache.index);
+        repo_cache.index_valid = false;
     }
-
-    if (path_join(target, ".git", git_dir, sizeof(git_dir)) != 0) {
-        fprintf(stderr, "cg init: path too long\n");
-        return 1;
+    index_list_init(&repo_cache.index);
+    if (index_list_copy(&repo_cache.index, list) != 0) {
+        index_list_free(&repo_cache.index);
+        return;
     }
+    repo_cache.index_stat = *st;
+    repo_cache.journal_stat = *journal_st;
+    repo_cache.index_valid = true;
+}
 
-    if (access(git_dir, F_OK) == 0) {
-        fprintf(stderr, "cg init: repository already exists at '%s'\n", git_dir);
-        return 1;
+static void repo_cache_store_head(const char *repo_root, const ObjectId *head_commit, const IndexList *entries) {
+    if (!repo_cache_owns(repo_root)) {
+        return;
     }
-
-    if (ensure_dir(git_dir) != 0) {
-        fprintf(stderr, "cg init: cannot create '%s': %s\n", git_dir, strerror(errno));
-        return 1;
+    if (repo_cache.head_valid) {
+        index_list_free(&repo_cache.head_entries);
+        repo_cache.head_valid = false;
     }
-
-    for (i = 0; i < sizeof(repo_dirs) / sizeof(repo_dirs[0]); i++) {
-        if (path_join(git_dir, repo_dirs[i], path_buf, sizeof(path_buf)) != 0) {
-            fprintf(stderr, "cg init: path too long\n");
-            return 1;
-        }
-        if (ensure_dir(path_buf) != 0) {
-            fprintf(stderr, "cg init: cannot create '%s': %s\n", path_buf, strerror(errno));
-            return 1;
-        }
+    index_list_init(&repo_cache.head_entries);
+    if (index_list_copy(&repo_cache.head_entries, entries) != 0) {
+        index_list_free(&repo_cache.head_entries);
+        return;
     }
+    repo_cache.head_commit = *head_commit;
+    repo_cache.head_valid = true;
+}
 
-    if (path_join(git_dir, "HEAD", path_buf, sizeof(path_buf)) != 0 ||
-        write_text_file(path_buf, "ref: refs/heads/main\n") != 0) {
-        fprintf(stderr, "cg init: cannot write HEAD\n");
-        return 1;
-    }
+static int index_cmp_path(const void *left, const void *right) {
+    const IndexEntry *l = (const IndexEntry *)left;
+    const IndexEntry *r = (const IndexEntry *)right;
+    return strcmp(l->path, r->path);
+}
 
-    if (path_join(git_dir, "config", path_buf, sizeof(path_buf)) != 0 ||
-        write_text_file(path_buf,
-                        "[core]\n"
-                        "\trepositoryformatversion = 0\n"
-                        "\tfilemode = true\n"
-                        "\tbare = false\n"
-                        "\tlogallrefupdates = true\n") != 0) {
-        fprintf(stderr, "cg init: cannot write config\n");
-        return 1;
+static void index_stat_fill(IndexStat *out, const struct stat *st) {
+    out->ctime_sec = (uint32_t)st->st_ctim.tv_sec;
+    out->ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+    out->mtime_sec = (uint32_t)st->st_mtim.tv_sec;
+    out->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+    out->dev = (uint32_t)st->st_dev;
+    out->ino = (uint32_t)st->st_ino;
+    out->mode = (uint32_t)st->st_mode;
+    out->size = (uint32_t)st->st_size;
+}
+
+/* Records st as stat data taken at time now. A file modified within the
+ * last second may change again without its mtime moving ("racy git"), so it
+ * gets no stat data and is hashed again next time instead. */
+static void index_stat_record(IndexStat *out, const struct stat *st, time_t now) {
+    if (st->st_mtim.tv_sec >= now - 1) {
+        memset(out, 0, sizeof(*out));
+        return;
     }
+    index_stat_fill(out, st);
+}
 
-    if (path_join(git_dir, "description", path_buf, sizeof(path_buf)) != 0 ||
-        write_text_file(path_buf, "Unnamed repository; edit this file to name it.\n") != 0) {
-        fprintf(stderr, "cg init: cannot write description\n");
-        return 1;
+/* Only the owner's execute bit counts, as in git. */
+static uint32_t index_mode_from_stat(mode_t mode) {
+    if (S_ISLNK(mode)) {
+        return INDEX_MODE_SYMLINK;
     }
+    return (mode & S_IXUSR) != 0 ? INDEX_MODE_EXEC : INDEX_MODE_FILE;
+}
 
-    if (path_join(git_dir, "cg-index", path_buf, sizeof(path_buf)) != 0 ||
-        write_text_file(path_buf, "") != 0) {
-        fprintf(stderr, "cg init: cannot create cg-index\n");
-        return 1;
+static bool index_stat_matches(const IndexStat *recorded, const struct stat *st) {
+    IndexStat current;
+
+    if (recorded->mode == 0) {
+        return false;
     }
+    index_stat_fill(&current, st);
+    return memcmp(recorded, &current, sizeof(current)) == 0;
+}
 
-    if (realpath(git_dir, resolved) != NULL) {
-        printf("Initialized empty CG repository in %s\n", resolved);
-    } else {
-        printf("Initialized empty CG repository in %s\n", git_dir);
+static bool index_entry_same(const IndexEntry *left, const IndexEntry *right) {
+    return oid_equal(&left->oid, &right->oid) && left->mode == right->mode &&
+           memcmp(&left->stat, &right->stat, sizeof(IndexStat)) == 0;
+}
+
+/* On top of the cg-index file (format below) sits an append-only
+ * cg-index.journal, so staging a few paths costs a few records
+ * instead of a full rewrite. The journal header names the base it applies to
+ * by inode, size and mtime; a base rewritten by rename therefore orphans any
+ * older journal without extra bookkeeping. Each record carries a CRC-32 of
+ * its text and replay stops at the first torn or corrupt record. */
+#define INDEX_JOURNAL_VERSION 1
+#define INDEX_JOURNAL_COMPACT_MIN (64 * 1024)
+
+/* Missing files get a zeroed stat so "absent" compares equal to "absent". */
+static int stat_or_absent(const char *path, struct stat *st) {
+    if (stat(path, st) == 0) {
+        return 0;
     }
+    memset(st, 0, sizeof(*st));
+    return errno == ENOENT ? 0 : -1;
+}
 
-    return 0;
+static int index_journal_header(const struct stat *base_st, char *out, size_t out_size) {
+    int len = snprintf(out, out_size, "cg-journal %d %llu %llu %lld %ld\n", INDEX_JOURNAL_VERSION,
+                       (unsigned long long)base_st->st_ino, (unsigned long long)base_st->st_size,
+                       (long long)base_st->st_mtim.tv_sec, (long)base_st->st_mtim.tv_nsec);
+    return len < 0 || (size_t)len >= out_size ? -1 : len;
 }
 
-static int cmd_status(int argc, char **argv) {
-    char repo_root[PATH_MAX];
-    char branch[128];
-    IndexList staged;
-    IndexList head_entries;
-    PathList working_files;
-    PathList staged_new;
-    PathList staged_modified;
-    PathList staged_deleted;
-    PathList unstaged_modified;
-    PathList unstaged_deleted;
-    PathList untracked;
-    bool has_head = false;
-    size_t i;
+#define INDEX_JOURNAL_RECORD_MAX (PATH_MAX + 160)
 
-    if (argc != 0) {
-        fprintf(stderr, "cg status: no arguments expected\n");
-        return 1;
+/* Records are lines, so a path holding a newline cannot be journaled; the
+ * caller then rewrites the whole index instead. */
+static int index_journal_record(FILE *out, const char *body, int len) {
+    if (len < 0 || (size_t)len >= INDEX_JOURNAL_RECORD_MAX || memchr(body, '\n', (size_t)len) != NULL) {
+        return -1;
     }
-    (void)argv;
+    return fprintf(out, "%08lx %s\n", (unsigned long)crc32(0L, (const Bytef *)body, (uInt)len), body) < 0 ? -1 : 0;
+}
 
-    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
-        fprintf(stderr, "cg status: not inside a CG repository\n");
-        return 1;
-    }
+/* "+ <id> <path>", or "= <id> <stat fields in hex> <path>" when the entry
+ * carries stat data; both imply mode 100644. Other modes are written as
+ * "* <id> <mode in octal> <stat fields in hex> <path>". */
+static int index_journal_upsert(FILE *out, const IndexEntry *entry) {
+    const IndexStat *stat = &entry->stat;
+    char body[INDEX_JOURNAL_RECORD_MAX];
+    char hex[41];
+
+    oid_to_hex(&entry->oid, hex);
+    if (entry->mode != INDEX_MODE_FILE) {
+        return index_journal_record(
+            out, body,
+            snprintf(body, sizeof(body), "* %s %o %x %x %x %x %x %x %x %x %s", hex, entry->mode, stat->ctime_sec,
+                     stat->ctime_nsec, stat->mtime_sec, stat->mtime_nsec, stat->dev, stat->ino, stat->mode,
+                     stat->size, entry->path));
+    }
+    if (stat->mode == 0) {
+        return index_journal_record(out, body, snprintf(body, sizeof(body), "+ %s %s", hex, entry->path));
+    }
+    return index_journal_record(out, body,
+                                snprintf(body, sizeof(body), "= %s %x %x %x %x %x %x %x %x %s", hex, stat->ctime_sec,
+                                         stat->ctime_nsec, stat->mtime_sec, stat->mtime_nsec, stat->dev, stat->ino,
+                                         stat->mode, stat->size, entry->path));
+}
 
-    if (get_current_branch(repo_root, branch, sizeof(branch)) != 0) {
-        fprintf(stderr, "cg status: cannot determine current branch\n");
-        return 1;
-    }
+static int index_journal_remove(FILE *out, const char *path) {
+    char body[INDEX_JOURNAL_RECORD_MAX];
 
-    index_list_init(&staged);
-    index_list_init(&head_entries);
-    path_list_init(&working_files);
-    path_list_init(&staged_new);
-    path_list_init(&staged_modified);
-    path_list_init(&staged_deleted);
-    path_list_init(&unstaged_modified);
-    path_list_init(&unstaged_deleted);
-    path_list_init(&untracked);
-
-    if (load_cg_index(repo_root, &staged) != 0 || load_head_tree(repo_root, &head_entries, &has_head) != 0) {
-        fprintf(stderr, "cg status: cannot read repository state\n");
-        goto fail;
-    }
+    return index_journal_record(out, body, snprintf(body, sizeof(body), "- %s", path));
+}
 
-    if (collect_files_recursive(repo_root, repo_root, &working_files) != 0) {
-        fprintf(stderr, "cg status: cannot scan working tree\n");
-        goto fail;
+static ssize_t index_list_search(const IndexList *list, size_t sorted_len, const char *path) {
+    size_t low = 0;
+    size_t high = sorted_len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(list->items[mid].path, path);
+        if (cmp == 0) {
+            return (ssize_t)mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    return -1;
+}
 
-    printf("On branch %s\n\n", branch);
+/* A journal record for a path outside the base; seq keeps the order of
+ * records for the same path once they are sorted by path. */
+typedef struct {
+    IndexEntry entry;
+    size_t seq;
+    bool removed;
+} JournalExtra;
 
-    for (i = 0; i < staged.len; i++) {
-        ssize_t head_pos = index_list_find(&head_entries, staged.items[i].path);
-        if (head_pos < 0) {
-            if (path_list_add(&staged_new, staged.items[i].path) != 0) {
-                goto fail;
-            }
-        } else if (strcmp(staged.items[i].hash, head_entries.items[head_pos].hash) != 0) {
-            if (path_list_add(&staged_modified, staged.items[i].path) != 0) {
-                goto fail;
-            }
-        }
+static int journal_extra_cmp(const void *left, const void *right) {
+    const JournalExtra *l = left;
+    const JournalExtra *r = right;
+    int cmp = strcmp(l->entry.path, r->entry.path);
+
+    if (cmp != 0) {
+        return cmp;
     }
+    return l->seq < r->seq ? -1 : l->seq > r->seq;
+}
 
-    for (i = 0; i < head_entries.len; i++) {
-        if (index_list_find(&staged, head_entries.items[i].path) < 0) {
-            if (path_list_add(&staged_deleted, head_entries.items[i].path) != 0) {
-                goto fail;
-            }
-        }
+/* Applies journal records on top of a sorted base list. Paths already in the
+ * base are updated in place through binary search; records for new paths
+ * collect in a side list that is sorted once at the end, where the last
+ * record of each path wins. */
+static int index_journal_replay(const char *journal_path, const struct stat *base_st, IndexList *list) {
+    FILE *file;
+    char header[128];
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t read_len;
+    size_t base_len = list->len;
+    bool *removed = NULL;
+    JournalExtra *extra = NULL;
+    size_t extra_len = 0;
+    size_t extra_cap = 0;
+    size_t i;
+    size_t kept;
+    int result = -1;
+
+    file = fopen(journal_path, "r");
+    if (file == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (index_journal_header(base_st, header, sizeof(header)) < 0) {
+        goto done;
+    }
+    if (getline(&line, &cap, file) == -1 || strcmp(line, header) != 0) {
+        result = 0;
+        goto done;
+    }
+    TRACE_COUNT(allocations, 1);
+    removed = calloc(base_len > 0 ? base_len : 1, sizeof(bool));
+    if (removed == NULL) {
+        goto done;
     }
 
-    for (i = 0; i < staged.len; i++) {
-        char absolute[PATH_MAX];
-        char work_hash[41];
-        if (path_join(repo_root, staged.items[i].path, absolute, sizeof(absolute)) != 0) {
-            goto fail;
-        }
+    while ((read_len = getline(&line, &cap, file)) != -1) {
+        char *body;
+        char *path;
+        char op;
+        ObjectId oid;
+        uint32_t mode = INDEX_MODE_FILE;
+        IndexStat stat;
+        ssize_t pos;
 
-        if (access(absolute, F_OK) != 0) {
-            if (path_list_add(&unstaged_deleted, staged.items[i].path) != 0) {
-                goto fail;
-            }
-            continue;
+        if (read_len < 12 || line[read_len - 1] != '\n' || line[8] != ' ') {
+            break;
         }
-
-        if (git_hash_object(repo_root, staged.items[i].path, false, work_hash) != 0) {
-            goto fail;
+        line[read_len - 1] = '\0';
+        line[8] = '\0';
+        body = line + 9;
+        if (strtoul(line, NULL, 16) != crc32(0L, (const Bytef *)body, (uInt)(read_len - 10))) {
+            break;
         }
-        if (strcmp(work_hash, staged.items[i].hash) != 0) {
-            if (path_list_add(&unstaged_modified, staged.items[i].path) != 0) {
-                goto fail;
+        op = body[0];
+        if (op == '+' && read_len - 10 >= 44 && body[1] == ' ' && body[42] == ' ') {
+            body[42] = '\0';
+            if (oid_from_hex(body + 2, &oid) != 0) {
+                break;
+            }
+            path = body + 43;
+            memset(&stat, 0, sizeof(stat));
+        } else if ((op == '=' || op == '*') && read_len - 10 >= 44 && body[1] == ' ' && body[42] == ' ') {
+            unsigned int fields[8];
+            char *cursor = body + 43;
+            int used = 0;
+
+            body[42] = '\0';
+            if (oid_from_hex(body + 2, &oid) != 0) {
+                break;
+            }
+            if (op == '*') {
+                unsigned int entry_mode;
+                if (sscanf(cursor, "%o %n", &entry_mode, &used) != 1 || used == 0) {
+                    break;
+                }
+                mode = entry_mode;
+                cursor += used;
+            }
+            if (sscanf(cursor, "%x %x %x %x %x %x %x %x%n", &fields[0], &fields[1], &fields[2], &fields[3],
+                       &fields[4], &fields[5], &fields[6], &fields[7], &used) != 8 ||
+                cursor[used] != ' ' || cursor[used + 1] == '\0') {
+                break;
             }
+            stat.ctime_sec = fields[0];
+            stat.ctime_nsec = fields[1];
+            stat.mtime_sec = fields[2];
+            stat.mtime_nsec = fields[3];
+            stat.dev = fields[4];
+            stat.ino = fields[5];
+            stat.mode = fields[6];
+            stat.size = fields[7];
+            path = cursor + used + 1;
+        } else if (op == '-' && body[1] == ' ' && body[2] != '\0') {
+            path = body + 2;
+        } else {
+            break;
         }
-    }
 
-    for (i = 0; i < working_files.len; i++) {
-        if (index_list_find(&staged, working_files.items[i]) < 0 &&
-            index_list_find(&head_entries, working_files.items[i]) < 0) {
-            if (path_list_add(&untracked, working_files.items[i]) != 0) {
-                goto fail;
+        cache_tree_invalidate(list->cache_tree, path);
+        pos = index_list_search(list, base_len, path);
+        if (pos >= 0) {
+            removed[pos] = op == '-';
+            if (op != '-') {
+                list->items[pos].oid = oid;
+                list->items[pos].mode = mode;
+                list->items[pos].stat = stat;
             }
+            continue;
         }
-    }
-
-    if (staged_new.len + staged_modified.len + staged_deleted.len > 0) {
-        size_t j;
-        puts("Changes to be committed:");
-        for (j = 0; j < staged_new.len; j++) {
-            printf("  new file:   %s\n", staged_new.items[j]);
+        if (extra_len == extra_cap) {
+            size_t new_cap = extra_cap == 0 ? 16 : extra_cap * 2;
+            JournalExtra *grown = realloc(extra, new_cap * sizeof(JournalExtra));
+            if (grown == NULL) {
+                goto done;
+            }
+            extra = grown;
+            extra_cap = new_cap;
         }
-        for (j = 0; j < staged_modified.len; j++) {
-            printf("  modified:   %s\n", staged_modified.items[j]);
+        extra[extra_len].entry.path = dup_string(path);
+        if (extra[extra_len].entry.path == NULL) {
+            goto done;
         }
-        for (j = 0; j < staged_deleted.len; j++) {
-            printf("  deleted:    %s\n", staged_deleted.items[j]);
+        extra[extra_len].entry.oid = oid;
+        extra[extra_len].entry.mode = mode;
+        extra[extra_len].entry.stat = stat;
+        extra[extra_len].seq = extra_len;
+        extra[extra_len].removed = op == '-';
+        extra_len++;
+    }
+
+    kept = 0;
+    for (i = 0; i < base_len; i++) {
+        if (removed[i]) {
+            free(list->items[i].path);
+            continue;
         }
-        puts("");
+        list->items[kept++] = list->items[i];
     }
-
-    if (unstaged_modified.len + unstaged_deleted.len > 0) {
-        size_t j;
-        puts("Changes not staged for commit:");
-        for (j = 0; j < unstaged_modified.len; j++) {
-            printf("  modified:   %s\n", unstaged_modified.items[j]);
+    list->len = kept;
+    if (extra_len > 0) {
+        qsort(extra, extra_len, sizeof(JournalExtra), journal_extra_cmp);
+        if (index_list_reserve(list, list->len + extra_len) != 0) {
+            goto done;
         }
-        for (j = 0; j < unstaged_deleted.len; j++) {
-            printf("  deleted:    %s\n", unstaged_deleted.items[j]);
+        for (i = 0; i < extra_len; i++) {
+            bool last = i + 1 == extra_len || strcmp(extra[i].entry.path, extra[i + 1].entry.path) != 0;
+            if (last && !extra[i].removed) {
+                list->items[list->len++] = extra[i].entry;
+            } else {
+                free(extra[i].entry.path);
+            }
+            extra[i].entry.path = NULL;
         }
-        puts("");
+        extra_len = 0;
+        qsort(list->items, list->len, sizeof(IndexEntry), index_cmp_path);
     }
+    result = 0;
 
-    if (untracked.len > 0) {
-        size_t j;
-        puts("Untracked files:");
-        for (j = 0; j < untracked.len; j++) {
-            printf("  %s\n", untracked.items[j]);
-        }
-        puts("");
-    }
-
-    if (staged_new.len + staged_modified.len + staged_deleted.len +
-            unstaged_modified.len + unstaged_deleted.len + untracked.len ==
-        0) {
-        puts("nothing to commit, working tree clean");
+done:
+    for (i = 0; i < extra_len; i++) {
+        free(extra[i].entry.path);
     }
+    free(extra);
+    free(line);
+    free(removed);
+    fclose(file);
+    return result;
+}
 
-    index_list_free(&staged);
-    index_list_free(&head_entries);
-    path_list_free(&working_files);
-    path_list_free(&staged_new);
-    path_list_free(&staged_modified);
-    path_list_free(&staged_deleted);
-    path_list_free(&unstaged_modified);
-    path_list_free(&unstaged_deleted);
-    path_list_free(&untracked);
-    return 0;
+/* Binary cg-index layout, integers big-endian:
+ *   "CGIX" | version u32 | entry count u32
+ *   per entry, sorted by path: oid[20] | mode u32 | stat | path length u16 |
+ *   path bytes, where mode is the tree mode of the blob and stat is ctime
+ *   sec, ctime nsec, mtime sec, mtime nsec, dev, ino, mode, size as u32 each
+ *   (all zero for an entry without stat data).
+ *   extensions: signature[4] | payload size u32 | payload
+ *   SHA-1 of everything above
+ * In split mode most entries live in an immutable .git/cg-sharedindex.<id>
+ * (same layout; the id is its own trailing SHA-1) and cg-index holds only the
+ * entries added or changed since, plus a LINK extension: the shared id and an
+ * EWAH bitmap of shared entries that were removed or replaced. The shared
+ * file is rewritten only once the delta passes CG_SPLIT_INDEX percent of it.
+ * The TREE extension stores the cache-tree in git's layout: per directory in
+ * pre-order, "<name>\0<entry count> <subtree count>\n" followed by the tree
+ * id unless the count is -1.
+ * Text indexes from older versions ("<hex> <path>" lines) are still read; a
+ * binary index of any other version is stale and rebuilt from HEAD. */
+#define INDEX_SIGNATURE "CGIX"
+#define INDEX_FORMAT_VERSION 3
+#define INDEX_HEADER_SIZE 12
+#define INDEX_ENTRY_FIXED_SIZE 58 /* oid, mode, stat, path length */
+#define INDEX_EXT_LINK "LINK"
+#define INDEX_EXT_TREE "TREE"
+#define SPLIT_INDEX_MIN_ENTRIES 4096
+#define SPLIT_INDEX_DEFAULT_PERCENT 20
 
-fail:
-    index_list_free(&staged);
-    index_list_free(&head_entries);
-    path_list_free(&working_files);
-    path_list_free(&staged_new);
-    path_list_free(&staged_modified);
-    path_list_free(&staged_deleted);
-    path_list_free(&unstaged_modified);
-    path_list_free(&unstaged_deleted);
-    path_list_free(&untracked);
-    return 1;
+typedef struct {
+    bool present;
+    ObjectId shared_id;
+    Bitmap removed;
+} IndexLink;
+
+static void index_link_init(IndexLink *link) {
+    link->present = false;
+    bitmap_init(&link->removed);
 }
 
-static int cmd_add(int argc, char **argv) {
-    char repo_root[PATH_MAX];
-    IndexList staged;
-    PathList files;
+static void index_link_free(IndexLink *link) {
+    bitmap_free(&link->removed);
+    link->present = false;
+}
+
+static void index_put_be32(FILE *out, uint32_t value) {
+    unsigned char bytes[4];
+    bytes[0] = (unsigned char)(value >> 24);
+    bytes[1] = (unsigned char)(value >> 16);
+    bytes[2] = (unsigned char)(value >> 8);
+    bytes[3] = (unsigned char)value;
+    fwrite(bytes, 1, sizeof(bytes), out);
+}
+
+static uint32_t index_get_be32(const unsigned char *in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+static void cache_tree_write(FILE *out, const CacheTree *node) {
     size_t i;
 
-    if (argc < 1) {
-        fprintf(stderr, "cg add: expected at least one path\n");
-        return 1;
+    fputs(node->name, out);
+    fputc('\0', out);
+    fprintf(out, "%d %zu\n", node->entry_count, node->child_count);
+    if (node->entry_count >= 0) {
+        fwrite(node->oid.hash, 1, sizeof(node->oid.hash), out);
     }
-
-    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
-        fprintf(stderr, "cg add: not inside a CG repository\n");
-        return 1;
+    for (i = 0; i < node->child_count; i++) {
+        cache_tree_write(out, node->children[i]);
     }
+}
 
-    index_list_init(&staged);
-    path_list_init(&files);
+static CacheTree *cache_tree_read(const unsigned char **cursor, const unsigned char *end) {
+    const unsigned char *name_end = memchr(*cursor, '\0', (size_t)(end - *cursor));
+    const unsigned char *line_end;
+    char counts[32];
+    int entry_count;
+    unsigned long child_count;
+    CacheTree *node;
+    char *after;
 
-    if (load_cg_index(repo_root, &staged) != 0) {
-        fprintf(stderr, "cg add: cannot read cg-index\n");
-        goto fail;
+    if (name_end == NULL) {
+        return NULL;
     }
-
-    if (collect_add_inputs(repo_root, argc, argv, &files) != 0) {
-        goto fail;
+    line_end = memchr(name_end + 1, '\n', (size_t)(end - name_end - 1));
+    if (line_end == NULL || (size_t)(line_end - name_end - 1) >= sizeof(counts)) {
+        return NULL;
     }
-
-    if (files.len == 0) {
-        fprintf(stderr, "cg add: no files matched\n");
-        goto fail;
+    memcpy(counts, name_end + 1, (size_t)(line_end - name_end - 1));
+    counts[line_end - name_end - 1] = '\0';
+    entry_count = (int)strtol(counts, &after, 10);
+    if (*after != ' ') {
+        return NULL;
+    }
+    child_count = strtoul(after + 1, &after, 10);
+    if (*after != '\0' || entry_count < -1) {
+        return NULL;
     }
 
-    for (i = 0; i < files.len; i++) {
-        char hash[41];
-        if (git_hash_object(repo_root, files.items[i], true, hash) != 0) {
-            fprintf(stderr, "cg add: failed to hash %s\n", files.items[i]);
-            goto fail;
+    node = cache_tree_new((const char *)*cursor, (size_t)(name_end - *cursor));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->entry_count = entry_count;
+    *cursor = line_end + 1;
+    if (entry_count >= 0) {
+        if ((size_t)(end - *cursor) < sizeof(node->oid.hash)) {
+            cache_tree_free(node);
+            return NULL;
         }
-        if (index_list_upsert(&staged, files.items[i], hash) != 0) {
-            fprintf(stderr, "cg add: out of memory\n");
-            goto fail;
+        memcpy(node->oid.hash, *cursor, sizeof(node->oid.hash));
+        *cursor += sizeof(node->oid.hash);
+    }
+    for (; child_count > 0; child_count--) {
+        CacheTree *child = cache_tree_read(cursor, end);
+        if (child == NULL || cache_tree_attach(node, child) != 0) {
+            cache_tree_free(child);
+            cache_tree_free(node);
+            return NULL;
         }
     }
+    return node;
+}
 
-    if (save_cg_index(repo_root, &staged) != 0) {
-        fprintf(stderr, "cg add: cannot write cg-index\n");
-        goto fail;
-    }
-
-    printf("staged %zu file(s)\n", files.len);
+static int index_serialize(const IndexEntry *entries, size_t count, const IndexLink *link,
+                           const CacheTree *cache_tree, char **out, size_t *out_len) {
+    FILE *buffer = open_memstream(out, out_len);
+    size_t i;
 
-    index_list_free(&staged);
-    path_list_free(&files);
+    if (buffer == NULL) {
+        return -1;
+    }
+    fwrite(INDEX_SIGNATURE, 1, 4, buffer);
+    index_put_be32(buffer, INDEX_FORMAT_VERSION);
+    index_put_be32(buffer, (uint32_t)count);
+    for (i = 0; i < count; i++) {
+        size_t path_len = strlen(entries[i].path);
+        unsigned char len_be[2];
+        if (path_len > 0xFFFF) {
+            fclose(buffer);
+            free(*out);
+            return -1;
+        }
+        len_be[0] = (unsigned char)(path_len >> 8);
+        len_be[1] = (unsigned char)path_len;
+        fwrite(entries[i].oid.hash, 1, sizeof(entries[i].oid.hash), buffer);
+        index_put_be32(buffer, entries[i].mode);
+        index_put_be32(buffer, entries[i].stat.ctime_sec);
+        index_put_be32(buffer, entries[i].stat.ctime_nsec);
+        index_put_be32(buffer, entries[i].stat.mtime_sec);
+        index_put_be32(buffer, entries[i].stat.mtime_nsec);
+        index_put_be32(buffer, entries[i].stat.dev);
+        index_put_be32(buffer, entries[i].stat.ino);
+        index_put_be32(buffer, entries[i].stat.mode);
+        index_put_be32(buffer, entries[i].stat.size);
+        fwrite(len_be, 1, sizeof(len_be), buffer);
+        fwrite(entries[i].path, 1, path_len, buffer);
+    }
+    if (link != NULL && link->present) {
+        unsigned char *ewah;
+        size_t ewah_len;
+        if (ewah_serialize(&link->removed, &ewah, &ewah_len) != 0) {
+            fclose(buffer);
+            free(*out);
+            return -1;
+        }
+        fwrite(INDEX_EXT_LINK, 1, 4, buffer);
+        index_put_be32(buffer, (uint32_t)(sizeof(link->shared_id.hash) + ewah_len));
+        fwrite(link->shared_id.hash, 1, sizeof(link->shared_id.hash), buffer);
+        fwrite(ewah, 1, ewah_len, buffer);
+        free(ewah);
+    }
+    if (cache_tree != NULL) {
+        char *tree_data = NULL;
+        size_t tree_len = 0;
+        FILE *tree = open_memstream(&tree_data, &tree_len);
+        if (tree == NULL) {
+            fclose(buffer);
+            free(*out);
+            return -1;
+        }
+        cache_tree_write(tree, cache_tree);
+        if (fclose(tree) != 0) {
+            free(tree_data);
+            fclose(buffer);
+            free(*out);
+            return -1;
+        }
+        fwrite(INDEX_EXT_TREE, 1, 4, buffer);
+        index_put_be32(buffer, (uint32_t)tree_len);
+        fwrite(tree_data, 1, tree_len, buffer);
+        free(tree_data);
+    }
+    if (fclose(buffer) != 0) {
+        free(*out);
+        return -1;
+    }
     return 0;
+}
 
-fail:
-    index_list_free(&staged);
-    path_list_free(&files);
-    return 1;
+static void index_checksum(const char *data, size_t len, ObjectId *out) {
+    Sha1Ctx sha;
+
+    TRACE_COUNT(bytes_hashed, len);
+    sha1_init(&sha);
+    sha1_update(&sha, data, len);
+    sha1_final(&sha, out->hash);
 }
 
-static int write_tree_from_index(const char *repo_root, const IndexList *staged, char out_tree[41]) {
-    char template_path[PATH_MAX];
+static int index_commit_file(const char *repo_root, const char *name, const char *data, size_t len,
+                             const ObjectId *checksum) {
+    char final_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
     int fd;
-    size_t i;
-    char *qroot = NULL;
-    char *qtmp = NULL;
-    char *command = NULL;
-    char output[256];
-    int status = -1;
-    bool ok = false;
 
-    if (build_git_path(repo_root, "cg-index-tmp-XXXXXX", template_path, sizeof(template_path)) != 0) {
+    if (build_git_path(repo_root, name, final_path, sizeof(final_path)) != 0 ||
+        build_git_path(repo_root, "cg-index.new-XXXXXX", tmp_path, sizeof(tmp_path)) != 0) {
         return -1;
     }
-
-    fd = mkstemp(template_path);
+    fd = mkstemp(tmp_path);
     if (fd < 0) {
         return -1;
     }
-    close(fd);
-
-    qroot = shell_quote_alloc(repo_root);
-    qtmp = shell_quote_alloc(template_path);
-    if (qroot == NULL || qtmp == NULL) {
-        goto cleanup;
+    if (fchmod(fd, 0644) != 0 || write_all(fd, data, len) != 0 ||
+        write_all(fd, checksum->hash, sizeof(checksum->hash)) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
     }
+    if (close(fd) != 0 || rename(tmp_path, final_path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
 
-    {
-        size_t needed = strlen("GIT_INDEX_FILE= git -C  read-tree --empty 2>/dev/null") + strlen(qtmp) + strlen(qroot) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            goto cleanup;
-        }
-        snprintf(command, needed, "GIT_INDEX_FILE=%s git -C %s read-tree --empty 2>/dev/null", qtmp, qroot);
-        if (run_command_capture(command, output, sizeof(output)) != 0) {
-            goto cleanup;
+/* Parses a binary index. list may be NULL to read only the extensions. When
+ * verify is false the trailing checksum is trusted, which is how shared
+ * indexes are read: they are immutable and named after that checksum. */
+static int index_parse(const unsigned char *data, size_t size, bool verify, IndexList *list, IndexLink *link) {
+    const unsigned char *end;
+    const unsigned char *cursor;
+    uint32_t count;
+    uint32_t i;
+    bool sorted = true;
+    size_t first = list != NULL ? list->len : 0;
+
+    if (size < INDEX_HEADER_SIZE + 20 || memcmp(data, INDEX_SIGNATURE, 4) != 0) {
+        return -1;
+    }
+    if (index_get_be32(data + 4) != INDEX_FORMAT_VERSION) {
+        return -1;
+    }
+    end = data + size - 20;
+    if (verify) {
+        ObjectId expected;
+        index_checksum((const char *)data, size - 20, &expected);
+        if (memcmp(expected.hash, end, sizeof(expected.hash)) != 0) {
+            return -1;
         }
-        free(command);
-        command = NULL;
     }
 
-    for (i = 0; i < staged->len; i++) {
-        char *qpath = shell_quote_alloc(staged->items[i].path);
-        size_t needed;
-        if (qpath == NULL) {
-            goto cleanup;
+    count = index_get_be32(data + 8);
+    cursor = data + INDEX_HEADER_SIZE;
+    for (i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        ObjectId oid;
+        IndexStat *stat;
+        size_t path_len;
+
+        if ((size_t)(end - cursor) < INDEX_ENTRY_FIXED_SIZE) {
+            return -1;
         }
-        needed = strlen("GIT_INDEX_FILE= git -C  update-index --add --cacheinfo 100644   2>/dev/null") +
-                 strlen(qtmp) + strlen(qroot) + strlen(staged->items[i].hash) + strlen(qpath) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            free(qpath);
-            goto cleanup;
-        }
-        snprintf(command, needed,
-                 "GIT_INDEX_FILE=%s git -C %s update-index --add --cacheinfo 100644 %s %s 2>/dev/null",
-                 qtmp,
-                 qroot,
-                 staged->items[i].hash,
-                 qpath);
-        free(qpath);
-        if (run_command_capture(command, output, sizeof(output)) != 0) {
-            goto cleanup;
+        path_len = ((size_t)cursor[INDEX_ENTRY_FIXED_SIZE - 2] << 8) | cursor[INDEX_ENTRY_FIXED_SIZE - 1];
+        if (path_len == 0 || path_len >= sizeof(path) || (size_t)(end - cursor) - INDEX_ENTRY_FIXED_SIZE < path_len) {
+            return -1;
         }
-        free(command);
-        command = NULL;
+        if (list != NULL) {
+            memcpy(oid.hash, cursor, sizeof(oid.hash));
+            memcpy(path, cursor + INDEX_ENTRY_FIXED_SIZE, path_len);
+            path[path_len] = '\0';
+            if (list->len > first && strcmp(list->items[list->len - 1].path, path) >= 0) {
+                sorted = false;
+            }
+            if (index_list_append(list, path, &oid, index_get_be32(cursor + 20)) != 0) {
+                return -1;
+            }
+            stat = &list->items[list->len - 1].stat;
+            stat->ctime_sec = index_get_be32(cursor + 24);
+            stat->ctime_nsec = index_get_be32(cursor + 28);
+            stat->mtime_sec = index_get_be32(cursor + 32);
+            stat->mtime_nsec = index_get_be32(cursor + 36);
+            stat->dev = index_get_be32(cursor + 40);
+            stat->ino = index_get_be32(cursor + 44);
+            stat->mode = index_get_be32(cursor + 48);
+            stat->size = index_get_be32(cursor + 52);
+        }
+        cursor += INDEX_ENTRY_FIXED_SIZE + path_len;
     }
 
-    {
-        size_t needed = strlen("GIT_INDEX_FILE= git -C  write-tree 2>/dev/null") + strlen(qtmp) + strlen(qroot) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            goto cleanup;
-        }
-        snprintf(command, needed, "GIT_INDEX_FILE=%s git -C %s write-tree 2>/dev/null", qtmp, qroot);
-        if (run_command_capture(command, output, sizeof(output)) != 0) {
-            goto cleanup;
+    while ((size_t)(end - cursor) >= 8) {
+        uint32_t ext_size = index_get_be32(cursor + 4);
+        const unsigned char *payload = cursor + 8;
+        if ((size_t)(end - payload) < ext_size) {
+            return -1;
         }
-        strip_newlines(output);
-        if (!is_hash40(output)) {
-            goto cleanup;
+        if (memcmp(cursor, INDEX_EXT_LINK, 4) == 0 && link != NULL) {
+            long used;
+            if (ext_size < 20) {
+                return -1;
+            }
+            bitmap_free(&link->removed);
+            memcpy(link->shared_id.hash, payload, 20);
+            used = ewah_deserialize(payload + 20, ext_size - 20, &link->removed);
+            if (used < 0 || (size_t)used != ext_size - 20) {
+                return -1;
+            }
+            link->present = true;
+        } else if (memcmp(cursor, INDEX_EXT_TREE, 4) == 0 && list != NULL) {
+            const unsigned char *tree_cursor = payload;
+            cache_tree_free(list->cache_tree);
+            list->cache_tree = cache_tree_read(&tree_cursor, payload + ext_size);
+            if (list->cache_tree == NULL || tree_cursor != payload + ext_size) {
+                return -1;
+            }
         }
-        memcpy(out_tree, output, 41);
+        cursor = payload + ext_size;
+    }
+    if (cursor != end) {
+        return -1;
     }
+    if (!sorted) {
+        qsort(list->items + first, list->len - first, sizeof(IndexEntry), index_cmp_path);
+    }
+    return 0;
+}
 
-    ok = true;
+/* Maps a whole file read-only; an empty file yields data == NULL. Returns 1
+ * when the file does not exist. */
+static int index_map_file(const char *path, struct stat *st, const unsigned char **data) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    void *map;
 
-cleanup:
-    if (command != NULL) {
-        free(command);
+    *data = NULL;
+    if (fd < 0) {
+        return errno == ENOENT ? 1 : -1;
     }
-    free(qroot);
-    free(qtmp);
-    status = unlink(template_path);
-    if (status != 0 && errno != ENOENT) {
+    if (fstat(fd, st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st->st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
         return -1;
     }
-    return ok ? 0 : -1;
+    *data = map;
+    return 0;
 }
 
-static int cmd_commit(int argc, char **argv) {
-    const char *message = NULL;
-    int i;
-    char repo_root[PATH_MAX];
-    IndexList staged;
-    char tree_hash[41];
-    char parent_hash[41];
-    char commit_hash[41];
-    char branch[128];
-    bool has_parent = false;
-    char *qroot = NULL;
-    char *qmsg = NULL;
-    char *command = NULL;
-    char output[512];
+static void index_unmap_file(const unsigned char *data, const struct stat *st) {
+    if (data != NULL) {
+        munmap((void *)data, (size_t)st->st_size);
+    }
+}
 
-    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
-        fprintf(stderr, "cg commit: not inside a CG repository\n");
-        return 1;
+static int shared_index_name(const ObjectId *id, char *out, size_t out_size) {
+    char hex[41];
+    oid_to_hex(id, hex);
+    return snprintf(out, out_size, "cg-sharedindex.%s", hex) >= (int)out_size ? -1 : 0;
+}
+
+/* Returns 1 when the shared index is gone, e.g. replaced by a concurrent
+ * writer between reading cg-index and opening it. */
+static int read_shared_index(const char *repo_root, const ObjectId *id, IndexList *list) {
+    char name[64];
+    char path[PATH_MAX];
+    const unsigned char *data;
+    struct stat st;
+    int status;
+
+    if (shared_index_name(id, name, sizeof(name)) != 0 || build_git_path(repo_root, name, path, sizeof(path)) != 0) {
+        return -1;
+    }
+    status = index_map_file(path, &st, &data);
+    if (status != 0) {
+        return status;
     }
+    if (data == NULL || memcmp(data + st.st_size - 20, id->hash, 20) != 0 ||
+        index_parse(data, (size_t)st.st_size, false, list, NULL) != 0) {
+        index_unmap_file(data, &st);
+        return -1;
+    }
+    index_unmap_file(data, &st);
+    return 0;
+}
 
-    for (i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
-            message = argv[i + 1];
-            i++;
-        } else {
-            fprintf(stderr, "cg commit: usage: cg commit -m <message>\n");
-            return 1;
-        }
+static void remove_shared_index(const char *repo_root, const ObjectId *id) {
+    char name[64];
+    char path[PATH_MAX];
+
+    if (shared_index_name(id, name, sizeof(name)) == 0 && build_git_path(repo_root, name, path, sizeof(path)) == 0) {
+        unlink(path);
     }
+}
 
-    if (message == NULL || message[0] == '\0') {
-        fprintf(stderr, "cg commit: commit message is required\n");
-        return 1;
+static int index_list_take(IndexList *dst, IndexList *src) {
+    if (dst->len == 0) {
+        IndexList swap = *dst;
+        *dst = *src;
+        *src = swap;
+        return 0;
+    }
+    if (src->len > 0 && index_list_reserve(dst, dst->len + src->len) != 0) {
+        return -1;
+    }
+    memcpy(dst->items + dst->len, src->items, src->len * sizeof(IndexEntry));
+    dst->len += src->len;
+    src->len = 0;
+    if (dst->cache_tree == NULL) {
+        dst->cache_tree = src->cache_tree;
+        src->cache_tree = NULL;
     }
+    return 0;
+}
 
-    index_list_init(&staged);
-    if (load_cg_index(repo_root, &staged) != 0) {
-        fprintf(stderr, "cg commit: cannot read cg-index\n");
-        goto fail;
+/* Folds the split delta into the shared entries: drops those marked in the
+ * bitmap and merges the (sorted) delta in, leaving the result in delta. */
+static int index_apply_link(IndexList *shared, const Bitmap *removed, IndexList *delta) {
+    IndexList merged;
+    size_t i = 0;
+    size_t j = 0;
+
+    index_list_init(&merged);
+    if (index_list_reserve(&merged, shared->len + delta->len + 1) != 0) {
+        return -1;
     }
-    if (staged.len == 0) {
-        fprintf(stderr, "cg commit: nothing staged\n");
-        goto fail;
+    while (i < shared->len || j < delta->len) {
+        int cmp;
+        if (i < shared->len && bitmap_get(removed, i)) {
+            free(shared->items[i++].path);
+            continue;
+        }
+        cmp = i == shared->len ? 1 : j == delta->len ? -1 : strcmp(shared->items[i].path, delta->items[j].path);
+        if (cmp < 0) {
+            merged.items[merged.len++] = shared->items[i++];
+            continue;
+        }
+        if (cmp == 0) {
+            free(shared->items[i++].path);
+        }
+        merged.items[merged.len++] = delta->items[j++];
+    }
+    merged.cache_tree = delta->cache_tree;
+    delta->cache_tree = NULL;
+    shared->len = 0;
+    delta->len = 0;
+    index_list_free(delta);
+    *delta = merged;
+    return 0;
+}
+
+/* Accepts the pre-binary text format so existing repositories keep working;
+ * the next write converts them. */
+static int index_parse_text(const unsigned char *data, size_t size, IndexList *list) {
+    const char *cursor = (const char *)data;
+    const char *end = cursor + size;
+    size_t first = list->len;
+    bool sorted = true;
+
+    while (cursor < end) {
+        const char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        const char *line_end = newline != NULL ? newline : end;
+        size_t line_len = (size_t)(line_end - cursor);
+        char hex[41];
+        char path[PATH_MAX];
+        ObjectId oid;
+
+        if (line_len > 0 && cursor[line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len > 41 && cursor[40] == ' ' && line_len - 41 < sizeof(path)) {
+            memcpy(hex, cursor, 40);
+            hex[40] = '\0';
+            memcpy(path, cursor + 41, line_len - 41);
+            path[line_len - 41] = '\0';
+            if (oid_from_hex(hex, &oid) == 0) {
+                if (list->len > first && strcmp(list->items[list->len - 1].path, path) >= 0) {
+                    sorted = false;
+                }
+                if (index_list_append(list, path, &oid, INDEX_MODE_FILE) != 0) {
+                    return -1;
+                }
+            }
+        }
+        cursor = line_end + 1;
     }
+    if (!sorted) {
+        qsort(list->items + first, list->len - first, sizeof(IndexEntry), index_cmp_path);
+    }
+    return 0;
+}
 
-    if (write_tree_from_index(repo_root, &staged, tree_hash) != 0) {
-        fprintf(stderr, "cg commit: cannot write tree\n");
-        goto fail;
+static int split_index_percent(void) {
+    const char *value = getenv("CG_SPLIT_INDEX");
+    int percent;
+
+    if (value == NULL || value[0] == '\0') {
+        return SPLIT_INDEX_DEFAULT_PERCENT;
     }
+    percent = atoi(value);
+    return percent < 0 ? 0 : percent > 100 ? 100 : percent;
+}
 
-    qroot = shell_quote_alloc(repo_root);
-    qmsg = shell_quote_alloc(message);
-    if (qroot == NULL || qmsg == NULL) {
-        fprintf(stderr, "cg commit: out of memory\n");
-        goto fail;
+static int read_index_link(const char *repo_root, IndexLink *link) {
+    char index_path[PATH_MAX];
+    const unsigned char *data;
+    struct stat st;
+    int status;
+
+    if (build_git_path(repo_root, "cg-index", index_path, sizeof(index_path)) != 0) {
+        return -1;
+    }
+    status = index_map_file(index_path, &st, &data);
+    if (status != 0) {
+        return status == 1 ? 0 : -1;
     }
+    if (data != NULL && (size_t)st.st_size >= 4 && memcmp(data, INDEX_SIGNATURE, 4) == 0 &&
+        index_parse(data, (size_t)st.st_size, false, NULL, link) != 0) {
+        index_link_free(link);
+    }
+    index_unmap_file(data, &st);
+    return 0;
+}
 
-    {
-        size_t needed = strlen("git -C  rev-parse --verify HEAD 2>/dev/null") + strlen(qroot) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            goto fail;
-        }
-        snprintf(command, needed, "git -C %s rev-parse --verify HEAD 2>/dev/null", qroot);
-        if (run_command_capture(command, output, sizeof(output)) == 0) {
-            strip_newlines(output);
-            if (is_hash40(output)) {
-                memcpy(parent_hash, output, 41);
-                has_parent = true;
+/* delta receives shallow copies. */
+static int index_split_delta(const IndexList *shared, const IndexList *list, Bitmap *removed, IndexEntry **delta,
+                             size_t *delta_len) {
+    size_t i = 0;
+    size_t j = 0;
+
+    *delta_len = 0;
+    *delta = malloc((list->len + 1) * sizeof(IndexEntry));
+    if (*delta == NULL) {
+        return -1;
+    }
+    while (i < shared->len || j < list->len) {
+        int cmp = i == shared->len ? 1 : j == list->len ? -1 : strcmp(shared->items[i].path, list->items[j].path);
+        if (cmp < 0 || (cmp == 0 && !index_entry_same(&shared->items[i], &list->items[j]))) {
+            if (bitmap_set(removed, i) != 0) {
+                return -1;
             }
         }
-        free(command);
-        command = NULL;
+        if (cmp > 0 || (cmp == 0 && !index_entry_same(&shared->items[i], &list->items[j]))) {
+            (*delta)[(*delta_len)++] = list->items[j];
+        }
+        if (cmp <= 0) {
+            i++;
+        }
+        if (cmp >= 0) {
+            j++;
+        }
+    }
+    return 0;
+}
+
+/* Writes list as the new cg-index and drops the journal, which the new file
+ * identity has already made stale. Large indexes are written split: only the
+ * delta against the current shared index unless it has grown too big, in
+ * which case the shared index itself is rewritten. */
+static int write_cg_index(const char *repo_root, IndexList *list) {
+    char index_path[PATH_MAX];
+    char journal_path[PATH_MAX];
+    IndexLink old_link;
+    IndexLink new_link;
+    IndexList shared;
+    IndexEntry *delta = NULL;
+    size_t delta_len = 0;
+    char *data = NULL;
+    size_t data_len = 0;
+    ObjectId checksum;
+    struct stat st;
+    struct stat journal_st;
+    int percent = split_index_percent();
+    int result = -1;
+
+    if (build_git_path(repo_root, "cg-index", index_path, sizeof(index_path)) != 0 ||
+        build_git_path(repo_root, "cg-index.journal", journal_path, sizeof(journal_path)) != 0) {
+        return -1;
+    }
+
+    qsort(list->items, list->len, sizeof(IndexEntry), index_cmp_path);
+    index_link_init(&old_link);
+    index_link_init(&new_link);
+    index_list_init(&shared);
+    if (read_index_link(repo_root, &old_link) != 0) {
+        goto done;
+    }
+
+    if (percent > 0 && list->len >= SPLIT_INDEX_MIN_ENTRIES) {
+        if (old_link.present && read_shared_index(repo_root, &old_link.shared_id, &shared) == 0) {
+            if (index_split_delta(&shared, list, &new_link.removed, &delta, &delta_len) != 0) {
+                goto done;
+            }
+            if (delta_len * 100 <= (size_t)percent * shared.len) {
+                new_link.present = true;
+                new_link.shared_id = old_link.shared_id;
+            }
+        }
+        if (!new_link.present) {
+            char name[64];
+            free(delta);
+            delta = NULL;
+            delta_len = 0;
+            bitmap_free(&new_link.removed);
+            if (index_serialize(list->items, list->len, NULL, NULL, &data, &data_len) != 0) {
+                goto done;
+            }
+            index_checksum(data, data_len, &checksum);
+            if (shared_index_name(&checksum, name, sizeof(name)) != 0 ||
+                index_commit_file(repo_root, name, data, data_len, &checksum) != 0) {
+                goto done;
+            }
+            free(data);
+            data = NULL;
+            new_link.present = true;
+            new_link.shared_id = checksum;
+        }
+        if (index_serialize(delta, delta_len, &new_link, list->cache_tree, &data, &data_len) != 0) {
+            goto done;
+        }
+    } else if (index_serialize(list->items, list->len, NULL, list->cache_tree, &data, &data_len) != 0) {
+        goto done;
+    }
+
+    index_checksum(data, data_len, &checksum);
+    if (index_commit_file(repo_root, "cg-index", data, data_len, &checksum) != 0) {
+        goto done;
+    }
+    if (old_link.present && (!new_link.present || !oid_equal(&old_link.shared_id, &new_link.shared_id))) {
+        remove_shared_index(repo_root, &old_link.shared_id);
+    }
+    if (unlink(journal_path) != 0 && errno != ENOENT) {
+        goto done;
+    }
+    memset(&journal_st, 0, sizeof(journal_st));
+    if (stat(index_path, &st) == 0) {
+        repo_cache_store_index(repo_root, &st, &journal_st, list);
+    }
+    result = 0;
+
+done:
+    free(data);
+    free(delta);
+    index_list_free(&shared);
+    index_link_free(&old_link);
+    index_link_free(&new_link);
+    return result;
+}
+
+/* Appends upsert records for changes and removal records for removed
+ * (which may be NULL) to the journal. Falls back to a full
+ * rewrite (compaction) when there is no base yet, the journal belongs to an
+ * older base or has a torn tail, or it would grow past max(64 KiB, base/4). */
+static int write_cg_index_journal(const char *repo_root, IndexList *list, const IndexList *changes,
+                                  const PathList *removed) {
+    char index_path[PATH_MAX];
+    char journal_path[PATH_MAX];
+    char header[128];
+    char existing[128];
+    struct stat base_st;
+    struct stat journal_st;
+    char *records = NULL;
+    size_t records_len = 0;
+    FILE *out;
+    int header_len;
+    int fd;
+    size_t i;
+    bool encoded = true;
+    off_t limit;
+
+    if (changes->len == 0 && (removed == NULL || removed->len == 0)) {
+        return 0;
+    }
+    if (build_git_path(repo_root, "cg-index", index_path, sizeof(index_path)) != 0 ||
+        build_git_path(repo_root, "cg-index.journal", journal_path, sizeof(journal_path)) != 0) {
+        return -1;
+    }
+    if (stat(index_path, &base_st) != 0 ||
+        (header_len = index_journal_header(&base_st, header, sizeof(header))) < 0) {
+        return write_cg_index(repo_root, list);
+    }
+
+    fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &journal_st) != 0) {
+        goto compact;
+    }
+    if (journal_st.st_size > 0) {
+        char last;
+        ssize_t got = pread(fd, existing, (size_t)header_len, 0);
+        if (got != header_len || memcmp(existing, header, (size_t)header_len) != 0 ||
+            pread(fd, &last, 1, journal_st.st_size - 1) != 1 || last != '\n') {
+            goto compact;
+        }
+    }
+
+    out = open_memstream(&records, &records_len);
+    if (out == NULL) {
+        goto compact;
+    }
+    if (journal_st.st_size == 0) {
+        fputs(header, out);
+    }
+    for (i = 0; i < changes->len && encoded; i++) {
+        encoded = index_journal_upsert(out, &changes->items[i]) == 0;
+    }
+    for (i = 0; removed != NULL && i < removed->len && encoded; i++) {
+        encoded = index_journal_remove(out, removed->items[i]) == 0;
+    }
+    if (fclose(out) != 0 || !encoded) {
+        goto compact;
+    }
+
+    limit = base_st.st_size / 4 > INDEX_JOURNAL_COMPACT_MIN ? base_st.st_size / 4 : INDEX_JOURNAL_COMPACT_MIN;
+    if (journal_st.st_size + (off_t)records_len > limit) {
+        goto compact;
+    }
+    if (write_all(fd, records, records_len) != 0 || fstat(fd, &journal_st) != 0) {
+        goto compact;
+    }
+    free(records);
+    close(fd);
+
+    qsort(list->items, list->len, sizeof(IndexEntry), index_cmp_path);
+    repo_cache_store_index(repo_root, &base_st, &journal_st, list);
+    return 0;
+
+compact:
+    free(records);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return write_cg_index(repo_root, list);
+}
+
+static int save_cg_index(const char *repo_root, IndexList *list) {
+    TraceRegion region;
+    int result;
+
+    trace_region_enter(&region, "index_save");
+    result = write_cg_index(repo_root, list);
+    trace_region_leave(&region);
+    return result;
+}
+
+static int save_cg_index_changes(const char *repo_root, IndexList *list, const IndexList *changes,
+                                 const PathList *removed) {
+    TraceRegion region;
+    int result;
+
+    trace_region_enter(&region, "index_save");
+    result = write_cg_index_journal(repo_root, list, changes, removed);
+    trace_region_leave(&region);
+    return result;
+}
+
+static int sync_cg_index_from_head(const char *repo_root);
+
+/* A binary index of a version other than INDEX_FORMAT_VERSION. */
+static bool index_is_stale(const unsigned char *data, size_t size) {
+    return data != NULL && size >= INDEX_HEADER_SIZE && memcmp(data, INDEX_SIGNATURE, 4) == 0 &&
+           index_get_be32(data + 4) != INDEX_FORMAT_VERSION;
+}
+
+static int read_cg_index(const char *repo_root, IndexList *list) {
+    char index_path[PATH_MAX];
+    char journal_path[PATH_MAX];
+    const unsigned char *data;
+    struct stat st;
+    struct stat journal_st;
+    IndexList loaded;
+    IndexLink link;
+    int attempt;
+    int status;
+
+    if (build_git_path(repo_root, "cg-index", index_path, sizeof(index_path)) != 0 ||
+        build_git_path(repo_root, "cg-index.journal", journal_path, sizeof(journal_path)) != 0) {
+        return -1;
+    }
+
+    /* A concurrent writer may replace the shared index between reading
+     * cg-index and opening it; rereading cg-index then finds the new one. */
+    for (attempt = 0; attempt < 3; attempt++) {
+        status = index_map_file(index_path, &st, &data);
+        if (status != 0) {
+            return status == 1 ? 0 : -1;
+        }
+        if (index_is_stale(data, (size_t)st.st_size)) {
+            index_unmap_file(data, &st);
+            fprintf(stderr, "cg: warning: cg-index has an unsupported format version, rebuilding it from HEAD\n");
+            if (sync_cg_index_from_head(repo_root) != 0) {
+                return -1;
+            }
+            index_list_init(&loaded);
+            status = 1;
+            continue;
+        }
+        if (stat_or_absent(journal_path, &journal_st) != 0) {
+            index_unmap_file(data, &st);
+            return -1;
+        }
+        if (repo_cache_owns(repo_root) && repo_cache.index_valid && same_file_state(&st, &repo_cache.index_stat) &&
+            same_file_state(&journal_st, &repo_cache.journal_stat)) {
+            index_unmap_file(data, &st);
+            return index_list_copy(list, &repo_cache.index);
+        }
+
+        index_list_init(&loaded);
+        index_link_init(&link);
+        if (data == NULL) {
+            status = 0;
+        } else if ((size_t)st.st_size >= 4 && memcmp(data, INDEX_SIGNATURE, 4) == 0) {
+            status = index_parse(data, (size_t)st.st_size, true, &loaded, &link);
+        } else {
+            status = index_parse_text(data, (size_t)st.st_size, &loaded);
+        }
+        index_unmap_file(data, &st);
+
+        if (status == 0 && link.present) {
+            IndexList shared;
+            index_list_init(&shared);
+            status = read_shared_index(repo_root, &link.shared_id, &shared);
+            if (status == 0) {
+                status = index_apply_link(&shared, &link.removed, &loaded);
+            }
+            index_list_free(&shared);
+        }
+        index_link_free(&link);
+        if (status != 1) {
+            break;
+        }
+        index_list_free(&loaded);
+    }
+
+    if (status == 0 && journal_st.st_ino != 0) {
+        status = index_journal_replay(journal_path, &st, &loaded);
+    }
+    if (status == 0) {
+        repo_cache_store_index(repo_root, &st, &journal_st, &loaded);
+        status = index_list_take(list, &loaded);
+    }
+    index_list_free(&loaded);
+    return status == 0 ? 0 : -1;
+}
+
+static int load_cg_index(const char *repo_root, IndexList *list) {
+    TraceRegion region;
+    int result;
+
+    trace_region_enter(&region, "index_load");
+    result = read_cg_index(repo_root, list);
+    trace_region_leave(&region);
+    return result;
+}
+
+static void path_list_init(PathList *list) {
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
+
+static void path_list_free(PathList *list) {
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
+
+static bool path_list_contains(const PathList *list, const char *path) {
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        if (strcmp(list->items[i], path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Appends without the duplicate check, for input that is already unique. */
+static int path_list_append(PathList *list, const char *path) {
+    char **new_items;
+    if (list->len == list->cap) {
+        size_t new_cap = list->cap == 0 ? 16 : list->cap * 2;
+        TRACE_COUNT(allocations, 1);
+        new_items = realloc(list->items, new_cap * sizeof(char *));
+        if (new_items == NULL) {
+            return -1;
+        }
+        list->items = new_items;
+        list->cap = new_cap;
+    }
+    list->items[list->len] = dup_string(path);
+    if (list->items[list->len] == NULL) {
+        return -1;
+    }
+    list->len++;
+    return 0;
+}
+
+static int path_list_add(PathList *list, const char *path) {
+    if (path_list_contains(list, path)) {
+        return 0;
+    }
+    return path_list_append(list, path);
+}
+
+static int path_cmp(const void *left, const void *right) {
+    return strcmp(*(char *const *)left, *(char *const *)right);
+}
+
+static void path_list_sort_unique(PathList *list) {
+    size_t kept = 0;
+    size_t i;
+
+    qsort(list->items, list->len, sizeof(char *), path_cmp);
+    for (i = 0; i < list->len; i++) {
+        if (kept > 0 && strcmp(list->items[kept - 1], list->items[i]) == 0) {
+            free(list->items[i]);
+        } else {
+            list->items[kept++] = list->items[i];
+        }
+    }
+    list->len = kept;
+}
+
+/* The object database: the repository's own object directory followed by
+ * its alternates (objects/info/alternates, recursively, as git does). Each
+ * store lists a loose fan-out directory once, on first use, and maps its
+ * pack indexes once, so lookups never stat individual object paths. Like
+ * git's reprepare, a miss rereads the fan-out and pack directories before
+ * the id is memoized as missing. Everything is dropped by odb_invalidate(),
+ * which the helpers that run git subprocesses call, and which long-lived
+ * callers (cg batch, libcg) call once the index or HEAD changed on disk. */
+#define ODB_MAX_ALTERNATE_DEPTH 5
+
+typedef struct {
+    char *dir;
+    PackFile **packs; /* stay put while others are added by a rescan */
+    size_t pack_count;
+    bool packs_loaded;
+    ObjectId *loose[256];
+    size_t loose_len[256];
+    size_t loose_cap[256];
+    bool loose_loaded[256];
+} ObjectStore;
+
+typedef struct {
+    char root[PATH_MAX];
+    ObjectStore *stores;
+    size_t store_count;
+    OidSet missing;
+} ObjectDatabase;
+
+typedef struct {
+    ObjectStore *store;
+    PackFile *pack; /* NULL for a loose object */
+    uint64_t offset;
+} ObjectLocation;
+
+static ObjectDatabase odb;
+
+static void odb_release(void) {
+    size_t i;
+
+    for (i = 0; i < odb.store_count; i++) {
+        ObjectStore *store = &odb.stores[i];
+        size_t j;
+        for (j = 0; j < store->pack_count; j++) {
+            pack_close(store->packs[j]);
+            free(store->packs[j]);
+        }
+        for (j = 0; j < 256; j++) {
+            free(store->loose[j]);
+        }
+        free(store->packs);
+        free(store->dir);
+    }
+    free(odb.stores);
+    oid_set_free(&odb.missing);
+    memset(&odb, 0, sizeof(odb));
+}
+
+static void odb_invalidate(void) {
+    odb_release();
+}
+
+static int odb_add_store(const char *dir, int depth) {
+    char resolved[PATH_MAX];
+    char alternates[PATH_MAX];
+    char line[PATH_MAX];
+    ObjectStore *grown;
+    FILE *file;
+    size_t i;
+    int result = 0;
+
+    if (realpath(dir, resolved) == NULL) {
+        if (depth > 0) {
+            fprintf(stderr, "cg: warning: alternate object directory %s does not exist\n", dir);
+            return 0;
+        }
+        return -1;
+    }
+    for (i = 0; i < odb.store_count; i++) {
+        if (strcmp(odb.stores[i].dir, resolved) == 0) {
+            return 0;
+        }
+    }
+    grown = realloc(odb.stores, (odb.store_count + 1) * sizeof(*odb.stores));
+    if (grown == NULL) {
+        return -1;
+    }
+    odb.stores = grown;
+    memset(&odb.stores[odb.store_count], 0, sizeof(ObjectStore));
+    odb.stores[odb.store_count].dir = dup_string(resolved);
+    if (odb.stores[odb.store_count].dir == NULL) {
+        return -1;
+    }
+    odb.store_count++;
+
+    if (path_join(resolved, "info/alternates", alternates, sizeof(alternates)) != 0) {
+        return -1;
+    }
+    file = fopen(alternates, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        char target[PATH_MAX];
+        size_t len = strcspn(line, "\r\n");
+
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        if (depth >= ODB_MAX_ALTERNATE_DEPTH) {
+            fprintf(stderr, "cg: warning: %s: alternates nested too deeply, ignoring %s\n", resolved, line);
+            continue;
+        }
+        if (line[0] == '/') {
+            result = snprintf(target, sizeof(target), "%s", line) < (int)sizeof(target) ? 0 : -1;
+        } else {
+            result = path_join(resolved, line, target, sizeof(target));
+        }
+        if (result == 0) {
+            result = odb_add_store(target, depth + 1);
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+static int odb_prepare(const char *repo_root) {
+    static char cached_root[PATH_MAX];
+    char objects_dir[PATH_MAX];
+
+    if (odb.store_count > 0 && strcmp(odb.root, repo_root) == 0) {
+        return 0;
+    }
+    odb_release();
+    /* The object cache outlives odb_release, but another repository may
+     * lack objects this one has. */
+    if (strcmp(cached_root, repo_root) != 0) {
+        object_cache_clear(&object_cache);
+        snprintf(cached_root, sizeof(cached_root), "%s", repo_root);
+    }
+    if (snprintf(odb.root, sizeof(odb.root), "%s", repo_root) >= (int)sizeof(odb.root) ||
+        build_git_path(repo_root, "objects", objects_dir, sizeof(objects_dir)) != 0 ||
+        odb_add_store(objects_dir, 0) != 0) {
+        odb_release();
+        return -1;
+    }
+    return 0;
+}
+
+static int odb_oid_cmp(const void *left, const void *right) {
+    return memcmp(((const ObjectId *)left)->hash, ((const ObjectId *)right)->hash, 20);
+}
+
+static bool store_has_pack(const ObjectStore *store, const char *idx_path) {
+    size_t len = strlen(idx_path) - strlen(".idx");
+    size_t i;
+
+    for (i = 0; i < store->pack_count; i++) {
+        if (strncmp(store->packs[i]->pack_path, idx_path, len) == 0 &&
+            strcmp(store->packs[i]->pack_path + len, ".pack") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Also picks up packs added since the last call, keeping those already open. */
+static int store_load_packs(ObjectStore *store) {
+    char pack_dir[PATH_MAX];
+    DIR *dir;
+    struct dirent *entry;
+
+    store->packs_loaded = true;
+    if (path_join(store->dir, "pack", pack_dir, sizeof(pack_dir)) != 0) {
+        return -1;
+    }
+    dir = opendir(pack_dir);
+    if (dir == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char idx_path[PATH_MAX];
+        size_t len = strlen(entry->d_name);
+        PackFile **grown;
+        PackFile *pack;
+
+        if (len < 5 || strcmp(entry->d_name + len - 4, ".idx") != 0 ||
+            path_join(pack_dir, entry->d_name, idx_path, sizeof(idx_path)) != 0 || store_has_pack(store, idx_path)) {
+            continue;
+        }
+        grown = realloc(store->packs, (store->pack_count + 1) * sizeof(*store->packs));
+        if (grown == NULL) {
+            closedir(dir);
+            return -1;
+        }
+        store->packs = grown;
+        pack = malloc(sizeof(*pack));
+        if (pack == NULL) {
+            closedir(dir);
+            return -1;
+        }
+        if (pack_open(pack, idx_path) == 0) {
+            store->packs[store->pack_count++] = pack;
+        } else {
+            free(pack);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int store_load_fanout(ObjectStore *store, unsigned int fanout) {
+    char fanout_dir[PATH_MAX];
+    char hex[41];
+    DIR *dir;
+    struct dirent *entry;
+
+    store->loose_loaded[fanout] = true;
+    store->loose_len[fanout] = 0;
+    if (snprintf(fanout_dir, sizeof(fanout_dir), "%s/%02x", store->dir, fanout) >= (int)sizeof(fanout_dir)) {
+        return -1;
+    }
+    dir = opendir(fanout_dir);
+    if (dir == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    snprintf(hex, sizeof(hex), "%02x", fanout);
+    while ((entry = readdir(dir)) != NULL) {
+        ObjectId oid;
+
+        if (strlen(entry->d_name) != 38) {
+            continue;
+        }
+        memcpy(hex + 2, entry->d_name, 39);
+        if (oid_from_hex(hex, &oid) != 0) {
+            continue;
+        }
+        if (store->loose_len[fanout] == store->loose_cap[fanout]) {
+            size_t new_cap = store->loose_cap[fanout] == 0 ? 16 : store->loose_cap[fanout] * 2;
+            ObjectId *grown = realloc(store->loose[fanout], new_cap * sizeof(ObjectId));
+            if (grown == NULL) {
+                closedir(dir);
+                return -1;
+            }
+            store->loose[fanout] = grown;
+            store->loose_cap[fanout] = new_cap;
+        }
+        store->loose[fanout][store->loose_len[fanout]++] = oid;
+    }
+    closedir(dir);
+    if (store->loose_len[fanout] > 1) {
+        qsort(store->loose[fanout], store->loose_len[fanout], sizeof(ObjectId), odb_oid_cmp);
+    }
+    return 0;
+}
+
+/* Index of oid in the sorted fan-out listing, or where it would go. */
+static size_t store_loose_position(const ObjectStore *store, const ObjectId *oid, bool *found) {
+    unsigned int fanout = oid->hash[0];
+    size_t lo = 0;
+    size_t hi = store->loose_len[fanout];
+
+    *found = false;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(store->loose[fanout][mid].hash, oid->hash, 20);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int odb_search(const ObjectId *oid, bool rescan, ObjectLocation *location) {
+    size_t i;
+
+    for (i = 0; i < odb.store_count; i++) {
+        ObjectStore *store = &odb.stores[i];
+        bool found;
+        size_t j;
+
+        if ((rescan || !store->packs_loaded) && store_load_packs(store) != 0) {
+            return -1;
+        }
+        for (j = 0; j < store->pack_count; j++) {
+            if (pack_find(store->packs[j], oid->hash, &location->offset)) {
+                location->store = store;
+                location->pack = store->packs[j];
+                return 0;
+            }
+        }
+        if ((rescan || !store->loose_loaded[oid->hash[0]]) && store_load_fanout(store, oid->hash[0]) != 0) {
+            return -1;
+        }
+        store_loose_position(store, oid, &found);
+        if (found) {
+            location->store = store;
+            location->pack = NULL;
+            location->offset = 0;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 0 with *location filled, 1 if no store has the object. Another
+ * process may have written it since the listings were taken, so a miss
+ * rereads them once before it is memoized. */
+static int odb_locate(const char *repo_root, const ObjectId *oid, ObjectLocation *location) {
+    int status;
+
+    if (odb_prepare(repo_root) != 0) {
+        return -1;
+    }
+    if (oid_set_contains(&odb.missing, oid)) {
+        return 1;
+    }
+    status = odb_search(oid, false, location);
+    if (status == 1) {
+        status = odb_search(oid, true, location);
+    }
+    if (status == 1 && oid_set_insert(&odb.missing, oid) < 0) {
+        return -1;
+    }
+    return status;
+}
+
+#define OID_MIN_ABBREV 4
+
+static bool odb_prefix_match(const unsigned char hash[20], ObjectId *out, bool *found) {
+    if (*found) {
+        return memcmp(out->hash, hash, 20) == 0;
+    }
+    memcpy(out->hash, hash, 20);
+    *found = true;
+    return true;
+}
+
+/* Resolves an abbreviated object id of OID_MIN_ABBREV to 39 hex digits
+ * through the pack indexes and loose listings. Returns 0 for a unique match,
+ * 1 for none and -1 when ambiguous or on error. */
+static int odb_resolve_prefix(const char *repo_root, const char *prefix, ObjectId *out) {
+    size_t len = strlen(prefix);
+    char padded[41];
+    char hex[41];
+    ObjectId low;
+    bool found = false;
+    size_t i;
+    size_t j;
+
+    if (len < OID_MIN_ABBREV || len >= 40 || strspn(prefix, "0123456789abcdef") != len) {
+        return 1;
+    }
+    memcpy(padded, prefix, len);
+    memset(padded + len, '0', 40 - len);
+    padded[40] = '\0';
+    if (oid_from_hex(padded, &low) != 0 || odb_prepare(repo_root) != 0) {
+        return -1;
+    }
+    for (i = 0; i < odb.store_count; i++) {
+        ObjectStore *store = &odb.stores[i];
+        bool exact;
+        size_t pos;
+
+        if (!store->packs_loaded && store_load_packs(store) != 0) {
+            return -1;
+        }
+        for (j = 0; j < store->pack_count; j++) {
+            const PackFile *pack = store->packs[j];
+            uint32_t lo = 0;
+            uint32_t hi = pack->count;
+            unsigned char hash[20];
+            uint64_t offset;
+
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                pack_nth(pack, mid, hash, &offset);
+                if (memcmp(hash, low.hash, 20) < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            for (; lo < pack->count; lo++) {
+                ObjectId candidate;
+                pack_nth(pack, lo, candidate.hash, &offset);
+                oid_to_hex(&candidate, hex);
+                if (strncmp(hex, prefix, len) != 0) {
+                    break;
+                }
+                if (!odb_prefix_match(candidate.hash, out, &found)) {
+                    return -1;
+                }
+            }
+        }
+        if (!store->loose_loaded[low.hash[0]] && store_load_fanout(store, low.hash[0]) != 0) {
+            return -1;
+        }
+        for (pos = store_loose_position(store, &low, &exact); pos < store->loose_len[low.hash[0]]; pos++) {
+            oid_to_hex(&store->loose[low.hash[0]][pos], hex);
+            if (strncmp(hex, prefix, len) != 0) {
+                break;
+            }
+            if (!odb_prefix_match(store->loose[low.hash[0]][pos].hash, out, &found)) {
+                return -1;
+            }
+        }
+    }
+    return found ? 0 : 1;
+}
+
+static bool odb_has_object(const char *repo_root, const ObjectId *oid) {
+    ObjectLocation location;
+    return odb_locate(repo_root, oid, &location) == 0;
+}
+
+static void odb_note_written(const char *repo_root, const ObjectId *oid) {
+    ObjectStore *store;
+    unsigned int fanout = oid->hash[0];
+    size_t pos;
+    bool found;
+
+    if (odb.store_count == 0 || strcmp(odb.root, repo_root) != 0) {
+        return;
+    }
+    oid_set_remove(&odb.missing, oid);
+    store = &odb.stores[0];
+    if (!store->loose_loaded[fanout]) {
+        return;
+    }
+    pos = store_loose_position(store, oid, &found);
+    if (found) {
+        return;
+    }
+    if (store->loose_len[fanout] == store->loose_cap[fanout]) {
+        size_t new_cap = store->loose_cap[fanout] == 0 ? 16 : store->loose_cap[fanout] * 2;
+        ObjectId *grown = realloc(store->loose[fanout], new_cap * sizeof(ObjectId));
+        if (grown == NULL) {
+            /* Forget the listing; the next lookup reads the directory again. */
+            store->loose_loaded[fanout] = false;
+            store->loose_len[fanout] = 0;
+            return;
+        }
+        store->loose[fanout] = grown;
+        store->loose_cap[fanout] = new_cap;
+    }
+    memmove(&store->loose[fanout][pos + 1], &store->loose[fanout][pos],
+            (store->loose_len[fanout] - pos) * sizeof(ObjectId));
+    store->loose[fanout][pos] = *oid;
+    store->loose_len[fanout]++;
+}
+
+/* Inflates until the input or output ends or the stream does, handing zlib
+ * at most UINT_MAX bytes at a time since its counters are 32-bit. */
+static int inflate_span(z_stream *zs, const unsigned char *in_end, unsigned char *out_end) {
+    int ret;
+
+    do {
+        size_t in_left = (size_t)(in_end - zs->next_in);
+        size_t out_left = (size_t)(out_end - zs->next_out);
+
+        zs->avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+        zs->avail_out = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+        ret = inflate(zs, Z_NO_FLUSH);
+    } while (ret == Z_OK && zs->next_in < in_end && zs->next_out < out_end);
+    return ret;
+}
+
+/* Inflates a loose object: a zlib stream of "<type> <size>\0<data>". Only
+ * reads the store, so worker threads may call it. */
+static int read_loose_object(const ObjectStore *store, const ObjectId *oid, char type[16], unsigned char **data,
+                             size_t *size) {
+    char hex[41];
+    char path[PATH_MAX];
+    char header[64];
+    unsigned char *buffer = NULL;
+    unsigned long long object_size;
+    struct stat st;
+    z_stream zs;
+    void *map;
+    char *nul;
+    size_t header_used;
+    size_t body;
+    int ret;
+    int fd;
+    int result = -1;
+
+    oid_to_hex(oid, hex);
+    if (snprintf(path, sizeof(path), "%s/%.2s/%s", store->dir, hex, hex + 2) >= (int)sizeof(path)) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || (unsigned long long)st.st_size >= SIZE_MAX) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    zs.next_in = map;
+    zs.avail_in = (unsigned long long)st.st_size > UINT_MAX ? UINT_MAX : (uInt)st.st_size;
+    zs.next_out = (unsigned char *)header;
+    zs.avail_out = sizeof(header);
+    do {
+        ret = inflate(&zs, Z_SYNC_FLUSH);
+        nul = memchr(header, '\0', sizeof(header) - zs.avail_out);
+    } while (nul == NULL && ret == Z_OK && zs.avail_out > 0);
+    if (nul == NULL || sscanf(header, "%15s %llu", type, &object_size) != 2 || object_size >= SIZE_MAX) {
+        goto done;
+    }
+    header_used = sizeof(header) - zs.avail_out;
+    body = header_used - (size_t)(nul + 1 - header);
+    if (body > object_size) {
+        goto done;
+    }
+    buffer = malloc((size_t)object_size + 1);
+    if (buffer == NULL) {
+        goto done;
+    }
+    memcpy(buffer, nul + 1, body);
+    if (ret != Z_STREAM_END) {
+        zs.next_out = buffer + body;
+        ret = inflate_span(&zs, (const unsigned char *)map + st.st_size, buffer + object_size + 1);
+        body = (size_t)(zs.next_out - buffer);
+    }
+    if (ret != Z_STREAM_END || body != object_size) {
+        goto done;
+    }
+    buffer[object_size] = '\0';
+    *data = buffer;
+    *size = (size_t)object_size;
+    buffer = NULL;
+    result = 0;
+
+done:
+    free(buffer);
+    inflateEnd(&zs);
+    munmap(map, (size_t)st.st_size);
+    return result;
+}
+
+static int odb_read(const char *repo_root, const ObjectId *oid, char type[16], unsigned char **data, size_t *size);
+
+/* REF_DELTA bases outside their own pack, from any store. Bounded so that
+ * packs referring to each other in a cycle cannot recurse forever. */
+static int odb_pack_base(void *ctx, const unsigned char hash[20], int *type, unsigned char **data, size_t *size) {
+    static int depth;
+    ObjectId oid;
+    char name[16];
+    int status;
+
+    if (depth >= ODB_MAX_ALTERNATE_DEPTH * 2) {
+        return -1;
+    }
+    memcpy(oid.hash, hash, 20);
+    depth++;
+    status = odb_read((const char *)ctx, &oid, name, data, size);
+    depth--;
+    if (status != 0) {
+        return status;
+    }
+    *type = pack_type_code(name);
+    if (*type == 0) {
+        free(*data);
+        return -1;
+    }
+    return 0;
+}
+
+#define OBJECT_CACHE_DEFAULT_MB 64
+#define DELTA_CACHE_DEFAULT_MB 32
+
+static size_t cache_limit(const char *name, long default_mb) {
+    const char *value = getenv(name);
+    long mb = value != NULL && value[0] != '\0' ? atol(value) : default_mb;
+    return mb > 0 ? (size_t)mb * 1024 * 1024 : 0;
+}
+
+/* Reads an object natively. Returns 1 if no store has it and -1 if it is
+ * there but cannot be decoded here. Objects never change under their id,
+ * so cached copies stay valid across odb_invalidate. */
+static int odb_read(const char *repo_root, const ObjectId *oid, char type[16], unsigned char **data, size_t *size) {
+    ObjectLocation location;
+    int code;
+    int status;
+
+    if (odb_prepare(repo_root) != 0) {
+        return -1;
+    }
+    if (object_cache_get(&object_cache, oid->hash, &code, data, size)) {
+        snprintf(type, 16, "%s", pack_type_name(code));
+        TRACE_COUNT(allocations, 1);
+        return 0;
+    }
+    status = odb_locate(repo_root, oid, &location);
+    if (status != 0) {
+        return status;
+    }
+    if (location.pack != NULL) {
+        if (pack_read(location.pack, location.offset, odb_pack_base, (void *)repo_root, &code, data, size) != 0) {
+            return -1;
+        }
+        snprintf(type, 16, "%s", pack_type_name(code));
+    } else if (read_loose_object(location.store, oid, type, data, size) != 0) {
+        return -1;
+    } else {
+        code = pack_type_code(type);
+    }
+    if (code != 0) {
+        object_cache_put(&object_cache, oid->hash, code, *data, *size);
+    }
+    TRACE_COUNT(objects_read, 1);
+    TRACE_COUNT(allocations, 1);
+    return 0;
+}
+
+/* Every object in the repository and its alternates, sorted by id, for
+ * whole-store passes like fsck. An object's index here is its position in
+ * reachability bitmaps. Packs stay owned by the object database and are
+ * mapped up front, so entries can be read from several threads. */
+#define OBJECT_TABLE_LOOSE UINT32_MAX
+
+typedef struct {
+    ObjectId oid;
+    uint32_t pack;  /* index into ObjectTable.packs, or OBJECT_TABLE_LOOSE */
+    uint32_t store; /* index into odb.stores */
+    uint64_t offset;
+} ObjectTableEntry;
+
+typedef struct {
+    ObjectTableEntry *items;
+    size_t len;
+    size_t cap;
+    PackFile **packs;
+    size_t pack_count;
+    size_t fanout[257]; /* ids starting with byte b sit in [fanout[b], fanout[b + 1]) */
+} ObjectTable;
+
+static void object_table_free(ObjectTable *table) {
+    free(table->items);
+    free(table->packs);
+    memset(table, 0, sizeof(*table));
+}
+
+static int object_table_add(ObjectTable *table, const ObjectId *oid, uint32_t pack, uint32_t store, uint64_t offset) {
+    if (table->len == table->cap) {
+        size_t new_cap = table->cap == 0 ? 1024 : table->cap * 2;
+        ObjectTableEntry *grown = realloc(table->items, new_cap * sizeof(ObjectTableEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        table->items = grown;
+        table->cap = new_cap;
+    }
+    table->items[table->len].oid = *oid;
+    table->items[table->len].pack = pack;
+    table->items[table->len].store = store;
+    table->items[table->len].offset = offset;
+    table->len++;
+    return 0;
+}
+
+/* By id; of several copies the packed one in the earliest store wins. */
+static int object_table_entry_cmp(const void *left, const void *right) {
+    const ObjectTableEntry *a = left;
+    const ObjectTableEntry *b = right;
+    int cmp = memcmp(a->oid.hash, b->oid.hash, 20);
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (a->pack != b->pack) {
+        return a->pack < b->pack ? -1 : 1;
+    }
+    return a->store < b->store ? -1 : a->store > b->store;
+}
+
+static int object_table_build(const char *repo_root, ObjectTable *table) {
+    size_t i;
+    size_t kept = 0;
+
+    memset(table, 0, sizeof(*table));
+    if (odb_prepare(repo_root) != 0) {
+        return -1;
+    }
+    for (i = 0; i < odb.store_count; i++) {
+        ObjectStore *store = &odb.stores[i];
+        unsigned int fanout;
+        size_t j;
+
+        if (!store->packs_loaded && store_load_packs(store) != 0) {
+            goto fail;
+        }
+        for (j = 0; j < store->pack_count; j++) {
+            PackFile *pack = store->packs[j];
+            PackFile **grown;
+            uint32_t n;
+
+            if (pack_map(pack) != 0) {
+                fprintf(stderr, "cg: cannot read %s\n", pack->pack_path);
+                goto fail;
+            }
+            grown = realloc(table->packs, (table->pack_count + 1) * sizeof(PackFile *));
+            if (grown == NULL) {
+                goto fail;
+            }
+            table->packs = grown;
+            table->packs[table->pack_count] = pack;
+            for (n = 0; n < pack->count; n++) {
+                ObjectId oid;
+                uint64_t offset;
+                pack_nth(pack, n, oid.hash, &offset);
+                if (object_table_add(table, &oid, (uint32_t)table->pack_count, (uint32_t)i, offset) != 0) {
+                    goto fail;
+                }
+            }
+            table->pack_count++;
+        }
+        for (fanout = 0; fanout < 256; fanout++) {
+            if (!store->loose_loaded[fanout] && store_load_fanout(store, fanout) != 0) {
+                goto fail;
+            }
+            for (j = 0; j < store->loose_len[fanout]; j++) {
+                if (object_table_add(table, &store->loose[fanout][j], OBJECT_TABLE_LOOSE, (uint32_t)i, 0) != 0) {
+                    goto fail;
+                }
+            }
+        }
+    }
+
+    if (table->len > 1) {
+        qsort(table->items, table->len, sizeof(ObjectTableEntry), object_table_entry_cmp);
+    }
+    for (i = 0; i < table->len; i++) {
+        if (kept == 0 || !oid_equal(&table->items[kept - 1].oid, &table->items[i].oid)) {
+            table->items[kept++] = table->items[i];
+        }
+    }
+    table->len = kept;
+    for (i = 0, kept = 0; i < 256; i++) {
+        table->fanout[i] = kept;
+        while (kept < table->len && table->items[kept].oid.hash[0] == i) {
+            kept++;
+        }
+    }
+    table->fanout[256] = table->len;
+    return 0;
+
+fail:
+    object_table_free(table);
+    return -1;
+}
+
+/* Position of oid, or table->len if the store does not have it. */
+static size_t object_table_find(const ObjectTable *table, const ObjectId *oid) {
+    size_t lo = table->fanout[oid->hash[0]];
+    size_t hi = table->fanout[oid->hash[0] + 1];
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(table->items[mid].oid.hash, oid->hash, 20);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return table->len;
+}
+
+static int object_table_read_entry(const ObjectTable *table, size_t pos, bool resolve, int *type,
+                                   unsigned char **data, size_t *size);
+
+/* REF_DELTA bases in another pack or loose. Such a base must not need
+ * another pack itself, which keeps this from recursing. */
+static int object_table_base(void *ctx, const unsigned char hash[20], int *type, unsigned char **data, size_t *size) {
+    const ObjectTable *table = ctx;
+    ObjectId oid;
+    size_t pos;
+
+    memcpy(oid.hash, hash, 20);
+    pos = object_table_find(table, &oid);
+    if (pos == table->len) {
+        return 1;
+    }
+    return object_table_read_entry(table, pos, false, type, data, size);
+}
+
+static int object_table_read_entry(const ObjectTable *table, size_t pos, bool resolve, int *type,
+                                   unsigned char **data, size_t *size) {
+    const ObjectTableEntry *entry = &table->items[pos];
+    char name[16];
+
+    if (entry->pack != OBJECT_TABLE_LOOSE) {
+        return pack_read(table->packs[entry->pack], entry->offset, resolve ? object_table_base : NULL,
+                         (void *)table, type, data, size);
+    }
+    if (read_loose_object(&odb.stores[entry->store], &entry->oid, name, data, size) != 0) {
+        return -1;
+    }
+    *type = pack_type_code(name);
+    if (*type == 0) {
+        free(*data);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the object at pos; safe from several threads at once. */
+static int object_table_read(const ObjectTable *table, size_t pos, int *type, unsigned char **data, size_t *size) {
+    return object_table_read_entry(table, pos, true, type, data, size);
+}
+
+typedef struct {
+    Sha1Ctx sha;
+    z_stream zs;
+    int fd;
+    const char *repo_root;
+    char objects_dir[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    unsigned char out[HASH_CHUNK_SIZE];
+} ObjectWriter;
+
+static int object_writer_deflate(ObjectWriter *writer, const unsigned char *data, size_t len, int flush) {
+    writer->zs.next_in = (Bytef *)data;
+    writer->zs.avail_in = (uInt)len;
+    while (1) {
+        int status;
+        size_t produced;
+        writer->zs.next_out = writer->out;
+        writer->zs.avail_out = sizeof(writer->out);
+        status = deflate(&writer->zs, flush);
+        if (status == Z_STREAM_ERROR) {
+            return -1;
+        }
+        produced = sizeof(writer->out) - writer->zs.avail_out;
+        if (produced > 0 && write_all(writer->fd, writer->out, produced) != 0) {
+            return -1;
+        }
+        if (flush == Z_FINISH ? status == Z_STREAM_END : writer->zs.avail_out != 0) {
+            return 0;
+        }
+    }
+}
+
+static void object_writer_abort(ObjectWriter *writer) {
+    if (writer->fd >= 0) {
+        deflateEnd(&writer->zs);
+        close(writer->fd);
+        unlink(writer->tmp_path);
+        writer->fd = -1;
+    }
+}
+
+static int object_writer_update(ObjectWriter *writer, const void *data, size_t len) {
+    const unsigned char *cursor = (const unsigned char *)data;
+
+    TRACE_COUNT(bytes_hashed, len);
+    sha1_update(&writer->sha, data, len);
+    if (writer->fd < 0) {
+        return 0;
+    }
+    while (len > 0) {
+        size_t step = len > HASH_MMAP_WINDOW ? HASH_MMAP_WINDOW : len;
+        if (object_writer_deflate(writer, cursor, step, Z_NO_FLUSH) != 0) {
+            return -1;
+        }
+        cursor += step;
+        len -= step;
+    }
+    return 0;
+}
+
+static int object_writer_begin(ObjectWriter *writer, const char *repo_root, const char *type, uint64_t size, bool write_object) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%s %llu", type, (unsigned long long)size);
+
+    sha1_init(&writer->sha);
+    writer->fd = -1;
+    writer->repo_root = repo_root;
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        return -1;
+    }
+
+    if (write_object) {
+        if (build_git_path(repo_root, "objects", writer->objects_dir, sizeof(writer->objects_dir)) != 0 ||
+            path_join(writer->objects_dir, "tmp_obj_XXXXXX", writer->tmp_path, sizeof(writer->tmp_path)) != 0) {
+            return -1;
+        }
+        memset(&writer->zs, 0, sizeof(writer->zs));
+        if (deflateInit(&writer->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return -1;
+        }
+        writer->fd = mkstemp(writer->tmp_path);
+        if (writer->fd < 0) {
+            deflateEnd(&writer->zs);
+            return -1;
+        }
+    }
+
+    if (object_writer_update(writer, header, (size_t)header_len + 1) != 0) {
+        object_writer_abort(writer);
+        return -1;
+    }
+    return 0;
+}
+
+static int object_writer_finish(ObjectWriter *writer, ObjectId *out) {
+    char hex[41];
+    char fanout[PATH_MAX];
+    char final_path[PATH_MAX];
+
+    if (sha1_final(&writer->sha, out->hash) != 0) {
+        fprintf(stderr, "cg: SHA-1 collision attack detected in object content\n");
+        object_writer_abort(writer);
+        return -1;
+    }
+    if (writer->fd < 0) {
+        return 0;
+    }
+
+    if (object_writer_deflate(writer, NULL, 0, Z_FINISH) != 0) {
+        object_writer_abort(writer);
+        return -1;
+    }
+    deflateEnd(&writer->zs);
+    if (fchmod(writer->fd, 0444) != 0 || close(writer->fd) != 0) {
+        writer->fd = -1;
+        unlink(writer->tmp_path);
+        return -1;
+    }
+    writer->fd = -1;
+
+    oid_to_hex(out, hex);
+    if (snprintf(fanout, sizeof(fanout), "%s/%.2s", writer->objects_dir, hex) >= (int)sizeof(fanout) ||
+        path_join(fanout, hex + 2, final_path, sizeof(final_path)) != 0 ||
+        ensure_dir(fanout) != 0) {
+        unlink(writer->tmp_path);
+        return -1;
+    }
+
+    if (odb_has_object(writer->repo_root, out)) {
+        unlink(writer->tmp_path);
+        return 0;
+    }
+    if (rename(writer->tmp_path, final_path) != 0) {
+        unlink(writer->tmp_path);
+        return -1;
+    }
+    odb_note_written(writer->repo_root, out);
+    return 0;
+}
+
+static bool direct_io_requested(void) {
+    const char *value = getenv("CG_DIRECT_IO");
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+/* Maps the file one window at a time; unmapping each window before the next
+ * keeps resident pages bounded by HASH_MMAP_WINDOW. Returns 1 if the file
+ * cannot be mapped at all so the caller can fall back to read(). */
+static int hash_fd_mmap(int fd, uint64_t size, ObjectWriter *writer) {
+    uint64_t offset = 0;
+
+    while (offset < size) {
+        size_t window = size - offset > HASH_MMAP_WINDOW ? HASH_MMAP_WINDOW : (size_t)(size - offset);
+        void *map = mmap(NULL, window, PROT_READ, MAP_PRIVATE, fd, (off_t)offset);
+        int status;
+        if (map == MAP_FAILED) {
+            return offset == 0 ? 1 : -1;
+        }
+        posix_madvise(map, window, POSIX_MADV_SEQUENTIAL);
+        status = object_writer_update(writer, map, window);
+        munmap(map, window);
+        if (status != 0) {
+            return -1;
+        }
+        offset += window;
+    }
+    return 0;
+}
+
+static int hash_fd_read(int fd, uint64_t size, bool drop_cache, ObjectWriter *writer) {
+    unsigned char *buffer = NULL;
+    uint64_t total = 0;
+    int result = -1;
+
+    if (posix_memalign((void **)&buffer, DIRECT_IO_ALIGN, HASH_CHUNK_SIZE) != 0) {
+        return -1;
+    }
+
+    while (1) {
+        ssize_t got = read(fd, buffer, HASH_CHUNK_SIZE);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto done;
+        }
+        if (got == 0) {
+            break;
+        }
+        if (total + (uint64_t)got > size || object_writer_update(writer, buffer, (size_t)got) != 0) {
+            goto done;
+        }
+        if (drop_cache) {
+            posix_fadvise(fd, (off_t)total, got, POSIX_FADV_DONTNEED);
+        }
+        total += (uint64_t)got;
+    }
+    result = total == size ? 0 : -1;
+
+done:
+    free(buffer);
+    return result;
+}
+
+/* CG_DIRECT_IO=1 reads with O_DIRECT (or drops pages behind us) to keep the
+ * page cache clean. */
+static int git_hash_object(const char *repo_root, const char *relpath, bool write_object, ObjectId *out) {
+    char absolute[PATH_MAX];
+    ObjectWriter writer;
+    struct stat st;
+    bool direct = direct_io_requested();
+    bool drop_cache = direct;
+    int fd = -1;
+    int status;
+
+    if (path_join(repo_root, relpath, absolute, sizeof(absolute)) != 0) {
+        return -1;
+    }
+
+#ifdef O_DIRECT
+    if (direct) {
+        fd = open(absolute, O_RDONLY | O_DIRECT);
+        if (fd >= 0) {
+            drop_cache = false;
+        }
+    }
+#endif
+    if (fd < 0) {
+        fd = open(absolute, O_RDONLY);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    TRACE_COUNT(files_stated, 1);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        object_writer_begin(&writer, repo_root, "blob", (uint64_t)st.st_size, write_object) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    status = 1;
+    if (!direct && (uint64_t)st.st_size >= HASH_MMAP_THRESHOLD) {
+        status = hash_fd_mmap(fd, (uint64_t)st.st_size, &writer);
+    }
+    if (status == 1) {
+        status = hash_fd_read(fd, (uint64_t)st.st_size, drop_cache, &writer);
+    }
+    close(fd);
+
+    if (status != 0) {
+        object_writer_abort(&writer);
+        return -1;
+    }
+    return object_writer_finish(&writer, out);
+}
+
+static int hash_object_buffer(const char *type, const void *data, size_t len, ObjectId *out) {
+    ObjectWriter writer;
+
+    if (object_writer_begin(&writer, NULL, type, len, false) != 0 || object_writer_update(&writer, data, len) != 0) {
+        return -1;
+    }
+    return object_writer_finish(&writer, out);
+}
+
+/* Hashes the object first and only deflates it when no store has it yet,
+ * which is the common case for trees rebuilt after a checkout. */
+static int write_object_buffer(const char *repo_root, const char *type, const void *data, size_t len,
+                               ObjectId *out) {
+    ObjectWriter writer;
+
+    if (hash_object_buffer(type, data, len, out) != 0) {
+        return -1;
+    }
+    if (odb_has_object(repo_root, out)) {
+        return 0;
+    }
+
+    if (object_writer_begin(&writer, repo_root, type, len, true) != 0) {
+        return -1;
+    }
+    if (object_writer_update(&writer, data, len) != 0) {
+        object_writer_abort(&writer);
+        return -1;
+    }
+    return object_writer_finish(&writer, out);
+}
+
+/* Files up to HASH_MMAP_THRESHOLD are read whole in batches and hashed from
+ * memory; a batch holds at most this many files and bytes. */
+#define HASH_BATCH_FILES 1024
+#define HASH_BATCH_BYTES (32 * 1024 * 1024)
+
+/* All files are stat'ed in one batch and the small ones read in batches, so
+ * filesystem round trips overlap instead of adding up. missing, stats and
+ * modes are optional. On a per-file failure *failed is its index, otherwise
+ * count. */
+static int hash_worktree_files(const char *repo_root, const char *const *relpaths, size_t count, bool write_object,
+                               ObjectId *oids, bool *missing, IndexStat *stats, uint32_t *modes, size_t *failed) {
+    FsBatchItem *items;
+    char **absolute;
+    size_t read_max = direct_io_requested() ? 0 : HASH_MMAP_THRESHOLD;
+    size_t start = 0;
+    time_t now;
+    size_t i;
+    int result = -1;
+
+    *failed = count;
+    if (count == 0) {
+        return 0;
+    }
+    items = calloc(count, sizeof(FsBatchItem));
+    absolute = calloc(count, sizeof(char *));
+    if (items == NULL || absolute == NULL) {
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (path_join(repo_root, relpaths[i], path, sizeof(path)) != 0 || (absolute[i] = dup_string(path)) == NULL) {
+            goto done;
+        }
+        items[i].path = absolute[i];
+    }
+    if (fs_batch_stat(items, count) != 0) {
+        goto done;
+    }
+    TRACE_COUNT(files_stated, count);
+    for (i = 0; missing != NULL && i < count; i++) {
+        missing[i] = items[i].error != 0;
+    }
+    for (i = 0; modes != NULL && i < count; i++) {
+        modes[i] = items[i].error == 0 ? index_mode_from_stat(items[i].st.st_mode) : 0;
+    }
+    now = time(NULL);
+    for (i = 0; stats != NULL && i < count; i++) {
+        if (items[i].error == 0) {
+            index_stat_record(&stats[i], &items[i].st, now);
+        } else {
+            memset(&stats[i], 0, sizeof(IndexStat));
+        }
+    }
+
+    while (start < count) {
+        size_t end = start;
+        size_t bytes = 0;
+
+        while (end < count && end - start < HASH_BATCH_FILES) {
+            if (items[end].error == 0 && S_ISREG(items[end].st.st_mode) &&
+                (uint64_t)items[end].st.st_size <= read_max) {
+                if (end > start && bytes + (size_t)items[end].st.st_size > HASH_BATCH_BYTES) {
+                    break;
+                }
+                bytes += (size_t)items[end].st.st_size;
+            }
+            end++;
+        }
+        if (fs_batch_read(items + start, end - start, read_max) != 0) {
+            goto done;
+        }
+
+        for (i = start; i < end; i++) {
+            int status;
+            if (missing != NULL && missing[i]) {
+                continue;
+            }
+            if (items[i].loaded) {
+                status = write_object ? write_object_buffer(repo_root, "blob", items[i].data, items[i].size, &oids[i])
+                                      : hash_object_buffer("blob", items[i].data, items[i].size, &oids[i]);
+            } else if (items[i].error == 0 && S_ISLNK(items[i].st.st_mode)) {
+                /* git stores a symlink as a blob holding its target. */
+                char target[PATH_MAX];
+                ssize_t len = readlink(items[i].path, target, sizeof(target));
+                status = len < 0 || (size_t)len == sizeof(target) ? -1
+                         : write_object ? write_object_buffer(repo_root, "blob", target, (size_t)len, &oids[i])
+                                        : hash_object_buffer("blob", target, (size_t)len, &oids[i]);
+            } else {
+                status = git_hash_object(repo_root, relpaths[i], write_object, &oids[i]);
+            }
+            free(items[i].data);
+            items[i].data = NULL;
+            if (status != 0) {
+                *failed = i;
+                goto done;
+            }
+        }
+        start = end;
+    }
+    result = 0;
+
+done:
+    for (i = 0; i < count; i++) {
+        if (items != NULL) {
+            free(items[i].data);
+        }
+        if (absolute != NULL) {
+            free(absolute[i]);
+        }
+    }
+    free(items);
+    free(absolute);
+    return result;
+}
+
+/* Preload: before anything is hashed, every tracked path is lstat'ed and
+ * compared with its recorded stat data. The index is cut into one slice
+ * per thread, as lstat mostly waits on the filesystem (cold caches, network
+ * mounts); small indexes stay on the calling thread. */
+#define PRELOAD_MIN_ENTRIES 500
+
+typedef struct {
+    const char *repo_root;
+    const IndexList *staged;
+    size_t slice;
+    bool *dirty;
+} PreloadJob;
+
+static void preload_slice(void *ctx, size_t index) {
+    PreloadJob *job = ctx;
+    size_t start = index * job->slice;
+    size_t end = start + job->slice < job->staged->len ? start + job->slice : job->staged->len;
+    size_t i;
+
+    for (i = start; i < end; i++) {
+        const IndexEntry *entry = &job->staged->items[i];
+        char path[PATH_MAX];
+        struct stat st;
+
+        job->dirty[i] = entry->stat.mode == 0 || path_join(job->repo_root, entry->path, path, sizeof(path)) != 0 ||
+                        lstat(path, &st) != 0 || !index_stat_matches(&entry->stat, &st);
+    }
+}
+
+static size_t preload_index(const char *repo_root, const IndexList *staged, bool *dirty) {
+    PreloadJob job;
+    size_t slices = staged->len / PRELOAD_MIN_ENTRIES;
+    size_t threads;
+    size_t count = 0;
+    size_t i;
+
+    if (staged->len == 0) {
+        return 0;
+    }
+    threads = parallel_worker_count(slices > 0 ? slices : 1) * 2;
+    if (threads > slices) {
+        threads = slices > 0 ? slices : 1;
+    }
+    if (threads > PARALLEL_MAX_THREADS) {
+        threads = PARALLEL_MAX_THREADS;
+    }
+    job.repo_root = repo_root;
+    job.staged = staged;
+    job.slice = (staged->len + threads - 1) / threads;
+    job.dirty = dirty;
+    parallel_for_threads(threads, threads, preload_slice, &job);
+    for (i = 0; i < staged->len; i++) {
+        if (staged->items[i].stat.mode != 0) {
+            TRACE_COUNT(files_stated, 1);
+        }
+        count += dirty[i];
+    }
+    return count;
+}
+
+/* Callers read objects in batches of up to OBJECT_READ_WINDOW: they queue
+ * the ids with object_request and then take the objects, in the same order,
+ * from object_response. */
+#define OBJECT_READ_WINDOW 256
+
+/* git cat-file --batch, started only for objects the native reader cannot
+ * decode, and kept up for the rest of the process once it is. */
+static Coprocess cat_file_proc = {-1, NULL, NULL};
+static char cat_file_root[PATH_MAX];
+
+static void cat_file_reset(void) {
+    if (cat_file_proc.pid > 0) {
+        coprocess_finish(&cat_file_proc);
+    }
+    cat_file_root[0] = '\0';
+}
+
+static int cat_file_ensure(const char *repo_root) {
+    static const char *const args[] = {"cat-file", "--batch", NULL};
+
+    if (cat_file_proc.pid > 0 && strcmp(cat_file_root, repo_root) == 0) {
+        return 0;
+    }
+    cat_file_reset();
+    if (snprintf(cat_file_root, sizeof(cat_file_root), "%s", repo_root) >= (int)sizeof(cat_file_root) ||
+        coprocess_start(&cat_file_proc, repo_root, args) != 0) {
+        cat_file_root[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+static int cat_file_read(const char *repo_root, const ObjectId *oid, char type[16], unsigned char **data,
+                         size_t *size) {
+    char header[256];
+    char hash[64];
+    unsigned long long object_size;
+    unsigned char *buffer;
+    int trailer;
+
+    oid_to_hex(oid, hash);
+    if (cat_file_ensure(repo_root) != 0 || fprintf(cat_file_proc.to_child, "%s\n", hash) < 0 ||
+        fflush(cat_file_proc.to_child) != 0) {
+        cat_file_reset();
+        return -1;
+    }
+    if (fgets(header, sizeof(header), cat_file_proc.from_child) == NULL) {
+        cat_file_reset();
+        return -1;
+    }
+    if (strstr(header, " missing") != NULL) {
+        return 1;
+    }
+    if (sscanf(header, "%63s %15s %llu", hash, type, &object_size) != 3) {
+        cat_file_reset();
+        return -1;
+    }
+
+    TRACE_COUNT(objects_read, 1);
+    TRACE_COUNT(allocations, 1);
+    buffer = malloc((size_t)object_size + 1);
+    if (buffer == NULL) {
+        cat_file_reset();
+        return -1;
+    }
+    if (fread(buffer, 1, (size_t)object_size, cat_file_proc.from_child) != (size_t)object_size) {
+        free(buffer);
+        cat_file_reset();
+        return -1;
+    }
+    trailer = fgetc(cat_file_proc.from_child);
+    if (trailer != '\n') {
+        free(buffer);
+        cat_file_reset();
+        return -1;
+    }
+    buffer[object_size] = '\0';
+    *data = buffer;
+    *size = (size_t)object_size;
+    return 0;
+}
+
+/* Returns 1 for a missing object; data is NUL-terminated for convenience and
+ * owned by the caller. */
+static int read_object(const char *repo_root, const ObjectId *oid, char type[16], unsigned char **data, size_t *size) {
+    int status = odb_read(repo_root, oid, type, data, size);
+
+    if (status < 0) {
+        status = cat_file_read(repo_root, oid, type, data, size);
+    }
+    return status;
+}
+
+static struct {
+    char root[PATH_MAX];
+    ObjectId *items;
+    size_t head;
+    size_t len;
+    size_t cap;
+} object_queue;
+
+static void object_queue_reset(void) {
+    object_queue.head = 0;
+    object_queue.len = 0;
+}
+
+static int object_request(const char *repo_root, const ObjectId *oid) {
+    if (object_queue.len == object_queue.head) {
+        object_queue_reset();
+        if (snprintf(object_queue.root, sizeof(object_queue.root), "%s", repo_root) >= (int)sizeof(object_queue.root)) {
+            return -1;
+        }
+    } else if (strcmp(object_queue.root, repo_root) != 0) {
+        return -1;
+    }
+    if (object_queue.len == object_queue.cap) {
+        size_t new_cap = object_queue.cap == 0 ? OBJECT_READ_WINDOW : object_queue.cap * 2;
+        ObjectId *grown = realloc(object_queue.items, new_cap * sizeof(ObjectId));
+        if (grown == NULL) {
+            return -1;
+        }
+        object_queue.items = grown;
+        object_queue.cap = new_cap;
+    }
+    object_queue.items[object_queue.len++] = *oid;
+    return 0;
+}
+
+static int object_response(char type[16], unsigned char **data, size_t *size) {
+    ObjectId oid;
+
+    if (object_queue.head == object_queue.len) {
+        return -1;
+    }
+    oid = object_queue.items[object_queue.head++];
+    return read_object(object_queue.root, &oid, type, data, size);
+}
+
+static int commit_tree_oid(const char *repo_root, const ObjectId *commit, ObjectId *out_tree) {
+    char type[16];
+    char hex[41];
+    unsigned char *data;
+    size_t size;
+
+    if (read_object(repo_root, commit, type, &data, &size) != 0) {
+        return -1;
+    }
+    if (strcmp(type, "commit") != 0 || size < 46 || memcmp(data, "tree ", 5) != 0) {
+        free(data);
+        return -1;
+    }
+    memcpy(hex, data + 5, 40);
+    hex[40] = '\0';
+    free(data);
+    return oid_from_hex(hex, out_tree);
+}
+
+typedef struct {
+    ObjectId oid;
+    char *prefix;
+} TreeWalkItem;
+
+static int tree_walk_push(TreeWalkItem **items, size_t *len, size_t *cap, const ObjectId *oid, const char *prefix) {
+    if (*len == *cap) {
+        size_t new_cap = *cap == 0 ? 64 : *cap * 2;
+        TreeWalkItem *new_items;
+        TRACE_COUNT(allocations, 1);
+        new_items = realloc(*items, new_cap * sizeof(TreeWalkItem));
+        if (new_items == NULL) {
+            return -1;
+        }
+        *items = new_items;
+        *cap = new_cap;
+    }
+    (*items)[*len].prefix = dup_string(prefix);
+    if ((*items)[*len].prefix == NULL) {
+        return -1;
+    }
+    (*items)[*len].oid = *oid;
+    (*len)++;
+    return 0;
+}
+
+typedef int (*TreeVisitFn)(void *ctx, const char *path, const ObjectId *oid, unsigned int mode);
+
+static int parse_tree_object(const unsigned char *data, size_t size, const char *prefix, TreeVisitFn visit, void *ctx,
+                             TreeWalkItem **queue, size_t *queue_len, size_t *queue_cap) {
+    size_t pos = 0;
+
+    while (pos < size) {
+        const unsigned char *space = memchr(data + pos, ' ', size - pos);
+        const unsigned char *nul;
+        const char *name;
+        char path[PATH_MAX];
+        ObjectId oid;
+        bool is_tree;
+        bool is_gitlink;
+
+        if (space == NULL) {
+            return -1;
+        }
+        nul = memchr(space + 1, '\0', size - (size_t)(space + 1 - data));
+        if (nul == NULL || (size_t)(nul - data) + 21 > size) {
+            return -1;
+        }
+        is_tree = (size_t)(space - (data + pos)) == 5 && memcmp(data + pos, "40000", 5) == 0;
+        is_gitlink = (size_t)(space - (data + pos)) == 6 && memcmp(data + pos, "160000", 6) == 0;
+        name = (const char *)(space + 1);
+        memcpy(oid.hash, nul + 1, sizeof(oid.hash));
+
+        if (prefix[0] == '\0') {
+            if (snprintf(path, sizeof(path), "%s", name) >= (int)sizeof(path)) {
+                return -1;
+            }
+        } else if (path_join(prefix, name, path, sizeof(path)) != 0) {
+            return -1;
+        }
+
+        if (is_tree) {
+            if (tree_walk_push(queue, queue_len, queue_cap, &oid, path) != 0) {
+                return -1;
+            }
+        } else if (!is_gitlink) {
+            if (visit(ctx, path, &oid, (unsigned int)strtoul((const char *)data + pos, NULL, 8)) != 0) {
+                return -1;
+            }
+        }
+        pos = (size_t)(nul - data) + 21;
+    }
+    return 0;
+}
+
+/* Visits every blob below tree, queueing up to OBJECT_READ_WINDOW tree
+ * reads at a time. Order is breadth-first. */
+static int tree_walk(const char *repo_root, const ObjectId *tree, TreeVisitFn visit, void *ctx) {
+    TreeWalkItem *queue = NULL;
+    size_t queue_len = 0;
+    size_t queue_cap = 0;
+    size_t sent = 0;
+    size_t received = 0;
+    int result = -1;
+    size_t i;
+
+    if (tree_walk_push(&queue, &queue_len, &queue_cap, tree, "") != 0) {
+        goto done;
+    }
+
+    while (received < queue_len) {
+        char type[16];
+        unsigned char *data;
+        size_t size;
+
+        while (sent < queue_len && sent - received < OBJECT_READ_WINDOW) {
+            if (object_request(repo_root, &queue[sent].oid) != 0) {
+                goto done;
+            }
+            sent++;
+        }
+        if (object_response(type, &data, &size) != 0) {
+            goto done;
+        }
+        if (strcmp(type, "tree") != 0 ||
+            parse_tree_object(data, size, queue[received].prefix, visit, ctx, &queue, &queue_len, &queue_cap) != 0) {
+            free(data);
+            goto done;
+        }
+        free(data);
+        received++;
+    }
+    result = 0;
+
+done:
+    if (result != 0 && sent > received) {
+        /* Leftover requests would desync the next reader. */
+        object_queue_reset();
+    }
+    for (i = 0; i < queue_len; i++) {
+        free(queue[i].prefix);
+    }
+    free(queue);
+    return result;
+}
+
+static int index_entry_visit(void *ctx, const char *path, const ObjectId *oid, unsigned int mode) {
+    return index_list_append((IndexList *)ctx, path, oid, mode);
+}
+
+static int read_tree_recursive(const char *repo_root, const ObjectId *tree, IndexList *entries) {
+    if (tree_walk(repo_root, tree, index_entry_visit, entries) != 0) {
+        return -1;
+    }
+    qsort(entries->items, entries->len, sizeof(IndexEntry), index_cmp_path);
+    return 0;
+}
+
+static int read_head_tree(const char *repo_root, IndexList *head_entries, bool *has_head) {
+    ObjectId head_commit;
+    ObjectId tree;
+
+    if (resolve_ref(repo_root, "HEAD", &head_commit) != 0) {
+        *has_head = false;
+        return 0;
+    }
+
+    *has_head = true;
+    if (repo_cache_owns(repo_root) && repo_cache.head_valid && oid_equal(&repo_cache.head_commit, &head_commit)) {
+        return index_list_copy(head_entries, &repo_cache.head_entries);
+    }
+
+    if (commit_tree_oid(repo_root, &head_commit, &tree) != 0 ||
+        read_tree_recursive(repo_root, &tree, head_entries) != 0) {
+        return -1;
+    }
+
+    repo_cache_store_head(repo_root, &head_commit, head_entries);
+    return 0;
+}
+
+static int load_head_tree(const char *repo_root, IndexList *head_entries, bool *has_head) {
+    TraceRegion region;
+    int result;
+
+    trace_region_enter(&region, "head_tree_load");
+    result = read_head_tree(repo_root, head_entries, has_head);
+    trace_region_leave(&region);
+    return result;
+}
+
+static int sync_cg_index_from_head(const char *repo_root) {
+    IndexList head_entries;
+    bool has_head = false;
+    int result;
+
+    index_list_init(&head_entries);
+    if (load_head_tree(repo_root, &head_entries, &has_head) != 0) {
+        index_list_free(&head_entries);
+        return -1;
+    }
+
+    result = save_cg_index(repo_root, &head_entries);
+    index_list_free(&head_entries);
+    return result;
+}
+
+static int get_current_branch(const char *repo_root, char *branch, size_t branch_size) {
+    char head[PATH_MAX];
+
+    if (read_git_file_line(repo_root, "HEAD", head, sizeof(head)) != 0 ||
+        strncmp(head, "ref: refs/heads/", 16) != 0) {
+        return snprintf(branch, branch_size, "detached") < (int)branch_size ? 0 : -1;
+    }
+
+    return snprintf(branch, branch_size, "%s", head + 16) < (int)branch_size ? 0 : -1;
+}
+
+typedef struct {
+    char *name;
+    unsigned char type;
+} WalkEntry;
+
+static void walk_entries_free(WalkEntry *entries, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+static int read_dir_entries(const char *dir_path, WalkEntry **out, size_t *out_count) {
+    DIR *dir = opendir(dir_path);
+    struct dirent *entry;
+    WalkEntry *entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (count == cap) {
+            size_t new_cap = cap == 0 ? 32 : cap * 2;
+            WalkEntry *grown = realloc(entries, new_cap * sizeof(WalkEntry));
+            if (grown == NULL) {
+                goto fail;
+            }
+            entries = grown;
+            cap = new_cap;
+        }
+        entries[count].name = dup_string(entry->d_name);
+        if (entries[count].name == NULL) {
+            goto fail;
+        }
+        entries[count].type = entry->d_type;
+        count++;
+    }
+    if (closedir(dir) != 0) {
+        walk_entries_free(entries, count);
+        return -1;
+    }
+    *out = entries;
+    *out_count = count;
+    return 0;
+
+fail:
+    closedir(dir);
+    walk_entries_free(entries, count);
+    return -1;
+}
+
+/* Settles the entries readdir could not type (DT_UNKNOWN, common on network
+ * filesystems) with one batch of lstat calls. Entries that vanished in the
+ * meantime are left unknown and skipped. */
+static int type_unknown_entries(const char *dir_path, WalkEntry *entries, size_t count) {
+    FsBatchItem *items = NULL;
+    char **paths = NULL;
+    size_t *positions = NULL;
+    size_t unknown = 0;
+    size_t i;
+    int result = -1;
+
+    for (i = 0; i < count; i++) {
+        unknown += entries[i].type == DT_UNKNOWN;
+    }
+    if (unknown == 0) {
+        return 0;
+    }
+    items = calloc(unknown, sizeof(FsBatchItem));
+    paths = calloc(unknown, sizeof(char *));
+    positions = malloc(unknown * sizeof(size_t));
+    if (items == NULL || paths == NULL || positions == NULL) {
+        goto done;
+    }
+    unknown = 0;
+    for (i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (entries[i].type != DT_UNKNOWN) {
+            continue;
+        }
+        if (path_join(dir_path, entries[i].name, path, sizeof(path)) != 0 ||
+            (paths[unknown] = dup_string(path)) == NULL) {
+            goto done;
+        }
+        items[unknown].path = paths[unknown];
+        positions[unknown++] = i;
+    }
+    if (fs_batch_stat(items, unknown) != 0) {
+        goto done;
+    }
+    TRACE_COUNT(files_stated, unknown);
+    for (i = 0; i < unknown; i++) {
+        if (items[i].error == ENOENT) {
+            continue;
+        }
+        if (items[i].error != 0) {
+            goto done;
+        }
+        entries[positions[i]].type = S_ISDIR(items[i].st.st_mode)   ? DT_DIR
+                                     : S_ISREG(items[i].st.st_mode) ? DT_REG
+                                     : S_ISLNK(items[i].st.st_mode) ? DT_LNK
+                                                                    : DT_UNKNOWN;
+    }
+    result = 0;
+
+done:
+    for (i = 0; paths != NULL && i < unknown; i++) {
+        free(paths[i]);
+    }
+    free(items);
+    free(paths);
+    free(positions);
+    return result;
+}
+
+typedef int (*WorktreeFileFn)(void *ctx, const char *relpath);
+
+static int walk_dir_files(const char *repo_root, const char *git_dir, const char *dir_path, WorktreeFileFn fn,
+                          void *ctx) {
+    WalkEntry *entries;
+    size_t count;
+    size_t i;
+
+    if (strcmp(dir_path, git_dir) == 0) {
+        return 0;
+    }
+    if (read_dir_entries(dir_path, &entries, &count) != 0) {
+        return -1;
+    }
+    if (type_unknown_entries(dir_path, entries, count) != 0) {
+        walk_entries_free(entries, count);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        char next_path[PATH_MAX];
+        char relpath[PATH_MAX];
+        int status = 0;
+
+        if (entries[i].type != DT_DIR && entries[i].type != DT_REG && entries[i].type != DT_LNK) {
+            continue;
+        }
+        if (path_join(dir_path, entries[i].name, next_path, sizeof(next_path)) != 0) {
+            status = -1;
+        } else if (entries[i].type == DT_DIR) {
+            status = walk_dir_files(repo_root, git_dir, next_path, fn, ctx);
+        } else if (absolute_to_repo_rel(repo_root, next_path, relpath, sizeof(relpath)) != 0 ||
+                   fn(ctx, relpath) != 0) {
+            status = -1;
+        }
+        if (status != 0) {
+            walk_entries_free(entries, count);
+            return -1;
+        }
+    }
+    walk_entries_free(entries, count);
+    return 0;
+}
+
+static int collect_path(void *ctx, const char *relpath) {
+    return path_list_append(ctx, relpath);
+}
+
+static int collect_files_recursive(const char *repo_root, const char *absolute_path, PathList *files) {
+    struct stat st;
+
+    TRACE_COUNT(files_stated, 1);
+    if (lstat(absolute_path, &st) != 0) {
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        char git_dir[PATH_MAX];
+
+        if (build_git_path(repo_root, "", git_dir, sizeof(git_dir)) != 0) {
+            return -1;
+        }
+        return walk_dir_files(repo_root, git_dir, absolute_path, collect_path, files);
+    }
+
+    if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+        char relpath[PATH_MAX];
+        if (absolute_to_repo_rel(repo_root, absolute_path, relpath, sizeof(relpath)) != 0) {
+            return -1;
+        }
+        return path_list_append(files, relpath);
+    }
+
+    return 0;
+}
+
+/* Resolves an add argument like realpath, except that a symlink is staged
+ * itself and so only its directory is resolved. */
+static int resolve_add_path(const char *path, char *out) {
+    char dir[PATH_MAX];
+    char resolved_dir[PATH_MAX];
+    const char *slash;
+    struct stat st;
+
+    if (lstat(path, &st) != 0 || !S_ISLNK(st.st_mode)) {
+        return realpath(path, out) != NULL ? 0 : -1;
+    }
+    slash = strrchr(path, '/');
+    if (slash == NULL || slash[1] == '\0' || (size_t)(slash - path) >= sizeof(dir)) {
+        return -1;
+    }
+    memcpy(dir, path, (size_t)(slash - path));
+    dir[slash - path] = '\0';
+    if (realpath(dir[0] != '\0' ? dir : "/", resolved_dir) == NULL) {
+        return -1;
+    }
+    return path_join(resolved_dir, slash + 1, out, PATH_MAX);
+}
+
+/* files come back sorted and unique; directory arguments also land in dirs
+ * (the root as "") so tracked files gone from them can be removed. */
+static int collect_add_inputs(const char *repo_root, const char *base, const char *const *argv, size_t argc,
+                              PathList *files, PathList *dirs) {
+    size_t i;
+
+    for (i = 0; i < argc; i++) {
+        char joined[PATH_MAX];
+        char resolved[PATH_MAX];
+        char relpath[PATH_MAX];
+
+        if (argv[i][0] == '/') {
+            if (snprintf(joined, sizeof(joined), "%s", argv[i]) >= (int)sizeof(joined)) {
+                return -1;
+            }
+        } else {
+            if (path_join(base, argv[i], joined, sizeof(joined)) != 0) {
+                return -1;
+            }
+        }
+
+        if (resolve_add_path(joined, resolved) != 0) {
+            fprintf(stderr, "cg add: path not found: %s\n", argv[i]);
+            return -1;
+        }
+
+        if (absolute_to_repo_rel(repo_root, resolved, relpath, sizeof(relpath)) != 0) {
+            fprintf(stderr, "cg add: path outside repository: %s\n", argv[i]);
+            return -1;
+        }
+
+        if (strcmp(relpath, ".") == 0) {
+            if (collect_files_recursive(repo_root, resolved, files) != 0 || path_list_add(dirs, "") != 0) {
+                return -1;
+            }
+        } else {
+            struct stat st;
+            if (collect_files_recursive(repo_root, resolved, files) != 0) {
+                return -1;
+            }
+            if (stat(resolved, &st) == 0 && S_ISDIR(st.st_mode) && path_list_add(dirs, relpath) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    path_list_sort_unique(files);
+    return 0;
+}
+
+#define COMMIT_MAX_PARENTS 64
+#define RENAME_DEFAULT_LIMIT 1000
+#define RENAME_CANDIDATES_PER_DST 4
+#define RENAME_BATCH_BLOBS 128
+#define RENAME_BASENAME_SCORE (DIFF_RENAME_SCORE + (DIFF_MAX_SCORE - DIFF_RENAME_SCORE) / 2)
+
+/* One side of a rename candidate. keep marks a source that still exists
+ * afterwards (a modified file), so matching it can only be a copy. */
+typedef struct {
+    const char *path;
+    ObjectId oid;
+    bool keep;
+} RenameFile;
+
+typedef struct {
+    size_t src;
+    size_t dst;
+    int score;
+    bool copy;
+} RenameMatch;
+
+typedef struct {
+    const RenameFile *sources;
+    const RenameFile *dests;
+    size_t *open_sources;
+    size_t open_source_count;
+    size_t *open_dests;
+    size_t open_dest_count;
+    DiffSketch *source_sketches;
+    DiffSketch *dest_sketches;
+    unsigned char **blobs;
+    size_t *blob_sizes;
+    size_t blob_base;
+    RenameMatch *candidates;
+} RenameScan;
+
+static size_t rename_limit(void) {
+    const char *value = getenv("CG_RENAME_LIMIT");
+    long limit = value != NULL && value[0] != '\0' ? atol(value) : RENAME_DEFAULT_LIMIT;
+    return limit > 0 ? (size_t)limit : 0;
+}
+
+static const char *path_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static int rename_match_cmp(const void *left, const void *right) {
+    const RenameMatch *a = (const RenameMatch *)left;
+    const RenameMatch *b = (const RenameMatch *)right;
+
+    if (a->score != b->score) {
+        return a->score > b->score ? -1 : 1;
+    }
+    if (a->dst != b->dst) {
+        return a->dst < b->dst ? -1 : 1;
+    }
+    return a->src < b->src ? -1 : a->src > b->src;
+}
+
+static int rename_match_dst_cmp(const void *left, const void *right) {
+    const RenameMatch *a = (const RenameMatch *)left;
+    const RenameMatch *b = (const RenameMatch *)right;
+    return a->dst < b->dst ? -1 : a->dst > b->dst;
+}
+
+/* Sketch jobs: index i below open_source_count is a source, the rest are
+ * destinations; the blob for job i sits at blobs[i - blob_base]. */
+static void rename_sketch_job(void *ctx, size_t index) {
+    RenameScan *scan = (RenameScan *)ctx;
+    size_t job = scan->blob_base + index;
+    DiffSketch *sketch = job < scan->open_source_count ? &scan->source_sketches[job]
+                                                       : &scan->dest_sketches[job - scan->open_source_count];
+
+    if (diff_sketch_build(scan->blobs[index], scan->blob_sizes[index], sketch) != 0) {
+        sketch->size = 0;
+    }
+}
+
+static void rename_score_job(void *ctx, size_t index) {
+    RenameScan *scan = (RenameScan *)ctx;
+    RenameMatch *best = &scan->candidates[index * RENAME_CANDIDATES_PER_DST];
+    const DiffSketch *dst = &scan->dest_sketches[index];
+    size_t i;
+
+    for (i = 0; i < RENAME_CANDIDATES_PER_DST; i++) {
+        best[i].score = 0;
+    }
+    if (dst->spans == NULL || dst->size == 0) {
+        return;
+    }
+    for (i = 0; i < scan->open_source_count; i++) {
+        const DiffSketch *src = &scan->source_sketches[i];
+        int score;
+        size_t slot;
+
+        if (src->spans == NULL || src->size == 0) {
+            continue;
+        }
+        score = diff_similarity(src, dst, DIFF_RENAME_SCORE);
+        if (score < DIFF_RENAME_SCORE || score <= best[RENAME_CANDIDATES_PER_DST - 1].score) {
+            continue;
+        }
+        slot = RENAME_CANDIDATES_PER_DST - 1;
+        while (slot > 0 && best[slot - 1].score < score) {
+            best[slot] = best[slot - 1];
+            slot--;
+        }
+        best[slot].src = scan->open_sources[i];
+        best[slot].dst = scan->open_dests[index];
+        best[slot].score = score;
+        best[slot].copy = false;
+    }
+}
+
+static int rename_sketch_batch(const char *repo_root, RenameScan *scan, size_t start, size_t count) {
+    char type[16];
+    size_t i;
+    int result = -1;
+
+    for (i = 0; i < count; i++) {
+        size_t job = start + i;
+        const ObjectId *oid = job < scan->open_source_count
+                                  ? &scan->sources[scan->open_sources[job]].oid
+                                  : &scan->dests[scan->open_dests[job - scan->open_source_count]].oid;
+        scan->blobs[i] = NULL;
+        if (object_request(repo_root, oid) != 0) {
+            object_queue_reset();
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (object_response(type, &scan->blobs[i], &scan->blob_sizes[i]) != 0) {
+            object_queue_reset();
+            goto done;
+        }
+    }
+    scan->blob_base = start;
+    parallel_for(count, rename_sketch_job, scan);
+    result = 0;
+
+done:
+    for (i = 0; i < count; i++) {
+        free(scan->blobs[i]);
+    }
+    return result;
+}
+
+static int rename_inexact(const char *repo_root, RenameScan *scan, size_t *uses, bool *dest_done, bool allow_copies,
+                          RenameMatch *matches, size_t *match_count) {
+    size_t jobs = scan->open_source_count + scan->open_dest_count;
+    size_t candidate_count = 0;
+    size_t start;
+    size_t i;
+    int result = -1;
+
+    scan->source_sketches = calloc(scan->open_source_count, sizeof(DiffSketch));
+    scan->dest_sketches = calloc(scan->open_dest_count, sizeof(DiffSketch));
+    scan->blobs = malloc(RENAME_BATCH_BLOBS * sizeof(unsigned char *));
+    scan->blob_sizes = malloc(RENAME_BATCH_BLOBS * sizeof(size_t));
+    scan->candidates = malloc(scan->open_dest_count * RENAME_CANDIDATES_PER_DST * sizeof(RenameMatch));
+    if (scan->source_sketches == NULL || scan->dest_sketches == NULL || scan->blobs == NULL ||
+        scan->blob_sizes == NULL || scan->candidates == NULL) {
+        goto done;
+    }
+    for (start = 0; start < jobs; start += RENAME_BATCH_BLOBS) {
+        size_t count = jobs - start < RENAME_BATCH_BLOBS ? jobs - start : RENAME_BATCH_BLOBS;
+        if (rename_sketch_batch(repo_root, scan, start, count) != 0) {
+            goto done;
+        }
+    }
+    parallel_for(scan->open_dest_count, rename_score_job, scan);
+
+    for (i = 0; i < scan->open_dest_count * RENAME_CANDIDATES_PER_DST; i++) {
+        if (scan->candidates[i].score > 0) {
+            scan->candidates[candidate_count++] = scan->candidates[i];
+        }
+    }
+    qsort(scan->candidates, candidate_count, sizeof(RenameMatch), rename_match_cmp);
+    for (i = 0; i < candidate_count; i++) {
+        const RenameMatch *candidate = &scan->candidates[i];
+        if (dest_done[candidate->dst] || (uses[candidate->src] > 0 && !allow_copies)) {
+            continue;
+        }
+        matches[(*match_count)++] = *candidate;
+        uses[candidate->src]++;
+        dest_done[candidate->dst] = true;
+    }
+    result = 0;
+
+done:
+    if (scan->source_sketches != NULL) {
+        for (i = 0; i < scan->open_source_count; i++) {
+            diff_sketch_free(&scan->source_sketches[i]);
+        }
+    }
+    if (scan->dest_sketches != NULL) {
+        for (i = 0; i < scan->open_dest_count; i++) {
+            diff_sketch_free(&scan->dest_sketches[i]);
+        }
+    }
+    free(scan->source_sketches);
+    free(scan->dest_sketches);
+    free(scan->blobs);
+    free(scan->blob_sizes);
+    free(scan->candidates);
+    return result;
+}
+
+typedef struct {
+    size_t src;
+    size_t dst;
+    unsigned char *src_data;
+    size_t src_size;
+    unsigned char *dst_data;
+    size_t dst_size;
+    int score;
+} RenameProbe;
+
+static void rename_probe_job(void *ctx, size_t index) {
+    RenameProbe *probe = &((RenameProbe *)ctx)[index];
+    DiffSketch src;
+    DiffSketch dst;
+
+    probe->score = 0;
+    if (probe->src_size == 0 || probe->dst_size == 0 ||
+        diff_sketch_build(probe->src_data, probe->src_size, &src) != 0) {
+        return;
+    }
+    if (diff_sketch_build(probe->dst_data, probe->dst_size, &dst) == 0) {
+        probe->score = diff_similarity(&src, &dst, RENAME_BASENAME_SCORE);
+        diff_sketch_free(&dst);
+    }
+    diff_sketch_free(&src);
+}
+
+typedef struct {
+    const char *base;
+    size_t index;
+    bool is_dest;
+} RenameName;
+
+static int rename_name_cmp(const void *left, const void *right) {
+    const RenameName *a = (const RenameName *)left;
+    const RenameName *b = (const RenameName *)right;
+    int cmp = strcmp(a->base, b->base);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (int)a->is_dest - (int)b->is_dest;
+}
+
+/* Like git since 2.33: a file that moved usually keeps its name. Before
+ * the all-pairs scan, every basename that occurs exactly once among the
+ * open sources and once among the open destinations is scored as a single
+ * pair and accepted above a stricter threshold. This keeps a directory
+ * move cheap no matter how many files it holds. */
+static int rename_basename_pass(const char *repo_root, const RenameScan *scan, size_t *uses, bool *dest_done,
+                                RenameMatch *matches, size_t *match_count) {
+    size_t entries = scan->open_source_count + scan->open_dest_count;
+    RenameName *names = malloc((entries > 0 ? entries : 1) * sizeof(RenameName));
+    RenameProbe *probes = malloc((scan->open_dest_count > 0 ? scan->open_dest_count : 1) * sizeof(RenameProbe));
+    size_t probe_count = 0;
+    size_t start;
+    size_t i;
+    char type[16];
+    int result = -1;
+
+    if (names == NULL || probes == NULL) {
+        goto done;
+    }
+    /* Sorted by basename, a run of exactly one source followed by one
+     * destination is a candidate. */
+    for (i = 0; i < scan->open_source_count; i++) {
+        names[i].base = path_basename(scan->sources[scan->open_sources[i]].path);
+        names[i].index = scan->open_sources[i];
+        names[i].is_dest = false;
+    }
+    for (i = 0; i < scan->open_dest_count; i++) {
+        names[scan->open_source_count + i].base = path_basename(scan->dests[scan->open_dests[i]].path);
+        names[scan->open_source_count + i].index = scan->open_dests[i];
+        names[scan->open_source_count + i].is_dest = true;
+    }
+    qsort(names, entries, sizeof(RenameName), rename_name_cmp);
+    for (i = 0; i + 1 < entries; i++) {
+        if (!names[i].is_dest && names[i + 1].is_dest && strcmp(names[i].base, names[i + 1].base) == 0 &&
+            (i == 0 || strcmp(names[i - 1].base, names[i].base) != 0) &&
+            (i + 2 == entries || strcmp(names[i + 2].base, names[i].base) != 0)) {
+            probes[probe_count].src = names[i].index;
+            probes[probe_count].dst = names[i + 1].index;
+            probe_count++;
+            i++;
+        }
+    }
+
+    for (start = 0; start < probe_count; start += RENAME_BATCH_BLOBS / 2) {
+        size_t count = probe_count - start < RENAME_BATCH_BLOBS / 2 ? probe_count - start : RENAME_BATCH_BLOBS / 2;
+        RenameProbe *batch = probes + start;
+        bool loaded = true;
+
+        for (i = 0; i < count; i++) {
+            batch[i].src_data = NULL;
+            batch[i].dst_data = NULL;
+            if (object_request(repo_root, &scan->sources[batch[i].src].oid) != 0 ||
+                object_request(repo_root, &scan->dests[batch[i].dst].oid) != 0) {
+                object_queue_reset();
+                goto done;
+            }
+        }
+        for (i = 0; i < count && loaded; i++) {
+            loaded = object_response(type, &batch[i].src_data, &batch[i].src_size) == 0 &&
+                     object_response(type, &batch[i].dst_data, &batch[i].dst_size) == 0;
+        }
+        if (loaded) {
+            parallel_for(count, rename_probe_job, batch);
+        } else {
+            object_queue_reset();
+        }
+        for (i = 0; i < count; i++) {
+            free(batch[i].src_data);
+            free(batch[i].dst_data);
+        }
+        if (!loaded) {
+            goto done;
+        }
+        for (i = 0; i < count; i++) {
+            if (batch[i].score < RENAME_BASENAME_SCORE) {
+                continue;
+            }
+            matches[*match_count].src = batch[i].src;
+            matches[*match_count].dst = batch[i].dst;
+            matches[*match_count].score = batch[i].score;
+            (*match_count)++;
+            uses[batch[i].src]++;
+            dest_done[batch[i].dst] = true;
+        }
+    }
+    result = 0;
+
+done:
+    free(names);
+    free(probes);
+    return result;
+}
+
+/* Like git's diffcore-rename: identical blob ids first (preferring a source
+ * with the same basename), then files that kept a unique basename, then
+ * content sketches, where every destination keeps its best few sources and
+ * the candidates are assigned best score first. The sketch pass is skipped
+ * when sources x destinations exceeds CG_RENAME_LIMIT squared. With
+ * allow_copies the last destination of a source by path is the rename and
+ * the others are copies. */
+static int detect_renames(const char *repo_root, const RenameFile *sources, size_t source_count,
+                          const RenameFile *dests, size_t dest_count, bool allow_copies, RenameMatch **out_matches,
+                          size_t *out_count) {
+    size_t table_size = 16;
+    size_t *table = NULL;
+    size_t *chain = NULL;
+    size_t *uses = NULL;
+    bool *dest_done = NULL;
+    RenameMatch *matches = NULL;
+    size_t match_count = 0;
+    RenameScan scan;
+    size_t limit = rename_limit();
+    size_t i;
+    int pass;
+    TraceRegion phase;
+    int result = -1;
+
+    memset(&scan, 0, sizeof(scan));
+    *out_matches = NULL;
+    *out_count = 0;
+    if (source_count == 0 || dest_count == 0) {
+        return 0;
+    }
+    trace_region_enter(&phase, "rename_detect");
+
+    while (table_size < source_count * 2) {
+        table_size *= 2;
+    }
+    table = malloc(table_size * sizeof(size_t));
+    chain = malloc(source_count * sizeof(size_t));
+    uses = calloc(source_count, sizeof(size_t));
+    dest_done = calloc(dest_count, sizeof(bool));
+    matches = malloc(dest_count * sizeof(RenameMatch));
+    scan.open_sources = malloc(source_count * sizeof(size_t));
+    scan.open_dests = malloc(dest_count * sizeof(size_t));
+    if (table == NULL || chain == NULL || uses == NULL || dest_done == NULL || matches == NULL ||
+        scan.open_sources == NULL || scan.open_dests == NULL) {
+        goto done;
+    }
+
+    /* Exact pass: buckets hold source indexes chained through chain[]. */
+    for (i = 0; i < table_size; i++) {
+        table[i] = SIZE_MAX;
+    }
+    for (i = source_count; i-- > 0;) {
+        size_t bucket = oid_bucket(&sources[i].oid) & (table_size - 1);
+        chain[i] = table[bucket];
+        table[bucket] = i;
+    }
+    for (i = 0; i < dest_count; i++) {
+        const char *base = path_basename(dests[i].path);
+        size_t bucket = oid_bucket(&dests[i].oid) & (table_size - 1);
+        size_t pick = SIZE_MAX;
+        size_t s;
+
+        for (s = table[bucket]; s != SIZE_MAX; s = chain[s]) {
+            if (!oid_equal(&sources[s].oid, &dests[i].oid) || (uses[s] > 0 && !allow_copies)) {
+                continue;
+            }
+            if (pick == SIZE_MAX || (strcmp(path_basename(sources[s].path), base) == 0 &&
+                                     strcmp(path_basename(sources[pick].path), base) != 0)) {
+                pick = s;
+            }
+        }
+        if (pick != SIZE_MAX) {
+            matches[match_count].src = pick;
+            matches[match_count].dst = i;
+            matches[match_count].score = DIFF_MAX_SCORE;
+            match_count++;
+            uses[pick]++;
+            dest_done[i] = true;
+        }
+    }
+
+    /* Inexact passes over whatever the exact pass left open; copies need
+     * every source, so they skip the basename shortcut. */
+    scan.sources = sources;
+    scan.dests = dests;
+    for (pass = allow_copies ? 1 : 0; pass < 2; pass++) {
+        scan.open_source_count = 0;
+        scan.open_dest_count = 0;
+        for (i = 0; i < source_count; i++) {
+            if (uses[i] == 0 || allow_copies) {
+                scan.open_sources[scan.open_source_count++] = i;
+            }
+        }
+        for (i = 0; i < dest_count; i++) {
+            if (!dest_done[i]) {
+                scan.open_dests[scan.open_dest_count++] = i;
+            }
+        }
+        if (pass == 0 && scan.open_source_count > 0 && scan.open_dest_count > 0 &&
+            rename_basename_pass(repo_root, &scan, uses, dest_done, matches, &match_count) != 0) {
+            goto done;
+        }
+    }
+    if (scan.open_source_count > 0 && scan.open_dest_count > 0) {
+        if (scan.open_source_count * scan.open_dest_count > limit * limit) {
+            fprintf(stderr,
+                    "cg: warning: inexact rename detection was skipped due to too many files "
+                    "(set CG_RENAME_LIMIT to at least %zu)\n",
+                    scan.open_source_count > scan.open_dest_count ? scan.open_source_count : scan.open_dest_count);
+        } else if (rename_inexact(repo_root, &scan, uses, dest_done, allow_copies, matches, &match_count) != 0) {
+            goto done;
+        }
+    }
+
+    /* Sorted by destination, the last use of a source that goes away is
+     * the rename and every earlier one a copy. */
+    qsort(matches, match_count, sizeof(RenameMatch), rename_match_dst_cmp);
+    for (i = match_count; i-- > 0;) {
+        RenameMatch *match = &matches[i];
+        match->copy = sources[match->src].keep || uses[match->src] == 0;
+        uses[match->src] = 0;
+    }
+    *out_matches = matches;
+    *out_count = match_count;
+    matches = NULL;
+    result = 0;
+
+done:
+    trace_region_leave(&phase);
+    free(table);
+    free(chain);
+    free(uses);
+    free(dest_done);
+    free(matches);
+    free(scan.open_sources);
+    free(scan.open_dests);
+    return result;
+}
+
+static void print_usage(void) {
+    puts("CG - C Git");
+    puts("Usage:");
+    puts("  cg init [directory]");
+    puts("  cg status [--porcelain=v2] [-z]");
+    puts("  cg add <path> [path...]");
+    puts("  cg commit [-a] -m <message>");
+    puts("  cg diff [-M | -C | --no-renames] [--cached | <commit> <commit>]");
+    puts("  cg log");
+    puts("  cg branch [--list [pattern]]");
+    puts("  cg branch <name> [start]");
+    puts("  cg branch (-d | -D) <name>");
+    puts("  cg pack-refs [--all]");
+    puts("  cg fsck [--no-dangling]");
+    puts("  cg gc [--prune[=<date>] | --no-prune] [--write-bitmap-index]");
+    puts("  cg count-objects --reachable <rev>");
+    puts("  cg clone [--local] [--shared] [--no-hardlinks] <source> [directory]");
+    puts("  cg checkout <branch|commit>");
+    puts("  cg batch [-z]");
+    puts("  cg --help");
+    puts("  cg --version");
+}
+
+/* Lays out an empty repository in target/.git, which must not exist yet;
+ * errors are reported as coming from cmd. */
+static int init_repository(const char *cmd, const char *target, char *git_dir, size_t git_dir_size) {
+    char path_buf[PATH_MAX];
+    const char *repo_dirs[] = {"objects", "refs", "refs/heads", "refs/tags"};
+    size_t i;
+
+    if (ensure_dir(target) != 0) {
+        fprintf(stderr, "cg %s: cannot create/open directory '%s': %s\n", cmd, target, strerror(errno));
+        return -1;
+    }
+
+    if (path_join(target, ".git", git_dir, git_dir_size) != 0) {
+        fprintf(stderr, "cg %s: path too long\n", cmd);
+        return -1;
+    }
+
+    if (access(git_dir, F_OK) == 0) {
+        fprintf(stderr, "cg %s: repository already exists at '%s'\n", cmd, git_dir);
+        return -1;
+    }
+
+    if (ensure_dir(git_dir) != 0) {
+        fprintf(stderr, "cg %s: cannot create '%s': %s\n", cmd, git_dir, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(repo_dirs) / sizeof(repo_dirs[0]); i++) {
+        if (path_join(git_dir, repo_dirs[i], path_buf, sizeof(path_buf)) != 0) {
+            fprintf(stderr, "cg %s: path too long\n", cmd);
+            return -1;
+        }
+        if (ensure_dir(path_buf) != 0) {
+            fprintf(stderr, "cg %s: cannot create '%s': %s\n", cmd, path_buf, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (path_join(git_dir, "HEAD", path_buf, sizeof(path_buf)) != 0 ||
+        write_text_file(path_buf, "ref: refs/heads/main\n") != 0) {
+        fprintf(stderr, "cg %s: cannot write HEAD\n", cmd);
+        return -1;
+    }
+
+    if (path_join(git_dir, "config", path_buf, sizeof(path_buf)) != 0 ||
+        write_text_file(path_buf,
+                        "[core]\n"
+                        "\trepositoryformatversion = 0\n"
+                        "\tfilemode = true\n"
+                        "\tbare = false\n"
+                        "\tlogallrefupdates = true\n") != 0) {
+        fprintf(stderr, "cg %s: cannot write config\n", cmd);
+        return -1;
+    }
+
+    if (path_join(git_dir, "description", path_buf, sizeof(path_buf)) != 0 ||
+        write_text_file(path_buf, "Unnamed repository; edit this file to name it.\n") != 0) {
+        fprintf(stderr, "cg %s: cannot write description\n", cmd);
+        return -1;
+    }
+
+    if (path_join(git_dir, "cg-index", path_buf, sizeof(path_buf)) != 0 ||
+        write_text_file(path_buf, "") != 0) {
+        fprintf(stderr, "cg %s: cannot create cg-index\n", cmd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cmd_init(int argc, char **argv) {
+    const char *target = ".";
+    char git_dir[PATH_MAX];
+    char resolved[PATH_MAX];
+
+    if (argc > 1) {
+        fprintf(stderr, "cg init: too many arguments\n");
+        return 1;
+    }
+
+    if (argc == 1) {
+        target = argv[0];
+    }
+
+    if (init_repository("init", target, git_dir, sizeof(git_dir)) != 0) {
+        return 1;
+    }
+
+    if (realpath(git_dir, resolved) != NULL) {
+        printf("Initialized empty CG repository in %s\n", resolved);
+    } else {
+        printf("Initialized empty CG repository in %s\n", git_dir);
+    }
+
+    return 0;
+}
+
+typedef struct {
+    PathList staged_new;
+    PathList staged_modified;
+    PathList staged_renamed;
+    PathList staged_deleted;
+    PathList unstaged_modified;
+    PathList unstaged_deleted;
+    PathList untracked;
+} StatusLists;
+
+static void status_lists_init(StatusLists *lists) {
+    path_list_init(&lists->staged_new);
+    path_list_init(&lists->staged_modified);
+    path_list_init(&lists->staged_renamed);
+    path_list_init(&lists->staged_deleted);
+    path_list_init(&lists->unstaged_modified);
+    path_list_init(&lists->unstaged_deleted);
+    path_list_init(&lists->untracked);
+}
+
+static void status_lists_free(StatusLists *lists) {
+    path_list_free(&lists->staged_new);
+    path_list_free(&lists->staged_modified);
+    path_list_free(&lists->staged_renamed);
+    path_list_free(&lists->staged_deleted);
+    path_list_free(&lists->unstaged_modified);
+    path_list_free(&lists->unstaged_deleted);
+    path_list_free(&lists->untracked);
+}
+
+/* One path reported by cg status. x and y are the index and worktree
+ * states as in porcelain v2 ('.', 'A', 'M', 'D', 'R'; both '?' for an
+ * untracked path). head and index are the entries compared, work_mode is
+ * the file's mode (0 once it is gone), and orig and score describe a
+ * rename. */
+typedef struct {
+    char x;
+    char y;
+    const char *path;
+    const IndexEntry *head;
+    const IndexEntry *index;
+    uint32_t work_mode;
+    const char *orig;
+    int score;
+} StatusRecord;
+
+/* A nonzero return stops status_walk, which then returns that value. */
+typedef int (*StatusRecordFn)(void *ctx, const StatusRecord *record);
+
+#define STATUS_HASH_CHUNK 1024
+
+static int index_entry_ptr_cmp(const void *left, const void *right) {
+    const IndexEntry *const *a = left;
+    const IndexEntry *const *b = right;
+    return strcmp((*a)->path, (*b)->path);
+}
+
+static const IndexEntry **index_sorted_by_path(const IndexList *list) {
+    const IndexEntry **sorted = malloc((list->len > 0 ? list->len : 1) * sizeof(*sorted));
+    size_t i;
+
+    if (sorted == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < list->len; i++) {
+        sorted[i] = &list->items[i];
+    }
+    qsort(sorted, list->len, sizeof(*sorted), index_entry_ptr_cmp);
+    return sorted;
+}
+
+static const IndexEntry *index_sorted_find(const IndexEntry **sorted, size_t len, const char *path) {
+    size_t low = 0;
+    size_t high = len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(sorted[mid]->path, path);
+        if (cmp == 0) {
+            return sorted[mid];
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+/* Whether any entry's path starts with the len bytes of prefix. */
+static bool index_sorted_has_prefix(const IndexEntry **sorted, size_t len, const char *prefix, size_t prefix_len) {
+    size_t low = 0;
+    size_t high = len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(sorted[mid]->path, prefix, prefix_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < len && strncmp(sorted[low]->path, prefix, prefix_len) == 0;
+}
+
+typedef struct {
+    const IndexEntry **staged;
+    size_t staged_len;
+    const IndexEntry **head;
+    size_t head_len;
+    PathList found;
+} UntrackedScan;
+
+static int status_untracked(void *ctx, const char *relpath) {
+    UntrackedScan *scan = ctx;
+
+    if (index_sorted_find(scan->staged, scan->staged_len, relpath) != NULL ||
+        index_sorted_find(scan->head, scan->head_len, relpath) != NULL) {
+        return 0;
+    }
+    return path_list_append(&scan->found, relpath);
+}
+
+/* Length of "dir/" for the outermost directory of path that holds no
+ * tracked file, which git reports in place of the files below it; 0 when
+ * the file is reported itself. */
+static size_t untracked_dir_len(const UntrackedScan *scan, const char *path) {
+    const char *slash;
+
+    for (slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        size_t len = (size_t)(slash - path) + 1;
+        if (!index_sorted_has_prefix(scan->staged, scan->staged_len, path, len) &&
+            !index_sorted_has_prefix(scan->head, scan->head_len, path, len)) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+/* Pairs staged deletions with staged additions. rename_of[i] is the match
+ * for staged[i] or -1, head_renamed marks the sources, and each match's src
+ * is rewritten to the source's position in head. */
+static int status_renames(const char *repo_root, const IndexEntry **staged, size_t staged_len,
+                             const IndexEntry **head, size_t head_len, RenameMatch **matches, size_t *match_count,
+                             ssize_t *rename_of, bool *head_renamed) {
+    RenameFile *sources = malloc((head_len > 0 ? head_len : 1) * sizeof(RenameFile));
+    RenameFile *dests = malloc((staged_len > 0 ? staged_len : 1) * sizeof(RenameFile));
+    size_t *source_pos = malloc((head_len > 0 ? head_len : 1) * sizeof(size_t));
+    size_t *dest_pos = malloc((staged_len > 0 ? staged_len : 1) * sizeof(size_t));
+    size_t source_count = 0;
+    size_t dest_count = 0;
+    size_t i;
+    int result = -1;
+
+    *matches = NULL;
+    *match_count = 0;
+    if (sources == NULL || dests == NULL || source_pos == NULL || dest_pos == NULL) {
+        goto done;
+    }
+    for (i = 0; i < head_len; i++) {
+        if (index_sorted_find(staged, staged_len, head[i]->path) == NULL) {
+            sources[source_count].path = head[i]->path;
+            sources[source_count].oid = head[i]->oid;
+            sources[source_count].keep = false;
+            source_pos[source_count++] = i;
+        }
+    }
+    for (i = 0; i < staged_len; i++) {
+        if (index_sorted_find(head, head_len, staged[i]->path) == NULL) {
+            dests[dest_count].path = staged[i]->path;
+            dests[dest_count].oid = staged[i]->oid;
+            dests[dest_count].keep = false;
+            dest_pos[dest_count++] = i;
+        }
+    }
+    if (source_count > 0 && dest_count > 0 &&
+        detect_renames(repo_root, sources, source_count, dests, dest_count, false, matches, match_count) != 0) {
+        goto done;
+    }
+    for (i = 0; i < *match_count; i++) {
+        size_t src = (*matches)[i].src;
+
+        rename_of[dest_pos[(*matches)[i].dst]] = (ssize_t)i;
+        head_renamed[source_pos[src]] = true;
+        (*matches)[i].src = source_pos[src];
+    }
+    result = 0;
+
+done:
+    free(sources);
+    free(dests);
+    free(source_pos);
+    free(dest_pos);
+    return result;
+}
+
+/* The one classifier behind every form of cg status: tracked paths are
+ * compared by merging the index and HEAD in path order, those the preload
+ * found dirty hashed a chunk at a time, so fn sees records while the scan
+ * still runs. Untracked files follow in path order once the walk is done,
+ * a directory without tracked files as a single "dir/" record, as in git.
+ * Other failures are reported as coming from cg status and return -1. */
+static int status_walk(const char *repo_root, const IndexList *staged_list, StatusRecordFn fn, void *ctx) {
+    IndexList head_list;
+    const IndexEntry **staged = NULL;
+    const IndexEntry **head = NULL;
+    RenameMatch *matches = NULL;
+    size_t match_count = 0;
+    ssize_t *rename_of = NULL;
+    bool *head_renamed = NULL;
+    bool *dirty = NULL;
+    const char *chunk_paths[STATUS_HASH_CHUNK];
+    ObjectId chunk_oids[STATUS_HASH_CHUNK];
+    bool chunk_missing[STATUS_HASH_CHUNK];
+    uint32_t chunk_modes[STATUS_HASH_CHUNK];
+    size_t chunk_next = 0;
+    size_t chunk_end = 0;
+    UntrackedScan scan;
+    char git_dir[PATH_MAX];
+    TraceRegion phase;
+    bool has_head = false;
+    size_t i = 0;
+    size_t j = 0;
+    int result = -1;
+
+    path_list_init(&scan.found);
+    index_list_init(&head_list);
+    if (load_head_tree(repo_root, &head_list, &has_head) != 0) {
+        fprintf(stderr, "cg status: cannot read repository state\n");
+        goto done;
+    }
+    staged = index_sorted_by_path(staged_list);
+    head = index_sorted_by_path(&head_list);
+    rename_of = malloc((staged_list->len > 0 ? staged_list->len : 1) * sizeof(ssize_t));
+    head_renamed = calloc(head_list.len > 0 ? head_list.len : 1, sizeof(bool));
+    dirty = malloc((staged_list->len > 0 ? staged_list->len : 1) * sizeof(bool));
+    if (staged == NULL || head == NULL || rename_of == NULL || head_renamed == NULL || dirty == NULL) {
+        fprintf(stderr, "cg status: out of memory\n");
+        goto done;
+    }
+    for (i = 0; i < staged_list->len; i++) {
+        rename_of[i] = -1;
+    }
+    if (status_renames(repo_root, staged, staged_list->len, head, head_list.len, &matches, &match_count, rename_of,
+                       head_renamed) != 0) {
+        fprintf(stderr, "cg status: cannot detect renames\n");
+        goto done;
+    }
+
+    trace_region_enter(&phase, "preload");
+    preload_index(repo_root, staged_list, dirty);
+    trace_region_leave(&phase);
+
+    trace_region_enter(&phase, "classify");
+    i = 0;
+    while (i < staged_list->len || j < head_list.len) {
+        int cmp = i >= staged_list->len ? 1 : j >= head_list.len ? -1 : strcmp(staged[i]->path, head[j]->path);
+        StatusRecord record;
+
+        memset(&record, 0, sizeof(record));
+        if (cmp > 0) {
+            if (!head_renamed[j]) {
+                record.x = 'D';
+                record.y = '.';
+                record.path = head[j]->path;
+                record.head = head[j];
+                result = fn(ctx, &record);
+                if (result != 0) {
+                    goto done;
+                }
+            }
+            j++;
+            continue;
+        }
+        if (i == chunk_end) {
+            size_t chunk_len = 0;
+            size_t failed;
+
+            for (chunk_end = i; chunk_end < staged_list->len && chunk_len < STATUS_HASH_CHUNK; chunk_end++) {
+                if (dirty[staged[chunk_end] - staged_list->items]) {
+                    chunk_paths[chunk_len++] = staged[chunk_end]->path;
+                }
+            }
+            if (hash_worktree_files(repo_root, chunk_paths, chunk_len, false, chunk_oids, chunk_missing, NULL,
+                                    chunk_modes, &failed) != 0) {
+                fprintf(stderr, "cg status: cannot hash working tree\n");
+                result = -1;
+                goto done;
+            }
+            chunk_next = 0;
+        }
+        record.path = staged[i]->path;
+        record.index = staged[i];
+        if (cmp == 0) {
+            record.head = head[j++];
+            record.x = oid_equal(&record.head->oid, &staged[i]->oid) && record.head->mode == staged[i]->mode ? '.'
+                                                                                                               : 'M';
+        } else if (rename_of[i] >= 0) {
+            const RenameMatch *match = &matches[rename_of[i]];
+            record.head = head[match->src];
+            record.orig = record.head->path;
+            record.score = match->score;
+            record.x = 'R';
+        } else {
+            record.x = 'A';
+        }
+        if (dirty[staged[i] - staged_list->items]) {
+            record.work_mode = chunk_missing[chunk_next] ? 0 : chunk_modes[chunk_next];
+            record.y = record.work_mode == 0 ? 'D'
+                       : oid_equal(&chunk_oids[chunk_next], &staged[i]->oid) && record.work_mode == staged[i]->mode
+                           ? '.'
+                           : 'M';
+            chunk_next++;
+        } else {
+            record.work_mode = staged[i]->mode;
+            record.y = '.';
+        }
+        if (record.x != '.' || record.y != '.') {
+            result = fn(ctx, &record);
+            if (result != 0) {
+                goto done;
+            }
+        }
+        i++;
+    }
+    trace_region_leave(&phase);
+
+    trace_region_enter(&phase, "worktree_scan");
+    scan.staged = staged;
+    scan.staged_len = staged_list->len;
+    scan.head = head;
+    scan.head_len = head_list.len;
+    if (build_git_path(repo_root, "", git_dir, sizeof(git_dir)) != 0 ||
+        walk_dir_files(repo_root, git_dir, repo_root, status_untracked, &scan) != 0) {
+        fprintf(stderr, "cg status: cannot scan working tree\n");
+        result = -1;
+        goto done;
+    }
+    trace_region_leave(&phase);
+
+    path_list_sort_unique(&scan.found);
+    for (i = 0; i < scan.found.len; i++) {
+        const char *path = scan.found.items[i];
+        size_t dir_len = untracked_dir_len(&scan, path);
+        char dir[PATH_MAX];
+        StatusRecord record;
+
+        memset(&record, 0, sizeof(record));
+        record.x = '?';
+        record.y = '?';
+        record.path = path;
+        if (dir_len > 0) {
+            memcpy(dir, path, dir_len);
+            dir[dir_len] = '\0';
+            record.path = dir;
+            while (i + 1 < scan.found.len && strncmp(scan.found.items[i + 1], dir, dir_len) == 0) {
+                i++;
+            }
+        }
+        result = fn(ctx, &record);
+        if (result != 0) {
+            goto done;
+        }
+    }
+    result = 0;
+
+done:
+    path_list_free(&scan.found);
+    index_list_free(&head_list);
+    free(staged);
+    free(head);
+    free(matches);
+    free(rename_of);
+    free(head_renamed);
+    free(dirty);
+    return result;
+}
+
+static int status_list_record(void *ctx, const StatusRecord *record) {
+    StatusLists *lists = ctx;
+    char renamed[PATH_MAX * 2 + 8];
+    int status = 0;
+
+    switch (record->x) {
+    case '?':
+        status = path_list_append(&lists->untracked, record->path);
+        break;
+    case 'A':
+        status = path_list_append(&lists->staged_new, record->path);
+        break;
+    case 'M':
+        status = path_list_append(&lists->staged_modified, record->path);
+        break;
+    case 'D':
+        status = path_list_append(&lists->staged_deleted, record->path);
+        break;
+    case 'R':
+        snprintf(renamed, sizeof(renamed), "%s -> %s", record->orig, record->path);
+        status = path_list_append(&lists->staged_renamed, renamed);
+        break;
+    default:
+        break;
+    }
+    if (status == 0 && record->y == 'M') {
+        status = path_list_append(&lists->unstaged_modified, record->path);
+    } else if (status == 0 && record->y == 'D') {
+        status = path_list_append(&lists->unstaged_deleted, record->path);
+    }
+    if (status != 0) {
+        fprintf(stderr, "cg status: out of memory\n");
+    }
+    return status;
+}
+
+#define STATUS_WRITE_BUFFER (256 * 1024)
+
+/* Output of cg status --porcelain=v2. Records collect in one large buffer
+ * that goes to stdout each time it fills, so a consumer sees results while
+ * the scan still runs without paying a write per record. */
+typedef struct {
+    char *data;
+    size_t len;
+    char term;
+    bool failed;
+} RecordWriter;
+
+static void record_flush(RecordWriter *out) {
+    if (out->len > 0 && !out->failed &&
+        (fwrite(out->data, 1, out->len, stdout) != out->len || fflush(stdout) != 0)) {
+        out->failed = true;
+    }
+    out->len = 0;
+}
+
+static void record_put(RecordWriter *out, const char *text, size_t len) {
+    if (out->len + len > STATUS_WRITE_BUFFER) {
+        record_flush(out);
+    }
+    if (len > STATUS_WRITE_BUFFER) {
+        if (!out->failed && fwrite(text, 1, len, stdout) != len) {
+            out->failed = true;
+        }
+        return;
+    }
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+}
+
+/* Writes a "1" (ordinary) or, with orig set, a "2" (rename) record. Missing
+ * sides get mode 000000 and the null id, as in git. */
+static void porcelain_entry(RecordWriter *out, char x, char y, const char *path, const IndexEntry *head,
+                            const IndexEntry *index, uint32_t work_mode, const char *orig, int score) {
+    static const ObjectId null_oid;
+    char head_hex[41];
+    char index_hex[41];
+    char line[PATH_MAX * 2 + 160];
+    int n;
+
+    oid_to_hex(head != NULL ? &head->oid : &null_oid, head_hex);
+    oid_to_hex(index != NULL ? &index->oid : &null_oid, index_hex);
+    if (orig == NULL) {
+        n = snprintf(line, sizeof(line), "1 %c%c N... %06o %06o %06o %s %s %s", x, y,
+                     head != NULL ? (unsigned int)head->mode : 0, index != NULL ? (unsigned int)index->mode : 0,
+                     (unsigned int)work_mode, head_hex, index_hex, path);
+    } else {
+        /* -z separates the two paths with NUL, line output with a tab. */
+        n = snprintf(line, sizeof(line), "2 %c%c N... %06o %06o %06o %s %s R%d %s%c%s", x, y,
+                     (unsigned int)head->mode, (unsigned int)index->mode, (unsigned int)work_mode, head_hex,
+                     index_hex, score * 100 / DIFF_MAX_SCORE, path, out->term == '\0' ? '\0' : '\t', orig);
+    }
+    if (n < 0 || (size_t)n >= sizeof(line) - 1) {
+        out->failed = true;
+        return;
+    }
+    line[n] = out->term;
+    record_put(out, line, (size_t)n + 1);
+}
+
+static int porcelain_record(void *ctx, const StatusRecord *record) {
+    RecordWriter *out = ctx;
+
+    if (record->x == '?') {
+        record_put(out, "? ", 2);
+        record_put(out, record->path, strlen(record->path));
+        record_put(out, &out->term, 1);
+    } else {
+        porcelain_entry(out, record->x, record->y, record->path, record->head, record->index, record->work_mode,
+                        record->orig, record->score);
+    }
+    return out->failed ? -1 : 0;
+}
+
+static int status_porcelain(const char *repo_root, const IndexList *staged, char term) {
+    RecordWriter out = {NULL, 0, term, false};
+    int result = -1;
+
+    out.data = malloc(STATUS_WRITE_BUFFER);
+    if (out.data == NULL) {
+        fprintf(stderr, "cg status: out of memory\n");
+        return -1;
+    }
+    if (status_walk(repo_root, staged, porcelain_record, &out) == 0) {
+        record_flush(&out);
+        result = out.failed ? -1 : 0;
+    }
+    if (out.failed) {
+        fprintf(stderr, "cg status: cannot write output\n");
+    }
+    free(out.data);
+    return result;
+}
+static int cmd_status(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    char branch[128];
+    IndexList staged;
+    StatusLists lists;
+    TraceRegion phase;
+    bool porcelain = false;
+    char term = '\n';
+    size_t j;
+    int i;
+    int result = 1;
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--porcelain=v2") == 0) {
+            porcelain = true;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            porcelain = true;
+            term = '\0';
+        } else {
+            fprintf(stderr, "cg status: usage: cg status [--porcelain=v2] [-z]\n");
+            return 1;
+        }
+    }
+
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg status: not inside a CG repository\n");
+        return 1;
+    }
+
+    if (porcelain) {
+        index_list_init(&staged);
+        if (load_cg_index(repo_root, &staged) != 0) {
+            fprintf(stderr, "cg status: cannot read repository state\n");
+        } else if (status_porcelain(repo_root, &staged, term) == 0) {
+            result = 0;
+        }
+        index_list_free(&staged);
+        return result;
+    }
+
+    if (get_current_branch(repo_root, branch, sizeof(branch)) != 0) {
+        fprintf(stderr, "cg status: cannot determine current branch\n");
+        return 1;
+    }
+
+    index_list_init(&staged);
+    status_lists_init(&lists);
+    if (load_cg_index(repo_root, &staged) != 0) {
+        fprintf(stderr, "cg status: cannot read repository state\n");
+        goto done;
+    }
+    if (status_walk(repo_root, &staged, status_list_record, &lists) != 0) {
+        goto done;
+    }
+
+    trace_region_enter(&phase, "output");
+    printf("On branch %s\n\n", branch);
+
+    if (lists.staged_new.len + lists.staged_modified.len + lists.staged_renamed.len + lists.staged_deleted.len > 0) {
+        puts("Changes to be committed:");
+        for (j = 0; j < lists.staged_new.len; j++) {
+            printf("  new file:   %s\n", lists.staged_new.items[j]);
+        }
+        for (j = 0; j < lists.staged_modified.len; j++) {
+            printf("  modified:   %s\n", lists.staged_modified.items[j]);
+        }
+        for (j = 0; j < lists.staged_renamed.len; j++) {
+            printf("  renamed:    %s\n", lists.staged_renamed.items[j]);
+        }
+        for (j = 0; j < lists.staged_deleted.len; j++) {
+            printf("  deleted:    %s\n", lists.staged_deleted.items[j]);
+        }
+        puts("");
+    }
+
+    if (lists.unstaged_modified.len + lists.unstaged_deleted.len > 0) {
+        puts("Changes not staged for commit:");
+        for (j = 0; j < lists.unstaged_modified.len; j++) {
+            printf("  modified:   %s\n", lists.unstaged_modified.items[j]);
+        }
+        for (j = 0; j < lists.unstaged_deleted.len; j++) {
+            printf("  deleted:    %s\n", lists.unstaged_deleted.items[j]);
+        }
+        puts("");
+    }
+
+    if (lists.untracked.len > 0) {
+        puts("Untracked files:");
+        for (j = 0; j < lists.untracked.len; j++) {
+            printf("  %s\n", lists.untracked.items[j]);
+        }
+        puts("");
+    }
+
+    if (lists.staged_new.len + lists.staged_modified.len + lists.staged_renamed.len + lists.staged_deleted.len +
+            lists.unstaged_modified.len + lists.unstaged_deleted.len + lists.untracked.len ==
+        0) {
+        puts("nothing to commit, working tree clean");
+    }
+    trace_region_leave(&phase);
+    result = 0;
+
+done:
+    index_list_free(&staged);
+    status_lists_free(&lists);
+    return result;
+}
+
+/* Drops index entries below one of dirs whose file no longer exists, the
+ * way `git add <dir>` records deletions, and lists them in removed. */
+static int remove_missing_entries(const char *repo_root, IndexList *staged, const PathList *dirs, PathList *removed) {
+    size_t kept = 0;
+    size_t i;
+
+    for (i = 0; i < staged->len; i++) {
+        const char *path = staged->items[i].path;
+        char absolute[PATH_MAX];
+        struct stat st;
+        bool covered = false;
+        size_t d;
+
+        for (d = 0; d < dirs->len && !covered; d++) {
+            size_t len = strlen(dirs->items[d]);
+            covered = len == 0 || (strncmp(path, dirs->items[d], len) == 0 && path[len] == '/');
+        }
+        if (covered) {
+            if (path_join(repo_root, path, absolute, sizeof(absolute)) != 0) {
+                return -1;
+            }
+            TRACE_COUNT(files_stated, 1);
+            covered = lstat(absolute, &st) != 0 && errno == ENOENT;
+        }
+        if (!covered) {
+            staged->items[kept++] = staged->items[i];
+            continue;
+        }
+        cache_tree_invalidate(staged->cache_tree, path);
+        if (path_list_append(removed, path) != 0) {
+            staged->items[kept++] = staged->items[i];
+            for (i++; i < staged->len; i++) {
+                staged->items[kept++] = staged->items[i];
+            }
+            staged->len = kept;
+            return -1;
+        }
+        free(staged->items[i].path);
+    }
+    staged->len = kept;
+    return 0;
+}
+
+/* changes and removed receive what differs from the index as loaded, for
+ * save_cg_index_changes. */
+static int stage_files(const char *repo_root, IndexList *staged, const PathList *files, const PathList *dirs,
+                       IndexList *changes, PathList *removed) {
+    ObjectId *oids = NULL;
+    IndexStat *stats = NULL;
+    uint32_t *modes = NULL;
+    TraceRegion phase;
+    size_t loaded = staged->len;
+    size_t i;
+    int result = -1;
+
+    trace_region_enter(&phase, "hash");
+    if (files->len > 0) {
+        size_t failed;
+        oids = malloc(files->len * sizeof(ObjectId));
+        stats = malloc(files->len * sizeof(IndexStat));
+        modes = malloc(files->len * sizeof(uint32_t));
+        if (oids == NULL || stats == NULL || modes == NULL) {
+            fprintf(stderr, "cg add: out of memory\n");
+            goto done;
+        }
+        if (hash_worktree_files(repo_root, (const char *const *)files->items, files->len, true, oids, NULL, stats,
+                                modes, &failed) != 0) {
+            if (failed < files->len) {
+                fprintf(stderr, "cg add: failed to hash %s\n", files->items[failed]);
+            } else {
+                fprintf(stderr, "cg add: out of memory\n");
+            }
+            goto done;
+        }
+    }
+    for (i = 0; i < files->len; i++) {
+        ssize_t pos = index_list_search(staged, loaded, files->items[i]);
+        if (pos >= 0 && oid_equal(&staged->items[pos].oid, &oids[i]) && staged->items[pos].mode == modes[i]) {
+            /* Same content: only fresher stat data is worth recording. */
+            if (memcmp(&staged->items[pos].stat, &stats[i], sizeof(IndexStat)) == 0 || stats[i].mode == 0) {
+                continue;
+            }
+        } else {
+            cache_tree_invalidate(staged->cache_tree, files->items[i]);
+        }
+        if (pos >= 0) {
+            staged->items[pos].oid = oids[i];
+            staged->items[pos].mode = modes[i];
+        } else if (index_list_append(staged, files->items[i], &oids[i], modes[i]) != 0) {
+            fprintf(stderr, "cg add: out of memory\n");
+            goto done;
+        } else {
+            pos = (ssize_t)staged->len - 1;
+        }
+        staged->items[pos].stat = stats[i];
+        if (index_list_append(changes, files->items[i], &oids[i], modes[i]) != 0) {
+            fprintf(stderr, "cg add: out of memory\n");
+            goto done;
+        }
+        changes->items[changes->len - 1].stat = stats[i];
+    }
+    if (staged->len > loaded) {
+        qsort(staged->items, staged->len, sizeof(IndexEntry), index_cmp_path);
+    }
+    trace_region_leave(&phase);
+
+    if (remove_missing_entries(repo_root, staged, dirs, removed) != 0) {
+        fprintf(stderr, "cg add: cannot stage removals\n");
+        goto done;
+    }
+    result = 0;
+
+done:
+    free(oids);
+    free(stats);
+    free(modes);
+    return result;
+}
+
+static int cmd_add(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    char cwd[PATH_MAX];
+    IndexList staged;
+    IndexList changes;
+    PathList files;
+    PathList dirs;
+    PathList removed;
+    TraceRegion phase;
+    int result = 1;
+
+    if (argc < 1) {
+        fprintf(stderr, "cg add: expected at least one path\n");
+        return 1;
+    }
+
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg add: not inside a CG repository\n");
+        return 1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "cg add: cannot determine current directory\n");
+        return 1;
+    }
+
+    index_list_init(&staged);
+    index_list_init(&changes);
+    path_list_init(&files);
+    path_list_init(&dirs);
+    path_list_init(&removed);
+
+    if (load_cg_index(repo_root, &staged) != 0) {
+        fprintf(stderr, "cg add: cannot read cg-index\n");
+        goto done;
+    }
+
+    trace_region_enter(&phase, "worktree_scan");
+    if (collect_add_inputs(repo_root, cwd, (const char *const *)argv, (size_t)argc, &files, &dirs) != 0) {
+        goto done;
+    }
+    trace_region_leave(&phase);
+
+    if (files.len == 0 && dirs.len == 0) {
+        fprintf(stderr, "cg add: no files matched\n");
+        goto done;
+    }
+
+    if (stage_files(repo_root, &staged, &files, &dirs, &changes, &removed) != 0) {
+        goto done;
+    }
+
+    if (save_cg_index_changes(repo_root, &staged, &changes, &removed) != 0) {
+        fprintf(stderr, "cg add: cannot write cg-index\n");
+        goto done;
+    }
+
+    printf("staged %zu file(s)\n", files.len);
+    result = 0;
+
+done:
+    index_list_free(&staged);
+    index_list_free(&changes);
+    path_list_free(&files);
+    path_list_free(&dirs);
+    path_list_free(&removed);
+    return result;
+}
+
+/* Writes the tree for entries[start, end), which all live below the
+ * directory spelled by the first base_len bytes of their paths. Full-path
+ * order is git's tree order (a directory sorts as "name/"), so each
+ * subdirectory is a contiguous run. A node whose cached entry count still
+ * matches is reused without touching its subtree; rebuilt nodes keep the
+ * children they still have and drop the rest. */
+static int cache_tree_update(const char *repo_root, CacheTree *node, const IndexEntry *entries, size_t start,
+                             size_t end, size_t base_len, ObjectId *out) {
+    CacheTree **old_children = node->children;
+    size_t old_count = node->child_count;
+    char *buffer = NULL;
+    size_t buffer_len = 0;
+    FILE *tree;
+    size_t i = start;
+    size_t k;
+    int result = -1;
+
+    if (node->entry_count >= 0 && (size_t)node->entry_count == end - start) {
+        *out = node->oid;
+        return 0;
+    }
+
+    node->children = NULL;
+    node->child_count = 0;
+    node->child_cap = 0;
+    tree = open_memstream(&buffer, &buffer_len);
+    if (tree == NULL) {
+        goto done;
+    }
+
+    while (i < end) {
+        const char *name = entries[i].path + base_len;
+        const char *slash = strchr(name, '/');
+        size_t name_len;
+        size_t sub_end;
+        CacheTree *child = NULL;
+        ObjectId sub_oid;
+
+        if (slash == NULL) {
+            fprintf(tree, "%o %s", (unsigned int)entries[i].mode, name);
+            fputc('\0', tree);
+            fwrite(entries[i].oid.hash, 1, sizeof(entries[i].oid.hash), tree);
+            i++;
+            continue;
+        }
+
+        name_len = (size_t)(slash - name);
+        for (sub_end = i + 1; sub_end < end; sub_end++) {
+            if (strncmp(entries[sub_end].path + base_len, name, name_len + 1) != 0) {
+                break;
+            }
+        }
+        for (k = 0; k < old_count; k++) {
+            if (old_children[k] != NULL && cache_tree_named(old_children[k], name, name_len)) {
+                child = old_children[k];
+                old_children[k] = NULL;
+                break;
+            }
+        }
+        if (child == NULL) {
+            child = cache_tree_new(name, name_len);
+        }
+        if (child == NULL || cache_tree_attach(node, child) != 0) {
+            cache_tree_free(child);
+            fclose(tree);
+            goto done;
+        }
+        if (cache_tree_update(repo_root, child, entries, i, sub_end, base_len + name_len + 1, &sub_oid) != 0) {
+            fclose(tree);
+            goto done;
+        }
+        fprintf(tree, "40000 %.*s", (int)name_len, name);
+        fputc('\0', tree);
+        fwrite(sub_oid.hash, 1, sizeof(sub_oid.hash), tree);
+        i = sub_end;
+    }
+
+    if (fclose(tree) != 0 || write_object_buffer(repo_root, "tree", buffer, buffer_len, out) != 0) {
+        goto done;
+    }
+    node->oid = *out;
+    node->entry_count = (int)(end - start);
+    result = 0;
+
+done:
+    for (k = 0; k < old_count; k++) {
+        cache_tree_free(old_children[k]);
+    }
+    free(old_children);
+    free(buffer);
+    return result;
+}
+
+static int write_tree_from_index(const char *repo_root, IndexList *staged, ObjectId *out_tree) {
+    qsort(staged->items, staged->len, sizeof(IndexEntry), index_cmp_path);
+    if (staged->cache_tree == NULL) {
+        staged->cache_tree = cache_tree_new("", 0);
+        if (staged->cache_tree == NULL) {
+            return -1;
+        }
+    }
+    return cache_tree_update(repo_root, staged->cache_tree, staged->items, 0, staged->len, 0, out_tree);
+}
+
+static int stage_tracked_changes(const char *repo_root, IndexList *staged) {
+    bool *dirty = NULL;
+    const char **dirty_paths = NULL;
+    size_t *dirty_pos = NULL;
+    ObjectId *oids = NULL;
+    bool *missing = NULL;
+    IndexStat *stats = NULL;
+    uint32_t *modes = NULL;
+    size_t dirty_count;
+    size_t kept;
+    size_t failed;
+    size_t i;
+    size_t k;
+    TraceRegion phase;
+    int result = -1;
+
+    if (staged->len == 0) {
+        return 0;
+    }
+    dirty = malloc(staged->len * sizeof(bool));
+    if (dirty == NULL) {
+        fprintf(stderr, "cg commit: out of memory\n");
+        goto done;
+    }
+    trace_region_enter(&phase, "preload");
+    dirty_count = preload_index(repo_root, staged, dirty);
+    trace_region_leave(&phase);
+    if (dirty_count == 0) {
+        result = 0;
+        goto done;
+    }
+
+    dirty_paths = malloc(dirty_count * sizeof(char *));
+    dirty_pos = malloc(dirty_count * sizeof(size_t));
+    oids = malloc(dirty_count * sizeof(ObjectId));
+    missing = malloc(dirty_count * sizeof(bool));
+    stats = malloc(dirty_count * sizeof(IndexStat));
+    modes = malloc(dirty_count * sizeof(uint32_t));
+    if (dirty_paths == NULL || dirty_pos == NULL || oids == NULL || missing == NULL || stats == NULL ||
+        modes == NULL) {
+        fprintf(stderr, "cg commit: out of memory\n");
+        goto done;
+    }
+    for (i = 0, k = 0; i < staged->len; i++) {
+        if (dirty[i]) {
+            dirty_paths[k] = staged->items[i].path;
+            dirty_pos[k++] = i;
+        }
+    }
+
+    trace_region_enter(&phase, "hash");
+    if (hash_worktree_files(repo_root, dirty_paths, dirty_count, true, oids, missing, stats, modes, &failed) != 0) {
+        if (failed < dirty_count) {
+            fprintf(stderr, "cg commit: failed to hash %s\n", dirty_paths[failed]);
+        } else {
+            fprintf(stderr, "cg commit: out of memory\n");
+        }
+        goto done;
+    }
+    trace_region_leave(&phase);
+
+    for (k = 0; k < dirty_count; k++) {
+        IndexEntry *entry = &staged->items[dirty_pos[k]];
+
+        if (missing[k]) {
+            cache_tree_invalidate(staged->cache_tree, entry->path);
+            free(entry->path);
+            entry->path = NULL;
+            continue;
+        }
+        if (!oid_equal(&entry->oid, &oids[k]) || entry->mode != modes[k]) {
+            cache_tree_invalidate(staged->cache_tree, entry->path);
+            entry->oid = oids[k];
+            entry->mode = modes[k];
+        }
+        entry->stat = stats[k];
+    }
+    kept = 0;
+    for (i = 0; i < staged->len; i++) {
+        if (staged->items[i].path != NULL) {
+            staged->items[kept++] = staged->items[i];
+        }
+    }
+    staged->len = kept;
+    result = 0;
+
+done:
+    free(dirty);
+    free(dirty_paths);
+    free(dirty_pos);
+    free(oids);
+    free(missing);
+    free(stats);
+    free(modes);
+    return result;
+}
+
+static int commit_index(const char *repo_root, IndexList *staged, const char *message, ObjectId *out) {
+    ObjectId tree_oid;
+    ObjectId parent_oid;
+    char tree_hash[41];
+    char parent_hash[41];
+    char commit_hash[41];
+    bool has_parent = false;
+    TraceRegion phase;
+    char *qroot = NULL;
+    char *qmsg = NULL;
+    char *command = NULL;
+    char output[512];
+    int result = -1;
+
+    trace_region_enter(&phase, "write_tree");
+    if (write_tree_from_index(repo_root, staged, &tree_oid) != 0) {
+        fprintf(stderr, "cg commit: cannot write tree\n");
+        goto done;
+    }
+    oid_to_hex(&tree_oid, tree_hash);
+    trace_region_leave(&phase);
+
+    qroot = shell_quote_alloc(repo_root);
+    qmsg = shell_quote_alloc(message);
+    if (qroot == NULL || qmsg == NULL) {
+        fprintf(stderr, "cg commit: out of memory\n");
+        goto done;
+    }
+
+    has_parent = resolve_ref(repo_root, "HEAD", &parent_oid) == 0;
+    if (has_parent) {
+        oid_to_hex(&parent_oid, parent_hash);
+    }
+
+    {
+        size_t needed = strlen("GIT_AUTHOR_NAME='CG' GIT_AUTHOR_EMAIL='cg@local' "
+                               "GIT_COMMITTER_NAME='CG' GIT_COMMITTER_EMAIL='cg@local' "
+                               "git -C  commit-tree   -m  2>/dev/null") +
+                        strlen(qroot) + strlen(tree_hash) + strlen(qmsg) + (has_parent ? strlen(parent_hash) + 4 : 0) + 1;
+        command = malloc(needed);
+        if (command == NULL) {
+            goto done;
+        }
+        if (has_parent) {
+            snprintf(command,
+                     needed,
+                     "GIT_AUTHOR_NAME='CG' GIT_AUTHOR_EMAIL='cg@local' "
+                     "GIT_COMMITTER_NAME='CG' GIT_COMMITTER_EMAIL='cg@local' "
+                     "git -C %s commit-tree %s -p %s -m %s 2>/dev/null",
+                     qroot,
+                     tree_hash,
+                     parent_hash,
+                     qmsg);
+        } else {
+            snprintf(command,
+                     needed,
+                     "GIT_AUTHOR_NAME='CG' GIT_AUTHOR_EMAIL='cg@local' "
+                     "GIT_COMMITTER_NAME='CG' GIT_COMMITTER_EMAIL='cg@local' "
+                     "git -C %s commit-tree %s -m %s 2>/dev/null",
+                     qroot,
+                     tree_hash,
+                     qmsg);
+        }
+        if (run_command_capture(command, output, sizeof(output)) != 0) {
+            fprintf(stderr, "cg commit: cannot create commit object\n");
+            goto done;
+        }
+        strip_newlines(output);
+        if (oid_from_hex(output, out) != 0) {
+            fprintf(stderr, "cg commit: invalid commit hash\n");
+            goto done;
+        }
+        oid_to_hex(out, commit_hash);
+        free(command);
+        command = NULL;
+    }
+
+    {
+        size_t needed = strlen("git -C  update-ref HEAD  2>/dev/null") + strlen(qroot) + strlen(commit_hash) + 1;
+        command = malloc(needed);
+        if (command == NULL) {
+            goto done;
+        }
+        snprintf(command, needed, "git -C %s update-ref HEAD %s 2>/dev/null", qroot, commit_hash);
+        if (run_command_capture(command, output, sizeof(output)) != 0) {
+            fprintf(stderr, "cg commit: cannot update HEAD\n");
+            goto done;
+        }
+        free(command);
+        command = NULL;
+    }
+
+    {
+        size_t needed = strlen("git -C  read-tree HEAD 2>/dev/null") + strlen(qroot) + 1;
+        command = malloc(needed);
+        if (command == NULL) {
+            goto done;
+        }
+        snprintf(command, needed, "git -C %s read-tree HEAD 2>/dev/null", qroot);
+        (void)run_command_capture(command, output, sizeof(output));
+        free(command);
+        command = NULL;
+    }
+
+    /* The new HEAD tree was built from exactly these entries, so saving them
+     * keeps the index in sync and persists the refreshed cache-tree. */
+    if (save_cg_index(repo_root, staged) != 0) {
+        fprintf(stderr, "cg commit: warning: failed to sync cg-index with HEAD\n");
+    }
+
+    result = 0;
+
+done:
+    free(command);
+    free(qroot);
+    free(qmsg);
+    return result;
+}
+
+static int cmd_commit(int argc, char **argv) {
+    const char *message = NULL;
+    int i;
+    char repo_root[PATH_MAX];
+    IndexList staged;
+    ObjectId commit_oid;
+    char commit_hash[41];
+    char branch[128];
+    bool all = false;
+    int result = 1;
+
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg commit: not inside a CG repository\n");
+        return 1;
+    }
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            message = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--all") == 0) {
+            all = true;
+        } else {
+            fprintf(stderr, "cg commit: usage: cg commit [-a] -m <message>\n");
+            return 1;
+        }
+    }
+
+    if (message == NULL || message[0] == '\0') {
+        fprintf(stderr, "cg commit: commit message is required\n");
+        return 1;
+    }
+
+    index_list_init(&staged);
+    if (load_cg_index(repo_root, &staged) != 0) {
+        fprintf(stderr, "cg commit: cannot read cg-index\n");
+        goto done;
+    }
+    if (all && stage_tracked_changes(repo_root, &staged) != 0) {
+        goto done;
+    }
+    if (staged.len == 0) {
+        fprintf(stderr, "cg commit: nothing staged\n");
+        goto done;
+    }
+
+    if (commit_index(repo_root, &staged, message, &commit_oid) != 0) {
+        goto done;
+    }
+    oid_to_hex(&commit_oid, commit_hash);
+
+    if (get_current_branch(repo_root, branch, sizeof(branch)) != 0) {
+        snprintf(branch, sizeof(branch), "detached");
+    }
+
+    printf("[%s %.7s] %s\n", branch, commit_hash, message);
+    result = 0;
+
+done:
+    index_list_free(&staged);
+    return result;
+}
+
+/* One file-level change for `cg diff`. Content is loaded batch by batch and
+ * the rendered text is kept per pair so workers can run in any order while
+ * output stays in path order. */
+typedef struct {
+    char *path;
+    char *old_path; /* set for renames and copies */
+    int score;
+    bool copy;
+    bool has_old;
+    bool has_new;
+    bool new_in_worktree;
+    unsigned int old_mode;
+    unsigned int new_mode;
+    ObjectId old_oid;
+    ObjectId new_oid;
+    unsigned char *old_data;
+    size_t old_size;
+    unsigned char *new_data;
+    size_t new_size;
+    char *output;
+    size_t output_len;
+    bool failed;
+} DiffPair;
+
+typedef struct {
+    DiffPair *items;
+    size_t len;
+    size_t cap;
+} DiffPairList;
+
+#define DIFF_BATCH_FILES 128
+#define DIFF_MODE_FILE 0100644u
+#define DIFF_MODE_TREE 040000u
+#define DIFF_MODE_GITLINK 0160000u
+
+static void diff_pair_list_free(DiffPairList *list) {
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        free(list->items[i].path);
+        free(list->items[i].old_path);
+        free(list->items[i].old_data);
+        free(list->items[i].new_data);
+        free(list->items[i].output);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
+
+static DiffPair *diff_pair_add(DiffPairList *list, const char *path) {
+    DiffPair *pair;
+
+    if (list->len == list->cap) {
+        size_t new_cap = list->cap == 0 ? 16 : list->cap * 2;
+        DiffPair *items;
+        TRACE_COUNT(allocations, 1);
+        items = realloc(list->items, new_cap * sizeof(DiffPair));
+        if (items == NULL) {
+            return NULL;
+        }
+        list->items = items;
+        list->cap = new_cap;
+    }
+    pair = &list->items[list->len];
+    memset(pair, 0, sizeof(*pair));
+    pair->path = dup_string(path);
+    if (pair->path == NULL) {
+        return NULL;
+    }
+    pair->old_mode = DIFF_MODE_FILE;
+    pair->new_mode = DIFF_MODE_FILE;
+    list->len++;
+    return pair;
+}
+
+static int diff_collect_worktree(const char *repo_root, const IndexList *staged, DiffPairList *pairs) {
+    const char **paths = malloc((staged->len > 0 ? staged->len : 1) * sizeof(char *));
+    ObjectId *oids = malloc((staged->len > 0 ? staged->len : 1) * sizeof(ObjectId));
+    bool *missing = malloc((staged->len > 0 ? staged->len : 1) * sizeof(bool));
+    uint32_t *modes = malloc((staged->len > 0 ? staged->len : 1) * sizeof(uint32_t));
+    size_t failed;
+    size_t i;
+    int result = -1;
+
+    if (paths == NULL || oids == NULL || missing == NULL || modes == NULL) {
+        goto done;
+    }
+    for (i = 0; i < staged->len; i++) {
+        paths[i] = staged->items[i].path;
+    }
+    if (hash_worktree_files(repo_root, paths, staged->len, false, oids, missing, NULL, modes, &failed) != 0) {
+        goto done;
+    }
+    for (i = 0; i < staged->len; i++) {
+        DiffPair *pair;
+
+        if (!missing[i] && oid_equal(&oids[i], &staged->items[i].oid) && modes[i] == staged->items[i].mode) {
+            continue;
+        }
+        pair = diff_pair_add(pairs, staged->items[i].path);
+        if (pair == NULL) {
+            goto done;
+        }
+        pair->has_old = true;
+        pair->old_oid = staged->items[i].oid;
+        pair->old_mode = staged->items[i].mode;
+        if (!missing[i]) {
+            pair->has_new = true;
+            pair->new_oid = oids[i];
+            pair->new_mode = modes[i];
+            pair->new_in_worktree = true;
+        }
+    }
+    result = 0;
+
+done:
+    free(paths);
+    free(oids);
+    free(missing);
+    free(modes);
+    return result;
+}
+
+static int diff_collect_cached(const IndexList *head, const IndexList *staged, DiffPairList *pairs) {
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < head->len || j < staged->len) {
+        int cmp = i == head->len ? 1 : j == staged->len ? -1 : strcmp(head->items[i].path, staged->items[j].path);
+        DiffPair *pair;
+
+        if (cmp == 0 && oid_equal(&head->items[i].oid, &staged->items[j].oid) &&
+            head->items[i].mode == staged->items[j].mode) {
+            i++;
+            j++;
+            continue;
+        }
+        pair = diff_pair_add(pairs, cmp <= 0 ? head->items[i].path : staged->items[j].path);
+        if (pair == NULL) {
+            return -1;
+        }
+        if (cmp <= 0) {
+            pair->has_old = true;
+            pair->old_mode = head->items[i].mode;
+            pair->old_oid = head->items[i++].oid;
+        }
+        if (cmp >= 0) {
+            pair->has_new = true;
+            pair->new_mode = staged->items[j].mode;
+            pair->new_oid = staged->items[j++].oid;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    unsigned int mode;
+    const char *name;
+    size_t name_len;
+    ObjectId oid;
+} TreeEntry;
+
+static int read_tree_entries(const char *repo_root, const ObjectId *tree, unsigned char **data, TreeEntry **entries,
+                             size_t *count) {
+    char type[16];
+    size_t size;
+    size_t pos = 0;
+    size_t cap = 0;
+
+    *entries = NULL;
+    *count = 0;
+    if (read_object(repo_root, tree, type, data, &size) != 0) {
+        return -1;
+    }
+    if (strcmp(type, "tree") != 0) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    while (pos < size) {
+        unsigned char *space = memchr(*data + pos, ' ', size - pos);
+        unsigned char *nul = space != NULL ? memchr(space + 1, '\0', size - (size_t)(space + 1 - *data)) : NULL;
+        TreeEntry *entry;
+
+        if (nul == NULL || (size_t)(nul - *data) + 21 > size) {
+            free(*entries);
+            free(*data);
+            *data = NULL;
+            return -1;
+        }
+        if (*count == cap) {
+            TreeEntry *grown;
+            cap = cap == 0 ? 16 : cap * 2;
+            grown = realloc(*entries, cap * sizeof(TreeEntry));
+            if (grown == NULL) {
+                free(*entries);
+                free(*data);
+                *data = NULL;
+                return -1;
+            }
+            *entries = grown;
+        }
+        entry = &(*entries)[(*count)++];
+        *space = '\0';
+        entry->mode = (unsigned int)strtoul((const char *)*data + pos, NULL, 8);
+        entry->name = (const char *)space + 1;
+        entry->name_len = (size_t)(nul - space - 1);
+        memcpy(entry->oid.hash, nul + 1, sizeof(entry->oid.hash));
+        pos = (size_t)(nul - *data) + 21;
+    }
+    return 0;
+}
+
+/* git's tree order: names compare bytewise with directories as "name/". */
+static int tree_entry_cmp(const TreeEntry *left, const TreeEntry *right) {
+    size_t len = left->name_len < right->name_len ? left->name_len : right->name_len;
+    int cmp = memcmp(left->name, right->name, len);
+    unsigned char lc;
+    unsigned char rc;
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    lc = len < left->name_len ? (unsigned char)left->name[len] : left->mode == DIFF_MODE_TREE ? '/' : '\0';
+    rc = len < right->name_len ? (unsigned char)right->name[len] : right->mode == DIFF_MODE_TREE ? '/' : '\0';
+    return (int)lc - (int)rc;
+}
+
+/* Tree vs tree. Subtrees with identical ids are skipped without being read;
+ * a missing side (NULL) stands for an empty tree, which is how added and
+ * deleted directories expand. */
+static int diff_collect_trees(const char *repo_root, const ObjectId *old_tree, const ObjectId *new_tree,
+                              const char *prefix, DiffPairList *pairs) {
+    unsigned char *old_data = NULL;
+    unsigned char *new_data = NULL;
+    TreeEntry *old_entries = NULL;
+    TreeEntry *new_entries = NULL;
+    size_t old_count = 0;
+    size_t new_count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    int result = -1;
+
+    if ((old_tree != NULL && read_tree_entries(repo_root, old_tree, &old_data, &old_entries, &old_count) != 0) ||
+        (new_tree != NULL && read_tree_entries(repo_root, new_tree, &new_data, &new_entries, &new_count) != 0)) {
+        goto done;
+    }
+
+    while (i < old_count || j < new_count) {
+        const TreeEntry *old_entry = i < old_count ? &old_entries[i] : NULL;
+        const TreeEntry *new_entry = j < new_count ? &new_entries[j] : NULL;
+        int cmp = old_entry == NULL ? 1 : new_entry == NULL ? -1 : tree_entry_cmp(old_entry, new_entry);
+        const TreeEntry *named = cmp <= 0 ? old_entry : new_entry;
+        char path[PATH_MAX];
+
+        if (cmp == 0 && old_entry->mode == new_entry->mode && oid_equal(&old_entry->oid, &new_entry->oid)) {
+            i++;
+            j++;
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s%.*s", prefix, (int)named->name_len, named->name) >= (int)sizeof(path)) {
+            goto done;
+        }
+
+        if (named->mode == DIFF_MODE_TREE) {
+            size_t len = strlen(path);
+            if (len + 1 >= sizeof(path)) {
+                goto done;
+            }
+            path[len] = '/';
+            path[len + 1] = '\0';
+            if (diff_collect_trees(repo_root, cmp <= 0 ? &old_entry->oid : NULL, cmp >= 0 ? &new_entry->oid : NULL,
+                                   path, pairs) != 0) {
+                goto done;
+            }
+        } else if (named->mode != DIFF_MODE_GITLINK) {
+            DiffPair *pair = diff_pair_add(pairs, path);
+            if (pair == NULL) {
+                goto done;
+            }
+            if (cmp <= 0) {
+                pair->has_old = true;
+                pair->old_oid = old_entry->oid;
+                pair->old_mode = old_entry->mode;
+            }
+            if (cmp >= 0) {
+                pair->has_new = true;
+                pair->new_oid = new_entry->oid;
+                pair->new_mode = new_entry->mode;
+            }
+        }
+        if (cmp <= 0) {
+            i++;
+        }
+        if (cmp >= 0) {
+            j++;
+        }
+    }
+    result = 0;
+
+done:
+    free(old_entries);
+    free(new_entries);
+    free(old_data);
+    free(new_data);
+    return result;
+}
+
+/* Folds deletions (and, with copies, modified files) into the additions
+ * they were renamed or copied to. A renamed deletion drops out of the
+ * list; the combined pair keeps the destination's place. */
+static int diff_find_renames(const char *repo_root, DiffPairList *pairs, bool copies) {
+    RenameFile *sources = NULL;
+    RenameFile *dests = NULL;
+    size_t *source_pairs = NULL;
+    size_t *dest_pairs = NULL;
+    RenameMatch *matches = NULL;
+    size_t source_count = 0;
+    size_t dest_count = 0;
+    size_t match_count = 0;
+    bool *removed = NULL;
+    size_t kept = 0;
+    size_t i;
+    int result = -1;
+
+    sources = malloc(pairs->len * sizeof(RenameFile));
+    dests = malloc(pairs->len * sizeof(RenameFile));
+    source_pairs = malloc(pairs->len * sizeof(size_t));
+    dest_pairs = malloc(pairs->len * sizeof(size_t));
+    removed = calloc(pairs->len, sizeof(bool));
+    if (pairs->len == 0 || sources == NULL || dests == NULL || source_pairs == NULL || dest_pairs == NULL ||
+        removed == NULL) {
+        result = pairs->len == 0 ? 0 : -1;
+        goto done;
+    }
+    for (i = 0; i < pairs->len; i++) {
+        const DiffPair *pair = &pairs->items[i];
+        if (pair->has_old && (!pair->has_new || (copies && !pair->new_in_worktree))) {
+            sources[source_count].path = pair->path;
+            sources[source_count].oid = pair->old_oid;
+            sources[source_count].keep = pair->has_new;
+            source_pairs[source_count++] = i;
+        } else if (!pair->has_old && pair->has_new && !pair->new_in_worktree) {
+            dests[dest_count].path = pair->path;
+            dests[dest_count].oid = pair->new_oid;
+            dests[dest_count].keep = false;
+            dest_pairs[dest_count++] = i;
+        }
+    }
+    if (detect_renames(repo_root, sources, source_count, dests, dest_count, copies, &matches, &match_count) != 0) {
+        goto done;
+    }
+
+    for (i = 0; i < match_count; i++) {
+        const DiffPair *source = &pairs->items[source_pairs[matches[i].src]];
+        DiffPair *dest = &pairs->items[dest_pairs[matches[i].dst]];
+
+        dest->old_path = dup_string(source->path);
+        if (dest->old_path == NULL) {
+            goto done;
+        }
+        dest->has_old = true;
+        dest->old_oid = source->old_oid;
+        dest->old_mode = source->old_mode;
+        dest->score = matches[i].score;
+        dest->copy = matches[i].copy;
+        if (!matches[i].copy) {
+            removed[source_pairs[matches[i].src]] = true;
+        }
+    }
+    for (i = 0; i < pairs->len; i++) {
+        if (removed[i]) {
+            free(pairs->items[i].path);
+        } else {
+            pairs->items[kept++] = pairs->items[i];
+        }
+    }
+    pairs->len = kept;
+    result = 0;
+
+done:
+    free(sources);
+    free(dests);
+    free(source_pairs);
+    free(dest_pairs);
+    free(matches);
+    free(removed);
+    return result;
+}
+
+static int read_worktree_file(const char *repo_root, const char *relpath, unsigned char **data, size_t *size) {
+    char absolute[PATH_MAX];
+    struct stat st;
+    unsigned char *buffer;
+    size_t used = 0;
+    int fd;
+
+    if (path_join(repo_root, relpath, absolute, sizeof(absolute)) != 0) {
+        return -1;
+    }
+    if (lstat(absolute, &st) == 0 && S_ISLNK(st.st_mode)) {
+        /* A symlink's content is its target, as in the blob. */
+        char target[PATH_MAX];
+        ssize_t len = readlink(absolute, target, sizeof(target));
+        if (len < 0 || (size_t)len == sizeof(target) || (buffer = malloc((size_t)len + 1)) == NULL) {
+            return -1;
+        }
+        memcpy(buffer, target, (size_t)len);
+        *data = buffer;
+        *size = (size_t)len;
+        return 0;
+    }
+    fd = open(absolute, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    TRACE_COUNT(allocations, 1);
+    buffer = malloc((size_t)st.st_size + 1);
+    if (buffer == NULL) {
+        close(fd);
+        return -1;
+    }
+    while (used < (size_t)st.st_size) {
+        ssize_t got = read(fd, buffer + used, (size_t)st.st_size - used);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        used += (size_t)got;
+    }
+    close(fd);
+    *data = buffer;
+    *size = used;
+    return 0;
+}
+
+static int diff_load_batch(const char *repo_root, DiffPair *pairs, size_t count) {
+    size_t i;
+    char type[16];
+
+    for (i = 0; i < count; i++) {
+        if ((pairs[i].has_old && object_request(repo_root, &pairs[i].old_oid) != 0) ||
+            (pairs[i].has_new && !pairs[i].new_in_worktree && object_request(repo_root, &pairs[i].new_oid) != 0)) {
+            object_queue_reset();
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if ((pairs[i].has_old && object_response(type, &pairs[i].old_data, &pairs[i].old_size) != 0) ||
+            (pairs[i].has_new && !pairs[i].new_in_worktree &&
+             object_response(type, &pairs[i].new_data, &pairs[i].new_size) != 0)) {
+            object_queue_reset();
+            return -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (pairs[i].new_in_worktree &&
+            read_worktree_file(repo_root, pairs[i].path, &pairs[i].new_data, &pairs[i].new_size) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void diff_abbrev(const ObjectId *oid, bool present, char out[8]) {
+    char hex[41];
+
+    if (!present) {
+        memcpy(out, "0000000", 8);
+        return;
+    }
+    oid_to_hex(oid, hex);
+    memcpy(out, hex, 7);
+    out[7] = '\0';
+}
+
+/* Renders one pair in git's unified format. Runs on worker threads, so it
+ * only touches its own pair. */
+static void diff_render_pair(DiffPair *pair) {
+    FILE *out = open_memstream(&pair->output, &pair->output_len);
+    char old_abbrev[8];
+    char new_abbrev[8];
+    const char *old_path = pair->old_path != NULL ? pair->old_path : pair->path;
+    static const unsigned char empty[1];
+
+    if (out == NULL) {
+        pair->failed = true;
+        return;
+    }
+    diff_abbrev(&pair->old_oid, pair->has_old, old_abbrev);
+    diff_abbrev(&pair->new_oid, pair->has_new, new_abbrev);
+
+    fprintf(out, "diff --git a/%s b/%s\n", old_path, pair->path);
+    if (!pair->has_old) {
+        fprintf(out, "new file mode %06o\n", pair->new_mode);
+    } else if (!pair->has_new) {
+        fprintf(out, "deleted file mode %06o\n", pair->old_mode);
+    } else if (pair->old_mode != pair->new_mode) {
+        fprintf(out, "old mode %06o\nnew mode %06o\n", pair->old_mode, pair->new_mode);
+    }
+    if (pair->old_path != NULL) {
+        const char *kind = pair->copy ? "copy" : "rename";
+        fprintf(out, "similarity index %d%%\n%s from %s\n%s to %s\n", pair->score * 100 / DIFF_MAX_SCORE, kind,
+                pair->old_path, kind, pair->path);
+    }
+
+    if (!pair->has_old || !pair->has_new || !oid_equal(&pair->old_oid, &pair->new_oid)) {
+        const unsigned char *old_data = pair->old_data != NULL ? pair->old_data : empty;
+        const unsigned char *new_data = pair->new_data != NULL ? pair->new_data : empty;
+        char *hunks = NULL;
+        size_t hunks_len = 0;
+        FILE *hunk_out;
+
+        fprintf(out, "index %s..%s", old_abbrev, new_abbrev);
+        if (pair->has_old && pair->has_new && pair->old_mode == pair->new_mode) {
+            fprintf(out, " %06o", pair->old_mode);
+        }
+        fputc('\n', out);
+
+        if (diff_is_binary(old_data, pair->old_size) || diff_is_binary(new_data, pair->new_size)) {
+            fprintf(out, "Binary files %s%s and %s%s differ\n", pair->has_old ? "a/" : "",
+                    pair->has_old ? old_path : "/dev/null", pair->has_new ? "b/" : "",
+                    pair->has_new ? pair->path : "/dev/null");
+        } else {
+            hunk_out = open_memstream(&hunks, &hunks_len);
+            if (hunk_out == NULL ||
+                diff_unified(hunk_out, old_data, pair->old_size, new_data, pair->new_size, DIFF_CONTEXT_LINES) != 0) {
+                pair->failed = true;
+            }
+            if (hunk_out != NULL) {
+                fclose(hunk_out);
+            }
+            if (hunks_len > 0) {
+                fprintf(out, "--- %s%s\n+++ %s%s\n", pair->has_old ? "a/" : "", pair->has_old ? old_path : "/dev/null",
+                        pair->has_new ? "b/" : "", pair->has_new ? pair->path : "/dev/null");
+                fwrite(hunks, 1, hunks_len, out);
+            }
+            free(hunks);
+        }
+    }
+    if (fclose(out) != 0) {
+        pair->failed = true;
+    }
+}
+
+static void diff_render_job(void *ctx, size_t index) {
+    diff_render_pair(&((DiffPair *)ctx)[index]);
+}
+
+static int resolve_tree_revision(const char *repo_root, const char *rev, ObjectId *out_tree) {
+    char *qroot = shell_quote_alloc(repo_root);
+    char *spec = malloc(strlen(rev) + 8);
+    char *qspec = NULL;
+    char *command = NULL;
+    char output[128];
+    int result = -1;
+
+    if (qroot == NULL || spec == NULL) {
+        goto done;
+    }
+    snprintf(spec, strlen(rev) + 8, "%s^{tree}", rev);
+    qspec = shell_quote_alloc(spec);
+    if (qspec == NULL) {
+        goto done;
+    }
+    command = malloc(strlen(qroot) + strlen(qspec) + 64);
+    if (command == NULL) {
+        goto done;
+    }
+    sprintf(command, "git -C %s rev-parse --verify --quiet %s 2>/dev/null", qroot, qspec);
+    if (run_command_capture(command, output, sizeof(output)) == 0) {
+        strip_newlines(output);
+        result = oid_from_hex(output, out_tree);
+    }
+
+done:
+    free(command);
+    free(qspec);
+    free(spec);
+    free(qroot);
+    return result;
+}
+
+static int cmd_diff(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    const char *revs[2];
+    size_t rev_count = 0;
+    bool cached = false;
+    bool renames = true;
+    bool copies = false;
+    IndexList staged;
+    IndexList head_entries;
+    DiffPairList pairs;
+    TraceRegion phase;
+    size_t start;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--cached") == 0 || strcmp(argv[i], "--staged") == 0) {
+            cached = true;
+        } else if (strcmp(argv[i], "-M") == 0 || strcmp(argv[i], "--find-renames") == 0) {
+            renames = true;
+        } else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--find-copies") == 0) {
+            renames = true;
+            copies = true;
+        } else if (strcmp(argv[i], "--no-renames") == 0) {
+            renames = false;
+            copies = false;
+        } else if (argv[i][0] != '-' && rev_count < 2) {
+            revs[rev_count++] = argv[i];
+        } else {
+            fprintf(stderr, "cg diff: usage: cg diff [-M | -C | --no-renames] [--cached | <commit> <commit>]\n");
+            return 1;
+        }
+    }
+    if (rev_count == 1 || (cached && rev_count != 0)) {
+        fprintf(stderr, "cg diff: usage: cg diff [-M | -C | --no-renames] [--cached | <commit> <commit>]\n");
+        return 1;
+    }
+
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg diff: not inside a CG repository\n");
+        return 1;
+    }
+
+    index_list_init(&staged);
+    index_list_init(&head_entries);
+    memset(&pairs, 0, sizeof(pairs));
+
+    trace_region_enter(&phase, "diff_collect");
+    if (rev_count == 2) {
+        ObjectId trees[2];
+        for (i = 0; i < 2; i++) {
+            if (resolve_tree_revision(repo_root, revs[i], &trees[i]) != 0) {
+                fprintf(stderr, "cg diff: unknown revision '%s'\n", revs[i]);
+                goto fail;
+            }
+        }
+        if (!oid_equal(&trees[0], &trees[1]) && diff_collect_trees(repo_root, &trees[0], &trees[1], "", &pairs) != 0) {
+            fprintf(stderr, "cg diff: cannot read trees\n");
+            goto fail;
+        }
+    } else {
+        bool has_head = false;
+        if (load_cg_index(repo_root, &staged) != 0 ||
+            (cached && load_head_tree(repo_root, &head_entries, &has_head) != 0)) {
+            fprintf(stderr, "cg diff: cannot read repository state\n");
+            goto fail;
+        }
+        if ((cached ? diff_collect_cached(&head_entries, &staged, &pairs)
+                    : diff_collect_worktree(repo_root, &staged, &pairs)) != 0) {
+            fprintf(stderr, "cg diff: cannot compare files\n");
+            goto fail;
+        }
+    }
+    trace_region_leave(&phase);
+
+    if (renames && diff_find_renames(repo_root, &pairs, copies) != 0) {
+        fprintf(stderr, "cg diff: cannot detect renames\n");
+        goto fail;
+    }
+
+    for (start = 0; start < pairs.len; start += DIFF_BATCH_FILES) {
+        size_t count = pairs.len - start < DIFF_BATCH_FILES ? pairs.len - start : DIFF_BATCH_FILES;
+        size_t k;
+
+        trace_region_enter(&phase, "diff_compute");
+        if (diff_load_batch(repo_root, pairs.items + start, count) != 0) {
+            fprintf(stderr, "cg diff: cannot read file contents\n");
+            goto fail;
+        }
+        parallel_for(count, diff_render_job, pairs.items + start);
+        trace_region_leave(&phase);
+
+        trace_region_enter(&phase, "output");
+        for (k = start; k < start + count; k++) {
+            DiffPair *pair = &pairs.items[k];
+            if (pair->failed) {
+                fprintf(stderr, "cg diff: cannot diff %s\n", pair->path);
+                goto fail;
+            }
+            fwrite(pair->output, 1, pair->output_len, stdout);
+            free(pair->old_data);
+            free(pair->new_data);
+            free(pair->output);
+            pair->old_data = NULL;
+            pair->new_data = NULL;
+            pair->output = NULL;
+        }
+        trace_region_leave(&phase);
+    }
+
+    index_list_free(&staged);
+    index_list_free(&head_entries);
+    diff_pair_list_free(&pairs);
+    return 0;
+
+fail:
+    index_list_free(&staged);
+    index_list_free(&head_entries);
+    diff_pair_list_free(&pairs);
+    return 1;
+}
+
+static int cmd_log(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    char *qroot;
+    char *command;
+    char output[65536];
+    size_t needed;
+    int status;
+
+    if (argc != 0) {
+        fprintf(stderr, "cg log: no arguments expected\n");
+        return 1;
+    }
+    (void)argv;
+
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg log: not inside a CG repository\n");
+        return 1;
+    }
+
+    qroot = shell_quote_alloc(repo_root);
+    if (qroot == NULL) {
+        return 1;
+    }
+
+    needed = strlen("git -C  --no-pager log --decorate --oneline --graph 2>/dev/null") + strlen(qroot) + 1;
+    command = malloc(needed);
+    if (command == NULL) {
+        free(qroot);
+        return 1;
+    }
+
+    snprintf(command, needed, "git -C %s --no-pager log --decorate --oneline --graph 2>/dev/null", qroot);
+    status = run_command_capture(command, output, sizeof(output));
+    free(command);
+    free(qroot);
+
+    if (status != 0 || output[0] == '\0') {
+        puts("No commits yet.");
+        return 0;
+    }
+
+    fputs(output, stdout);
+    return 0;
+}
+
+static int loose_refs_walk(const char *repo_root, const char *dir, const char *prefix, RefList *out) {
+    char path[PATH_MAX];
+    DIR *handle;
+    struct dirent *entry;
+    size_t prefix_len = strlen(prefix);
+    size_t dir_len = strlen(dir);
+
+    if (build_git_path(repo_root, dir, path, sizeof(path)) != 0) {
+        return -1;
+    }
+    handle = opendir(path);
+    if (handle == NULL) {
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    }
+    while ((entry = readdir(handle)) != NULL) {
+        char name[PATH_MAX];
+        size_t name_len = strlen(entry->d_name);
+        size_t common;
+        struct stat st;
+        char full[PATH_MAX];
+        ObjectId oid;
+
+        if (entry->d_name[0] == '.' ||
+            (name_len > 5 && strcmp(entry->d_name + name_len - 5, ".lock") == 0)) {
+            continue;
+        }
+        if (snprintf(name, sizeof(name), "%s%s", dir, entry->d_name) >= (int)sizeof(name) ||
+            build_git_path(repo_root, name, full, sizeof(full)) != 0) {
+            closedir(handle);
+            return -1;
+        }
+        common = dir_len + name_len < prefix_len ? dir_len + name_len : prefix_len;
+        if (strncmp(name, prefix, common) != 0) {
+            continue;
+        }
+        TRACE_COUNT(files_stated, 1);
+        if (lstat(full, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            size_t len = strlen(name);
+            if (len + 1 >= sizeof(name)) {
+                closedir(handle);
+                return -1;
+            }
+            name[len] = '/';
+            name[len + 1] = '\0';
+            if (loose_refs_walk(repo_root, name, prefix, out) != 0) {
+                closedir(handle);
+                return -1;
+            }
+        } else if (strncmp(name, prefix, prefix_len) == 0) {
+            char line[16];
+            if (resolve_ref(repo_root, name, &oid) != 0) {
+                fprintf(stderr, "cg: warning: ignoring broken ref %s\n", name);
+            } else if (ref_list_add(out, name, strlen(name), &oid) != 0) {
+                closedir(handle);
+                return -1;
+            } else {
+                out->items[out->len - 1].symbolic =
+                    read_git_file_line(repo_root, name, line, sizeof(line)) == 0 && strncmp(line, "ref: ", 5) == 0;
+            }
+        }
+    }
+    return closedir(handle) == 0 ? 0 : -1;
+}
+
+/* All refs starting with prefix, sorted: a walk of the loose directory
+ * holding the prefix merged with the matching range of packed-refs,
+ * where a loose ref shadows a packed one of the same name. Entries that
+ * came from a loose file are flagged. */
+static int collect_refs(const char *repo_root, const char *prefix, RefList *out) {
+    RefList loose;
+    RefList packed_list;
+    PackedRefs packed;
+    char dir[PATH_MAX];
+    const char *slash = strrchr(prefix, '/');
+    size_t dir_len = slash != NULL ? (size_t)(slash - prefix) + 1 : 0;
+    size_t i = 0;
+    size_t j = 0;
+    int opened;
+    int result = -1;
+
+    memset(&loose, 0, sizeof(loose));
+    memset(&packed_list, 0, sizeof(packed_list));
+    if (dir_len >= sizeof(dir)) {
+        return -1;
+    }
+    memcpy(dir, prefix, dir_len);
+    dir[dir_len] = '\0';
+
+    if (loose_refs_walk(repo_root, dir, prefix, &loose) != 0) {
+        goto done;
+    }
+    qsort(loose.items, loose.len, sizeof(RefEntry), ref_entry_cmp);
+    opened = packed_refs_open(repo_root, &packed);
+    if (opened < 0) {
+        goto done;
+    }
+    if (opened == 0) {
+        int collected = packed_refs_collect(&packed, prefix, &packed_list);
+        packed_refs_close(&packed);
+        if (collected != 0) {
+            goto done;
+        }
+    }
+
+    while (i < loose.len || j < packed_list.len) {
+        int cmp = i == loose.len ? 1 : j == packed_list.len ? -1
+                                                             : strcmp(loose.items[i].name, packed_list.items[j].name);
+        RefEntry *pick = cmp <= 0 ? &loose.items[i] : &packed_list.items[j];
+
+        if (ref_list_add(out, pick->name, strlen(pick->name), &pick->oid) != 0) {
+            goto done;
+        }
+        out->items[out->len - 1].loose = cmp <= 0;
+        out->items[out->len - 1].symbolic = cmp <= 0 && pick->symbolic;
+        if (cmp <= 0) {
+            i++;
+        }
+        if (cmp >= 0) {
+            j++;
+        }
+    }
+    result = 0;
+
+done:
+    ref_list_free(&loose);
+    ref_list_free(&packed_list);
+    return result;
+}
+
+/* git check-ref-format rules for a branch name. */
+static bool valid_branch_name(const char *name) {
+    const char *component = name;
+    const char *p;
+
+    if (name[0] == '\0' || name[0] == '-' || strcmp(name, "HEAD") == 0) {
+        return false;
+    }
+    for (p = name;; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '/' || c == '\0') {
+            size_t len = (size_t)(p - component);
+            if (len == 0 || component[0] == '.' ||
+                (len >= 5 && memcmp(p - 5, ".lock", 5) == 0)) {
+                return false;
+            }
+            if (c == '\0') {
+                break;
+            }
+            component = p + 1;
+            continue;
+        }
+        if (c < 0x20 || c == 0x7f || strchr(" ~^:?*[\\", c) != NULL || (c == '.' && p[1] == '.') ||
+            (c == '@' && p[1] == '{')) {
+            return false;
+        }
+    }
+    return p[-1] != '.';
+}
+
+/* Creates the lock for a ref under .git, making parent directories as
+ * needed. Like git, the lock is "<ref>.lock" opened with O_EXCL, so a
+ * concurrent update fails instead of racing. */
+static int ref_lock(const char *repo_root, const char *refname, char *ref_path, char *lock_path) {
+    int fd;
+
+    if (build_git_path(repo_root, refname, ref_path, PATH_MAX) != 0 ||
+        snprintf(lock_path, PATH_MAX, "%s.lock", ref_path) >= PATH_MAX) {
+        return -1;
+    }
+    if (ensure_parent_dirs(ref_path, strlen(repo_root)) != 0) {
+        return -1;
+    }
+    fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == EEXIST) {
+        fprintf(stderr, "cg: unable to create '%s': File exists; another cg or git process may be running\n",
+                lock_path);
+    }
+    return fd;
+}
+
+static int ref_lock_commit(int fd, const char *lock_path, const char *ref_path, const ObjectId *oid) {
+    char line[42];
+
+    oid_to_hex(oid, line);
+    line[40] = '\n';
+    if (write_all(fd, line, 41) != 0 || close(fd) != 0) {
+        unlink(lock_path);
+        return -1;
+    }
+    if (rename(lock_path, ref_path) != 0) {
+        unlink(lock_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_ref_locked(const char *repo_root, const char *refname, const ObjectId *oid) {
+    char ref_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    int fd = ref_lock(repo_root, refname, ref_path, lock_path);
+
+    if (fd < 0) {
+        return -1;
+    }
+    return ref_lock_commit(fd, lock_path, ref_path, oid);
+}
+
+/* Like write_ref_locked, but returns 1 without writing if refname exists
+ * once the lock is held, so of two concurrent creations only one wins. */
+static int create_ref_locked(const char *repo_root, const char *refname, const ObjectId *oid) {
+    char ref_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    ObjectId existing;
+    int fd = ref_lock(repo_root, refname, ref_path, lock_path);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (resolve_ref(repo_root, refname, &existing) == 0) {
+        close(fd);
+        unlink(lock_path);
+        return 1;
+    }
+    return ref_lock_commit(fd, lock_path, ref_path, oid);
+}
+
+static int packed_refs_remove(const char *repo_root, const char *refname) {
+    PackedRefs packed;
+    char path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    size_t pos;
+    size_t end;
+    int fd;
+    int result = -1;
+    int opened = packed_refs_open(repo_root, &packed);
+
+    if (opened != 0) {
+        return opened > 0 ? 0 : -1;
+    }
+    pos = packed.sorted ? packed_refs_seek(&packed, refname, false) : packed.records;
+    while (pos < packed.size &&
+           (!packed_refs_record(&packed, pos) || packed_refs_compare(&packed, pos, refname, strlen(refname), false) != 0)) {
+        if (packed.sorted && packed_refs_record(&packed, pos)) {
+            pos = packed.size;
+            break;
+        }
+        pos = packed_refs_line_end(&packed, pos);
+    }
+    if (pos >= packed.size) {
+        packed_refs_close(&packed);
+        return 0;
+    }
+    end = packed_refs_line_end(&packed, pos);
+    while (end < packed.size && packed.data[end] == '^') {
+        end = packed_refs_line_end(&packed, end);
+    }
+
+    if (build_git_path(repo_root, "packed-refs", path, sizeof(path)) != 0 ||
+        snprintf(lock_path, sizeof(lock_path), "%s.lock", path) >= (int)sizeof(lock_path)) {
+        packed_refs_close(&packed);
+        return -1;
+    }
+    fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        if (errno == EEXIST) {
+            fprintf(stderr, "cg: unable to create '%s': File exists\n", lock_path);
+        }
+        packed_refs_close(&packed);
+        return -1;
+    }
+    if (write_all(fd, packed.data, pos) == 0 && write_all(fd, packed.data + end, packed.size - end) == 0 &&
+        close(fd) == 0) {
+        fd = -1;
+        result = rename(lock_path, path);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (result != 0) {
+        unlink(lock_path);
+    }
+    packed_refs_close(&packed);
+    return result;
+}
+
+/* Stops at <top>/<kind> itself; top is "refs" or "logs/refs". */
+static void prune_empty_ref_dirs(const char *repo_root, const char *top, char *ref_path) {
+    size_t floor = strlen(repo_root) + strlen("/.git/") + strlen(top) + 1;
+    char *slash;
+
+    while ((slash = strrchr(ref_path, '/')) != NULL && (size_t)(slash - ref_path) > floor) {
+        *slash = '\0';
+        if (strchr(ref_path + floor, '/') == NULL || rmdir(ref_path) != 0) {
+            break;
+        }
+    }
+}
+
+/* The reflog goes too, as in git: gc would otherwise keep its objects alive. */
+static int delete_ref_locked(const char *repo_root, const char *refname) {
+    char ref_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    char log_name[PATH_MAX];
+    char log_path[PATH_MAX];
+    int fd = ref_lock(repo_root, refname, ref_path, lock_path);
+    int result = 0;
+
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
+    if (packed_refs_remove(repo_root, refname) != 0 || (unlink(ref_path) != 0 && errno != ENOENT)) {
+        result = -1;
+    }
+    if (result == 0 && snprintf(log_name, sizeof(log_name), "logs/%s", refname) < (int)sizeof(log_name) &&
+        build_git_path(repo_root, log_name, log_path, sizeof(log_path)) == 0) {
+        if (unlink(log_path) == 0) {
+            prune_empty_ref_dirs(repo_root, "logs/refs", log_path);
+        } else if (errno != ENOENT) {
+            result = -1;
+        }
+    }
+    unlink(lock_path);
+    prune_empty_ref_dirs(repo_root, "refs", ref_path);
+    return result;
+}
+
+static int commit_parents(const char *repo_root, const ObjectId *commit, ObjectId *parents, size_t max,
+                          size_t *count) {
+    char type[16];
+    unsigned char *data;
+    size_t size;
+    const char *line;
+
+    *count = 0;
+    if (read_object(repo_root, commit, type, &data, &size) != 0) {
+        return -1;
+    }
+    if (strcmp(type, "commit") != 0) {
+        free(data);
+        return -1;
+    }
+    line = (const char *)data;
+    while (line < (const char *)data + size && *line != '\n') {
+        const char *next = memchr(line, '\n', size - (size_t)(line - (const char *)data));
+        if (next == NULL) {
+            break;
+        }
+        if (strncmp(line, "parent ", 7) == 0 && next - line >= 47 && *count < max) {
+            char hex[41];
+            memcpy(hex, line + 7, 40);
+            hex[40] = '\0';
+            if (oid_from_hex(hex, &parents[*count]) == 0) {
+                (*count)++;
+            }
+        }
+        line = next + 1;
+    }
+    free(data);
+    return 0;
+}
+
+static int reach_is_ancestor(const char *repo_root, const ObjectId *ancestor, const ObjectId *tip);
+
+/* Whether ancestor is reachable from tip. Reachability bitmaps answer it
+ * when a pack has them; otherwise this is a breadth-first walk over
+ * parents. */
+static int commit_is_ancestor(const char *repo_root, const ObjectId *ancestor, const ObjectId *tip) {
+    OidSet seen;
+    ObjectId *queue = NULL;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t cap = 0;
+    int result = reach_is_ancestor(repo_root, ancestor, tip);
+
+    if (result != 2) {
+        return result;
+    }
+    result = 0;
+    oid_set_init(&seen);
+    if (oid_set_insert(&seen, tip) < 0) {
+        return -1;
+    }
+    cap = 64;
+    queue = malloc(cap * sizeof(ObjectId));
+    if (queue == NULL) {
+        oid_set_free(&seen);
+        return -1;
+    }
+    queue[tail++] = *tip;
+    while (head < tail && result == 0) {
+        ObjectId parents[COMMIT_MAX_PARENTS];
+        size_t count;
+        size_t i;
+        ObjectId current = queue[head++];
+
+        if (oid_equal(&current, ancestor)) {
+            result = 1;
+            break;
+        }
+        if (commit_parents(repo_root, &current, parents, COMMIT_MAX_PARENTS, &count) != 0) {
+            result = -1;
+            break;
+        }
+        for (i = 0; i < count && result == 0; i++) {
+            int added = oid_set_insert(&seen, &parents[i]);
+            if (added < 0) {
+                result = -1;
+            } else if (added > 0) {
+                if (tail == cap) {
+                    ObjectId *grown;
+                    memmove(queue, queue + head, (tail - head) * sizeof(ObjectId));
+                    tail -= head;
+                    head = 0;
+                    if (tail == cap) {
+                        cap *= 2;
+                        grown = realloc(queue, cap * sizeof(ObjectId));
+                        if (grown == NULL) {
+                            result = -1;
+                            break;
+                        }
+                        queue = grown;
+                    }
+                }
+                queue[tail++] = parents[i];
+            }
+        }
+    }
+    free(queue);
+    oid_set_free(&seen);
+    return result;
+}
+
+static int peel_to_commit(const char *repo_root, ObjectId *out) {
+    int depth;
+
+    for (depth = 0; depth < 8; depth++) {
+        char type[16];
+        unsigned char *data;
+        size_t size;
+        char hex[41];
+
+        if (read_object(repo_root, out, type, &data, &size) != 0) {
+            return -1;
+        }
+        if (strcmp(type, "commit") == 0) {
+            free(data);
+            return 0;
+        }
+        if (strcmp(type, "tag") != 0 || size < 47 || memcmp(data, "object ", 7) != 0) {
+            free(data);
+            return -1;
+        }
+        memcpy(hex, data + 7, 40);
+        hex[40] = '\0';
+        free(data);
+        if (oid_from_hex(hex, out) != 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/* HEAD, a full object id, a ref, branch or tag name, or else an
+ * abbreviated object id, as git tries them. */
+static int resolve_revision_name(const char *repo_root, const char *name, ObjectId *out) {
+    const char *forms[] = {"%s", "refs/heads/%s", "refs/tags/%s"};
+    char refname[PATH_MAX];
+    size_t f;
+    int status;
+
+    if (strcmp(name, "HEAD") == 0) {
+        return resolve_ref(repo_root, "HEAD", out);
+    }
+    if (strlen(name) == 40 && oid_from_hex(name, out) == 0) {
+        return 0;
+    }
+    for (f = 0; f < sizeof(forms) / sizeof(forms[0]); f++) {
+        if ((f == 0 && strncmp(name, "refs/", 5) != 0) ||
+            snprintf(refname, sizeof(refname), forms[f], name) >= (int)sizeof(refname)) {
+            continue;
+        }
+        if (resolve_ref(repo_root, refname, out) == 0) {
+            return 0;
+        }
+    }
+    status = odb_resolve_prefix(repo_root, name, out);
+    if (status < 0) {
+        fprintf(stderr, "cg: short object id %s is ambiguous\n", name);
+    }
+    return status == 0 ? 0 : -1;
+}
+
+/* Resolves a revision name (see resolve_revision_name) followed by any
+ * number of ~<n> (n-th first-parent ancestor) and ^<n> (n-th parent, ^0
+ * the commit itself) suffixes, n defaulting to 1, as in git. */
+static int resolve_revision(const char *repo_root, const char *spec, ObjectId *out) {
+    char name[PATH_MAX];
+    size_t name_len = strcspn(spec, "~^");
+    const char *cursor = spec + name_len;
+
+    if (name_len == 0 || name_len >= sizeof(name)) {
+        return -1;
+    }
+    memcpy(name, spec, name_len);
+    name[name_len] = '\0';
+    if (resolve_revision_name(repo_root, name, out) != 0) {
+        return -1;
+    }
+    while (*cursor != '\0') {
+        ObjectId parents[COMMIT_MAX_PARENTS];
+        size_t parent_count;
+        char op = *cursor++;
+        unsigned long n = 1;
+
+        if (op != '~' && op != '^') {
+            return -1;
+        }
+        if (*cursor >= '0' && *cursor <= '9') {
+            char *end;
+            n = strtoul(cursor, &end, 10);
+            cursor = end;
+        }
+        if (peel_to_commit(repo_root, out) != 0) {
+            return -1;
+        }
+        if (op == '~') {
+            for (; n > 0; n--) {
+                if (commit_parents(repo_root, out, parents, 1, &parent_count) != 0 || parent_count == 0) {
+                    return -1;
+                }
+                *out = parents[0];
+            }
+        } else if (n > 0) {
+            if (commit_parents(repo_root, out, parents, COMMIT_MAX_PARENTS, &parent_count) != 0 ||
+                n > parent_count) {
+                return -1;
+            }
+            *out = parents[n - 1];
+        }
+    }
+    return 0;
+}
+
+static int resolve_commitish(const char *repo_root, const char *spec, ObjectId *out) {
+    if (resolve_revision(repo_root, spec, out) != 0) {
+        return -1;
+    }
+    return peel_to_commit(repo_root, out);
+}
+
+/* Prints branches as git does, "* " marking the current one. pattern is a
+ * prefix of the branch name, or a glob whose literal head is used as the
+ * prefix for the ref lookup. */
+static int branch_list(const char *repo_root, const char *pattern) {
+    char prefix[PATH_MAX];
+    char head[PATH_MAX];
+    const char *current = NULL;
+    RefList refs;
+    size_t literal = pattern != NULL ? strcspn(pattern, "*?[\\") : 0;
+    bool glob = pattern != NULL && pattern[literal] != '\0';
+    size_t i;
+
+    if (snprintf(prefix, sizeof(prefix), "refs/heads/%.*s", (int)literal, pattern != NULL ? pattern : "") >=
+        (int)sizeof(prefix)) {
+        return -1;
+    }
+    if (read_git_file_line(repo_root, "HEAD", head, sizeof(head)) == 0 && strncmp(head, "ref: refs/heads/", 16) == 0) {
+        current = head + 16;
+    } else {
+        ObjectId head_oid;
+        char hex[41];
+        if (resolve_ref(repo_root, "HEAD", &head_oid) == 0) {
+            oid_to_hex(&head_oid, hex);
+            printf("* (HEAD detached at %.7s)\n", hex);
+        }
+    }
+
+    memset(&refs, 0, sizeof(refs));
+    if (collect_refs(repo_root, prefix, &refs) != 0) {
+        ref_list_free(&refs);
+        return -1;
+    }
+    for (i = 0; i < refs.len; i++) {
+        const char *name = refs.items[i].name + strlen("refs/heads/");
+        if (glob && fnmatch(pattern, name, 0) != 0) {
+            continue;
+        }
+        printf("%c %s\n", current != NULL && strcmp(name, current) == 0 ? '*' : ' ', name);
+    }
+    ref_list_free(&refs);
+    return 0;
+}
+
+static int branch_create(const char *repo_root, const char *name, const char *start) {
+    char refname[PATH_MAX];
+    ObjectId target;
+    ObjectId existing;
+    int created;
+
+    if (!valid_branch_name(name)) {
+        fprintf(stderr, "cg branch: '%s' is not a valid branch name\n", name);
+        return 1;
+    }
+    if (snprintf(refname, sizeof(refname), "refs/heads/%s", name) >= (int)sizeof(refname)) {
+        return 1;
+    }
+    if (resolve_ref(repo_root, refname, &existing) == 0) {
+        fprintf(stderr, "cg branch: a branch named '%s' already exists\n", name);
+        return 1;
+    }
+    if (resolve_commitish(repo_root, start, &target) != 0) {
+        fprintf(stderr, "cg branch: not a valid object name: '%s'\n", start);
+        return 1;
+    }
+    created = create_ref_locked(repo_root, refname, &target);
+    if (created > 0) {
+        fprintf(stderr, "cg branch: a branch named '%s' already exists\n", name);
+        return 1;
+    }
+    if (created != 0) {
+        fprintf(stderr, "cg branch: cannot create branch '%s'\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+static int branch_delete(const char *repo_root, const char *name, bool force) {
+    char refname[PATH_MAX];
+    char current[128];
+    ObjectId tip;
+    ObjectId head;
+    char hex[41];
+
+    if (snprintf(refname, sizeof(refname), "refs/heads/%s", name) >= (int)sizeof(refname) ||
+        resolve_ref(repo_root, refname, &tip) != 0) {
+        fprintf(stderr, "cg branch: branch '%s' not found\n", name);
+        return 1;
+    }
+    if (get_current_branch(repo_root, current, sizeof(current)) == 0 && strcmp(current, name) == 0) {
+        fprintf(stderr, "cg branch: cannot delete branch '%s' checked out\n", name);
+        return 1;
+    }
+    if (!force && resolve_ref(repo_root, "HEAD", &head) == 0) {
+        int merged = commit_is_ancestor(repo_root, &tip, &head);
+        if (merged < 0) {
+            fprintf(stderr, "cg branch: cannot read history\n");
+            return 1;
+        }
+        if (merged == 0) {
+            fprintf(stderr, "cg branch: the branch '%s' is not fully merged; use -D to delete it anyway\n", name);
+            return 1;
+        }
+    }
+    if (delete_ref_locked(repo_root, refname) != 0) {
+        fprintf(stderr, "cg branch: cannot delete branch '%s'\n", name);
+        return 1;
+    }
+    oid_to_hex(&tip, hex);
+    printf("Deleted branch %s (was %.7s).\n", name, hex);
+    return 0;
+}
+
+static int cmd_branch(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg branch: not inside a CG repository\n");
+        return 1;
+    }
+
+    if (argc == 0 || (strcmp(argv[0], "--list") == 0 && argc <= 2)) {
+        if (branch_list(repo_root, argc == 2 ? argv[1] : NULL) != 0) {
+            fprintf(stderr, "cg branch: cannot read refs\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 2 && (strcmp(argv[0], "-d") == 0 || strcmp(argv[0], "-D") == 0)) {
+        return branch_delete(repo_root, argv[1], argv[0][1] == 'D');
+    }
+    if ((argc == 1 || argc == 2) && argv[0][0] != '-') {
+        return branch_create(repo_root, argv[0], argc == 2 ? argv[1] : "HEAD");
+    }
+
+    fprintf(stderr, "cg branch: usage: cg branch [--list [pattern]] | cg branch <name> [start] | "
+                    "cg branch (-d | -D) <name>\n");
+    return 1;
+}
+
+/* Target of an annotated tag object, or -1 if data is not one. */
+static int tag_object_target(const char *type, const unsigned char *data, size_t size, ObjectId *out) {
+    char hex[41];
+
+    if (strcmp(type, "tag") != 0 || size < 47 || memcmp(data, "object ", 7) != 0) {
+        return -1;
+    }
+    memcpy(hex, data + 7, 40);
+    hex[40] = '\0';
+    return oid_from_hex(hex, out);
+}
+
+/* Peels the refs under refs/tags/ that name annotated tags, reading the
+ * objects in pipelined batches; has_peel[i] says whether peeled[i] is set.
+ * Tags of tags are followed one read at a time. */
+static int pack_refs_peel(const char *repo_root, const RefList *refs, ObjectId *peeled, bool *has_peel) {
+    size_t start = 0;
+
+    while (start < refs->len) {
+        size_t batch[OBJECT_READ_WINDOW];
+        size_t count = 0;
+        size_t end;
+        size_t i;
+
+        for (end = start; end < refs->len && count < OBJECT_READ_WINDOW; end++) {
+            has_peel[end] = false;
+            if (strncmp(refs->items[end].name, "refs/tags/", 10) != 0) {
+                continue;
+            }
+            if (object_request(repo_root, &refs->items[end].oid) != 0) {
+                object_queue_reset();
+                return -1;
+            }
+            batch[count++] = end;
+        }
+        for (i = 0; i < count; i++) {
+            char type[16];
+            unsigned char *data;
+            size_t size;
+
+            if (object_response(type, &data, &size) != 0) {
+                object_queue_reset();
+                return -1;
+            }
+            has_peel[batch[i]] = tag_object_target(type, data, size, &peeled[batch[i]]) == 0;
+            free(data);
+        }
+        for (i = 0; i < count; i++) {
+            int depth;
+
+            for (depth = 0; has_peel[batch[i]] && depth < 8; depth++) {
+                char type[16];
+                unsigned char *data;
+                size_t size;
+                ObjectId next;
+                int nested;
+
+                if (read_object(repo_root, &peeled[batch[i]], type, &data, &size) != 0) {
+                    return -1;
+                }
+                nested = tag_object_target(type, data, size, &next);
+                free(data);
+                if (nested != 0) {
+                    break;
+                }
+                peeled[batch[i]] = next;
+            }
+        }
+        start = end;
+    }
+    return 0;
+}
+
+/* Removes a loose ref that was just packed, under its lock and only if it
+ * still holds the value that went into packed-refs; a ref updated in the
+ * meantime stays loose and keeps shadowing the packed copy. */
+static void pack_refs_prune(const char *repo_root, const RefEntry *ref) {
+    char ref_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    char line[PATH_MAX];
+    ObjectId current;
+    int fd = ref_lock(repo_root, ref->name, ref_path, lock_path);
+
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    if (read_git_file_line(repo_root, ref->name, line, sizeof(line)) == 0 && oid_from_hex(line, &current) == 0 &&
+        oid_equal(&current, &ref->oid)) {
+        unlink(ref_path);
+    }
+    unlink(lock_path);
+    prune_empty_ref_dirs(repo_root, "refs", ref_path);
+}
+
+/* Errors are reported as coming from cmd. */
+static int write_packed_refs(const char *repo_root, int fd, const RefList *refs, const char *cmd) {
+    ObjectId *peeled = malloc((refs->len > 0 ? refs->len : 1) * sizeof(ObjectId));
+    bool *has_peel = calloc(refs->len > 0 ? refs->len : 1, sizeof(bool));
+    char *buffer = NULL;
+    size_t buffer_len = 0;
+    FILE *out = NULL;
+    int result = -1;
+    size_t i;
+
+    if (peeled == NULL || has_peel == NULL || pack_refs_peel(repo_root, refs, peeled, has_peel) != 0) {
+        fprintf(stderr, "cg %s: cannot peel tags\n", cmd);
+        goto done;
+    }
+
+    out = open_memstream(&buffer, &buffer_len);
+    if (out == NULL) {
+        goto done;
+    }
+    fputs("# pack-refs with: peeled sorted \n", out);
+    for (i = 0; i < refs->len; i++) {
+        char hex[41];
+        oid_to_hex(&refs->items[i].oid, hex);
+        fprintf(out, "%s %s\n", hex, refs->items[i].name);
+        if (has_peel[i]) {
+            oid_to_hex(&peeled[i], hex);
+            fprintf(out, "^%s\n", hex);
+        }
+    }
+    if (fclose(out) != 0) {
+        goto done;
+    }
+    if (write_all(fd, buffer, buffer_len) != 0) {
+        fprintf(stderr, "cg %s: cannot write packed-refs\n", cmd);
+        goto done;
+    }
+    result = 0;
+
+done:
+    free(buffer);
+    free(peeled);
+    free(has_peel);
+    return result;
+}
+
+static int cmd_pack_refs(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    char path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    RefList refs;
+    int fd = -1;
+    size_t kept;
+    size_t i;
+    TraceRegion phase;
+
+    if (argc > 1 || (argc == 1 && strcmp(argv[0], "--all") != 0)) {
+        fprintf(stderr, "cg pack-refs: usage: cg pack-refs [--all]\n");
+        return 1;
+    }
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg pack-refs: not inside a CG repository\n");
+        return 1;
+    }
+    if (build_git_path(repo_root, "packed-refs", path, sizeof(path)) != 0 ||
+        snprintf(lock_path, sizeof(lock_path), "%s.lock", path) >= (int)sizeof(lock_path)) {
+        return 1;
+    }
+
+    /* Holding packed-refs.lock keeps other packers and deleters out; loose
+     * updates may go on, since a loose ref always wins over a packed one. */
+    fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "cg pack-refs: unable to create '%s': %s\n", lock_path, strerror(errno));
+        return 1;
+    }
+
+    memset(&refs, 0, sizeof(refs));
+    trace_region_enter(&phase, "ref_scan");
+    if (collect_refs(repo_root, "refs/", &refs) != 0) {
+        fprintf(stderr, "cg pack-refs: cannot read refs\n");
+        goto fail;
+    }
+    /* Symbolic refs such as refs/remotes/origin/HEAD stay loose, as in git. */
+    for (i = 0, kept = 0; i < refs.len; i++) {
+        if (refs.items[i].symbolic) {
+            free(refs.items[i].name);
+        } else {
+            refs.items[kept++] = refs.items[i];
+        }
+    }
+    refs.len = kept;
+    trace_region_leave(&phase);
+
+    if (write_packed_refs(repo_root, fd, &refs, "pack-refs") != 0) {
+        goto fail;
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        fprintf(stderr, "cg pack-refs: cannot write packed-refs\n");
+        goto fail;
+    }
+    fd = -1;
+    if (rename(lock_path, path) != 0) {
+        fprintf(stderr, "cg pack-refs: cannot replace packed-refs\n");
+        goto fail;
+    }
+
+    trace_region_enter(&phase, "ref_prune");
+    for (i = 0; i < refs.len; i++) {
+        if (refs.items[i].loose) {
+            pack_refs_prune(repo_root, &refs.items[i]);
+        }
+    }
+    trace_region_leave(&phase);
+
+    ref_list_free(&refs);
+    return 0;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(lock_path);
+    ref_list_free(&refs);
+    return 1;
+}
+
+/* Calls fn with the old and new id of every reflog entry below dir (a path
+ * inside .git/logs); the null ids of creations and deletions are skipped. */
+static int reflogs_walk_dir(const char *dir, int (*fn)(void *ctx, const ObjectId *oid), void *ctx) {
+    DIR *handle = opendir(dir);
+    struct dirent *entry;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int result = 0;
+
+    if (handle == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while (result == 0 && (entry = readdir(handle)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        FILE *file;
+
+        if (entry->d_name[0] == '.' || path_join(dir, entry->d_name, path, sizeof(path)) != 0 ||
+            lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            result = reflogs_walk_dir(path, fn, ctx);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || (file = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        while (result == 0 && getline(&line, &line_cap, file) > 82) {
+            static const ObjectId null_oid;
+            ObjectId ids[2];
+            int i;
+
+            line[40] = '\0';
+            line[81] = '\0';
+            if (oid_from_hex(line, &ids[0]) != 0 || oid_from_hex(line + 41, &ids[1]) != 0) {
+                continue;
+            }
+            for (i = 0; i < 2 && result == 0; i++) {
+                if (!oid_equal(&ids[i], &null_oid)) {
+                    result = fn(ctx, &ids[i]);
+                }
+            }
+        }
+        fclose(file);
+    }
+    free(line);
+    closedir(handle);
+    return result;
+}
+
+static int reflogs_walk(const char *repo_root, int (*fn)(void *ctx, const ObjectId *oid), void *ctx) {
+    char logs[PATH_MAX];
+
+    if (build_git_path(repo_root, "logs", logs, sizeof(logs)) != 0) {
+        return -1;
+    }
+    return reflogs_walk_dir(logs, fn, ctx);
+}
+
+typedef int (*ObjectLinkFn)(void *ctx, const ObjectId *oid, int type);
+
+/* Parses a "<key><hex>\n" header line at *pos. Returns 1 if the line has
+ * another key. */
+static int object_header_oid(const unsigned char *data, size_t size, size_t *pos, const char *key, ObjectId *oid) {
+    size_t key_len = strlen(key);
+    char hex[41];
+
+    if (size - *pos < key_len + 41 || memcmp(data + *pos, key, key_len) != 0 || data[*pos + key_len + 40] != '\n') {
+        return 1;
+    }
+    memcpy(hex, data + *pos + key_len, 40);
+    hex[40] = '\0';
+    if (oid_from_hex(hex, oid) != 0) {
+        return -1;
+    }
+    *pos += key_len + 41;
+    return 0;
+}
+
+/* Calls fn for every object a commit, tree or tag points at, with the type
+ * the link implies (0 if a tag names no known type). Submodule commits in
+ * trees are not links. Returns -1 for a malformed object. */
+static int object_links(int type, const unsigned char *data, size_t size, ObjectLinkFn fn, void *ctx) {
+    ObjectId oid;
+    size_t pos = 0;
+    int status;
+
+    if (type == PACK_OBJ_TREE) {
+        while (pos < size) {
+            const unsigned char *space = memchr(data + pos, ' ', size - pos);
+            const unsigned char *nul;
+            size_t mode_len;
+
+            if (space == NULL) {
+                return -1;
+            }
+            mode_len = (size_t)(space - (data + pos));
+            nul = memchr(space + 1, '\0', size - (size_t)(space + 1 - data));
+            if (nul == NULL || (size_t)(nul - data) + 21 > size) {
+                return -1;
+            }
+            memcpy(oid.hash, nul + 1, sizeof(oid.hash));
+            if (mode_len != 6 || memcmp(data + pos, "160000", 6) != 0) {
+                bool is_tree = mode_len == 5 && memcmp(data + pos, "40000", 5) == 0;
+                if (fn(ctx, &oid, is_tree ? PACK_OBJ_TREE : PACK_OBJ_BLOB) != 0) {
+                    return -1;
+                }
+            }
+            pos = (size_t)(nul - data) + 21;
+        }
+        return 0;
+    }
+    if (type == PACK_OBJ_COMMIT) {
+        if (object_header_oid(data, size, &pos, "tree ", &oid) != 0 || fn(ctx, &oid, PACK_OBJ_TREE) != 0) {
+            return -1;
+        }
+        while ((status = object_header_oid(data, size, &pos, "parent ", &oid)) == 0) {
+            if (fn(ctx, &oid, PACK_OBJ_COMMIT) != 0) {
+                return -1;
+            }
+        }
+        return status < 0 ? -1 : 0;
+    }
+    if (type == PACK_OBJ_TAG) {
+        char name[16];
+        const unsigned char *eol;
+        size_t len;
+
+        if (object_header_oid(data, size, &pos, "object ", &oid) != 0 || size - pos < 5 ||
+            memcmp(data + pos, "type ", 5) != 0 || (eol = memchr(data + pos, '\n', size - pos)) == NULL) {
+            return -1;
+        }
+        len = (size_t)(eol - (data + pos)) - 5;
+        if (len >= sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, data + pos + 5, len);
+        name[len] = '\0';
+        return fn(ctx, &oid, pack_type_code(name));
+    }
+    return 0;
+}
+
+/* Reachability bitmaps. cg gc --write-bitmap-index gives the largest local
+ * pack a .bitmap that records, for every ref tip and every
+ * BITMAP_COMMIT_INTERVAL-th commit below them, the objects reachable from
+ * that commit. Queries walk from their tip only until they meet a commit
+ * with a bitmap and OR it in, so history the bitmaps cover is never read.
+ * Objects the bitmapped pack does not hold, such as commits made since,
+ * are tracked in an OidSet instead. */
+#define BITMAP_COMMIT_INTERVAL 100
+
+typedef struct {
+    PackFile *pack; /* NULL if no pack has a usable .bitmap */
+    PackBitmapIndex index;
+} ReachIndex;
+
+static void reach_index_free(ReachIndex *reach) {
+    pack_bitmap_free(&reach->index);
+    reach->pack = NULL;
+}
+
+static int reach_index_load(const char *repo_root, ReachIndex *reach) {
+    size_t s;
+    size_t p;
+
+    memset(reach, 0, sizeof(*reach));
+    if (odb_prepare(repo_root) != 0) {
+        return -1;
+    }
+    for (s = 0; s < odb.store_count; s++) {
+        ObjectStore *store = &odb.stores[s];
+
+        if (!store->packs_loaded && store_load_packs(store) != 0) {
+            return -1;
+        }
+        for (p = 0; p < store->pack_count; p++) {
+            int status = pack_bitmap_read(store->packs[p], &reach->index);
+
+            if (status < 0) {
+                fprintf(stderr, "cg: warning: ignoring unusable bitmap index for %s\n", store->packs[p]->pack_path);
+            } else if (status == 0) {
+                if (pack_load_order(store->packs[p]) != 0) {
+                    pack_bitmap_free(&reach->index);
+                    return -1;
+                }
+                reach->pack = store->packs[p];
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    ObjectId oid;
+    int type;
+} ReachItem;
+
+typedef struct {
+    const char *repo_root;
+    const ReachIndex *reach;
+    bool commits_only;
+    Bitmap bits;  /* objects of the bitmapped pack, in pack order */
+    OidSet extra; /* objects outside it */
+    size_t extra_types[PACK_OBJ_TAG + 1];
+    ReachItem *stack;
+    size_t len;
+    size_t cap;
+    size_t bitmaps_used;
+    size_t objects_read;
+} ReachWalk;
+
+static void reach_walk_init(ReachWalk *walk, const char *repo_root, const ReachIndex *reach, bool commits_only) {
+    memset(walk, 0, sizeof(*walk));
+    walk->repo_root = repo_root;
+    walk->reach = reach;
+    walk->commits_only = commits_only;
+    bitmap_init(&walk->bits);
+    oid_set_init(&walk->extra);
+}
+
+static void reach_walk_free(ReachWalk *walk) {
+    bitmap_free(&walk->bits);
+    oid_set_free(&walk->extra);
+    free(walk->stack);
+}
+
+static int reach_push(void *ctx, const ObjectId *oid, int type) {
+    ReachWalk *walk = ctx;
+
+    if (walk->commits_only && type != PACK_OBJ_COMMIT) {
+        return 0;
+    }
+    if (walk->len == walk->cap) {
+        size_t new_cap = walk->cap == 0 ? 64 : walk->cap * 2;
+        ReachItem *grown = realloc(walk->stack, new_cap * sizeof(ReachItem));
+        if (grown == NULL) {
+            return -1;
+        }
+        walk->stack = grown;
+        walk->cap = new_cap;
+    }
+    walk->stack[walk->len].oid = *oid;
+    walk->stack[walk->len].type = type;
+    walk->len++;
+    return 0;
+}
+
+/* Adds everything reachable from the pushed objects to walk. Returns 1 as
+ * soon as target (if not NULL) is found to be reachable. */
+static int reach_walk_run(ReachWalk *walk, const ObjectId *target) {
+    const ReachIndex *reach = walk->reach;
+    size_t target_pos = SIZE_MAX;
+    uint32_t n;
+
+    if (target != NULL && reach->pack != NULL && pack_find_position(reach->pack, target->hash, &n)) {
+        target_pos = reach->pack->order_pos[n];
+    }
+    while (walk->len > 0) {
+        ReachItem item = walk->stack[--walk->len];
+        bool in_pack = reach->pack != NULL && pack_find_position(reach->pack, item.oid.hash, &n);
+        char type[16];
+        unsigned char *data;
+        size_t size;
+        int status;
+
+        if (in_pack) {
+            size_t pos = reach->pack->order_pos[n];
+            const PackBitmap *bitmap;
+
+            if (bitmap_get(&walk->bits, pos)) {
+                continue;
+            }
+            if (item.type != PACK_OBJ_TREE && item.type != PACK_OBJ_BLOB &&
+                (bitmap = pack_bitmap_find(&reach->index, n)) != NULL) {
+                if (bitmap_or(&walk->bits, &bitmap->bits) != 0) {
+                    return -1;
+                }
+                walk->bitmaps_used++;
+                if (target_pos != SIZE_MAX && bitmap_get(&walk->bits, target_pos)) {
+                    return 1;
+                }
+                continue;
+            }
+            if (bitmap_set(&walk->bits, pos) != 0) {
+                return -1;
+            }
+        } else {
+            status = oid_set_insert(&walk->extra, &item.oid);
+            if (status <= 0) {
+                if (status < 0) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+        if (target != NULL && oid_equal(&item.oid, target)) {
+            return 1;
+        }
+        if (item.type == PACK_OBJ_BLOB) {
+            walk->extra_types[PACK_OBJ_BLOB] += in_pack ? 0 : 1;
+            continue;
+        }
+
+        if (read_object(walk->repo_root, &item.oid, type, &data, &size) != 0) {
+            return -1;
+        }
+        walk->objects_read++;
+        item.type = pack_type_code(type);
+        if (!in_pack) {
+            walk->extra_types[item.type]++;
+        }
+        status = object_links(item.type, data, size, reach_push, walk);
+        free(data);
+        if (status != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Whether ancestor is reachable from tip, answered from the bitmaps as far
+ * as they cover history. Returns 2 if no pack has a bitmap. */
+static int reach_is_ancestor(const char *repo_root, const ObjectId *ancestor, const ObjectId *tip) {
+    ReachIndex reach;
+    ReachWalk walk;
+    int result;
+
+    if (reach_index_load(repo_root, &reach) != 0) {
+        return -1;
+    }
+    if (reach.pack == NULL) {
+        return 2;
+    }
+    reach_walk_init(&walk, repo_root, &reach, true);
+    result = reach_push(&walk, tip, PACK_OBJ_COMMIT) == 0 ? reach_walk_run(&walk, ancestor) : -1;
+    reach_walk_free(&walk);
+    reach_index_free(&reach);
+    return result;
+}
+
+typedef struct {
+    PackFile *pack;
+    Bitmap *bits; /* NULL while ordering commits: only parents are followed */
+    uint32_t *stack;
+    size_t len;
+    size_t cap;
+    bool outside; /* a link left the pack */
+} BitmapBuild;
+
+static int bitmap_build_push(BitmapBuild *build, uint32_t n) {
+    if (build->len == build->cap) {
+        size_t new_cap = build->cap == 0 ? 256 : build->cap * 2;
+        uint32_t *grown = realloc(build->stack, new_cap * sizeof(uint32_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        build->stack = grown;
+        build->cap = new_cap;
+    }
+    build->stack[build->len++] = n;
+    return 0;
+}
+
+static int bitmap_build_link(void *ctx, const ObjectId *oid, int type) {
+    BitmapBuild *build = ctx;
+    uint32_t n;
+
+    if (!pack_find_position(build->pack, oid->hash, &n)) {
+        build->outside = true;
+        return 0;
+    }
+    if (build->bits == NULL) {
+        return type == PACK_OBJ_COMMIT ? bitmap_build_push(build, n) : 0;
+    }
+    if (bitmap_get(build->bits, build->pack->order_pos[n])) {
+        return 0;
+    }
+    if (type == PACK_OBJ_BLOB) {
+        return bitmap_set(build->bits, build->pack->order_pos[n]);
+    }
+    return bitmap_build_push(build, n);
+}
+
+static int bitmap_build_read(BitmapBuild *build, uint32_t n, int *type, unsigned char **data, size_t *size) {
+    unsigned char hash[20];
+    uint64_t offset;
+
+    pack_nth(build->pack, n, hash, &offset);
+    return pack_read(build->pack, offset, NULL, NULL, type, data, size);
+}
+
+static int bitmap_build_links(BitmapBuild *build, uint32_t n) {
+    unsigned char *data;
+    size_t size;
+    int type;
+    int status;
+
+    if (bitmap_build_read(build, n, &type, &data, &size) != 0) {
+        return -1;
+    }
+    status = object_links(type, data, size, bitmap_build_link, build);
+    free(data);
+    return status;
+}
+
+/* Index position of the commit a ref in the pack points at, peeling tags;
+ * false if it is not a commit in the pack. */
+static bool bitmap_ref_commit(BitmapBuild *build, const ObjectId *oid, uint32_t *out) {
+    ObjectId current = *oid;
+    int depth;
+
+    for (depth = 0; depth < 8; depth++) {
+        unsigned char hash[20];
+        unsigned char *data;
+        uint64_t offset;
+        size_t size;
+        size_t pos = 0;
+        uint32_t n;
+        int type;
+        int status;
+
+        if (!pack_find_position(build->pack, current.hash, &n)) {
+            return false;
+        }
+        pack_nth(build->pack, n, hash, &offset);
+        type = pack_object_type(build->pack, offset);
+        if (type == PACK_OBJ_COMMIT) {
+            *out = n;
+            return true;
+        }
+        if (type != PACK_OBJ_TAG || bitmap_build_read(build, n, &type, &data, &size) != 0) {
+            return false;
+        }
+        status = object_header_oid(data, size, &pos, "object ", &current);
+        free(data);
+        if (status != 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+#define BITMAP_NEW 0
+#define BITMAP_OPEN 1
+#define BITMAP_DONE 2
+#define BITMAP_TIP 4
+
+/* Walks down from a ref whose newest commits are not in the pack yet and
+ * takes the first packed commits below them as tips. */
+static int bitmap_loose_tips(const char *repo_root, BitmapBuild *build, const ObjectId *oid, OidSet *seen,
+                             unsigned char *flags) {
+    ObjectId *stack = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int result = 0;
+
+    if (oid_set_insert(seen, oid) <= 0) {
+        return 0;
+    }
+    stack = malloc(COMMIT_MAX_PARENTS * sizeof(ObjectId));
+    if (stack == NULL) {
+        return -1;
+    }
+    cap = COMMIT_MAX_PARENTS;
+    stack[len++] = *oid;
+    while (len > 0 && result == 0) {
+        ObjectId current = stack[--len];
+        ObjectId parents[COMMIT_MAX_PARENTS];
+        size_t count;
+        size_t i;
+        uint32_t n;
+
+        if (pack_find_position(build->pack, current.hash, &n)) {
+            if ((flags[n] & BITMAP_TIP) == 0) {
+                flags[n] |= BITMAP_TIP;
+                result = bitmap_build_push(build, n);
+            }
+            continue;
+        }
+        /* Tags and unreadable commits just end the walk. */
+        if (commit_parents(repo_root, &current, parents, COMMIT_MAX_PARENTS, &count) != 0) {
+            continue;
+        }
+        if (len + count > cap) {
+            ObjectId *grown = realloc(stack, (cap * 2 + count) * sizeof(ObjectId));
+            if (grown == NULL) {
+                result = -1;
+                break;
+            }
+            stack = grown;
+            cap = cap * 2 + count;
+        }
+        for (i = 0; i < count && result == 0; i++) {
+            int added = oid_set_insert(seen, &parents[i]);
+            if (added < 0) {
+                result = -1;
+            } else if (added > 0) {
+                stack[len++] = parents[i];
+            }
+        }
+    }
+    free(stack);
+    return result;
+}
+
+/* Writes a .bitmap for the largest local pack. Commits are put in
+ * topological order first, so each selected commit's bitmap can reuse
+ * those of the selected commits below it; a commit whose history or trees
+ * leave the pack gets no bitmap. */
+static int write_bitmap_index(const char *repo_root) {
+    ObjectStore *store;
+    PackFile *pack = NULL;
+    PackBitmapIndex index;
+    BitmapBuild build;
+    RefList refs;
+    ObjectId head;
+    OidSet loose;
+    unsigned char *flags = NULL;
+    uint32_t *entry_of = NULL;
+    uint32_t *topo = NULL;
+    size_t topo_len = 0;
+    size_t skipped = 0;
+    uint32_t n;
+    size_t i;
+    int result = -1;
+
+    memset(&index, 0, sizeof(index));
+    memset(&build, 0, sizeof(build));
+    memset(&refs, 0, sizeof(refs));
+    oid_set_init(&loose);
+    if (odb_prepare(repo_root) != 0) {
+        return -1;
+    }
+    store = &odb.stores[0];
+    if (!store->packs_loaded && store_load_packs(store) != 0) {
+        return -1;
+    }
+    for (i = 0; i < store->pack_count; i++) {
+        if (pack == NULL || store->packs[i]->count > pack->count) {
+            pack = store->packs[i];
+        }
+    }
+    if (pack == NULL) {
+        fprintf(stderr, "cg gc: no local pack; not writing a bitmap index\n");
+        return 0;
+    }
+    build.pack = pack;
+    flags = calloc((size_t)pack->count + 1, 1);
+    entry_of = malloc(((size_t)pack->count + 1) * sizeof(uint32_t));
+    topo = malloc(((size_t)pack->count + 1) * sizeof(uint32_t));
+    if (flags == NULL || entry_of == NULL || topo == NULL || pack_map(pack) != 0 || pack_load_order(pack) != 0) {
+        goto done;
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (bitmap_reserve(&index.types[i], pack->count) != 0) {
+            goto done;
+        }
+    }
+    for (n = 0; n < pack->count; n++) {
+        unsigned char hash[20];
+        uint64_t offset;
+        int type;
+
+        pack_nth(pack, n, hash, &offset);
+        type = pack_object_type(pack, offset);
+        if (type == 0 || bitmap_set(&index.types[type - 1], pack->order_pos[n]) != 0) {
+            fprintf(stderr, "cg gc: cannot read object %u of %s\n", n, pack->pack_path);
+            goto done;
+        }
+        entry_of[n] = UINT32_MAX;
+    }
+
+    if (collect_refs(repo_root, "refs/", &refs) != 0) {
+        fprintf(stderr, "cg gc: cannot read refs\n");
+        goto done;
+    }
+    for (i = 0; i <= refs.len; i++) {
+        const ObjectId *oid = i < refs.len ? &refs.items[i].oid : &head;
+
+        if (i == refs.len && resolve_ref(repo_root, "HEAD", &head) != 0) {
+            break;
+        }
+        if (bitmap_ref_commit(&build, oid, &n)) {
+            if ((flags[n] & BITMAP_TIP) == 0) {
+                flags[n] |= BITMAP_TIP;
+                if (bitmap_build_push(&build, n) != 0) {
+                    goto done;
+                }
+            }
+        } else if (!pack_find_position(pack, oid->hash, &n) &&
+                   bitmap_loose_tips(repo_root, &build, oid, &loose, flags) != 0) {
+            goto done;
+        }
+    }
+    /* Depth-first over parents; a commit is done once all of them are. */
+    while (build.len > 0) {
+        n = build.stack[build.len - 1];
+        if ((flags[n] & 3) == BITMAP_NEW) {
+            flags[n] |= BITMAP_OPEN;
+            if (bitmap_build_links(&build, n) != 0) {
+                fprintf(stderr, "cg gc: cannot read commit %u of %s\n", n, pack->pack_path);
+                goto done;
+            }
+            continue;
+        }
+        build.len--;
+        if ((flags[n] & 3) == BITMAP_OPEN) {
+            flags[n] = (unsigned char)((flags[n] & ~3) | BITMAP_DONE);
+            topo[topo_len++] = n;
+        }
+    }
+
+    for (i = 0; i < topo_len; i++) {
+        uint32_t commit = topo[i];
+        PackBitmap *grown;
+        Bitmap bits;
+
+        if ((flags[commit] & BITMAP_TIP) == 0 && (i + 1) % BITMAP_COMMIT_INTERVAL != 0) {
+            continue;
+        }
+        bitmap_init(&bits);
+        build.bits = &bits;
+        build.outside = false;
+        build.len = 0;
+        if (bitmap_reserve(&bits, pack->count) != 0 || bitmap_build_push(&build, commit) != 0) {
+            bitmap_free(&bits);
+            goto done;
+        }
+        while (build.len > 0 && !build.outside) {
+            size_t pos;
+
+            n = build.stack[--build.len];
+            pos = pack->order_pos[n];
+            if (bitmap_get(&bits, pos)) {
+                continue;
+            }
+            if (n != commit && entry_of[n] != UINT32_MAX) {
+                if (bitmap_or(&bits, &index.entries[entry_of[n]].bits) != 0) {
+                    bitmap_free(&bits);
+                    goto done;
+                }
+                continue;
+            }
+            if (bitmap_set(&bits, pos) != 0 || bitmap_build_links(&build, n) != 0) {
+                fprintf(stderr, "cg gc: cannot read object %u of %s\n", n, pack->pack_path);
+                bitmap_free(&bits);
+                goto done;
+            }
+        }
+        if (build.outside) {
+            bitmap_free(&bits);
+            skipped++;
+            continue;
+        }
+        grown = realloc(index.entries, (index.count + 1) * sizeof(PackBitmap));
+        if (grown == NULL) {
+            bitmap_free(&bits);
+            goto done;
+        }
+        index.entries = grown;
+        index.entries[index.count].commit = commit;
+        index.entries[index.count].bits = bits;
+        entry_of[commit] = (uint32_t)index.count++;
+    }
+
+    if (pack_bitmap_write(pack, &index) != 0) {
+        fprintf(stderr, "cg gc: cannot write bitmap index for %s\n", pack->pack_path);
+        goto done;
+    }
+    fprintf(stderr, "cg gc: wrote reachability bitmaps for %zu of %zu commits", index.count, topo_len);
+    if (skipped > 0) {
+        fprintf(stderr, "; %zu skipped, their history leaves the pack", skipped);
+    }
+    fputc('\n', stderr);
+    if (trace_file != NULL) {
+        trace_begin_event("bitmap_write");
+        fprintf(trace_file, ",\"objects\":%u,\"commits\":%zu,\"bitmaps\":%zu}\n", pack->count, topo_len,
+                index.count);
+    }
+    result = 0;
+
+done:
+    pack_bitmap_free(&index);
+    ref_list_free(&refs);
+    oid_set_free(&loose);
+    free(build.stack);
+    free(flags);
+    free(entry_of);
+    free(topo);
+    return result;
+}
+
+static int cmd_count_objects(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    size_t counts[PACK_OBJ_TAG + 1] = {0};
+    size_t total = 0;
+    ReachIndex reach;
+    ReachWalk walk;
+    ObjectId tip;
+    int type;
+    int result = 1;
+
+    if (argc != 2 || strcmp(argv[0], "--reachable") != 0) {
+        fprintf(stderr, "cg count-objects: usage: cg count-objects --reachable <rev>\n");
+        return 1;
+    }
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg count-objects: not inside a CG repository\n");
+        return 1;
+    }
+    if (resolve_revision(repo_root, argv[1], &tip) != 0) {
+        fprintf(stderr, "cg count-objects: unknown revision '%s'\n", argv[1]);
+        return 1;
+    }
+    if (reach_index_load(repo_root, &reach) != 0) {
+        fprintf(stderr, "cg count-objects: cannot read object database\n");
+        return 1;
+    }
+    reach_walk_init(&walk, repo_root, &reach, false);
+    if (reach_push(&walk, &tip, 0) != 0 || reach_walk_run(&walk, NULL) != 0) {
+        fprintf(stderr, "cg count-objects: cannot walk objects reachable from '%s'\n", argv[1]);
+        goto done;
+    }
+    for (type = PACK_OBJ_COMMIT; type <= PACK_OBJ_TAG; type++) {
+        counts[type] = walk.extra_types[type];
+        if (reach.pack != NULL) {
+            counts[type] += bitmap_count(&walk.bits, &reach.index.types[type - 1]);
+        }
+        total += counts[type];
+    }
+    printf("%zu objects (%zu commits, %zu trees, %zu blobs, %zu tags)\n", total, counts[PACK_OBJ_COMMIT],
+           counts[PACK_OBJ_TREE], counts[PACK_OBJ_BLOB], counts[PACK_OBJ_TAG]);
+    if (trace_file != NULL) {
+        trace_begin_event("count_objects");
+        fprintf(trace_file, ",\"objects\":%zu,\"bitmaps\":%zu,\"read\":%zu}\n", total, walk.bitmaps_used,
+                walk.objects_read);
+    }
+    result = 0;
+
+done:
+    reach_walk_free(&walk);
+    reach_index_free(&reach);
+    return result;
+}
+
+/* fsck verifies every object in three steps. Inflating and rehashing is
+ * split into jobs of FSCK_CHUNK table positions (plus one job per pack for
+ * its checksums) that run on all cores; each job records the links of its
+ * objects as table positions. Connectivity is then a walk over those
+ * in-memory edges from refs, HEAD, the cg-index and the reflogs, with
+ * reachability kept in a bitmap indexed by table position, so no object is
+ * read twice. */
+#define FSCK_CHUNK 256
+#define FSCK_CORRUPT 0xff
+
+typedef struct {
+    ObjectId oid;
+    int type;
+} FsckMissing;
+
+typedef struct {
+    uint32_t *edges;
+    unsigned char *edge_types;
+    size_t edge_len;
+    size_t edge_cap;
+    FsckMissing *missing;
+    size_t missing_len;
+    size_t missing_cap;
+    uint64_t bytes;
+    bool failed;
+} FsckJob;
+
+typedef struct {
+    const ObjectTable *table;
+    unsigned char *types; /* per position: PACK_OBJ_* or FSCK_CORRUPT */
+    size_t *edge_start;   /* per position, into the edges of its job */
+    uint32_t *edge_count;
+    FsckJob *jobs;        /* job i covers positions [i * FSCK_CHUNK, (i + 1) * FSCK_CHUNK) */
+    size_t job_count;
+    bool *pack_ok;
+} FsckScan;
+
+static int fsck_link(void *ctx, const ObjectId *oid, int type) {
+    FsckScan *scan = ((void **)ctx)[0];
+    FsckJob *job = ((void **)ctx)[1];
+    size_t pos = object_table_find(scan->table, oid);
+
+    if (pos == scan->table->len) {
+        if (job->missing_len == job->missing_cap) {
+            size_t new_cap = job->missing_cap == 0 ? 16 : job->missing_cap * 2;
+            FsckMissing *grown = realloc(job->missing, new_cap * sizeof(FsckMissing));
+            if (grown == NULL) {
+                job->failed = true;
+                return -1;
+            }
+            job->missing = grown;
+            job->missing_cap = new_cap;
+        }
+        job->missing[job->missing_len].oid = *oid;
+        job->missing[job->missing_len].type = type;
+        job->missing_len++;
+        return 0;
+    }
+    if (job->edge_len == job->edge_cap) {
+        size_t new_cap = job->edge_cap == 0 ? 4096 : job->edge_cap * 2;
+        uint32_t *edges = realloc(job->edges, new_cap * sizeof(uint32_t));
+        unsigned char *types;
+        if (edges == NULL) {
+            job->failed = true;
+            return -1;
+        }
+        job->edges = edges;
+        types = realloc(job->edge_types, new_cap);
+        if (types == NULL) {
+            job->failed = true;
+            return -1;
+        }
+        job->edge_types = types;
+        job->edge_cap = new_cap;
+    }
+    job->edges[job->edge_len] = (uint32_t)pos;
+    job->edge_types[job->edge_len] = (unsigned char)type;
+    job->edge_len++;
+    return 0;
+}
+
+/* A pack ends with the SHA-1 of everything before it; its index ends with
+ * a copy of that and then its own. */
+static bool fsck_pack_checksums(const PackFile *pack) {
+    unsigned char digest[20];
+    Sha1Ctx sha;
+
+    sha1_init(&sha);
+    sha1_update(&sha, pack->data, pack->size - 20);
+    if (sha1_final(&sha, digest) != 0 || memcmp(digest, pack->data + pack->size - 20, 20) != 0 ||
+        memcmp(pack->idx + pack->idx_size - 40, digest, 20) != 0) {
+        return false;
+    }
+    sha1_init(&sha);
+    sha1_update(&sha, pack->idx, pack->idx_size - 20);
+    return sha1_final(&sha, digest) == 0 && memcmp(digest, pack->idx + pack->idx_size - 20, 20) == 0;
+}
+
+static void fsck_job(void *ctx, size_t index) {
+    FsckScan *scan = ctx;
+    const ObjectTable *table = scan->table;
+    void *link_ctx[2];
+    FsckJob *job;
+    size_t end;
+    size_t pos;
+
+    /* Pack jobs come first: a big pack's checksum is the longest job. */
+    if (index < table->pack_count) {
+        scan->pack_ok[index] = fsck_pack_checksums(table->packs[index]);
+        return;
+    }
+    index -= table->pack_count;
+    job = &scan->jobs[index];
+    link_ctx[0] = scan;
+    link_ctx[1] = job;
+    end = (index + 1) * FSCK_CHUNK < table->len ? (index + 1) * FSCK_CHUNK : table->len;
+    for (pos = index * FSCK_CHUNK; pos < end && !job->failed; pos++) {
+        ObjectId actual;
+        unsigned char *data;
+        size_t size;
+        int type;
+
+        scan->types[pos] = FSCK_CORRUPT;
+        scan->edge_start[pos] = job->edge_len;
+        scan->edge_count[pos] = 0;
+        if (object_table_read(table, pos, &type, &data, &size) != 0) {
+            continue;
+        }
+        job->bytes += size;
+        if (hash_object_buffer(pack_type_name(type), data, size, &actual) == 0 && oid_equal(&actual, &table->items[pos].oid)) {
+            size_t missing_mark = job->missing_len;
+            if (object_links(type, data, size, fsck_link, link_ctx) == 0) {
+                scan->types[pos] = (unsigned char)type;
+                scan->edge_count[pos] = (uint32_t)(job->edge_len - scan->edge_start[pos]);
+            } else {
+                /* Malformed, unless fsck_link ran out of memory. */
+                job->edge_len = scan->edge_start[pos];
+                job->missing_len = missing_mark;
+            }
+        }
+        free(data);
+    }
+}
+
+static int fsck_missing_cmp(const void *left, const void *right) {
+    return memcmp(((const FsckMissing *)left)->oid.hash, ((const FsckMissing *)right)->oid.hash, 20);
+}
+
+typedef struct {
+    FsckScan *scan;
+    Bitmap *reachable;
+    size_t *stack;
+    size_t depth;
+} FsckWalk;
+
+/* Returns 1 if the store lacks oid. */
+static int fsck_root(FsckWalk *walk, const ObjectId *oid) {
+    size_t pos = object_table_find(walk->scan->table, oid);
+
+    if (pos == walk->scan->table->len) {
+        return 1;
+    }
+    if (!bitmap_get(walk->reachable, pos)) {
+        bitmap_set(walk->reachable, pos);
+        walk->stack[walk->depth++] = pos;
+    }
+    return 0;
+}
+
+static int fsck_reflog_root(void *ctx, const ObjectId *oid) {
+    /* Expired history may legitimately be gone; only refs must resolve. */
+    (void)fsck_root(ctx, oid);
+    return 0;
+}
+
+static const char *fsck_type_name(int type) {
+    const char *name = pack_type_name(type);
+    return name != NULL ? name : "object";
+}
+
+/* Follows the recorded edges from every root. Links whose target turns out
+ * to have another type than the link implies are reported as broken. */
+static size_t fsck_walk(FsckWalk *walk) {
+    const FsckScan *scan = walk->scan;
+    size_t broken = 0;
+
+    while (walk->depth > 0) {
+        size_t pos = walk->stack[--walk->depth];
+        const FsckJob *job = &scan->jobs[pos / FSCK_CHUNK];
+        size_t i;
+
+        for (i = 0; i < scan->edge_count[pos]; i++) {
+            size_t edge = scan->edge_start[pos] + i;
+            size_t target = job->edges[edge];
+            int expected = job->edge_types[edge];
+
+            if (expected != 0 && scan->types[target] != FSCK_CORRUPT && scan->types[target] != expected) {
+                char from_hex[41];
+                char to_hex[41];
+                oid_to_hex(&scan->table->items[pos].oid, from_hex);
+                oid_to_hex(&scan->table->items[target].oid, to_hex);
+                printf("broken link from %s %s to %s %s (a %s)\n", fsck_type_name(scan->types[pos]), from_hex,
+                       fsck_type_name(expected), to_hex, fsck_type_name(scan->types[target]));
+                broken++;
+            }
+            if (!bitmap_get(walk->reachable, target)) {
+                bitmap_set(walk->reachable, target);
+                walk->stack[walk->depth++] = target;
+            }
+        }
+    }
+    return broken;
+}
+
+static int cmd_fsck(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    ObjectTable table;
+    FsckScan scan;
+    FsckWalk walk;
+    Bitmap reachable;
+    Bitmap referenced;
+    RefList refs;
+    IndexList index;
+    FsckMissing *missing = NULL;
+    size_t missing_len = 0;
+    size_t errors = 0;
+    size_t threads;
+    uint64_t bytes = 0;
+    long long started;
+    double seconds;
+    bool show_dangling = true;
+    ObjectId head;
+    size_t i;
+    int result = 1;
+    TraceRegion phase;
+
+    for (i = 0; i < (size_t)argc; i++) {
+        if (strcmp(argv[i], "--no-dangling") == 0) {
+            show_dangling = false;
+        } else {
+            fprintf(stderr, "cg fsck: usage: cg fsck [--no-dangling]\n");
+            return 1;
+        }
+    }
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg fsck: not inside a CG repository\n");
+        return 1;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    memset(&refs, 0, sizeof(refs));
+    memset(&index, 0, sizeof(index));
+    bitmap_init(&reachable);
+    bitmap_init(&referenced);
+    walk.stack = NULL;
+
+    started = trace_now_ns();
+    trace_region_enter(&phase, "fsck_enumerate");
+    if (object_table_build(repo_root, &table) != 0) {
+        fprintf(stderr, "cg fsck: cannot enumerate objects\n");
+        return 1;
+    }
+    trace_region_leave(&phase);
+
+    scan.table = &table;
+    scan.job_count = (table.len + FSCK_CHUNK - 1) / FSCK_CHUNK;
+    scan.types = malloc(table.len + 1);
+    scan.edge_start = malloc((table.len + 1) * sizeof(size_t));
+    scan.edge_count = malloc((table.len + 1) * sizeof(uint32_t));
+    scan.jobs = calloc(scan.job_count + 1, sizeof(FsckJob));
+    scan.pack_ok = calloc(table.pack_count + 1, sizeof(bool));
+    walk.stack = malloc((table.len + 1) * sizeof(size_t));
+    if (scan.types == NULL || scan.edge_start == NULL || scan.edge_count == NULL || scan.jobs == NULL ||
+        scan.pack_ok == NULL || walk.stack == NULL || bitmap_reserve(&reachable, table.len) != 0 ||
+        bitmap_reserve(&referenced, table.len) != 0) {
+        fprintf(stderr, "cg fsck: out of memory\n");
+        goto done;
+    }
+
+    threads = parallel_worker_count(table.pack_count + scan.job_count);
+    trace_region_enter(&phase, "fsck_verify");
+    parallel_for(table.pack_count + scan.job_count, fsck_job, &scan);
+    trace_region_leave(&phase);
+
+    for (i = 0; i < scan.job_count; i++) {
+        if (scan.jobs[i].failed) {
+            fprintf(stderr, "cg fsck: out of memory\n");
+            goto done;
+        }
+        bytes += scan.jobs[i].bytes;
+        missing_len += scan.jobs[i].missing_len;
+    }
+    for (i = 0; i < table.pack_count; i++) {
+        if (!scan.pack_ok[i]) {
+            fprintf(stderr, "cg fsck: %s: checksum mismatch\n", table.packs[i]->pack_path);
+            errors++;
+        }
+    }
+    for (i = 0; i < table.len; i++) {
+        if (scan.types[i] == FSCK_CORRUPT) {
+            char hex[41];
+            oid_to_hex(&table.items[i].oid, hex);
+            printf("corrupt object %s\n", hex);
+            errors++;
+        }
+    }
+
+    /* Each missing object once, however many objects point at it. */
+    missing = malloc((missing_len + 1) * sizeof(FsckMissing));
+    if (missing == NULL) {
+        goto done;
+    }
+    missing_len = 0;
+    for (i = 0; i < scan.job_count; i++) {
+        memcpy(missing + missing_len, scan.jobs[i].missing, scan.jobs[i].missing_len * sizeof(FsckMissing));
+        missing_len += scan.jobs[i].missing_len;
+    }
+    qsort(missing, missing_len, sizeof(FsckMissing), fsck_missing_cmp);
+    for (i = 0; i < missing_len; i++) {
+        if (i == 0 || !oid_equal(&missing[i - 1].oid, &missing[i].oid)) {
+            char hex[41];
+            oid_to_hex(&missing[i].oid, hex);
+            printf("missing %s %s\n", fsck_type_name(missing[i].type), hex);
+            errors++;
+        }
+    }
+
+    trace_region_enter(&phase, "fsck_connectivity");
+    walk.scan = &scan;
+    walk.reachable = &reachable;
+    walk.depth = 0;
+    if (collect_refs(repo_root, "refs/", &refs) != 0) {
+        fprintf(stderr, "cg fsck: cannot read refs\n");
+        goto done;
+    }
+    for (i = 0; i < refs.len; i++) {
+        if (fsck_root(&walk, &refs.items[i].oid) != 0) {
+            char hex[41];
+            oid_to_hex(&refs.items[i].oid, hex);
+            printf("missing object %s for %s\n", hex, refs.items[i].name);
+            errors++;
+        }
+    }
+    if (resolve_ref(repo_root, "HEAD", &head) == 0 && fsck_root(&walk, &head) != 0) {
+        char hex[41];
+        oid_to_hex(&head, hex);
+        printf("missing object %s for HEAD\n", hex);
+        errors++;
+    }
+    if (read_cg_index(repo_root, &index) != 0) {
+        fprintf(stderr, "cg fsck: cannot read cg-index\n");
+        goto done;
+    }
+    for (i = 0; i < index.len; i++) {
+        if (fsck_root(&walk, &index.items[i].oid) != 0) {
+            char hex[41];
+            oid_to_hex(&index.items[i].oid, hex);
+            printf("missing blob %s for cg-index entry '%s'\n", hex, index.items[i].path);
+            errors++;
+        }
+    }
+    if (reflogs_walk(repo_root, fsck_reflog_root, &walk) != 0) {
+        fprintf(stderr, "cg fsck: warning: cannot read reflogs\n");
+    }
+    errors += fsck_walk(&walk);
+    trace_region_leave(&phase);
+
+    /* Dangling: unreachable, and not pointed at by another unreachable
+     * object either, so only the tips of lost history are listed. */
+    if (show_dangling) {
+        for (i = 0; i < table.len; i++) {
+            const FsckJob *job = &scan.jobs[i / FSCK_CHUNK];
+            uint32_t j;
+
+            if (bitmap_get(&reachable, i)) {
+                continue;
+            }
+            for (j = 0; j < scan.edge_count[i]; j++) {
+                bitmap_set(&referenced, job->edges[scan.edge_start[i] + j]);
+            }
+        }
+        for (i = 0; i < table.len; i++) {
+            if (!bitmap_get(&reachable, i) && !bitmap_get(&referenced, i) && scan.types[i] != FSCK_CORRUPT &&
+                table.items[i].store == 0) {
+                char hex[41];
+                oid_to_hex(&table.items[i].oid, hex);
+                printf("dangling %s %s\n", fsck_type_name(scan.types[i]), hex);
+            }
+        }
+    }
+
+    seconds = (double)(trace_now_ns() - started) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    fprintf(stderr, "cg fsck: checked %zu object%s (%.1f MiB) in %.2fs: %.0f objects/s, %.1f MiB/s on %zu thread%s\n",
+            table.len, table.len == 1 ? "" : "s", (double)bytes / (1024.0 * 1024.0), seconds,
+            (double)table.len / seconds, (double)bytes / (1024.0 * 1024.0) / seconds, threads,
+            threads == 1 ? "" : "s");
+    if (trace_file != NULL) {
+        trace_begin_event("fsck");
+        fprintf(trace_file, ",\"objects\":%zu,\"packs\":%zu,\"bytes\":%llu,\"threads\":%zu,\"errors\":%zu}\n",
+                table.len, table.pack_count, (unsigned long long)bytes, threads, errors);
+    }
+    result = errors > 0 ? 1 : 0;
+
+done:
+    for (i = 0; scan.jobs != NULL && i < scan.job_count; i++) {
+        free(scan.jobs[i].edges);
+        free(scan.jobs[i].edge_types);
+        free(scan.jobs[i].missing);
+    }
+    free(scan.jobs);
+    free(scan.types);
+    free(scan.edge_start);
+    free(scan.edge_count);
+    free(scan.pack_ok);
+    free(walk.stack);
+    free(missing);
+    bitmap_free(&reachable);
+    bitmap_free(&referenced);
+    ref_list_free(&refs);
+    index_list_free(&index);
+    object_table_free(&table);
+    return result;
+}
+
+/* cg gc marks every object reachable from refs, HEAD, the cg-index (blobs
+ * and cache-tree entries) and the reflogs in a bitmap keyed by table
+ * position, then unlinks the unmarked loose objects older than the grace
+ * period. Commits and tags are walked one at a time; trees, the bulk of
+ * the work, go level by level through a worker pool that marks with atomic
+ * bit operations, so the number of passes is the depth of the directory
+ * hierarchy and not the length of history. */
+#define GC_TREE_CHUNK 64
+#define GC_DEFAULT_EXPIRE "2.weeks.ago"
+#define GC_SWEEP_JOBS 257
+
+typedef struct {
+    size_t *items;
+    size_t len;
+    size_t cap;
+} PositionList;
+
+static int position_list_push(PositionList *list, size_t pos) {
+    if (list->len == list->cap) {
+        size_t new_cap = list->cap == 0 ? 256 : list->cap * 2;
+        size_t *grown = realloc(list->items, new_cap * sizeof(size_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->items = grown;
+        list->cap = new_cap;
+    }
+    list->items[list->len++] = pos;
+    return 0;
+}
+
+/* Sets bit pos and returns whether it was already set; safe to race. */
+static bool bitmap_test_and_set(Bitmap *bitmap, size_t pos) {
+    uint64_t mask = (uint64_t)1 << (pos % 64);
+    return (__atomic_fetch_or(&bitmap->words[pos / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+typedef struct {
+    const ObjectTable *table;
+    Bitmap marked;
+    PositionList pending; /* commits, tags and objects of unknown type */
+    PositionList trees;   /* the next tree level */
+    size_t missing;
+} GcMark;
+
+typedef struct {
+    GcMark *mark;
+    const size_t *trees;
+    size_t tree_count;
+    PositionList *next; /* one list per job */
+    bool *failed;
+} GcTreePass;
+
+/* Queues an object for the walk unless it is marked already. Missing
+ * objects are counted; the caller decides whether that is fatal. */
+static int gc_mark_oid(GcMark *mark, const ObjectId *oid, int type) {
+    size_t pos = object_table_find(mark->table, oid);
+
+    if (pos == mark->table->len) {
+        mark->missing++;
+        return 0;
+    }
+    if (bitmap_test_and_set(&mark->marked, pos) || type == PACK_OBJ_BLOB) {
+        return 0;
+    }
+    return position_list_push(type == PACK_OBJ_TREE ? &mark->trees : &mark->pending, pos);
+}
+
+static int gc_mark_link(void *ctx, const ObjectId *oid, int type) {
+    return gc_mark_oid(ctx, oid, type);
+}
+
+static int gc_mark_reflog(void *ctx, const ObjectId *oid) {
+    GcMark *mark = ctx;
+    size_t missing = mark->missing;
+    int result = gc_mark_oid(mark, oid, 0);
+
+    /* Reflogs may name history that is already gone. */
+    mark->missing = missing;
+    return result;
+}
+
+static int gc_mark_cache_tree(GcMark *mark, const CacheTree *node) {
+    size_t i;
+
+    if (node == NULL) {
+        return 0;
+    }
+    if (node->entry_count >= 0 && gc_mark_oid(mark, &node->oid, PACK_OBJ_TREE) != 0) {
+        return -1;
+    }
+    for (i = 0; i < node->child_count; i++) {
+        if (gc_mark_cache_tree(mark, node->children[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    GcMark *mark;
+    PositionList *next;
+    bool failed;
+} GcTreeLink;
+
+static int gc_tree_link(void *ctx, const ObjectId *oid, int type) {
+    GcTreeLink *link = ctx;
+    const ObjectTable *table = link->mark->table;
+    size_t pos = object_table_find(table, oid);
+
+    if (pos == table->len) {
+        link->failed = true;
+        return -1;
+    }
+    if (bitmap_test_and_set(&link->mark->marked, pos) || type != PACK_OBJ_TREE) {
+        return 0;
+    }
+    if (position_list_push(link->next, pos) != 0) {
+        link->failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+static void gc_tree_job(void *ctx, size_t index) {
+    GcTreePass *pass = ctx;
+    size_t end = (index + 1) * GC_TREE_CHUNK < pass->tree_count ? (index + 1) * GC_TREE_CHUNK : pass->tree_count;
+    GcTreeLink link;
+    size_t i;
+
+    link.mark = pass->mark;
+    link.next = &pass->next[index];
+    link.failed = false;
+    for (i = index * GC_TREE_CHUNK; i < end && !link.failed; i++) {
+        unsigned char *data;
+        size_t size;
+        int type;
+
+        if (object_table_read(pass->mark->table, pass->trees[i], &type, &data, &size) != 0) {
+            link.failed = true;
+            break;
+        }
+        if (type != PACK_OBJ_TREE || object_links(type, data, size, gc_tree_link, &link) != 0) {
+            link.failed = true;
+        }
+        free(data);
+    }
+    pass->failed[index] = link.failed;
+}
+
+static int gc_mark_walk(GcMark *mark) {
+    for (;;) {
+        GcTreePass pass;
+        PositionList level;
+        size_t jobs;
+        size_t i;
+        int result = 0;
+
+        while (mark->pending.len > 0) {
+            size_t pos = mark->pending.items[--mark->pending.len];
+            unsigned char *data;
+            size_t size;
+            int type;
+
+            if (object_table_read(mark->table, pos, &type, &data, &size) != 0) {
+                char hex[41];
+                oid_to_hex(&mark->table->items[pos].oid, hex);
+                fprintf(stderr, "cg gc: cannot read object %s\n", hex);
+                return -1;
+            }
+            if (type == PACK_OBJ_TREE) {
+                result = position_list_push(&mark->trees, pos);
+            } else {
+                result = object_links(type, data, size, gc_mark_link, mark);
+            }
+            free(data);
+            if (result != 0) {
+                return -1;
+            }
+        }
+        if (mark->trees.len == 0) {
+            return 0;
+        }
+
+        level = mark->trees;
+        memset(&mark->trees, 0, sizeof(mark->trees));
+        jobs = (level.len + GC_TREE_CHUNK - 1) / GC_TREE_CHUNK;
+        pass.mark = mark;
+        pass.trees = level.items;
+        pass.tree_count = level.len;
+        pass.next = calloc(jobs, sizeof(PositionList));
+        pass.failed = calloc(jobs, sizeof(bool));
+        if (pass.next == NULL || pass.failed == NULL) {
+            result = -1;
+        } else {
+            parallel_for(jobs, gc_tree_job, &pass);
+        }
+        for (i = 0; pass.next != NULL && i < jobs; i++) {
+            size_t j;
+            if (pass.failed[i]) {
+                result = -1;
+            }
+            for (j = 0; j < pass.next[i].len && result == 0; j++) {
+                result = position_list_push(&mark->trees, pass.next[i].items[j]);
+            }
+            free(pass.next[i].items);
+        }
+        free(pass.next);
+        free(pass.failed);
+        free(level.items);
+        if (result != 0) {
+            fprintf(stderr, "cg gc: cannot read every reachable tree\n");
+            return -1;
+        }
+    }
+}
+
+/* Accepts "now", "never" and "<n>.<unit>.ago" with unit one of second,
+ * minute, hour, day or week, optionally plural. */
+static int gc_parse_expire(const char *text, time_t now, time_t *cutoff, bool *never) {
+    static const struct {
+        const char *name;
+        long seconds;
+    } units[] = {{"second", 1}, {"minute", 60}, {"hour", 3600}, {"day", 86400}, {"week", 604800}};
+    char *end;
+    long count;
+    size_t i;
+
+    *never = false;
+    if (strcmp(text, "now") == 0) {
+        *cutoff = now;
+        return 0;
+    }
+    if (strcmp(text, "never") == 0) {
+        *never = true;
+        return 0;
+    }
+    count = strtol(text, &end, 10);
+    if (end == text || *end != '.' || count < 0) {
+        return -1;
+    }
+    for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        size_t len = strlen(units[i].name);
+        const char *rest = end + 1;
+
+        if (strncmp(rest, units[i].name, len) != 0) {
+            continue;
+        }
+        rest += len;
+        if (*rest == 's') {
+            rest++;
+        }
+        if (strcmp(rest, ".ago") != 0) {
+            return -1;
+        }
+        *cutoff = now - (time_t)count * units[i].seconds;
+        return 0;
+    }
+    return -1;
+}
+
+typedef struct {
+    const ObjectTable *table;
+    const Bitmap *marked;
+    ObjectStore *store;
+    time_t cutoff;
+    size_t pruned[GC_SWEEP_JOBS];
+    size_t recent[GC_SWEEP_JOBS];
+    uint64_t bytes[GC_SWEEP_JOBS];
+} GcSweep;
+
+/* One job per fan-out directory, plus one for the temporary files that
+ * interrupted writers leave in objects/. */
+static void gc_sweep_job(void *ctx, size_t index) {
+    GcSweep *sweep = ctx;
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (index == 256) {
+        DIR *dir = opendir(sweep->store->dir);
+        struct dirent *entry;
+
+        if (dir == NULL) {
+            return;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "tmp_obj_", 8) == 0 &&
+                path_join(sweep->store->dir, entry->d_name, path, sizeof(path)) == 0 && lstat(path, &st) == 0 &&
+                S_ISREG(st.st_mode) && st.st_mtime <= sweep->cutoff && unlink(path) == 0) {
+                sweep->bytes[index] += (uint64_t)st.st_size;
+            }
+        }
+        closedir(dir);
+        return;
     }
 
     {
-        size_t needed = strlen("GIT_AUTHOR_NAME='CG' GIT_AUTHOR_EMAIL='cg@local' "
-                               "GIT_COMMITTER_NAME='CG' GIT_COMMITTER_EMAIL='cg@local' "
-                               "git -C  commit-tree   -m  2>/dev/null") +
-                        strlen(qroot) + strlen(tree_hash) + strlen(qmsg) + (has_parent ? strlen(parent_hash) + 4 : 0) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            goto fail;
+        const ObjectId *loose = sweep->store->loose[index];
+        size_t count = sweep->store->loose_len[index];
+        size_t i;
+
+        for (i = 0; i < count; i++) {
+            char hex[41];
+            size_t pos = object_table_find(sweep->table, &loose[i]);
+
+            if (pos < sweep->table->len && bitmap_get(sweep->marked, pos)) {
+                continue;
+            }
+            oid_to_hex(&loose[i], hex);
+            if (snprintf(path, sizeof(path), "%s/%.2s/%s", sweep->store->dir, hex, hex + 2) >= (int)sizeof(path) ||
+                lstat(path, &st) != 0) {
+                continue;
+            }
+            if (st.st_mtime > sweep->cutoff) {
+                sweep->recent[index]++;
+            } else if (unlink(path) == 0) {
+                sweep->pruned[index]++;
+                sweep->bytes[index] += (uint64_t)st.st_size;
+            }
+        }
+        if (sweep->pruned[index] > 0 &&
+            snprintf(path, sizeof(path), "%s/%02x", sweep->store->dir, (unsigned int)index) < (int)sizeof(path)) {
+            /* Fails harmlessly while objects remain. */
+            rmdir(path);
+        }
+    }
+}
+
+static int cmd_gc(int argc, char **argv) {
+    char repo_root[PATH_MAX];
+    const char *expire = GC_DEFAULT_EXPIRE;
+    ObjectTable table;
+    GcMark mark;
+    GcSweep *sweep = NULL;
+    RefList refs;
+    IndexList index;
+    ObjectId head;
+    time_t cutoff = 0;
+    bool never = false;
+    bool write_bitmap = false;
+    size_t pruned = 0;
+    size_t recent = 0;
+    uint64_t bytes = 0;
+    size_t i;
+    int result = 1;
+    TraceRegion phase;
+
+    for (i = 0; i < (size_t)argc; i++) {
+        if (strcmp(argv[i], "--prune") == 0) {
+            expire = GC_DEFAULT_EXPIRE;
+        } else if (strncmp(argv[i], "--prune=", 8) == 0) {
+            expire = argv[i] + 8;
+        } else if (strcmp(argv[i], "--no-prune") == 0) {
+            expire = "never";
+        } else if (strcmp(argv[i], "--write-bitmap-index") == 0) {
+            write_bitmap = true;
+        } else {
+            fprintf(stderr, "cg gc: usage: cg gc [--prune[=<date>] | --no-prune] [--write-bitmap-index]\n");
+            return 1;
+        }
+    }
+    if (gc_parse_expire(expire, time(NULL), &cutoff, &never) != 0) {
+        fprintf(stderr, "cg gc: invalid prune date '%s'\n", expire);
+        return 1;
+    }
+    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
+        fprintf(stderr, "cg gc: not inside a CG repository\n");
+        return 1;
+    }
+    if (write_bitmap && write_bitmap_index(repo_root) != 0) {
+        return 1;
+    }
+    if (never) {
+        return 0;
+    }
+
+    memset(&mark, 0, sizeof(mark));
+    memset(&refs, 0, sizeof(refs));
+    memset(&index, 0, sizeof(index));
+    bitmap_init(&mark.marked);
+
+    trace_region_enter(&phase, "gc_enumerate");
+    if (object_table_build(repo_root, &table) != 0) {
+        fprintf(stderr, "cg gc: cannot enumerate objects\n");
+        return 1;
+    }
+    trace_region_leave(&phase);
+    mark.table = &table;
+    if (bitmap_reserve(&mark.marked, table.len) != 0) {
+        goto done;
+    }
+
+    trace_region_enter(&phase, "gc_mark");
+    if (collect_refs(repo_root, "refs/", &refs) != 0 || read_cg_index(repo_root, &index) != 0) {
+        fprintf(stderr, "cg gc: cannot read refs or cg-index\n");
+        goto done;
+    }
+    for (i = 0; i < refs.len; i++) {
+        if (gc_mark_oid(&mark, &refs.items[i].oid, 0) != 0) {
+            goto done;
+        }
+    }
+    if (resolve_ref(repo_root, "HEAD", &head) == 0 && gc_mark_oid(&mark, &head, 0) != 0) {
+        goto done;
+    }
+    for (i = 0; i < index.len; i++) {
+        if (gc_mark_oid(&mark, &index.items[i].oid, PACK_OBJ_BLOB) != 0) {
+            goto done;
         }
-        if (has_parent) {
-            snprintf(command,
-                     needed,
-                     "GIT_AUTHOR_NAME='CG' GIT_AUTHOR_EMAIL='cg@local' "
-                     "GIT_COMMITTER_NAME='CG' GIT_COMMITTER_EMAIL='cg@local' "
-                     "git -C %s commit-tree %s -p %s -m %s 2>/dev/null",
-                     qroot,
-                     tree_hash,
-                     parent_hash,
-                     qmsg);
-        } else {
-            snprintf(command,
-                     needed,
-                     "GIT_AUTHOR_NAME='CG' GIT_AUTHOR_EMAIL='cg@local' "
-                     "GIT_COMMITTER_NAME='CG' GIT_COMMITTER_EMAIL='cg@local' "
-                     "git -C %s commit-tree %s -m %s 2>/dev/null",
-                     qroot,
-                     tree_hash,
-                     qmsg);
+    }
+    if (gc_mark_cache_tree(&mark, index.cache_tree) != 0 || reflogs_walk(repo_root, gc_mark_reflog, &mark) != 0) {
+        goto done;
+    }
+    if (gc_mark_walk(&mark) != 0) {
+        fprintf(stderr, "cg gc: not pruning\n");
+        goto done;
+    }
+    if (mark.missing > 0) {
+        fprintf(stderr, "cg gc: %zu reachable objects are missing; not pruning\n", mark.missing);
+        goto done;
+    }
+    trace_region_leave(&phase);
+
+    trace_region_enter(&phase, "gc_sweep");
+    sweep = calloc(1, sizeof(*sweep));
+    if (sweep == NULL) {
+        goto done;
+    }
+    sweep->table = &table;
+    sweep->marked = &mark.marked;
+    sweep->store = &odb.stores[0];
+    sweep->cutoff = cutoff;
+    parallel_for_threads(GC_SWEEP_JOBS, parallel_worker_count(GC_SWEEP_JOBS) * 2, gc_sweep_job, sweep);
+    for (i = 0; i < GC_SWEEP_JOBS; i++) {
+        pruned += sweep->pruned[i];
+        recent += sweep->recent[i];
+        bytes += sweep->bytes[i];
+    }
+    trace_region_leave(&phase);
+
+    fprintf(stderr, "cg gc: pruned %zu unreachable loose object%s (%.1f KiB)", pruned, pruned == 1 ? "" : "s",
+            (double)bytes / 1024.0);
+    if (recent > 0) {
+        fprintf(stderr, ", kept %zu newer than %s", recent, expire);
+    }
+    fputc('\n', stderr);
+    if (trace_file != NULL) {
+        trace_begin_event("gc_prune");
+        fprintf(trace_file, ",\"objects\":%zu,\"pruned\":%zu,\"recent\":%zu,\"bytes\":%llu}\n", table.len, pruned,
+                recent, (unsigned long long)bytes);
+    }
+    result = 0;
+
+done:
+    free(sweep);
+    free(mark.pending.items);
+    free(mark.trees.items);
+    bitmap_free(&mark.marked);
+    ref_list_free(&refs);
+    index_list_free(&index);
+    object_table_free(&table);
+    /* Listings cached by the object database are stale now. */
+    odb_invalidate();
+    return result;
+}
+
+/* Loose objects live in 256 fan-out directories; clone handles each of them
+ * and objects/pack as one job. */
+#define CLONE_OBJECT_JOBS 257
+/* A checkout batch is written out once its blobs pass this many bytes,
+ * even if more object reads are still queued. */
+#define CHECKOUT_BATCH_BYTES (64 * 1024 * 1024)
+
+/* Copies src into a new file dst. copy_file_range lets filesystems that
+ * support it share extents instead of moving bytes through user space. */
+static int copy_file(const char *src, const char *dst, mode_t mode) {
+    unsigned char buffer[HASH_CHUNK_SIZE];
+    struct stat st;
+    off_t done = 0;
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    int out = -1;
+    int result = -1;
+
+    if (in < 0 || fstat(in, &st) != 0) {
+        goto done;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (out < 0) {
+        goto done;
+    }
+    while (done < st.st_size) {
+        ssize_t copied = copy_file_range(in, NULL, out, NULL, (size_t)(st.st_size - done), 0);
+        if (copied <= 0) {
+            break;
         }
-        if (run_command_capture(command, output, sizeof(output)) != 0) {
-            fprintf(stderr, "cg commit: cannot create commit object\n");
-            goto fail;
+        done += copied;
+    }
+    for (;;) {
+        ssize_t got = read(in, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+            continue;
         }
-        strip_newlines(output);
-        if (!is_hash40(output)) {
-            fprintf(stderr, "cg commit: invalid commit hash\n");
-            goto fail;
+        if (got < 0 || (got > 0 && write_all(out, buffer, (size_t)got) != 0)) {
+            goto done;
+        }
+        if (got == 0) {
+            break;
         }
-        memcpy(commit_hash, output, 41);
-        free(command);
-        command = NULL;
     }
+    result = close(out);
+    out = -1;
 
-    {
-        size_t needed = strlen("git -C  update-ref HEAD  2>/dev/null") + strlen(qroot) + strlen(commit_hash) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            goto fail;
+done:
+    if (out >= 0) {
+        close(out);
+        unlink(dst);
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    return result == 0 ? 0 : -1;
+}
+
+typedef struct {
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    bool hardlink;
+    int status[CLONE_OBJECT_JOBS];
+    size_t linked[CLONE_OBJECT_JOBS];
+    size_t copied[CLONE_OBJECT_JOBS];
+} CloneObjects;
+
+static void clone_objects_job(void *ctx, size_t index) {
+    CloneObjects *job = (CloneObjects *)ctx;
+    char name[8];
+    char src_dir[PATH_MAX];
+    char dst_dir[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+
+    job->status[index] = -1;
+    if (index < 256) {
+        snprintf(name, sizeof(name), "%02x", (unsigned int)index);
+    } else {
+        snprintf(name, sizeof(name), "pack");
+    }
+    if (path_join(job->src, name, src_dir, sizeof(src_dir)) != 0 ||
+        path_join(job->dst, name, dst_dir, sizeof(dst_dir)) != 0) {
+        return;
+    }
+    dir = opendir(src_dir);
+    if (dir == NULL) {
+        job->status[index] = errno == ENOENT ? 0 : -1;
+        return;
+    }
+    if (ensure_dir(dst_dir) != 0) {
+        closedir(dir);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char from[PATH_MAX];
+        char to[PATH_MAX];
+
+        /* Skips ".", ".." and temporary files of writers still running. */
+        if (entry->d_name[0] == '.' || strncmp(entry->d_name, "tmp_", 4) == 0) {
+            continue;
         }
-        snprintf(command, needed, "git -C %s update-ref HEAD %s 2>/dev/null", qroot, commit_hash);
-        if (run_command_capture(command, output, sizeof(output)) != 0) {
-            fprintf(stderr, "cg commit: cannot update HEAD\n");
-            goto fail;
+        if (path_join(src_dir, entry->d_name, from, sizeof(from)) != 0 ||
+            path_join(dst_dir, entry->d_name, to, sizeof(to)) != 0) {
+            closedir(dir);
+            return;
         }
-        free(command);
-        command = NULL;
+        if (job->hardlink && link(from, to) == 0) {
+            job->linked[index]++;
+            continue;
+        }
+        if (job->hardlink && errno != EXDEV && errno != EPERM && errno != EMLINK) {
+            closedir(dir);
+            return;
+        }
+        if (copy_file(from, to, 0444) != 0) {
+            closedir(dir);
+            return;
+        }
+        job->copied[index]++;
     }
+    closedir(dir);
+    job->status[index] = 0;
+}
 
-    {
-        size_t needed = strlen("git -C  read-tree HEAD 2>/dev/null") + strlen(qroot) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            goto fail;
+/* Points dst at the object stores it borrows from: the source's own store
+ * when shared (git follows the source's alternates from there), otherwise
+ * the source's alternates, rewritten as absolute paths. */
+static int clone_alternates(const char *src_objects, const char *dst_objects, bool shared) {
+    char path[PATH_MAX];
+    char info_dir[PATH_MAX];
+    char line[PATH_MAX];
+    char *buffer = NULL;
+    size_t buffer_len = 0;
+    FILE *in = NULL;
+    FILE *out;
+    int result = -1;
+
+    out = open_memstream(&buffer, &buffer_len);
+    if (out == NULL) {
+        return -1;
+    }
+    if (shared) {
+        fprintf(out, "%s\n", src_objects);
+    } else {
+        if (path_join(src_objects, "info/alternates", path, sizeof(path)) != 0) {
+            goto done;
         }
-        snprintf(command, needed, "git -C %s read-tree HEAD 2>/dev/null", qroot);
-        (void)run_command_capture(command, output, sizeof(output));
-        free(command);
-        command = NULL;
+        in = fopen(path, "r");
+        while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+            char joined[PATH_MAX];
+            char resolved[PATH_MAX];
+            strip_newlines(line);
+            if (line[0] == '\0' || line[0] == '#') {
+                continue;
+            }
+            if (line[0] == '/') {
+                fprintf(out, "%s\n", line);
+            } else if (path_join(src_objects, line, joined, sizeof(joined)) == 0) {
+                fprintf(out, "%s\n", realpath(joined, resolved) != NULL ? resolved : joined);
+            }
+        }
+    }
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto done;
     }
+    out = NULL;
 
-    if (sync_cg_index_from_head(repo_root) != 0) {
-        fprintf(stderr, "cg commit: warning: failed to sync cg-index with HEAD\n");
+    result = 0;
+    if (buffer_len > 0) {
+        result = path_join(dst_objects, "info", info_dir, sizeof(info_dir)) == 0 && ensure_dir(info_dir) == 0 &&
+                         path_join(info_dir, "alternates", path, sizeof(path)) == 0 &&
+                         write_text_file(path, buffer) == 0
+                     ? 0
+                     : -1;
     }
 
-    if (get_current_branch(repo_root, branch, sizeof(branch)) != 0) {
-        snprintf(branch, sizeof(branch), "detached");
+done:
+    if (out != NULL) {
+        fclose(out);
     }
+    if (in != NULL) {
+        fclose(in);
+    }
+    free(buffer);
+    return result;
+}
 
-    printf("[%s %.7s] %s\n", branch, commit_hash, message);
+static int clone_objects(const char *src_root, const char *dst_root, bool shared, bool hardlinks) {
+    CloneObjects *job;
+    struct stat src_st;
+    struct stat dst_st;
+    size_t linked = 0;
+    size_t copied = 0;
+    size_t i;
+    int result = 0;
 
-    index_list_free(&staged);
-    free(qroot);
-    free(qmsg);
+    job = calloc(1, sizeof(CloneObjects));
+    if (job == NULL || build_git_path(src_root, "objects", job->src, sizeof(job->src)) != 0 ||
+        build_git_path(dst_root, "objects", job->dst, sizeof(job->dst)) != 0 ||
+        clone_alternates(job->src, job->dst, shared) != 0) {
+        free(job);
+        return -1;
+    }
+    if (shared) {
+        free(job);
+        return 0;
+    }
+
+    /* Trying link() per object would fail the same way for every one of
+     * them when the stores sit on different filesystems. */
+    job->hardlink = hardlinks && stat(job->src, &src_st) == 0 && stat(job->dst, &dst_st) == 0 &&
+                    src_st.st_dev == dst_st.st_dev;
+    parallel_for_threads(CLONE_OBJECT_JOBS, parallel_worker_count(CLONE_OBJECT_JOBS) * 4, clone_objects_job, job);
+    for (i = 0; i < CLONE_OBJECT_JOBS; i++) {
+        if (job->status[i] != 0) {
+            result = -1;
+        }
+        linked += job->linked[i];
+        copied += job->copied[i];
+    }
+    if (trace_file != NULL) {
+        trace_begin_event("clone_objects");
+        fprintf(trace_file, ",\"linked\":%zu,\"copied\":%zu}\n", linked, copied);
+    }
+    free(job);
+    return result;
+}
+
+static void config_write_value(FILE *out, const char *value) {
+    size_t len = strlen(value);
+    bool quote = len > 0 && (value[0] == ' ' || value[len - 1] == ' ' || strpbrk(value, "#;\"\\") != NULL);
+
+    if (!quote) {
+        fputs(value, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *value != '\0'; value++) {
+        if (*value == '"' || *value == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*value, out);
+    }
+    fputc('"', out);
+}
+
+static int clone_refs(const char *src_root, const char *dst_root, const char *url, ObjectId *head, bool *has_head) {
+    char line[PATH_MAX];
+    char path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    char head_text[PATH_MAX + 2];
+    const char *branch = NULL;
+    RefList refs;
+    RefList mapped;
+    FILE *config = NULL;
+    int fd = -1;
+    int result = -1;
+    size_t i;
+
+    memset(&refs, 0, sizeof(refs));
+    memset(&mapped, 0, sizeof(mapped));
+    *has_head = false;
+    if (collect_refs(src_root, "refs/", &refs) != 0) {
+        fprintf(stderr, "cg clone: cannot read refs of the source\n");
+        goto done;
+    }
+    for (i = 0; i < refs.len; i++) {
+        char name[PATH_MAX];
+        int len;
+        if (refs.items[i].symbolic) {
+            continue;
+        } else if (strncmp(refs.items[i].name, "refs/heads/", 11) == 0) {
+            len = snprintf(name, sizeof(name), "refs/remotes/origin/%s", refs.items[i].name + 11);
+        } else if (strncmp(refs.items[i].name, "refs/tags/", 10) == 0) {
+            len = snprintf(name, sizeof(name), "%s", refs.items[i].name);
+        } else {
+            continue;
+        }
+        if (len < 0 || (size_t)len >= sizeof(name) || ref_list_add(&mapped, name, (size_t)len, &refs.items[i].oid) != 0) {
+            goto done;
+        }
+    }
+    qsort(mapped.items, mapped.len, sizeof(RefEntry), ref_entry_cmp);
+
+    if (build_git_path(dst_root, "packed-refs", path, sizeof(path)) != 0 ||
+        snprintf(lock_path, sizeof(lock_path), "%s.lock", path) >= (int)sizeof(lock_path)) {
+        goto done;
+    }
+    fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0 || write_packed_refs(dst_root, fd, &mapped, "clone") != 0 || close(fd) != 0 ||
+        rename(lock_path, path) != 0) {
+        fprintf(stderr, "cg clone: cannot write packed-refs\n");
+        fd = -1;
+        unlink(lock_path);
+        goto done;
+    }
+    fd = -1;
+
+    if (read_git_file_line(src_root, "HEAD", line, sizeof(line)) != 0) {
+        fprintf(stderr, "cg clone: cannot read HEAD of the source\n");
+        goto done;
+    }
+    if (strncmp(line, "ref: refs/heads/", 16) == 0) {
+        branch = line + 16;
+        *has_head = resolve_ref(src_root, line + 5, head) == 0;
+    } else if (oid_from_hex(line, head) == 0) {
+        *has_head = true;
+    } else {
+        fprintf(stderr, "cg clone: source HEAD is not a branch or commit\n");
+        goto done;
+    }
+    snprintf(head_text, sizeof(head_text), "%s\n", line);
+
+    if (branch != NULL && *has_head) {
+        char remote_head[PATH_MAX];
+        if (write_ref_locked(dst_root, line + 5, head) != 0 ||
+            snprintf(remote_head, sizeof(remote_head), "ref: refs/remotes/origin/%s\n", branch) >=
+                (int)sizeof(remote_head) ||
+            build_git_path(dst_root, "refs/remotes/origin/HEAD", path, sizeof(path)) != 0 ||
+            ensure_parent_dirs(path, strlen(dst_root)) != 0 || write_text_file(path, remote_head) != 0) {
+            fprintf(stderr, "cg clone: cannot write refs\n");
+            goto done;
+        }
+    }
+    if (build_git_path(dst_root, "HEAD", path, sizeof(path)) != 0 || write_text_file(path, head_text) != 0) {
+        fprintf(stderr, "cg clone: cannot write HEAD\n");
+        goto done;
+    }
+
+    if (build_git_path(dst_root, "config", path, sizeof(path)) != 0 || (config = fopen(path, "a")) == NULL) {
+        fprintf(stderr, "cg clone: cannot update config\n");
+        goto done;
+    }
+    fputs("[remote \"origin\"]\n\turl = ", config);
+    config_write_value(config, url);
+    fputs("\n\tfetch = +refs/heads/*:refs/remotes/origin/*\n", config);
+    if (branch != NULL && *has_head) {
+        fprintf(config, "[branch \"%s\"]\n\tremote = origin\n\tmerge = refs/heads/%s\n", branch, branch);
+    }
+    if (fclose(config) != 0) {
+        fprintf(stderr, "cg clone: cannot update config\n");
+        goto done;
+    }
+    result = 0;
+
+done:
+    if (fd >= 0) {
+        close(fd);
+        unlink(lock_path);
+    }
+    ref_list_free(&refs);
+    ref_list_free(&mapped);
+    return result;
+}
+
+typedef struct {
+    char *path;
+    ObjectId oid;
+    unsigned int mode;
+} CheckoutEntry;
+
+typedef struct {
+    CheckoutEntry *items;
+    size_t len;
+    size_t cap;
+} CheckoutList;
+
+static void checkout_list_free(CheckoutList *list) {
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Refuses what git refuses to check out: empty, "." and ".." components and
+ * anything named .git, whatever its case. */
+static bool checkout_path_ok(const char *path) {
+    const char *component = path;
+
+    for (;;) {
+        size_t len = strcspn(component, "/");
+        if (len == 0 || (len == 1 && component[0] == '.') || (len == 2 && strncmp(component, "..", 2) == 0) ||
+            (len == 4 && strncasecmp(component, ".git", 4) == 0)) {
+            return false;
+        }
+        if (component[len] == '\0') {
+            return true;
+        }
+        component += len + 1;
+    }
+}
+
+static int checkout_visit(void *ctx, const char *path, const ObjectId *oid, unsigned int mode) {
+    CheckoutList *list = (CheckoutList *)ctx;
+
+    if (!checkout_path_ok(path)) {
+        fprintf(stderr, "cg: invalid path '%s' in tree\n", path);
+        return -1;
+    }
+    if (list->len == list->cap) {
+        size_t new_cap = list->cap == 0 ? 256 : list->cap * 2;
+        CheckoutEntry *grown = realloc(list->items, new_cap * sizeof(CheckoutEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->items = grown;
+        list->cap = new_cap;
+    }
+    list->items[list->len].path = dup_string(path);
+    if (list->items[list->len].path == NULL) {
+        return -1;
+    }
+    list->items[list->len].oid = *oid;
+    list->items[list->len].mode = mode;
+    list->len++;
     return 0;
+}
 
-fail:
-    if (command != NULL) {
-        free(command);
+static int checkout_entry_cmp(const void *left, const void *right) {
+    return strcmp(((const CheckoutEntry *)left)->path, ((const CheckoutEntry *)right)->path);
+}
+
+typedef struct {
+    const char *root;
+    const CheckoutEntry *entries;
+    unsigned char **data;
+    size_t *sizes;
+    int *errors;
+} CheckoutBatch;
+
+static void checkout_write_job(void *ctx, size_t index) {
+    CheckoutBatch *batch = (CheckoutBatch *)ctx;
+    const CheckoutEntry *entry = &batch->entries[index];
+    char absolute[PATH_MAX];
+    int fd;
+
+    batch->errors[index] = 0;
+    if (path_join(batch->root, entry->path, absolute, sizeof(absolute)) != 0) {
+        batch->errors[index] = ENAMETOOLONG;
+        return;
+    }
+    if (entry->mode == INDEX_MODE_SYMLINK) {
+        if (symlink((const char *)batch->data[index], absolute) != 0) {
+            batch->errors[index] = errno;
+        }
+        return;
+    }
+    fd = open(absolute, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, (entry->mode & 0111) ? 0777 : 0666);
+    if (fd < 0) {
+        batch->errors[index] = errno;
+        return;
+    }
+    if (write_all(fd, batch->data[index], batch->sizes[index]) != 0) {
+        batch->errors[index] = errno != 0 ? errno : EIO;
+    }
+    if (close(fd) != 0 && batch->errors[index] == 0) {
+        batch->errors[index] = errno;
     }
-    free(qroot);
-    free(qmsg);
-    index_list_free(&staged);
-    return 1;
 }
 
-static int cmd_log(int argc, char **argv) {
-    char repo_root[PATH_MAX];
+static int checkout_flush(const char *root, const CheckoutEntry *entries, size_t start, size_t end,
+                          unsigned char **data, size_t *sizes, int *errors) {
+    CheckoutBatch batch;
+    size_t i;
+    int result = 0;
+
+    batch.root = root;
+    batch.entries = entries + start;
+    batch.data = data;
+    batch.sizes = sizes;
+    batch.errors = errors;
+    parallel_for_threads(end - start, parallel_worker_count(end - start) * 2, checkout_write_job, &batch);
+    for (i = 0; i < end - start; i++) {
+        if (errors[i] != 0 && result == 0) {
+            fprintf(stderr, "cg: cannot write '%s': %s\n", entries[start + i].path, strerror(errors[i]));
+            result = -1;
+        }
+        free(data[i]);
+        data[i] = NULL;
+    }
+    return result;
+}
+
+/* Writes the files of tree into the empty worktree at root. Blobs are read
+ * OBJECT_READ_WINDOW at a time and handed to a thread pool that creates
+ * the files, so decoding and the filesystem overlap instead of taking turns
+ * for the whole tree. The entries come back sorted, ready for the cg-index. */
+static int checkout_tree(const char *root, const ObjectId *tree, IndexList *entries) {
+    CheckoutList list;
+    unsigned char *data[OBJECT_READ_WINDOW];
+    size_t sizes[OBJECT_READ_WINDOW];
+    int errors[OBJECT_READ_WINDOW];
+    char last_dir[PATH_MAX] = "";
+    size_t start = 0;
+    size_t i;
+    int result = -1;
+
+    memset(&list, 0, sizeof(list));
+    memset(data, 0, sizeof(data));
+    if (tree_walk(root, tree, checkout_visit, &list) != 0) {
+        goto done;
+    }
+    qsort(list.items, list.len, sizeof(CheckoutEntry), checkout_entry_cmp);
+
+    while (start < list.len) {
+        size_t end = start + OBJECT_READ_WINDOW < list.len ? start + OBJECT_READ_WINDOW : list.len;
+        size_t flushed = start;
+        size_t bytes = 0;
+
+        for (i = start; i < end; i++) {
+            char absolute[PATH_MAX];
+            const char *slash = strrchr(list.items[i].path, '/');
+            size_t dir_len = slash != NULL ? (size_t)(slash - list.items[i].path) : 0;
+
+            if (dir_len > 0 && (strlen(last_dir) != dir_len || strncmp(last_dir, list.items[i].path, dir_len) != 0)) {
+                if (path_join(root, list.items[i].path, absolute, sizeof(absolute)) != 0 ||
+                    ensure_parent_dirs(absolute, strlen(root)) != 0) {
+                    fprintf(stderr, "cg: cannot create leading directories of '%s'\n", list.items[i].path);
+                    goto done;
+                }
+                memcpy(last_dir, list.items[i].path, dir_len);
+                last_dir[dir_len] = '\0';
+            }
+            if (object_request(root, &list.items[i].oid) != 0) {
+                goto done;
+            }
+        }
+        for (i = start; i < end; i++) {
+            char type[16];
+            int status = object_response(type, &data[i - flushed], &sizes[i - flushed]);
+            if (status == 0 && strcmp(type, "blob") != 0) {
+                free(data[i - flushed]);
+                data[i - flushed] = NULL;
+                status = -1;
+            }
+            if (status != 0) {
+                char hex[41];
+                oid_to_hex(&list.items[i].oid, hex);
+                fprintf(stderr, "cg: cannot read blob %s for '%s'\n", hex, list.items[i].path);
+                object_queue_reset();
+                goto done;
+            }
+            bytes += sizes[i - flushed];
+            if (bytes >= CHECKOUT_BATCH_BYTES || i + 1 == end) {
+                if (checkout_flush(root, list.items, flushed, i + 1, data, sizes, errors) != 0) {
+                    object_queue_reset();
+                    goto done;
+                }
+                flushed = i + 1;
+                bytes = 0;
+            }
+        }
+        start = end;
+    }
+
+    for (i = 0; i < list.len; i++) {
+        if (index_list_append(entries, list.items[i].path, &list.items[i].oid, list.items[i].mode) != 0) {
+            goto done;
+        }
+    }
+    result = 0;
+
+done:
+    for (i = 0; i < OBJECT_READ_WINDOW; i++) {
+        free(data[i]);
+    }
+    checkout_list_free(&list);
+    return result;
+}
+
+/* Resolves a local clone source to its worktree root; bare repositories are
+ * not supported, like everywhere else in cg. */
+static int clone_source_root(const char *source, char *out, size_t out_size) {
+    char resolved[PATH_MAX];
+    char git_dir[PATH_MAX];
+    struct stat st;
+    size_t len;
+
+    if (realpath(source, resolved) == NULL) {
+        return -1;
+    }
+    len = strlen(resolved);
+    if (len > 5 && strcmp(resolved + len - 5, "/.git") == 0) {
+        resolved[len - 5] = '\0';
+    }
+    if (path_join(resolved, ".git", git_dir, sizeof(git_dir)) != 0 || stat(git_dir, &st) != 0 ||
+        !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    return snprintf(out, out_size, "%s", resolved) < (int)out_size ? 0 : -1;
+}
+
+/* The directory name git would pick: the last component of the source,
+ * without a trailing ".git". */
+static int clone_default_target(const char *src_root, char *out, size_t out_size) {
+    const char *name = path_basename(src_root);
+    size_t len = strlen(name);
+
+    if (len > 4 && strcmp(name + len - 4, ".git") == 0) {
+        len -= 4;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    return snprintf(out, out_size, "%.*s", (int)len, name) < (int)out_size ? 0 : -1;
+}
+
+static bool dir_is_empty(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    bool empty = true;
+
+    if (dir == NULL) {
+        return false;
+    }
+    while (empty && (entry = readdir(dir)) != NULL) {
+        empty = strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0;
+    }
+    closedir(dir);
+    return empty;
+}
+
+static int cmd_clone(int argc, char **argv) {
+    const char *source = NULL;
+    const char *target = NULL;
+    char src_root[PATH_MAX];
+    char target_buf[PATH_MAX];
+    char dst_root[PATH_MAX];
+    char git_dir[PATH_MAX];
+    char output[256];
+    bool shared = false;
+    bool hardlinks = true;
+    bool has_head = false;
+    ObjectId head;
+    ObjectId tree;
+    IndexList entries;
+    TraceRegion phase;
+    struct stat st;
     char *qroot;
     char *command;
-    char output[65536];
     size_t needed;
-    int status;
+    int i;
 
-    if (argc != 0) {
-        fprintf(stderr, "cg log: no arguments expected\n");
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--local") == 0 || strcmp(argv[i], "-l") == 0) {
+            continue;
+        } else if (strcmp(argv[i], "--shared") == 0 || strcmp(argv[i], "-s") == 0) {
+            shared = true;
+        } else if (strcmp(argv[i], "--no-hardlinks") == 0) {
+            hardlinks = false;
+        } else if (argv[i][0] == '-' || (source != NULL && target != NULL)) {
+            source = NULL;
+            break;
+        } else if (source == NULL) {
+            source = argv[i];
+        } else {
+            target = argv[i];
+        }
+    }
+    if (source == NULL) {
+        fprintf(stderr, "cg clone: usage: cg clone [--local] [--shared] [--no-hardlinks] <source> [<directory>]\n");
         return 1;
     }
-    (void)argv;
-
-    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
-        fprintf(stderr, "cg log: not inside a CG repository\n");
+    if (clone_source_root(source, src_root, sizeof(src_root)) != 0) {
+        fprintf(stderr, "cg clone: '%s' is not a local CG repository\n", source);
         return 1;
     }
-
-    qroot = shell_quote_alloc(repo_root);
-    if (qroot == NULL) {
+    if (target == NULL) {
+        if (clone_default_target(src_root, target_buf, sizeof(target_buf)) != 0) {
+            fprintf(stderr, "cg clone: cannot derive a directory name from '%s'\n", source);
+            return 1;
+        }
+        target = target_buf;
+    }
+    if (stat(target, &st) == 0 && !(S_ISDIR(st.st_mode) && dir_is_empty(target))) {
+        fprintf(stderr, "cg clone: destination path '%s' already exists and is not an empty directory\n", target);
         return 1;
     }
 
-    needed = strlen("git -C  --no-pager log --decorate --oneline --graph 2>/dev/null") + strlen(qroot) + 1;
-    command = malloc(needed);
-    if (command == NULL) {
-        free(qroot);
+    fprintf(stderr, "Cloning into '%s'...\n", target);
+    if (init_repository("clone", target, git_dir, sizeof(git_dir)) != 0) {
         return 1;
     }
-
-    snprintf(command, needed, "git -C %s --no-pager log --decorate --oneline --graph 2>/dev/null", qroot);
-    status = run_command_capture(command, output, sizeof(output));
-    free(command);
-    free(qroot);
-
-    if (status != 0 || output[0] == '\0') {
-        puts("No commits yet.");
-        return 0;
+    if (realpath(target, dst_root) == NULL) {
+        fprintf(stderr, "cg clone: cannot resolve '%s'\n", target);
+        return 1;
     }
 
-    fputs(output, stdout);
-    return 0;
-}
-
-static int cmd_branch(int argc, char **argv) {
-    char repo_root[PATH_MAX];
-    char *qroot;
-    char *qname = NULL;
-    char *command = NULL;
-    size_t needed;
-    int status;
-
-    if (find_repo_root(repo_root, sizeof(repo_root)) != 0) {
-        fprintf(stderr, "cg branch: not inside a CG repository\n");
+    trace_region_enter(&phase, "clone_objects");
+    if (clone_objects(src_root, dst_root, shared, hardlinks) != 0) {
+        fprintf(stderr, "cg clone: cannot copy objects\n");
         return 1;
     }
+    trace_region_leave(&phase);
 
-    qroot = shell_quote_alloc(repo_root);
-    if (qroot == NULL) {
+    trace_region_enter(&phase, "clone_refs");
+    if (clone_refs(src_root, dst_root, src_root, &head, &has_head) != 0) {
         return 1;
     }
+    trace_region_leave(&phase);
 
-    if (argc == 0) {
-        needed = strlen("git -C  branch") + strlen(qroot) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            free(qroot);
-            return 1;
-        }
-        snprintf(command, needed, "git -C %s branch", qroot);
-        status = run_command_passthrough(command);
-        free(command);
-        free(qroot);
-        return status == 0 ? 0 : 1;
+    if (!has_head) {
+        fprintf(stderr, "warning: You appear to have cloned an empty repository.\n");
+        return 0;
     }
 
-    if (argc == 1) {
-        qname = shell_quote_alloc(argv[0]);
-        if (qname == NULL) {
-            free(qroot);
-            return 1;
-        }
-        needed = strlen("git -C  branch ") + strlen(qroot) + strlen(qname) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            free(qname);
-            free(qroot);
-            return 1;
-        }
-        snprintf(command, needed, "git -C %s branch %s", qroot, qname);
-        status = run_command_passthrough(command);
-        free(command);
-        free(qname);
-        free(qroot);
-        return status == 0 ? 0 : 1;
+    index_list_init(&entries);
+    trace_region_enter(&phase, "checkout");
+    if (commit_tree_oid(dst_root, &head, &tree) != 0 || checkout_tree(dst_root, &tree, &entries) != 0) {
+        fprintf(stderr, "cg clone: checkout failed\n");
+        index_list_free(&entries);
+        return 1;
     }
+    trace_region_leave(&phase);
 
-    if (argc == 2 && strcmp(argv[0], "-d") == 0) {
-        qname = shell_quote_alloc(argv[1]);
-        if (qname == NULL) {
-            free(qroot);
-            return 1;
-        }
-        needed = strlen("git -C  branch -d ") + strlen(qroot) + strlen(qname) + 1;
-        command = malloc(needed);
-        if (command == NULL) {
-            free(qname);
-            free(qroot);
-            return 1;
-        }
-        snprintf(command, needed, "git -C %s branch -d %s", qroot, qname);
-        status = run_command_passthrough(command);
-        free(command);
-        free(qname);
-        free(qroot);
-        return status == 0 ? 0 : 1;
+    qsort(entries.items, entries.len, sizeof(IndexEntry), index_cmp_path);
+    if (save_cg_index(dst_root, &entries) != 0) {
+        fprintf(stderr, "cg clone: cannot write cg-index\n");
+        index_list_free(&entries);
+        return 1;
     }
+    index_list_free(&entries);
 
+    /* git's own index, for the commands cg still hands to git. */
+    qroot = shell_quote_alloc(dst_root);
+    if (qroot == NULL) {
+        return 1;
+    }
+    needed = strlen("git -C  read-tree HEAD 2>/dev/null") + strlen(qroot) + 1;
+    command = malloc(needed);
+    if (command != NULL) {
+        snprintf(command, needed, "git -C %s read-tree HEAD 2>/dev/null", qroot);
+        (void)run_command_capture(command, output, sizeof(output));
+    }
+    free(command);
     free(qroot);
-    fprintf(stderr, "cg branch: usage: cg branch [name] | cg branch -d <name>\n");
-    return 1;
+    return 0;
 }
 
 static int cmd_checkout(int argc, char **argv) {
@@ -1503,50 +10527,489 @@ static int cmd_checkout(int argc, char **argv) {
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        print_usage();
-        return 1;
+static int dispatch_subcommand(int argc, char **argv) {
+    if (strcmp(argv[0], "init") == 0) {
+        return cmd_init(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[0], "status") == 0) {
+        return cmd_status(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[0], "add") == 0) {
+        return cmd_add(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[0], "commit") == 0) {
+        return cmd_commit(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[0], "diff") == 0) {
+        return cmd_diff(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[0], "log") == 0) {
+        return cmd_log(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "init") == 0) {
-        return cmd_init(argc - 2, argv + 2);
+    if (strcmp(argv[0], "pack-refs") == 0) {
+        return cmd_pack_refs(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "status") == 0) {
-        return cmd_status(argc - 2, argv + 2);
+    if (strcmp(argv[0], "fsck") == 0) {
+        return cmd_fsck(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "add") == 0) {
-        return cmd_add(argc - 2, argv + 2);
+    if (strcmp(argv[0], "gc") == 0) {
+        return cmd_gc(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "commit") == 0) {
-        return cmd_commit(argc - 2, argv + 2);
+    if (strcmp(argv[0], "count-objects") == 0) {
+        return cmd_count_objects(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "log") == 0) {
-        return cmd_log(argc - 2, argv + 2);
+    if (strcmp(argv[0], "branch") == 0) {
+        return cmd_branch(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "branch") == 0) {
-        return cmd_branch(argc - 2, argv + 2);
+    if (strcmp(argv[0], "clone") == 0) {
+        return cmd_clone(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "checkout") == 0) {
-        return cmd_checkout(argc - 2, argv + 2);
+    if (strcmp(argv[0], "checkout") == 0) {
+        return cmd_checkout(argc - 1, argv + 1);
     }
 
-    if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
+    if (strcmp(argv[0], "--help") == 0 || strcmp(argv[0], "-h") == 0) {
         print_usage();
         return 0;
     }
 
-    if (strcmp(argv[1], "--version") == 0) {
+    if (strcmp(argv[0], "--version") == 0) {
         puts("cg 0.2.0");
         return 0;
     }
 
-    fprintf(stderr, "cg: command '%s' not implemented yet\n", argv[1]);
+    fprintf(stderr, "cg: command '%s' not implemented yet\n", argv[0]);
     return 1;
 }
+
+static int run_subcommand(int argc, char **argv) {
+    TraceRegion region;
+    char name[64];
+    int result;
+
+    snprintf(name, sizeof(name), "cmd_%s", argv[0]);
+    trace_region_enter(&region, name);
+    result = dispatch_subcommand(argc, argv);
+    trace_region_leave(&region);
+    return result;
+}
+
+/* Splits a batch command line into words in place. Supports single quotes,
+ * double quotes with backslash escapes, and bare backslash escapes, so
+ * messages with spaces survive: commit -m "fix the thing". */
+static int split_command_words(char *line, char ***out_words, int *out_count) {
+    char **words = NULL;
+    int count = 0;
+    int cap = 0;
+    char *read_cursor = line;
+    char *write_cursor = line;
+
+    while (1) {
+        char quote = '\0';
+        char *word;
+
+        while (*read_cursor == ' ' || *read_cursor == '\t' || *read_cursor == '\n' || *read_cursor == '\r') {
+            read_cursor++;
+        }
+        if (*read_cursor == '\0') {
+            break;
+        }
+
+        word = write_cursor;
+        while (*read_cursor != '\0') {
+            char c = *read_cursor;
+            if (quote == '\0' && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+                break;
+            }
+            read_cursor++;
+            if (quote == '\0' && (c == '\'' || c == '"')) {
+                quote = c;
+            } else if (c == quote) {
+                quote = '\0';
+            } else if (c == '\\' && quote != '\'' && *read_cursor != '\0') {
+                *write_cursor++ = *read_cursor++;
+            } else {
+                *write_cursor++ = c;
+            }
+        }
+        if (quote != '\0') {
+            free(words);
+            return -1;
+        }
+        if (*read_cursor != '\0') {
+            read_cursor++;
+        }
+        *write_cursor++ = '\0';
+
+        if (count + 1 >= cap) {
+            int new_cap = cap == 0 ? 8 : cap * 2;
+            char **new_words = realloc(words, (size_t)new_cap * sizeof(char *));
+            if (new_words == NULL) {
+                free(words);
+                return -1;
+            }
+            words = new_words;
+            cap = new_cap;
+        }
+        words[count++] = word;
+    }
+
+    if (words != NULL) {
+        words[count] = NULL;
+    }
+    *out_words = words;
+    *out_count = count;
+    return 0;
+}
+
+static int repo_disk_state(const char *repo_root, bool *has_head, ObjectId *head, struct stat *index_st,
+                           struct stat *journal_st, struct stat *packed_refs_st) {
+    char path[PATH_MAX];
+
+    *has_head = resolve_ref(repo_root, "HEAD", head) == 0;
+    if (build_git_path(repo_root, "cg-index", path, sizeof(path)) != 0 || stat_or_absent(path, index_st) != 0 ||
+        build_git_path(repo_root, "cg-index.journal", path, sizeof(path)) != 0 ||
+        stat_or_absent(path, journal_st) != 0 || build_git_path(repo_root, "packed-refs", path, sizeof(path)) != 0 ||
+        stat_or_absent(path, packed_refs_st) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Another process that changed the index, HEAD or packed-refs since the
+ * last command may also have written or repacked objects, so the object
+ * database listings are dropped then. */
+static void repo_cache_check_disk(const char *repo_root) {
+    struct stat index_st;
+    struct stat journal_st;
+    struct stat packed_refs_st;
+    ObjectId head;
+    bool has_head;
+
+    if (!repo_cache.disk_valid || strcmp(repo_cache.repo_root, repo_root) != 0 ||
+        repo_disk_state(repo_root, &has_head, &head, &index_st, &journal_st, &packed_refs_st) != 0 ||
+        has_head != repo_cache.disk_has_head || (has_head && !oid_equal(&head, &repo_cache.disk_head)) ||
+        !same_file_state(&index_st, &repo_cache.disk_index_stat) ||
+        !same_file_state(&journal_st, &repo_cache.disk_journal_stat) ||
+        !same_file_state(&packed_refs_st, &repo_cache.disk_packed_refs_stat)) {
+        odb_invalidate();
+    }
+}
+
+static void repo_cache_note_disk(const char *repo_root) {
+    repo_cache.disk_valid =
+        repo_cache_owns(repo_root) &&
+        repo_disk_state(repo_root, &repo_cache.disk_has_head, &repo_cache.disk_head, &repo_cache.disk_index_stat,
+                        &repo_cache.disk_journal_stat, &repo_cache.disk_packed_refs_stat) == 0;
+}
+
+/* Runs one command per input record against a warm repository cache: the
+ * repo root, cg-index and HEAD tree are reused until their files change.
+ * Every command is followed by "cg-batch-end <exit code>" on stdout. */
+static int cmd_batch(int argc, char **argv) {
+    int delimiter = '\n';
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t read_len;
+    int failures = 0;
+
+    if (argc == 1 && strcmp(argv[0], "-z") == 0) {
+        delimiter = '\0';
+    } else if (argc != 0) {
+        fprintf(stderr, "cg batch: usage: cg batch [-z]\n");
+        return 1;
+    }
+
+    repo_cache.active = true;
+
+    while ((read_len = getdelim(&line, &cap, delimiter, stdin)) != -1) {
+        char **words = NULL;
+        int count = 0;
+        int status;
+
+        if (read_len > 0 && line[read_len - 1] == (char)delimiter) {
+            line[read_len - 1] = '\0';
+        }
+        if (delimiter == '\n') {
+            strip_newlines(line);
+        }
+
+        if (split_command_words(line, &words, &count) != 0) {
+            fprintf(stderr, "cg batch: cannot parse command\n");
+            status = 1;
+        } else if (count == 0 || words[0][0] == '#') {
+            free(words);
+            continue;
+        } else if (strcmp(words[0], "batch") == 0) {
+            fprintf(stderr, "cg batch: nested batch is not supported\n");
+            status = 1;
+        } else {
+            if (repo_cache.repo_root[0] != '\0') {
+                repo_cache_check_disk(repo_cache.repo_root);
+            }
+            status = run_subcommand(count, words);
+            if (repo_cache.repo_root[0] != '\0') {
+                repo_cache_note_disk(repo_cache.repo_root);
+            }
+        }
+        free(words);
+
+        if (status != 0) {
+            failures++;
+        }
+        fflush(stderr);
+        printf("cg-batch-end %d%c", status, delimiter == '\0' ? '\0' : '\n');
+        fflush(stdout);
+    }
+
+    free(line);
+    repo_cache_drop_state();
+    repo_cache.active = false;
+    return failures == 0 ? 0 : 1;
+}
+
+static void cg_setup(void) {
+    static bool done;
+
+    if (done) {
+        return;
+    }
+    done = true;
+    if (sha1_select_kernel(getenv("CG_SHA1_IMPL")) != 0) {
+        sha1_select_kernel(NULL);
+        fprintf(stderr, "cg: warning: SHA-1 implementation '%s' is not available, using %s\n", getenv("CG_SHA1_IMPL"),
+                sha1_kernel_name());
+    }
+    if (fs_batch_select(getenv("CG_IO_IMPL")) != 0) {
+        fs_batch_select(NULL);
+        fprintf(stderr, "cg: warning: I/O backend '%s' is not available, using %s\n", getenv("CG_IO_IMPL"),
+                fs_batch_backend());
+    }
+    object_cache_set_limit(&object_cache, cache_limit("CG_OBJECT_CACHE_MB", OBJECT_CACHE_DEFAULT_MB));
+    pack_set_delta_cache_limit(cache_limit("CG_DELTA_CACHE_MB", DELTA_CACHE_DEFAULT_MB));
+}
+
+/* libcg handles (see cg.h). There is one RepoCache per process, so every
+ * call first points it at its handle's repository; switching between
+ * handles of different repositories is correct, just not warm. */
+struct cg_repo {
+    char root[PATH_MAX];
+    IndexList index;
+};
+
+static size_t open_repos;
+
+static void cg_repo_bind(const cg_repo *repo) {
+    repo_cache.active = true;
+    if (strcmp(repo_cache.repo_root, repo->root) != 0) {
+        repo_cache_drop_state();
+        memcpy(repo_cache.repo_root, repo->root, sizeof(repo->root));
+        repo_cache.cwd[0] = '\0';
+    }
+}
+
+int cg_repo_open(const char *path, cg_repo **out) {
+    char resolved[PATH_MAX];
+    cg_repo *repo;
+
+    cg_setup();
+    if (realpath(path, resolved) == NULL) {
+        fprintf(stderr, "cg: path not found: %s\n", path);
+        return -1;
+    }
+    repo = calloc(1, sizeof(*repo));
+    if (repo == NULL) {
+        fprintf(stderr, "cg: out of memory\n");
+        return -1;
+    }
+    if (discover_repo_root_from(resolved, repo->root, sizeof(repo->root)) != 0) {
+        fprintf(stderr, "cg: not inside a CG repository: %s\n", path);
+        free(repo);
+        return -1;
+    }
+    index_list_init(&repo->index);
+    open_repos++;
+    *out = repo;
+    return 0;
+}
+
+void cg_repo_close(cg_repo *repo) {
+    if (repo == NULL) {
+        return;
+    }
+    index_list_free(&repo->index);
+    free(repo);
+    if (--open_repos == 0) {
+        repo_cache_drop_state();
+        repo_cache.active = false;
+        repo_cache.repo_root[0] = '\0';
+        repo_cache.cwd[0] = '\0';
+    }
+}
+
+const char *cg_repo_root(const cg_repo *repo) {
+    return repo->root;
+}
+
+/* Refreshes the handle's index; cheap while the cached copy still matches
+ * the file on disk. */
+static int cg_repo_reload(cg_repo *repo, const char *cmd) {
+    IndexList fresh;
+
+    cg_repo_bind(repo);
+    repo_cache_check_disk(repo->root);
+    index_list_init(&fresh);
+    if (load_cg_index(repo->root, &fresh) != 0) {
+        fprintf(stderr, "cg %s: cannot read cg-index\n", cmd);
+        index_list_free(&fresh);
+        return -1;
+    }
+    index_list_free(&repo->index);
+    repo->index = fresh;
+    repo_cache_note_disk(repo->root);
+    return 0;
+}
+
+int cg_index_load(cg_repo *repo) {
+    return cg_repo_reload(repo, "index");
+}
+
+size_t cg_index_count(const cg_repo *repo) {
+    return repo->index.len;
+}
+
+int cg_index_entry(const cg_repo *repo, size_t pos, const char **path, char hex[41]) {
+    if (pos >= repo->index.len) {
+        return -1;
+    }
+    *path = repo->index.items[pos].path;
+    oid_to_hex(&repo->index.items[pos].oid, hex);
+    return 0;
+}
+
+int cg_status(cg_repo *repo, cg_status_fn fn, void *ctx) {
+    StatusLists lists;
+    const PathList *order[7];
+    const cg_status_kind kinds[7] = {CG_STATUS_STAGED_NEW, CG_STATUS_STAGED_MODIFIED, CG_STATUS_STAGED_RENAMED,
+                                     CG_STATUS_STAGED_DELETED, CG_STATUS_MODIFIED, CG_STATUS_DELETED,
+                                     CG_STATUS_UNTRACKED};
+    size_t i;
+    size_t j;
+    int result = -1;
+
+    if (cg_repo_reload(repo, "status") != 0) {
+        return -1;
+    }
+    status_lists_init(&lists);
+    if (status_walk(repo->root, &repo->index, status_list_record, &lists) != 0) {
+        goto done;
+    }
+    order[0] = &lists.staged_new;
+    order[1] = &lists.staged_modified;
+    order[2] = &lists.staged_renamed;
+    order[3] = &lists.staged_deleted;
+    order[4] = &lists.unstaged_modified;
+    order[5] = &lists.unstaged_deleted;
+    order[6] = &lists.untracked;
+    result = 0;
+    for (i = 0; i < 7 && result == 0; i++) {
+        for (j = 0; j < order[i]->len && result == 0; j++) {
+            result = fn(ctx, order[i]->items[j], kinds[i]);
+        }
+    }
+
+done:
+    status_lists_free(&lists);
+    return result;
+}
+
+int cg_add(cg_repo *repo, const char *const *paths, size_t count) {
+    IndexList changes;
+    PathList files;
+    PathList dirs;
+    PathList removed;
+    int result = -1;
+
+    if (cg_repo_reload(repo, "add") != 0) {
+        return -1;
+    }
+    index_list_init(&changes);
+    path_list_init(&files);
+    path_list_init(&dirs);
+    path_list_init(&removed);
+
+    if (collect_add_inputs(repo->root, repo->root, paths, count, &files, &dirs) != 0) {
+        goto done;
+    }
+    if (stage_files(repo->root, &repo->index, &files, &dirs, &changes, &removed) != 0) {
+        goto done;
+    }
+    if (save_cg_index_changes(repo->root, &repo->index, &changes, &removed) != 0) {
+        fprintf(stderr, "cg add: cannot write cg-index\n");
+        goto done;
+    }
+    repo_cache_note_disk(repo->root);
+    result = 0;
+
+done:
+    index_list_free(&changes);
+    path_list_free(&files);
+    path_list_free(&dirs);
+    path_list_free(&removed);
+    return result;
+}
+
+int cg_commit(cg_repo *repo, const char *message, char commit_hex[41]) {
+    ObjectId commit_oid;
+
+    if (message == NULL || message[0] == '\0') {
+        fprintf(stderr, "cg commit: commit message is required\n");
+        return -1;
+    }
+    if (cg_repo_reload(repo, "commit") != 0) {
+        return -1;
+    }
+    if (repo->index.len == 0) {
+        fprintf(stderr, "cg commit: nothing staged\n");
+        return -1;
+    }
+    if (commit_index(repo->root, &repo->index, message, &commit_oid) != 0) {
+        return -1;
+    }
+    repo_cache_note_disk(repo->root);
+    if (commit_hex != NULL) {
+        oid_to_hex(&commit_oid, commit_hex);
+    }
+    return 0;
+}
+
+int cg_main(int argc, char **argv) {
+    int status;
+
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    cg_setup();
+    trace_init(argc, argv);
+    if (strcmp(argv[1], "batch") == 0) {
+        status = cmd_batch(argc - 2, argv + 2);
+    } else {
+        status = run_subcommand(argc - 1, argv + 1);
+    }
+    trace_finish(status);
+    return status;
+}
@@ -0,0 +1,225 @@
+#include "objcache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ObjectCacheEntry {
+    unsigned char key[20];
+    int type;
+    unsigned char *data;
+    size_t size;
+    ObjectCacheEntry *newer;
+    ObjectCacheEntry *older;
+};
+
+/* Object ids are uniform already, but keys built from a pack offset are
+ * not, so both halves of the first 16 bytes are mixed in. */
+static size_t cache_hash(const unsigned char key[20]) {
+    uint64_t low;
+    uint64_t high;
+    uint64_t h;
+
+    memcpy(&low, key, 8);
+    memcpy(&high, key + 8, 8);
+    h = (low ^ high) * 0x9e3779b97f4a7c15ull;
+    return (size_t)(h ^ (h >> 29));
+}
+
+static size_t cache_slot(const ObjectCache *cache, const unsigned char key[20]) {
+    size_t mask = cache->cap - 1;
+    size_t i = cache_hash(key) & mask;
+
+    while (cache->slots[i] != NULL && memcmp(cache->slots[i]->key, key, 20) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void cache_unlink(ObjectCache *cache, ObjectCacheEntry *entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void cache_link_newest(ObjectCache *cache, ObjectCacheEntry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/* Empties slot i and shifts later members of its probe run back, so
+ * lookups never need tombstones. */
+static void cache_remove_slot(ObjectCache *cache, size_t i) {
+    size_t mask = cache->cap - 1;
+    size_t j = i;
+
+    cache->slots[i] = NULL;
+    for (;;) {
+        size_t home;
+
+        j = (j + 1) & mask;
+        if (cache->slots[j] == NULL) {
+            break;
+        }
+        home = cache_hash(cache->slots[j]->key) & mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            cache->slots[i] = cache->slots[j];
+            cache->slots[j] = NULL;
+            i = j;
+        }
+    }
+    cache->len--;
+}
+
+static void cache_evict(ObjectCache *cache) {
+    while (cache->bytes > cache->limit && cache->oldest != NULL) {
+        ObjectCacheEntry *entry = cache->oldest;
+
+        cache_remove_slot(cache, cache_slot(cache, entry->key));
+        cache_unlink(cache, entry);
+        cache->bytes -= entry->size;
+        free(entry->data);
+        free(entry);
+    }
+}
+
+static int cache_grow(ObjectCache *cache) {
+    size_t new_cap = cache->cap == 0 ? 1024 : cache->cap * 2;
+    ObjectCacheEntry **old_slots = cache->slots;
+    size_t old_cap = cache->cap;
+    size_t i;
+
+    cache->slots = calloc(new_cap, sizeof(*cache->slots));
+    if (cache->slots == NULL) {
+        cache->slots = old_slots;
+        return -1;
+    }
+    cache->cap = new_cap;
+    for (i = 0; i < old_cap; i++) {
+        if (old_slots[i] != NULL) {
+            cache->slots[cache_slot(cache, old_slots[i]->key)] = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return 0;
+}
+
+void object_cache_set_limit(ObjectCache *cache, size_t limit) {
+    pthread_mutex_lock(&cache->lock);
+    cache->limit = limit;
+    cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void object_cache_clear(ObjectCache *cache) {
+    ObjectCacheEntry *entry;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = cache->newest;
+    while (entry != NULL) {
+        ObjectCacheEntry *older = entry->older;
+        free(entry->data);
+        free(entry);
+        entry = older;
+    }
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->cap = 0;
+    cache->len = 0;
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->bytes = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+bool object_cache_get(ObjectCache *cache, const unsigned char key[20], int *type, unsigned char **data,
+                      size_t *size) {
+    ObjectCacheEntry *entry = NULL;
+    unsigned char *copy;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->limit == 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+    if (cache->len > 0) {
+        entry = cache->slots[cache_slot(cache, key)];
+    }
+    copy = entry != NULL ? malloc(entry->size + 1) : NULL;
+    if (copy == NULL) {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+    memcpy(copy, entry->data, entry->size);
+    copy[entry->size] = '\0';
+    *type = entry->type;
+    *data = copy;
+    *size = entry->size;
+    cache_unlink(cache, entry);
+    cache_link_newest(cache, entry);
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+void object_cache_put(ObjectCache *cache, const unsigned char key[20], int type, const unsigned char *data,
+                      size_t size) {
+    ObjectCacheEntry *entry;
+    size_t slot;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->limit == 0 || size > cache->limit / 8) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    if ((cache->len + 1) * 4 > cache->cap * 3 && cache_grow(cache) != 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    slot = cache_slot(cache, key);
+    if (cache->slots[slot] != NULL) {
+        cache_unlink(cache, cache->slots[slot]);
+        cache_link_newest(cache, cache->slots[slot]);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL || (entry->data = malloc(size > 0 ? size : 1)) == NULL) {
+        free(entry);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    memcpy(entry->key, key, 20);
+    memcpy(entry->data, data, size);
+    entry->type = type;
+    entry->size = size;
+    cache->slots[slot] = entry;
+    cache->len++;
+    cache->bytes += size;
+    cache_link_newest(cache, entry);
+    cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void object_cache_stats(ObjectCache *cache, unsigned long long *hits, unsigned long long *misses) {
+    pthread_mutex_lock(&cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,44 @@
+#ifndef CG_OBJCACHE_H
+#define CG_OBJCACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A size-bounded LRU of inflated objects keyed by 20 raw bytes. The table
+ * uses open addressing with linear probing over pointers to entries, so
+ * entries never move and the recency list can link them directly. A cache
+ * with a zero limit stores nothing. Safe to share between threads. */
+typedef struct ObjectCacheEntry ObjectCacheEntry;
+
+typedef struct {
+    ObjectCacheEntry **slots;
+    size_t cap; /* a power of two, or 0 */
+    size_t len;
+    ObjectCacheEntry *newest;
+    ObjectCacheEntry *oldest;
+    size_t bytes;
+    size_t limit;
+    unsigned long long hits;
+    unsigned long long misses;
+    pthread_mutex_t lock;
+} ObjectCache;
+
+#define OBJECT_CACHE_INIT {NULL, 0, 0, NULL, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER}
+
+/* Sets the budget in bytes of object data, evicting down to it. */
+void object_cache_set_limit(ObjectCache *cache, size_t limit);
+/* Drops every entry; the limit and counters stay. */
+void object_cache_clear(ObjectCache *cache);
+
+/* On a hit *data is a malloc'ed copy with a NUL after size bytes. A copy
+ * that cannot be allocated counts as a miss. */
+bool object_cache_get(ObjectCache *cache, const unsigned char key[20], int *type, unsigned char **data,
+                      size_t *size);
+/* Copies data in as the most recently used entry. Objects larger than an
+ * eighth of the limit are not kept, so one huge blob cannot flush the rest. */
+void object_cache_put(ObjectCache *cache, const unsigned char key[20], int type, const unsigned char *data,
+                      size_t size);
+void object_cache_stats(ObjectCache *cache, unsigned long long *hits, unsigned long long *misses);
+
+#endif
@@ -0,0 +1,915 @@
+#define _GNU_SOURCE
+
+#include "pack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "objcache.h"
+#include "sha1.h"
+
+#define IDX_FANOUT_SIZE (256 * 4)
+#define IDX_TRAILER_SIZE 40
+#define PACK_HEADER_SIZE 12
+#define PACK_TRAILER_SIZE 20
+
+static uint32_t read_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t read_be64(const unsigned char *p) {
+    return ((uint64_t)read_be32(p) << 32) | read_be32(p + 4);
+}
+
+static void put_be32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static const unsigned char *idx_fanout(const PackFile *pack) {
+    return pack->idx + (pack->idx_version == 2 ? 8 : 0);
+}
+
+static const unsigned char *idx_name(const PackFile *pack, uint32_t n) {
+    if (pack->idx_version == 2) {
+        return pack->idx + 8 + IDX_FANOUT_SIZE + (size_t)n * 20;
+    }
+    return pack->idx + IDX_FANOUT_SIZE + (size_t)n * 24 + 4;
+}
+
+static uint64_t idx_offset(const PackFile *pack, uint32_t n) {
+    const unsigned char *offsets;
+    uint32_t value;
+    size_t large;
+
+    if (pack->idx_version != 2) {
+        return read_be32(pack->idx + IDX_FANOUT_SIZE + (size_t)n * 24);
+    }
+    offsets = pack->idx + 8 + IDX_FANOUT_SIZE + (size_t)pack->count * 24;
+    value = read_be32(offsets + (size_t)n * 4);
+    if ((value & 0x80000000u) == 0) {
+        return value;
+    }
+    large = (size_t)(offsets - pack->idx) + (size_t)pack->count * 4 + (size_t)(value & 0x7fffffffu) * 8;
+    if (large + 8 > pack->idx_size - IDX_TRAILER_SIZE) {
+        return 0;
+    }
+    return read_be64(pack->idx + large);
+}
+
+int pack_open(PackFile *pack, const char *idx_path) {
+    struct stat st;
+    size_t path_len = strlen(idx_path);
+    size_t table_size;
+    const unsigned char *fanout;
+    uint32_t previous = 0;
+    void *map;
+    int fd;
+    int i;
+
+    memset(pack, 0, sizeof(*pack));
+    if (path_len < 4 || strcmp(idx_path + path_len - 4, ".idx") != 0) {
+        return -1;
+    }
+    fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < IDX_FANOUT_SIZE + IDX_TRAILER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    pack->idx = map;
+    pack->idx_size = (size_t)st.st_size;
+    pack->idx_version = memcmp(pack->idx, "\377tOc", 4) == 0 ? (int)read_be32(pack->idx + 4) : 1;
+    if (pack->idx_version != 1 && pack->idx_version != 2) {
+        goto fail;
+    }
+    if (pack->idx_version == 2 && pack->idx_size < 8 + IDX_FANOUT_SIZE + IDX_TRAILER_SIZE) {
+        goto fail;
+    }
+
+    fanout = idx_fanout(pack);
+    for (i = 0; i < 256; i++) {
+        uint32_t value = read_be32(fanout + i * 4);
+        if (value < previous) {
+            goto fail;
+        }
+        previous = value;
+    }
+    pack->count = previous;
+    table_size = pack->idx_version == 2 ? 8 + IDX_FANOUT_SIZE + (size_t)pack->count * 28
+                                        : IDX_FANOUT_SIZE + (size_t)pack->count * 24;
+    if (table_size > pack->idx_size - IDX_TRAILER_SIZE) {
+        goto fail;
+    }
+
+    pack->pack_path = malloc(path_len + 2);
+    if (pack->pack_path == NULL) {
+        goto fail;
+    }
+    memcpy(pack->pack_path, idx_path, path_len - 4);
+    memcpy(pack->pack_path + path_len - 4, ".pack", 6);
+    return 0;
+
+fail:
+    pack_close(pack);
+    return -1;
+}
+
+void pack_close(PackFile *pack) {
+    if (pack->idx != NULL) {
+        munmap((void *)pack->idx, pack->idx_size);
+    }
+    if (pack->data != NULL) {
+        munmap((void *)pack->data, pack->size);
+    }
+    free(pack->pack_path);
+    free(pack->order);
+    free(pack->order_pos);
+    memset(pack, 0, sizeof(*pack));
+}
+
+int pack_map(PackFile *pack) {
+    const unsigned char *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (pack->data != NULL) {
+        return 0;
+    }
+    fd = open(pack->pack_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < PACK_HEADER_SIZE + PACK_TRAILER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    header = map;
+    if (memcmp(header, "PACK", 4) != 0 || (read_be32(header + 4) != 2 && read_be32(header + 4) != 3) ||
+        read_be32(header + 8) != pack->count) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    pack->data = map;
+    pack->size = (size_t)st.st_size;
+    return 0;
+}
+
+bool pack_find_position(const PackFile *pack, const unsigned char hash[20], uint32_t *n) {
+    const unsigned char *fanout = idx_fanout(pack);
+    uint32_t lo = hash[0] == 0 ? 0 : read_be32(fanout + (hash[0] - 1) * 4);
+    uint32_t hi = read_be32(fanout + hash[0] * 4);
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(idx_name(pack, mid), hash, 20);
+        if (cmp == 0) {
+            *n = mid;
+            return true;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
+
+bool pack_find(const PackFile *pack, const unsigned char hash[20], uint64_t *offset) {
+    uint32_t n;
+
+    if (!pack_find_position(pack, hash, &n)) {
+        return false;
+    }
+    *offset = idx_offset(pack, n);
+    return true;
+}
+
+void pack_nth(const PackFile *pack, uint32_t n, unsigned char hash[20], uint64_t *offset) {
+    memcpy(hash, idx_name(pack, n), 20);
+    *offset = idx_offset(pack, n);
+}
+
+const char *pack_type_name(int type) {
+    switch (type) {
+    case PACK_OBJ_COMMIT:
+        return "commit";
+    case PACK_OBJ_TREE:
+        return "tree";
+    case PACK_OBJ_BLOB:
+        return "blob";
+    case PACK_OBJ_TAG:
+        return "tag";
+    default:
+        return NULL;
+    }
+}
+
+int pack_type_code(const char *name) {
+    int type;
+
+    for (type = PACK_OBJ_COMMIT; type <= PACK_OBJ_TAG; type++) {
+        if (strcmp(pack_type_name(type), name) == 0) {
+            return type;
+        }
+    }
+    return 0;
+}
+
+static int pack_entry_header(const PackFile *pack, uint64_t offset, int *type, uint64_t *size, uint64_t *data_offset) {
+    uint64_t end = pack->size - PACK_TRAILER_SIZE;
+    unsigned int shift = 4;
+    unsigned char c;
+
+    if (offset < PACK_HEADER_SIZE || offset >= end) {
+        return -1;
+    }
+    c = pack->data[offset++];
+    *type = (c >> 4) & 7;
+    *size = c & 15;
+    while (c & 0x80) {
+        if (offset >= end || shift > 57) {
+            return -1;
+        }
+        c = pack->data[offset++];
+        *size |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    *data_offset = offset;
+    return 0;
+}
+
+static int pack_inflate(const PackFile *pack, uint64_t offset, uint64_t size, unsigned char **out) {
+    const unsigned char *in_end = pack->data + pack->size - PACK_TRAILER_SIZE;
+    unsigned char *buffer;
+    z_stream zs;
+    int ret;
+
+    if (size >= SIZE_MAX) {
+        return -1;
+    }
+    buffer = malloc((size_t)size + 1);
+    if (buffer == NULL) {
+        return -1;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        free(buffer);
+        return -1;
+    }
+    zs.next_in = (unsigned char *)pack->data + offset;
+    zs.next_out = buffer;
+    /* zlib counts in 32 bits, so objects over 4GiB take several calls. */
+    do {
+        size_t in_left = (size_t)(in_end - zs.next_in);
+        size_t out_left = (size_t)(buffer + size + 1 - zs.next_out);
+        zs.avail_in = in_left > UINT_MAX ? UINT_MAX : (unsigned int)in_left;
+        zs.avail_out = out_left > UINT_MAX ? UINT_MAX : (unsigned int)out_left;
+        ret = inflate(&zs, Z_NO_FLUSH);
+    } while (ret == Z_OK && zs.next_in < in_end && zs.next_out <= buffer + size);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != size) {
+        free(buffer);
+        return -1;
+    }
+    buffer[size] = '\0';
+    *out = buffer;
+    return 0;
+}
+
+/* Reads the negative base distance of an OFS_DELTA entry at offset, moving
+ * *data_offset past it. */
+static int pack_ofs_base(const PackFile *pack, uint64_t offset, uint64_t *data_offset, uint64_t *base_offset) {
+    uint64_t end = pack->size - PACK_TRAILER_SIZE;
+    uint64_t distance;
+    unsigned char c;
+
+    if (*data_offset >= end) {
+        return -1;
+    }
+    c = pack->data[(*data_offset)++];
+    distance = c & 0x7f;
+    while (c & 0x80) {
+        if (*data_offset >= end || distance >= (UINT64_MAX >> 7) - 1) {
+            return -1;
+        }
+        c = pack->data[(*data_offset)++];
+        distance = ((distance + 1) << 7) | (c & 0x7f);
+    }
+    if (distance == 0 || distance > offset) {
+        return -1;
+    }
+    *base_offset = offset - distance;
+    return 0;
+}
+
+static ObjectCache delta_cache = OBJECT_CACHE_INIT;
+
+void pack_set_delta_cache_limit(size_t limit) {
+    object_cache_set_limit(&delta_cache, limit);
+}
+
+void pack_delta_cache_stats(unsigned long long *hits, unsigned long long *misses) {
+    object_cache_stats(&delta_cache, hits, misses);
+}
+
+/* The offset, then the start of the pack checksum, which names the pack by
+ * its contents so keys stay valid across pack_close. */
+static void delta_cache_key(const PackFile *pack, uint64_t offset, unsigned char key[20]) {
+    memcpy(key, &offset, 8);
+    memcpy(key + 8, pack->idx + pack->idx_size - IDX_TRAILER_SIZE, 12);
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t data_offset;
+    uint64_t size;
+} PackDelta;
+
+int pack_read(PackFile *pack, uint64_t offset, PackBaseFn resolve, void *ctx, int *type, unsigned char **data,
+              size_t *size) {
+    PackDelta *chain = NULL;
+    size_t depth = 0;
+    size_t cap = 0;
+    unsigned char *base = NULL;
+    size_t base_size = 0;
+    int base_type = 0;
+    int result = -1;
+
+    if (pack_map(pack) != 0) {
+        return -1;
+    }
+    /* Walk down to the base first, remembering each delta on the way, then
+     * apply them back up; this keeps deep chains off the call stack. The
+     * walk stops early at a base some earlier read left in the cache. */
+    for (;;) {
+        unsigned char key[20];
+        int entry_type;
+        uint64_t entry_size;
+        uint64_t data_offset;
+        uint64_t base_offset;
+
+        delta_cache_key(pack, offset, key);
+        if (depth > 0 && object_cache_get(&delta_cache, key, &base_type, &base, &base_size)) {
+            break;
+        }
+        if (pack_entry_header(pack, offset, &entry_type, &entry_size, &data_offset) != 0) {
+            goto done;
+        }
+        if (entry_type != PACK_OBJ_OFS_DELTA && entry_type != PACK_OBJ_REF_DELTA) {
+            if (pack_type_name(entry_type) == NULL || pack_inflate(pack, data_offset, entry_size, &base) != 0) {
+                goto done;
+            }
+            base_type = entry_type;
+            base_size = (size_t)entry_size;
+            if (depth > 0) {
+                object_cache_put(&delta_cache, key, base_type, base, base_size);
+            }
+            break;
+        }
+        if (depth == PACK_MAX_DELTA_DEPTH) {
+            goto done;
+        }
+        if (depth == cap) {
+            size_t new_cap = cap == 0 ? 16 : cap * 2;
+            PackDelta *grown = realloc(chain, new_cap * sizeof(*chain));
+            if (grown == NULL) {
+                goto done;
+            }
+            chain = grown;
+            cap = new_cap;
+        }
+
+        if (entry_type == PACK_OBJ_OFS_DELTA) {
+            if (pack_ofs_base(pack, offset, &data_offset, &base_offset) != 0) {
+                goto done;
+            }
+            chain[depth].offset = offset;
+            chain[depth].data_offset = data_offset;
+            chain[depth].size = entry_size;
+            depth++;
+        } else {
+            const unsigned char *hash = pack->data + data_offset;
+
+            if (data_offset + 20 > pack->size - PACK_TRAILER_SIZE) {
+                goto done;
+            }
+            chain[depth].offset = offset;
+            chain[depth].data_offset = data_offset + 20;
+            chain[depth].size = entry_size;
+            depth++;
+            if (!pack_find(pack, hash, &base_offset)) {
+                if (resolve == NULL || resolve(ctx, hash, &base_type, &base, &base_size) != 0) {
+                    base = NULL;
+                    goto done;
+                }
+                break;
+            }
+        }
+        offset = base_offset;
+    }
+
+    while (depth > 0) {
+        unsigned char *delta;
+        unsigned char *target;
+        size_t target_size;
+        int status;
+
+        depth--;
+        if (pack_inflate(pack, chain[depth].data_offset, chain[depth].size, &delta) != 0) {
+            goto done;
+        }
+        status = delta_apply(base, base_size, delta, (size_t)chain[depth].size, &target, &target_size);
+        free(delta);
+        if (status != 0) {
+            goto done;
+        }
+        free(base);
+        base = target;
+        base_size = target_size;
+        if (depth > 0) {
+            unsigned char key[20];
+
+            delta_cache_key(pack, chain[depth].offset, key);
+            object_cache_put(&delta_cache, key, base_type, base, base_size);
+        }
+    }
+
+    *type = base_type;
+    *data = base;
+    *size = base_size;
+    base = NULL;
+    result = 0;
+
+done:
+    free(base);
+    free(chain);
+    return result;
+}
+
+int pack_object_type(PackFile *pack, uint64_t offset) {
+    size_t depth;
+
+    if (pack_map(pack) != 0) {
+        return 0;
+    }
+    for (depth = 0; depth <= PACK_MAX_DELTA_DEPTH; depth++) {
+        int type;
+        uint64_t size;
+        uint64_t data_offset;
+
+        if (pack_entry_header(pack, offset, &type, &size, &data_offset) != 0) {
+            return 0;
+        }
+        if (type == PACK_OBJ_OFS_DELTA) {
+            if (pack_ofs_base(pack, offset, &data_offset, &offset) != 0) {
+                return 0;
+            }
+        } else if (type == PACK_OBJ_REF_DELTA) {
+            if (data_offset + 20 > pack->size - PACK_TRAILER_SIZE ||
+                !pack_find(pack, pack->data + data_offset, &offset)) {
+                return 0;
+            }
+        } else {
+            return pack_type_name(type) != NULL ? type : 0;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint32_t n;
+} PackOrderEntry;
+
+static int pack_order_cmp(const void *a, const void *b) {
+    const PackOrderEntry *left = a;
+    const PackOrderEntry *right = b;
+
+    if (left->offset != right->offset) {
+        return left->offset < right->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+int pack_load_order(PackFile *pack) {
+    PackOrderEntry *entries;
+    uint32_t i;
+
+    if (pack->order != NULL) {
+        return 0;
+    }
+    entries = malloc(((size_t)pack->count + 1) * sizeof(*entries));
+    pack->order = malloc(((size_t)pack->count + 1) * sizeof(uint32_t));
+    pack->order_pos = malloc(((size_t)pack->count + 1) * sizeof(uint32_t));
+    if (entries == NULL || pack->order == NULL || pack->order_pos == NULL) {
+        free(entries);
+        free(pack->order);
+        free(pack->order_pos);
+        pack->order = NULL;
+        pack->order_pos = NULL;
+        return -1;
+    }
+    for (i = 0; i < pack->count; i++) {
+        entries[i].offset = idx_offset(pack, i);
+        entries[i].n = i;
+    }
+    qsort(entries, pack->count, sizeof(*entries), pack_order_cmp);
+    for (i = 0; i < pack->count; i++) {
+        pack->order[i] = entries[i].n;
+        pack->order_pos[entries[i].n] = i;
+    }
+    free(entries);
+    return 0;
+}
+
+#define BITMAP_HEADER_SIZE 32
+
+static char *pack_bitmap_path(const PackFile *pack) {
+    size_t len = strlen(pack->pack_path);
+    char *path = malloc(len + 3);
+
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, pack->pack_path, len - 5);
+    memcpy(path + len - 5, ".bitmap", 8);
+    return path;
+}
+
+/* The pack checksum is the first half of the .idx trailer. */
+static const unsigned char *pack_checksum(const PackFile *pack) {
+    return pack->idx + pack->idx_size - IDX_TRAILER_SIZE;
+}
+
+static int pack_bitmap_cmp(const void *a, const void *b) {
+    const PackBitmap *left = a;
+    const PackBitmap *right = b;
+
+    if (left->commit != right->commit) {
+        return left->commit < right->commit ? -1 : 1;
+    }
+    return 0;
+}
+
+int pack_bitmap_read(PackFile *pack, PackBitmapIndex *index) {
+    const unsigned char *data = NULL;
+    struct stat st;
+    char *path;
+    size_t size = 0;
+    size_t end;
+    size_t pos;
+    size_t i;
+    uint32_t count;
+    void *map;
+    int result = -1;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    path = pack_bitmap_path(pack);
+    if (path == NULL) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) {
+        return errno == ENOENT ? 1 : -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < BITMAP_HEADER_SIZE + 20) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    data = map;
+    size = (size_t)st.st_size;
+
+    if (memcmp(data, "BITM", 4) != 0 || ((data[4] << 8) | data[5]) != 1 ||
+        (((data[6] << 8) | data[7]) & PACK_BITMAP_OPT_FULL_DAG) == 0 ||
+        memcmp(data + 12, pack_checksum(pack), 20) != 0) {
+        goto done;
+    }
+    count = read_be32(data + 8);
+    end = size - 20;
+    pos = BITMAP_HEADER_SIZE;
+    for (i = 0; i < 4; i++) {
+        long used = ewah_deserialize(data + pos, end - pos, &index->types[i]);
+        if (used < 0) {
+            goto done;
+        }
+        pos += (size_t)used;
+    }
+    if (count > (end - pos) / 6) {
+        goto done;
+    }
+    index->entries = calloc((size_t)count + 1, sizeof(*index->entries));
+    if (index->entries == NULL) {
+        goto done;
+    }
+    /* The hash cache and lookup table options add tables after the entries;
+     * lookups by commit do not need them. */
+    for (i = 0; i < count; i++) {
+        PackBitmap *entry = &index->entries[i];
+        size_t xor_offset;
+        long used;
+
+        if (end - pos < 6) {
+            goto done;
+        }
+        entry->commit = read_be32(data + pos);
+        xor_offset = data[pos + 4];
+        pos += 6;
+        used = ewah_deserialize(data + pos, end - pos, &entry->bits);
+        if (used < 0) {
+            goto done;
+        }
+        pos += (size_t)used;
+        index->count++;
+        if (entry->commit >= pack->count || xor_offset > i) {
+            goto done;
+        }
+        if (xor_offset > 0 && bitmap_xor(&entry->bits, &index->entries[i - xor_offset].bits) != 0) {
+            goto done;
+        }
+    }
+    qsort(index->entries, index->count, sizeof(*index->entries), pack_bitmap_cmp);
+    result = 0;
+
+done:
+    munmap(map, size);
+    if (result != 0) {
+        pack_bitmap_free(index);
+    }
+    return result;
+}
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} BitmapBuffer;
+
+static int bitmap_buffer_append(BitmapBuffer *buffer, const void *data, size_t len) {
+    if (buffer->len + len > buffer->cap) {
+        size_t new_cap = buffer->cap == 0 ? 4096 : buffer->cap;
+        unsigned char *grown;
+
+        while (new_cap < buffer->len + len) {
+            new_cap *= 2;
+        }
+        grown = realloc(buffer->data, new_cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->cap = new_cap;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+static int bitmap_buffer_ewah(BitmapBuffer *buffer, const Bitmap *bitmap) {
+    unsigned char *bytes;
+    size_t len;
+    int status;
+
+    if (ewah_serialize(bitmap, &bytes, &len) != 0) {
+        return -1;
+    }
+    status = bitmap_buffer_append(buffer, bytes, len);
+    free(bytes);
+    return status;
+}
+
+int pack_bitmap_write(PackFile *pack, const PackBitmapIndex *index) {
+    BitmapBuffer buffer = {0};
+    unsigned char header[BITMAP_HEADER_SIZE];
+    unsigned char digest[20];
+    char tmp_path[PATH_MAX];
+    char *path;
+    const char *slash;
+    Sha1Ctx sha;
+    size_t written = 0;
+    size_t i;
+    int result = -1;
+    int fd;
+
+    memcpy(header, "BITM", 4);
+    header[4] = 0;
+    header[5] = 1;
+    header[6] = 0;
+    header[7] = PACK_BITMAP_OPT_FULL_DAG;
+    put_be32(header + 8, (uint32_t)index->count);
+    memcpy(header + 12, pack_checksum(pack), 20);
+    if (bitmap_buffer_append(&buffer, header, sizeof(header)) != 0) {
+        goto done;
+    }
+    for (i = 0; i < 4; i++) {
+        if (bitmap_buffer_ewah(&buffer, &index->types[i]) != 0) {
+            goto done;
+        }
+    }
+    for (i = 0; i < index->count; i++) {
+        unsigned char entry[6];
+
+        /* No XOR compression: each bitmap is stored whole. */
+        put_be32(entry, index->entries[i].commit);
+        entry[4] = 0;
+        entry[5] = 0;
+        if (bitmap_buffer_append(&buffer, entry, sizeof(entry)) != 0 ||
+            bitmap_buffer_ewah(&buffer, &index->entries[i].bits) != 0) {
+            goto done;
+        }
+    }
+    sha1_init(&sha);
+    sha1_update(&sha, buffer.data, buffer.len);
+    sha1_final(&sha, digest);
+    if (bitmap_buffer_append(&buffer, digest, sizeof(digest)) != 0) {
+        goto done;
+    }
+
+    slash = strrchr(pack->pack_path, '/');
+    if (slash == NULL || snprintf(tmp_path, sizeof(tmp_path), "%.*s/tmp_bitmap_XXXXXX",
+                                  (int)(slash - pack->pack_path), pack->pack_path) >= (int)sizeof(tmp_path)) {
+        goto done;
+    }
+    path = pack_bitmap_path(pack);
+    if (path == NULL) {
+        goto done;
+    }
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        free(path);
+        goto done;
+    }
+    while (written < buffer.len) {
+        ssize_t n = write(fd, buffer.data + written, buffer.len - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += (size_t)n;
+    }
+    if (written != buffer.len || fchmod(fd, 0444) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        free(path);
+        goto done;
+    }
+    if (close(fd) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        free(path);
+        goto done;
+    }
+    free(path);
+    result = 0;
+
+done:
+    free(buffer.data);
+    return result;
+}
+
+const PackBitmap *pack_bitmap_find(const PackBitmapIndex *index, uint32_t commit) {
+    PackBitmap key;
+
+    if (index->count == 0) {
+        return NULL;
+    }
+    key.commit = commit;
+    return bsearch(&key, index->entries, index->count, sizeof(*index->entries), pack_bitmap_cmp);
+}
+
+void pack_bitmap_free(PackBitmapIndex *index) {
+    size_t i;
+
+    for (i = 0; i < 4; i++) {
+        bitmap_free(&index->types[i]);
+    }
+    for (i = 0; i < index->count; i++) {
+        bitmap_free(&index->entries[i].bits);
+    }
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
+
+static int delta_size(const unsigned char **cursor, const unsigned char *end, uint64_t *out) {
+    unsigned int shift = 0;
+    unsigned char c;
+
+    *out = 0;
+    do {
+        if (*cursor >= end || shift > 63) {
+            return -1;
+        }
+        c = *(*cursor)++;
+        *out |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+int delta_apply(const unsigned char *base, size_t base_size, const unsigned char *delta, size_t delta_len,
+                unsigned char **out, size_t *out_size) {
+    const unsigned char *cursor = delta;
+    const unsigned char *end = delta + delta_len;
+    uint64_t source_size;
+    uint64_t target_size;
+    unsigned char *target;
+    size_t written = 0;
+
+    if (delta_size(&cursor, end, &source_size) != 0 || delta_size(&cursor, end, &target_size) != 0 ||
+        source_size != base_size || target_size >= SIZE_MAX) {
+        return -1;
+    }
+    target = malloc((size_t)target_size + 1);
+    if (target == NULL) {
+        return -1;
+    }
+    while (cursor < end) {
+        unsigned char op = *cursor++;
+
+        if (op & 0x80) {
+            /* Copy from base: bits 0-3 select offset bytes, bits 4-6 size bytes. */
+            uint64_t copy_offset = 0;
+            size_t copy_size = 0;
+            int i;
+
+            for (i = 0; i < 4; i++) {
+                if (op & (1u << i)) {
+                    if (cursor >= end) {
+                        goto fail;
+                    }
+                    copy_offset |= (uint64_t)*cursor++ << (8 * i);
+                }
+            }
+            for (i = 0; i < 3; i++) {
+                if (op & (0x10u << i)) {
+                    if (cursor >= end) {
+                        goto fail;
+                    }
+                    copy_size |= (size_t)*cursor++ << (8 * i);
+                }
+            }
+            if (copy_size == 0) {
+                copy_size = 0x10000;
+            }
+            if (copy_offset > base_size || copy_size > base_size - copy_offset ||
+                copy_size > target_size - written) {
+                goto fail;
+            }
+            memcpy(target + written, base + copy_offset, copy_size);
+            written += copy_size;
+        } else if (op != 0) {
+            /* Insert the next op bytes literally. */
+            if (op > (size_t)(end - cursor) || op > target_size - written) {
+                goto fail;
+            }
+            memcpy(target + written, cursor, op);
+            cursor += op;
+            written += op;
+        } else {
+            goto fail;
+        }
+    }
+    if (written != target_size) {
+        goto fail;
+    }
+    target[written] = '\0';
+    *out = target;
+    *out_size = written;
+    return 0;
+
+fail:
+    free(target);
+    return -1;
+}
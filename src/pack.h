@@ -0,0 +1,112 @@
+#ifndef CG_PACK_H
+#define CG_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ewah.h"
+
+/* Object types as numbered in pack entry headers. */
+#define PACK_OBJ_COMMIT 1
+#define PACK_OBJ_TREE 2
+#define PACK_OBJ_BLOB 3
+#define PACK_OBJ_TAG 4
+#define PACK_OBJ_OFS_DELTA 6
+#define PACK_OBJ_REF_DELTA 7
+
+/* A pack and its .idx (version 1 or 2). The index is mapped by pack_open; the
+ * pack itself only on the first read, or by pack_map. Lookups are safe from
+ * several threads once the pack is mapped. */
+typedef struct {
+    char *pack_path;
+    const unsigned char *idx;
+    size_t idx_size;
+    const unsigned char *data;
+    size_t size;
+    uint32_t count;
+    int idx_version;
+    /* Pack order, built by pack_load_order: order[i] is the index position of
+     * the i-th object by offset, order_pos the inverse. */
+    uint32_t *order;
+    uint32_t *order_pos;
+} PackFile;
+
+/* Supplies a REF_DELTA base that is not in the pack itself. Returns 0 with a
+ * malloc'ed *data, 1 if the base is unknown, -1 on error. */
+typedef int (*PackBaseFn)(void *ctx, const unsigned char hash[20], int *type, unsigned char **data, size_t *size);
+
+/* Maps idx_path and remembers the .pack next to it. Returns -1 if the index
+ * is unreadable or malformed. */
+int pack_open(PackFile *pack, const char *idx_path);
+void pack_close(PackFile *pack);
+int pack_map(PackFile *pack);
+
+/* Binary search below the fan-out bucket; false if hash is not in the pack. */
+bool pack_find(const PackFile *pack, const unsigned char hash[20], uint64_t *offset);
+/* Same search, giving the index (sorted) position instead of the offset. */
+bool pack_find_position(const PackFile *pack, const unsigned char hash[20], uint32_t *n);
+/* The n-th id in index (sorted) order and its offset, for enumeration. */
+void pack_nth(const PackFile *pack, uint32_t n, unsigned char hash[20], uint64_t *offset);
+
+/* Inflates the object at offset, applying its whole delta chain. On success
+ * *type is a base type and *data is malloc'ed with a NUL after size bytes.
+ * Returns -1 for corrupt entries, chains deeper than PACK_MAX_DELTA_DEPTH or
+ * bases resolve() cannot supply. */
+#define PACK_MAX_DELTA_DEPTH 10000
+int pack_read(PackFile *pack, uint64_t offset, PackBaseFn resolve, void *ctx, int *type, unsigned char **data,
+              size_t *size);
+
+/* Delta bases inflated by pack_read are kept in a process-wide LRU keyed by
+ * pack and offset, so objects whose chains share a base do not inflate and
+ * patch it again. The budget is in bytes; 0 (the default) disables it. */
+void pack_set_delta_cache_limit(size_t limit);
+void pack_delta_cache_stats(unsigned long long *hits, unsigned long long *misses);
+
+/* Applies a git delta to base. out is malloc'ed and NUL-terminated. */
+int delta_apply(const unsigned char *base, size_t base_size, const unsigned char *delta, size_t delta_size,
+                unsigned char **out, size_t *out_size);
+
+/* Builds the pack order on first use; .bitmap files number objects this way.
+ * Not safe to call from several threads at once. */
+int pack_load_order(PackFile *pack);
+/* Base type of the entry at offset, found by following delta headers without
+ * inflating anything; 0 if the entry is corrupt or its base is outside the
+ * pack. */
+int pack_object_type(PackFile *pack, uint64_t offset);
+
+/* A .bitmap next to the pack, in git's version 1 layout: each selected commit
+ * has an EWAH bitmap of every object reachable from it, bit i standing for the
+ * i-th object in pack order, plus one bitmap per object type. Only packs that
+ * hold the whole closure of their selected commits can carry one. */
+#define PACK_BITMAP_OPT_FULL_DAG 0x1
+#define PACK_BITMAP_OPT_HASH_CACHE 0x4
+
+typedef struct {
+    uint32_t commit;
+    Bitmap bits;
+} PackBitmap;
+
+typedef struct {
+    /* Indexed by PACK_OBJ_COMMIT - 1 through PACK_OBJ_TAG - 1. */
+    Bitmap types[4];
+    /* Sorted by commit (index position) after pack_bitmap_read. */
+    PackBitmap *entries;
+    size_t count;
+} PackBitmapIndex;
+
+/* Returns 1 if the pack has no .bitmap, -1 if it is malformed or was written
+ * for a different pack. XOR-compressed entries are expanded on load. */
+int pack_bitmap_read(PackFile *pack, PackBitmapIndex *index);
+/* Writes the .bitmap atomically, entries in the order given; a commit's
+ * entry should follow those of its selected ancestors. */
+int pack_bitmap_write(PackFile *pack, const PackBitmapIndex *index);
+const PackBitmap *pack_bitmap_find(const PackBitmapIndex *index, uint32_t commit);
+void pack_bitmap_free(PackBitmapIndex *index);
+
+/* "commit", "tree", "blob", "tag", or NULL for other types. */
+const char *pack_type_name(int type);
+/* The reverse of pack_type_name; 0 for an unknown name. */
+int pack_type_code(const char *name);
+
+#endif
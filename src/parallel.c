@@ -0,0 +1,71 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+size_t parallel_worker_count(size_t jobs) {
+    const char *value = getenv("CG_THREADS");
+    long count = value != NULL && value[0] != '\0' ? atol(value) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > PARALLEL_MAX_THREADS) {
+        count = PARALLEL_MAX_THREADS;
+    }
+    return (size_t)count < jobs ? (size_t)count : jobs;
+}
+
+typedef struct {
+    void (*fn)(void *ctx, size_t index);
+    void *ctx;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} ParallelQueue;
+
+static void *parallel_worker(void *arg) {
+    ParallelQueue *queue = (ParallelQueue *)arg;
+
+    for (;;) {
+        size_t index;
+        pthread_mutex_lock(&queue->lock);
+        index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) {
+            return NULL;
+        }
+        queue->fn(queue->ctx, index);
+    }
+}
+
+void parallel_for_threads(size_t count, size_t threads, void (*fn)(void *ctx, size_t index), void *ctx) {
+    ParallelQueue queue;
+    pthread_t workers[PARALLEL_MAX_THREADS];
+    size_t started = 0;
+
+    if (threads > PARALLEL_MAX_THREADS) {
+        threads = PARALLEL_MAX_THREADS;
+    }
+    if (threads > count) {
+        threads = count;
+    }
+    queue.fn = fn;
+    queue.ctx = ctx;
+    queue.count = count;
+    queue.next = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, parallel_worker, &queue) == 0) {
+        started++;
+    }
+    parallel_worker(&queue);
+    while (started > 0) {
+        pthread_join(workers[--started], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+}
+
+void parallel_for(size_t count, void (*fn)(void *ctx, size_t index), void *ctx) {
+    parallel_for_threads(count, parallel_worker_count(count), fn, ctx);
+}
@@ -0,0 +1,18 @@
+#ifndef CG_PARALLEL_H
+#define CG_PARALLEL_H
+
+#include <stddef.h>
+
+#define PARALLEL_MAX_THREADS 64
+
+/* Threads for CPU-bound fan-out: CG_THREADS if set, else the online CPU
+ * count, never more than there are jobs. */
+size_t parallel_worker_count(size_t jobs);
+
+/* Runs fn(ctx, 0..count-1) on a small pool; the calling thread works too.
+ * Jobs must only touch their own slot of ctx. */
+void parallel_for(size_t count, void (*fn)(void *ctx, size_t index), void *ctx);
+/* Same, with an explicit thread count, for jobs that mostly wait on I/O. */
+void parallel_for_threads(size_t count, size_t threads, void (*fn)(void *ctx, size_t index), void *ctx);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CG_SHA1_H
+#define CG_SHA1_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef CG_SHA1DC
+#include <sha1dc/sha1.h>
+#endif
+
+/* Streaming SHA-1. The compression function is picked once per process by
+ * sha1_select_kernel(); every context created afterwards uses that kernel. */
+typedef struct {
+    uint32_t state[5];
+    uint64_t length;
+    unsigned char block[64];
+    size_t block_len;
+#ifdef CG_SHA1DC
+    bool detect_collisions;
+    SHA1_CTX dc;
+#endif
+} Sha1Ctx;
+
+void sha1_init(Sha1Ctx *ctx);
+void sha1_update(Sha1Ctx *ctx, const void *data, size_t len);
+/* Returns -1 when collision detection is active and the input looks like half
+ * of a known SHA-1 collision attack; out still receives a digest. */
+int sha1_final(Sha1Ctx *ctx, unsigned char out[20]);
+
+/* Selects a kernel by name ("portable", "shani", "armv8", "sha1dc"). NULL or
+ * an empty name picks the best one available on this machine. Returns -1 if
+ * the named kernel is unknown or not supported here. */
+int sha1_select_kernel(const char *name);
+const char *sha1_kernel_name(void);
+/* Iterates over the kernels compiled in, including unsupported ones; returns
+ * NULL past the end. */
+const char *sha1_kernel_at(size_t index, bool *available);
+
+#endif
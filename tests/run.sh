@@ -0,0 +1,293 @@
+#!/bin/sh
+# Regression tests for cg. Each case runs in a fresh repository under a
+# scratch directory; run through `make test`.
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CG=${CG:-$ROOT/cg}
+SCRATCH=$(mktemp -d "${TMPDIR:-/tmp}/cg-tests.XXXXXX")
+trap 'rm -rf "$SCRATCH"' EXIT
+
+export GIT_AUTHOR_NAME=cg GIT_AUTHOR_EMAIL=cg@local
+export GIT_COMMITTER_NAME=cg GIT_COMMITTER_EMAIL=cg@local
+export GIT_CONFIG_NOSYSTEM=1 HOME="$SCRATCH"
+
+passed=0
+failed=0
+
+# Cases run in a subshell, so this ends the case.
+fail() {
+    echo "  $*" >&2
+    exit 1
+}
+
+new_repo() {
+    rm -rf "$SCRATCH/repo" &&
+    "$CG" init "$SCRATCH/repo" >/dev/null &&
+    cd "$SCRATCH/repo"
+}
+
+untracked() {
+    "$CG" status --porcelain=v2 -z | tr '\0' '\n' | sed -n 's/^? //p'
+}
+
+# A path with a newline cannot be journaled; it must not take later journal
+# records down with it.
+test_journal_newline_path() {
+    new_repo &&
+    echo a > a && "$CG" add a >/dev/null && "$CG" commit -m base >/dev/null &&
+    echo x > 'nl
+name' && echo y > after.txt &&
+    "$CG" add 'nl
+name' >/dev/null && "$CG" add after.txt >/dev/null || return 1
+    [ -z "$(untracked)" ] || fail "untracked after add: $(untracked)"
+}
+
+# Journal records for paths missing from the base index: the last record of
+# each path wins.
+test_journal_replay_order() {
+    new_repo &&
+    echo a > a && "$CG" add a >/dev/null && "$CG" commit -m base >/dev/null &&
+    echo b > b && echo c > c && "$CG" add b c >/dev/null &&
+    rm b && echo c2 > c && "$CG" add . >/dev/null &&
+    echo b2 > b && "$CG" add b >/dev/null || return 1
+    [ -f .git/cg-index.journal ] || fail "no journal written"
+    staged=$("$CG" status --porcelain=v2 -z | tr '\0' '\n' | awk '$1 == "1" { print $2, $8, $9 }')
+    expected=$(printf 'A. %s b\nA. %s c' "$(git hash-object b)" "$(git hash-object c)")
+    [ "$staged" = "$expected" ] || fail "staged: $staged"
+}
+
+# A binary index of another format version is rebuilt from HEAD.
+test_stale_index_version() {
+    new_repo &&
+    echo a > a && "$CG" add a >/dev/null && "$CG" commit -m base >/dev/null &&
+    printf '\002' | dd of=.git/cg-index bs=1 seek=7 conv=notrunc 2>/dev/null || return 1
+    out=$("$CG" status --porcelain=v2 2>&1) || fail "status failed: $out"
+    [ "$out" = "cg: warning: cg-index has an unsupported format version, rebuilding it from HEAD" ] ||
+        fail "status printed: $out"
+    [ "$(od -An -tu1 -j7 -N1 .git/cg-index | tr -d ' ')" = 3 ] || fail "cg-index not rewritten"
+    [ -z "$("$CG" status --porcelain=v2 2>&1)" ] || fail "second status: $("$CG" status --porcelain=v2 2>&1)"
+}
+
+# Executable bits and symlinks survive clone, commit and add.
+test_modes_round_trip() {
+    rm -rf "$SCRATCH/origin" && git init -q "$SCRATCH/origin" && cd "$SCRATCH/origin" &&
+    printf '#!/bin/sh\n' > run.sh && chmod +x run.sh && ln -s run.sh link && echo x > plain &&
+    git add . && git commit -qm init && cd "$SCRATCH" || return 1
+    rm -rf "$SCRATCH/repo" && "$CG" clone origin repo >/dev/null 2>&1 && cd repo || return 1
+    echo y >> plain && "$CG" add plain >/dev/null && "$CG" commit -m two >/dev/null || return 1
+    modes=$(git ls-tree HEAD | awk '{ print $1, $4 }' | tr '\n' ' ')
+    [ "$modes" = "120000 link 100644 plain 100755 run.sh " ] || fail "after commit: $modes"
+    ln -s plain new-link && printf '#!/bin/sh\n' > tool && chmod +x tool && chmod -x run.sh || return 1
+    "$CG" add new-link tool run.sh >/dev/null && "$CG" commit -m three >/dev/null || return 1
+    modes=$(git ls-tree HEAD | awk '{ print $1, $4 }' | tr '\n' ' ')
+    [ "$modes" = "120000 link 120000 new-link 100644 plain 100644 run.sh 100755 tool " ] ||
+        fail "after add: $modes"
+    [ -z "$("$CG" status --porcelain=v2)" ] || fail "not clean: $("$CG" status --porcelain=v2)"
+}
+
+# A mode change alone shows up as a modification.
+test_mode_change_status() {
+    new_repo &&
+    printf '#!/bin/sh\n' > run.sh && "$CG" add run.sh >/dev/null && "$CG" commit -m base >/dev/null &&
+    chmod +x run.sh || return 1
+    status=$("$CG" status --porcelain=v2 | cut -d' ' -f1-6)
+    [ "$status" = "1 .M N... 100644 100644 100755" ] || fail "status: $status"
+}
+
+# Human and porcelain output come from the same classifier.
+test_status_forms_agree() {
+    new_repo &&
+    seq 1 100 > a && echo b > b && echo c > c && "$CG" add . >/dev/null && "$CG" commit -m base >/dev/null &&
+    mv a a2 && rm b && echo c2 >> c && echo n > n && "$CG" add . >/dev/null &&
+    echo c3 >> c && echo u > u || return 1
+    human=$("$CG" status | sed -n 's/^  //p' | tr -s ' ' | tr '\n' ';')
+    [ "$human" = "new file: n;modified: c;renamed: a -> a2;deleted: b;modified: c;u;" ] || fail "human: $human"
+    porcelain=$("$CG" status --porcelain=v2 | cut -d' ' -f1,2 | tr '\n' ';')
+    [ "$porcelain" = "2 R.;1 D.;1 MM;1 A.;? u;" ] || fail "porcelain: $porcelain"
+}
+
+# Untracked files come sorted after the tracked records, and a directory
+# holding no tracked file is reported once, as git does.
+test_untracked_directories() {
+    new_repo &&
+    mkdir -p src/sub newdir/deep && echo a > src/a && "$CG" add src/a >/dev/null && "$CG" commit -m base >/dev/null &&
+    echo x > src/sub/x && echo y > newdir/deep/y && echo z > newdir/z && echo q > src/q &&
+    echo t > top && echo m > new-dir || return 1
+    porcelain=$("$CG" status --porcelain=v2 | tr '\n' ';')
+    [ "$porcelain" = "? new-dir;? newdir/;? src/q;? src/sub/;? top;" ] || fail "porcelain: $porcelain"
+    human=$("$CG" status | sed -n 's/^  //p' | tr '\n' ';')
+    [ "$human" = "new-dir;newdir/;src/q;src/sub/;top;" ] || fail "human: $human"
+}
+
+# A commit made by another process in the middle of a batch is seen by the
+# next command. Enough trees are read up front that the new objects land in
+# fan-out directories that were already listed.
+test_batch_external_commit() {
+    new_repo &&
+    for i in $(seq 1 2000); do mkdir d$i && echo $i > d$i/f || return 1; done
+    "$CG" add . >/dev/null && "$CG" commit -m base >/dev/null && mkfifo "$SCRATCH/in" || return 1
+    "$CG" batch < "$SCRATCH/in" > "$SCRATCH/out" 2>&1 &
+    exec 3> "$SCRATCH/in"
+    echo 'status --porcelain=v2' >&3
+    for i in $(seq 1 100); do
+        grep -q cg-batch-end "$SCRATCH/out" && break
+        sleep 0.1
+    done
+    echo b > b && git add -A && git commit -qm external || return 1
+    echo 'status --porcelain=v2' >&3
+    echo 'diff --cached' >&3
+    exec 3>&-
+    wait
+    expected=$(printf 'cg-batch-end 0\n%s\ncg-batch-end 0\n%s\ncg-batch-end 0' \
+        "$("$CG" status --porcelain=v2)" "$("$CG" diff --cached)")
+    [ "$(cat "$SCRATCH/out")" = "$expected" ] || fail "batch printed: $(cat "$SCRATCH/out")"
+}
+
+# An embedder may define names libcg uses internally; only cg_* is exported.
+test_libcg_embedding() {
+    new_repo && echo a > a && echo b > b || return 1
+    cat > "$SCRATCH/embed.c" <<'C'
+#include <stdio.h>
+#include "cg.h"
+
+int parallel_for(void) { return 7; }
+int sha1_init(void) { return 7; }
+
+static int count(void *ctx, const char *path, cg_status_kind kind) {
+    (void)path;
+    (void)kind;
+    ++*(int *)ctx;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *paths[] = {"a"};
+    cg_repo *repo;
+    int seen = 0;
+
+    if (argc < 2 || cg_repo_open(argv[1], &repo) != 0 || cg_add(repo, paths, 1) != 0 ||
+        cg_status(repo, count, &seen) != 0 || cg_index_load(repo) != 0) {
+        return 1;
+    }
+    printf("%d %zu %d\n", seen, cg_index_count(repo), parallel_for() + sha1_init());
+    cg_repo_close(repo);
+    return 0;
+}
+C
+    ${CC:-cc} -I"$ROOT/src" -o "$SCRATCH/embed" "$SCRATCH/embed.c" "$ROOT/libcg.a" -lz -pthread ||
+        fail "cannot link against libcg.a"
+    out=$("$SCRATCH/embed" "$SCRATCH/repo") || fail "embedder failed"
+    [ "$out" = "2 1 14" ] || fail "embedder printed: $out"
+}
+
+# A cg_repo handle sees a commit another process made between two calls.
+test_libcg_external_commit() {
+    new_repo &&
+    for i in $(seq 1 2000); do mkdir d$i && echo $i > d$i/f || return 1; done
+    "$CG" add . >/dev/null && "$CG" commit -m base >/dev/null && echo b > b || return 1
+    cat > "$SCRATCH/embed.c" <<'C'
+#include <stdio.h>
+#include <stdlib.h>
+#include "cg.h"
+
+static int count(void *ctx, const char *path, cg_status_kind kind) {
+    (void)path;
+    (void)kind;
+    ++*(int *)ctx;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    cg_repo *repo;
+    int before = 0;
+    int after = 0;
+
+    if (argc < 2 || cg_repo_open(argv[1], &repo) != 0 || cg_status(repo, count, &before) != 0 ||
+        system("git add -A && git commit -qm external") != 0 || cg_status(repo, count, &after) != 0) {
+        return 1;
+    }
+    printf("%d %d\n", before, after);
+    cg_repo_close(repo);
+    return 0;
+}
+C
+    ${CC:-cc} -I"$ROOT/src" -o "$SCRATCH/embed" "$SCRATCH/embed.c" "$ROOT/libcg.a" -lz -pthread ||
+        fail "cannot link against libcg.a"
+    out=$("$SCRATCH/embed" "$SCRATCH/repo") || fail "embedder failed"
+    [ "$out" = "1 1" ] || fail "embedder printed: $out"
+}
+
+# Revisions with ~N and ^N suffixes and abbreviated ids, loose and packed.
+test_revision_suffixes() {
+    new_repo &&
+    for i in 1 2 3; do
+        echo $i > f && "$CG" add f >/dev/null && "$CG" commit -m c$i >/dev/null || return 1
+    done
+    [ "$("$CG" count-objects --reachable HEAD~1)" = "6 objects (2 commits, 2 trees, 2 blobs, 0 tags)" ] ||
+        fail "HEAD~1 not resolved"
+    [ "$("$CG" count-objects --reachable HEAD^^)" = "3 objects (1 commits, 1 trees, 1 blobs, 0 tags)" ] ||
+        fail "HEAD^^ not resolved"
+    "$CG" count-objects --reachable HEAD~3 >/dev/null 2>&1 && fail "HEAD~3 resolved past the root"
+    short=$(git rev-parse HEAD~1 | cut -c1-7)
+    [ "$("$CG" count-objects --reachable "$short")" = "6 objects (2 commits, 2 trees, 2 blobs, 0 tags)" ] ||
+        fail "loose $short not resolved"
+    git gc -q || return 1
+    [ "$("$CG" count-objects --reachable "$short^0")" = "6 objects (2 commits, 2 trees, 2 blobs, 0 tags)" ] ||
+        fail "packed $short not resolved"
+}
+
+# Branches start from revision expressions, concurrent creations of one
+# branch leave exactly one winner, and deletion takes the reflog along.
+test_branch_create_delete() {
+    new_repo &&
+    for i in 1 2; do
+        echo $i > f && "$CG" add f >/dev/null && "$CG" commit -m c$i >/dev/null || return 1
+    done
+    "$CG" branch old HEAD~1 || fail "branch from HEAD~1 failed"
+    [ "$(git rev-parse old)" = "$(git rev-parse HEAD~1)" ] || fail "old does not point at HEAD~1"
+    for i in 1 2 3 4 5 6 7 8; do
+        ("$CG" branch race HEAD~1 2>/dev/null && echo won >> "$SCRATCH/won") &
+    done
+    wait
+    [ "$(wc -l < "$SCRATCH/won")" -eq 1 ] || fail "$(wc -l < "$SCRATCH/won") creations of one branch succeeded"
+    git update-ref -m note refs/heads/nested/x HEAD || return 1
+    [ -f .git/logs/refs/heads/nested/x ] || fail "git wrote no reflog"
+    "$CG" branch -D nested/x >/dev/null || fail "delete failed"
+    [ ! -e .git/logs/refs/heads/nested ] || fail "reflog left behind"
+    [ -d .git/logs/refs/heads ] || fail "logs/refs/heads pruned"
+}
+
+# Objects over 4GiB read back through the loose object path. Slow and needs
+# about 5GiB of memory, so it only runs with CG_TEST_LARGE=1.
+test_large_object() {
+    if [ "${CG_TEST_LARGE:-0}" != 1 ]; then
+        echo "  skipped; set CG_TEST_LARGE=1 to run" >&2
+        return 0
+    fi
+    new_repo &&
+    truncate -s 4294967300 big && echo tail >> big &&
+    "$CG" add big >/dev/null || fail "add failed"
+    out=$("$CG" fsck 2>&1) || fail "fsck failed: $out"
+    case $out in
+        *"checked 1 object "*) ;;
+        *) fail "fsck printed: $out" ;;
+    esac
+}
+
+run() {
+    if ("$1"); then
+        passed=$((passed + 1))
+        echo "ok   $1"
+    else
+        failed=$((failed + 1))
+        echo "FAIL $1"
+    fi
+}
+
+cases=$(sed -n 's/^\(test_[a-z0-9_]*\)() {$/\1/p' "$0")
+for name in $cases; do
+    run "$name"
+done
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]